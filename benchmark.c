@@ -1,43 +1,967 @@
+#include <math.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Every allocation made by mp.h goes through these counters via MP_MALLOC and
+// MP_REALLOC
+
+typedef struct {
+    size_t allocs;
+    size_t bytes;
+} Alloc_Stats;
+
+Alloc_Stats alloc_stats;
+
+void *bench_malloc(size_t size)
+{
+    alloc_stats.allocs++;
+    alloc_stats.bytes += size;
+    return malloc(size);
+}
+
+void *bench_realloc(void *ptr, size_t size)
+{
+    alloc_stats.allocs++;
+    alloc_stats.bytes += size;
+    return realloc(ptr, size);
+}
+
+#define MP_MALLOC(size)       bench_malloc(size)
+#define MP_REALLOC(ptr, size) bench_realloc(ptr, size)
 #define MP_IMPLEMENTATION
 #include "mp.h"
 
-#include <time.h>
+#define REPETITIONS 7
+#define MIN_REPETITION_NS (20*1000*1000) // 20 ms
+#define EXPR_CAPACITY (64*1024)
+
+//--------
+// Corpus
+//--------
+
+typedef struct {
+    const char *name;
+    char expr[EXPR_CAPACITY];
+} Shape;
+
+void append(char *dst, const char *fmt, ...)
+{
+    size_t len = strlen(dst);
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(dst + len, EXPR_CAPACITY - len, fmt, args);
+    va_end(args);
+}
+
+void make_mixed(Shape *s)
+{
+    s->name = "mixed";
+    strcpy(s->expr, "(12+45)*(78-34)/(9^3)+((56*(23+67)-(89/7))^2)-(15*(3+5)/(2^4))+((8-4)*(6+2)/(10-3))+(100/(25-5)*(3^2)-(7+2)*(5-1)+(4*(9+1)/(2^3)))-((11+22)*(33-44)/(55+66)+(77^2)-(88/(4+4))*(3+5)+(2*(6-1)^3))");
+}
+
+void make_deep(Shape *s)
+{
+    s->name = "deep";
+    s->expr[0] = '\0';
+    const int depth = 80;
+    for (int i = 0; i < depth; ++i) append(s->expr, "(");
+    append(s->expr, "x");
+    for (int i = 0; i < depth; ++i) append(s->expr, "%s%d)", i % 2 ? "*" : "+", i % 7 + 1);
+}
+
+void make_wide(Shape *s)
+{
+    s->name = "wide";
+    s->expr[0] = '\0';
+    for (int i = 0; i < 150; ++i) append(s->expr, "%s%d.%d", i ? "+" : "", i, i % 10);
+}
+
+void make_literals(Shape *s)
+{
+    s->name = "literals";
+    s->expr[0] = '\0';
+    for (int i = 0; i < 120; ++i) {
+        append(s->expr, "%s%.17g", i ? "+" : "", 1.0 / (i + 3) * pow(10.0, i % 41 - 20));
+    }
+}
+
+void make_functions(Shape *s)
+{
+    static const char *fns[] = {"sin", "cos", "tan", "sqrt", "ln", "log"};
+    s->name = "functions";
+    s->expr[0] = '\0';
+    for (int i = 0; i < 40; ++i) {
+        append(s->expr, "%s%s(x+%d)", i ? "+" : "", fns[i % 6], i + 1);
+    }
+}
+
+void make_variables(Shape *s)
+{
+    s->name = "variables";
+    s->expr[0] = '\0';
+    for (int i = 0; i < 80; ++i) {
+        append(s->expr, "%s%c*%c", i ? (i % 3 ? "+" : "-") : "",
+               'a' + i % 26, 'a' + (i * 7 + 3) % 26);
+    }
+}
+
+//---------
+// Timing
+//---------
+
+typedef struct {
+    const char *shape;
+    const char *backend;
+    const char *phase;
+    size_t iterations;
+    double ns[REPETITIONS];
+    double allocs;
+    double bytes;
+    size_t input_bytes; // Expression size for the throughput of tokenize/parse
+    size_t resident;    // mp_memory_usage() of the environment being evaluated
+} Measurement;
+
+typedef void (*Phase_Fn)(void *ctx, size_t iterations);
+
+long long now_ns(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (long long)t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+int compare_double(const void *a, const void *b)
+{
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+void measure(Measurement *m, Phase_Fn fn, void *ctx)
+{
+    // Warm up and calibrate the amount of iterations per repetition
+    size_t iterations = 1;
+    while (true) {
+        long long start = now_ns();
+        fn(ctx, iterations);
+        if (now_ns() - start >= MIN_REPETITION_NS / 4 || iterations >= (1u << 30))
+            break;
+        iterations *= 2;
+    }
+    iterations *= 4;
+
+    m->iterations = iterations;
+    for (size_t r = 0; r < REPETITIONS; ++r) {
+        alloc_stats = (Alloc_Stats){0};
+        long long start = now_ns();
+        fn(ctx, iterations);
+        long long end = now_ns();
+        m->ns[r] = (double)(end - start) / iterations;
+        m->allocs = (double)alloc_stats.allocs / iterations;
+        m->bytes = (double)alloc_stats.bytes / iterations;
+    }
+}
+
+//----------
+// Baseline
+//----------
+
+typedef struct {
+    char key[128];
+    double ns_median;
+} Baseline_Entry;
+
+Baseline_Entry *baseline;
+size_t baseline_count;
+
+void load_baseline(const char *path)
+{
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        fprintf(stderr, "ERROR: Could not open baseline %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+
+    char line[512];
+    size_t capacity = 0;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        char shape[64], backend[32], phase[32];
+        double ns_median;
+        if (sscanf(line, "%63[^,],%31[^,],%31[^,],%*[^,],%*[^,],%lf",
+                   shape, backend, phase, &ns_median) != 4)
+            continue;
+
+        if (baseline_count >= capacity) {
+            capacity = capacity == 0 ? 64 : capacity * 2;
+            baseline = realloc(baseline, capacity * sizeof(*baseline));
+        }
+        Baseline_Entry *e = &baseline[baseline_count++];
+        snprintf(e->key, sizeof(e->key), "%s,%s,%s", shape, backend, phase);
+        e->ns_median = ns_median;
+    }
+
+    fclose(f);
+}
+
+double baseline_lookup(const Measurement *m)
+{
+    char key[128];
+    snprintf(key, sizeof(key), "%s,%s,%s", m->shape, m->backend, m->phase);
+    for (size_t i = 0; i < baseline_count; ++i) {
+        if (strcmp(baseline[i].key, key) == 0)
+            return baseline[i].ns_median;
+    }
+    return NAN;
+}
+
+//--------
+// Report
+//--------
+
+void print_header(void)
+{
+    printf("shape,backend,phase,reps,iterations,ns_median,ns_min,ns_mean,"
+           "ns_stddev,ops_per_sec,allocs_per_op,bytes_per_op,mb_per_sec,"
+           "resident_bytes");
+    if (baseline_count > 0) printf(",baseline_ns_median,delta_pct");
+    printf("\n");
+}
+
+void print_measurement(Measurement *m)
+{
+    double sorted[REPETITIONS];
+    memcpy(sorted, m->ns, sizeof(sorted));
+    qsort(sorted, REPETITIONS, sizeof(sorted[0]), compare_double);
+
+    double mean = 0.0;
+    for (size_t r = 0; r < REPETITIONS; ++r) mean += sorted[r];
+    mean /= REPETITIONS;
+
+    double var = 0.0;
+    for (size_t r = 0; r < REPETITIONS; ++r) var += (sorted[r] - mean)*(sorted[r] - mean);
+    double stddev = sqrt(var / (REPETITIONS - 1));
+
+    double median = sorted[REPETITIONS / 2];
+
+    printf("%s,%s,%s,%d,%zu,%.2f,%.2f,%.2f,%.2f,%.0f,%.2f,%.1f",
+           m->shape, m->backend, m->phase, REPETITIONS, m->iterations,
+           median, sorted[0], mean, stddev, 1e9 / median, m->allocs,
+           m->bytes);
+
+    if (m->input_bytes > 0) {
+        printf(",%.1f", m->input_bytes / median * 1e3);
+    } else {
+        printf(",");
+    }
+
+    if (m->resident > 0) {
+        printf(",%zu", m->resident);
+    } else {
+        printf(",");
+    }
+
+    if (baseline_count > 0) {
+        double base = baseline_lookup(m);
+        printf(",%.2f,%.1f", base, (median - base) / base * 100.0);
+    }
+
+    printf("\n");
+    fflush(stdout);
+}
+
+//--------
+// Phases
+//--------
+
+typedef struct {
+    const char *expr;
+    MP_Token_List tokens;
+    MP_Parse_Tree tree;
+    MP_Arena arena;
+    MP_Env *env;
+    MP_Options options;
+} Context;
+
+void phase_tokenize(void *ctx, size_t iterations)
+{
+    Context *c = ctx;
+    for (size_t i = 0; i < iterations; ++i) {
+        MP_Token_List list = {0};
+        mp_tokenize(&list, c->expr);
+        mp_da_free(&list);
+    }
+}
+
+void phase_parse(void *ctx, size_t iterations)
+{
+    Context *c = ctx;
+    for (size_t i = 0; i < iterations; ++i) {
+        MP_Arena arena = {0};
+        MP_Parse_Tree tree = {0};
+        mp_parse(&arena, &tree, c->tokens);
+        mp_arena_free(&arena);
+    }
+}
+
+void phase_compile(void *ctx, size_t iterations)
+{
+    Context *c = ctx;
+    for (size_t i = 0; i < iterations; ++i) {
+        MP_Program program = {0};
+        mp_program_compile(&program, c->tree);
+        mp_da_free(&program);
+    }
+}
+
+void phase_evaluate(void *ctx, size_t iterations)
+{
+    Context *c = ctx;
+    for (size_t i = 0; i < iterations; ++i) {
+        mp_evaluate(c->env);
+    }
+}
+
+// A single variable changes between two evaluations, a different one each time
+void phase_update(void *ctx, size_t iterations)
+{
+    Context *c = ctx;
+    for (size_t i = 0; i < iterations; ++i) {
+        char var = 'a' + i % 26;
+        if (var == 'p' || var == 'e') continue;
+        mp_variable(c->env, var, 0.5 + (i & 7) * 0.125);
+        mp_evaluate(c->env);
+    }
+}
+
+void set_variables(MP_Env *env);
+
+// Setting up, evaluating once and freeing, the cost of a one-shot formula
+void phase_once(void *ctx, size_t iterations)
+{
+    Context *c = ctx;
+    for (size_t i = 0; i < iterations; ++i) {
+        MP_Env *env = mp_init_options(c->expr, c->options);
+        set_variables(env);
+        mp_evaluate(env);
+        mp_free(env);
+    }
+}
+
+void phase_reinit(void *ctx, size_t iterations)
+{
+    Context *c = ctx;
+    for (size_t i = 0; i < iterations; ++i) {
+        mp_reinit(c->env, c->expr);
+        mp_evaluate(c->env);
+    }
+}
+
+void set_variables(MP_Env *env)
+{
+    for (char v = 'a'; v <= 'z'; ++v) {
+        if (v == 'p' || v == 'e') continue;
+        mp_variable(env, v, 0.5 + (v - 'a') * 0.125);
+    }
+}
+
+void benchmark_shape(Shape *s)
+{
+    Context c = {0};
+    c.expr = s->expr;
+
+    if (mp_tokenize(&c.tokens, c.expr).error
+        || mp_parse(&c.arena, &c.tree, c.tokens).error) {
+        fprintf(stderr, "ERROR: Invalid expression for shape %s\n", s->name);
+        exit(EXIT_FAILURE);
+    }
+
+    Measurement m = {0};
+    m.shape = s->name;
+    m.backend = "common";
+    m.input_bytes = strlen(c.expr);
+
+    m.phase = "tokenize";
+    measure(&m, phase_tokenize, &c);
+    print_measurement(&m);
+
+    m.phase = "parse";
+    measure(&m, phase_parse, &c);
+    print_measurement(&m);
+
+    m.input_bytes = 0;
+    m.backend = "vm";
+    m.phase = "compile";
+    measure(&m, phase_compile, &c);
+    print_measurement(&m);
+
+    struct {
+        const char *name;
+        MP_Mode mode;
+        MP_Precision precision;
+    } backends[] = {
+        {"vm", MP_MODE_COMPILE, MP_PRECISION_EXACT},
+        {"interpreter", MP_MODE_INTERPRET, MP_PRECISION_EXACT},
+        {"vm_fast", MP_MODE_COMPILE, MP_PRECISION_FAST},
+        {"interpreter_fast", MP_MODE_INTERPRET, MP_PRECISION_FAST},
+        {"adaptive", MP_MODE_ADAPTIVE, MP_PRECISION_EXACT},
+        {"incremental", MP_MODE_INCREMENTAL, MP_PRECISION_EXACT},
+    };
 
-long benchmark(const char *expression, size_t count, MP_Mode mode)
+    for (size_t i = 0; i < sizeof(backends)/sizeof(backends[0]); ++i) {
+        MP_Options options = {0};
+        options.mode = backends[i].mode;
+        options.precision = backends[i].precision;
+        c.options = options;
+        c.env = mp_init_options(c.expr, options);
+        if (c.env == NULL) {
+            fprintf(stderr, "ERROR: Could not init %s for %s\n",
+                    backends[i].name, s->name);
+            exit(EXIT_FAILURE);
+        }
+        set_variables(c.env);
+
+        m.backend = backends[i].name;
+        m.phase = "evaluate";
+        measure(&m, phase_evaluate, &c);
+        m.resident = mp_memory_usage(c.env);
+        print_measurement(&m);
+        m.resident = 0;
+
+        m.phase = "update";
+        measure(&m, phase_update, &c);
+        print_measurement(&m);
+        set_variables(c.env);
+
+        m.phase = "once";
+        measure(&m, phase_once, &c);
+        print_measurement(&m);
+
+        m.phase = "reinit";
+        measure(&m, phase_reinit, &c);
+        print_measurement(&m);
+
+        mp_free(c.env);
+    }
+
+    mp_da_free(&c.tokens);
+    mp_arena_free(&c.arena);
+}
+
+// A few megabytes of machine generated formula, deeply nested. Only the front
+// end is measured, evaluating it is not the point.
+void benchmark_large(void)
 {
-    struct timespec start, end;
+    size_t depth = 100000;
+    size_t blocks = 60000;
+    size_t capacity = 2 * depth + blocks * 64 + 16;
+    char *expr = malloc(capacity);
+    assert(expr != NULL);
 
-    MP_Env *mp = mp_init_mode(expression, mode);
-    if (mp == NULL) {
-        fprintf(stderr, "ERROR\n");
-        return 1;
+    size_t count = 0;
+    for (size_t i = 0; i < depth; ++i) expr[count++] = '(';
+    expr[count++] = 'x';
+    for (size_t i = 0; i < depth; ++i) expr[count++] = ')';
+    for (size_t i = 0; i < blocks; ++i) {
+        count += snprintf(expr + count, capacity - count,
+                          "+(a*%zu.25-(b/3.5+(c^2-4.75e-3)))", i);
     }
 
-    clock_gettime(CLOCK_MONOTONIC, &start);
+    Context c = {0};
+    c.expr = expr;
+    if (mp_tokenize(&c.tokens, c.expr).error
+        || mp_parse(&c.arena, &c.tree, c.tokens).error) {
+        fprintf(stderr, "ERROR: Invalid expression for shape large\n");
+        exit(EXIT_FAILURE);
+    }
+
+    Measurement m = {0};
+    m.shape = "large";
+    m.backend = "common";
+    m.input_bytes = count;
+
+    m.phase = "tokenize";
+    measure(&m, phase_tokenize, &c);
+    print_measurement(&m);
+
+    m.phase = "parse";
+    measure(&m, phase_parse, &c);
+    print_measurement(&m);
+
+    mp_da_free(&c.tokens);
+    mp_arena_free(&c.arena);
+    free(expr);
+}
+
+//---------------
+// Program sizes
+//---------------
+
+// Size of the program in the encoding before the dense opcodes: 9 bytes per
+// number, 2 per variable and no operand folded into the arithmetic
+size_t plain_program_size(MP_Tree_Node *node)
+{
+    switch (node->type) {
+        case MP_NODE_NUMBER:   return 1 + sizeof(double);
+        case MP_NODE_SYMBOL:   return 2;
+        case MP_NODE_FUNCTION: return 2 + plain_program_size(node->function.arg);
+        case MP_NODE_PLUS:     return plain_program_size(node->unary.node);
+        case MP_NODE_MINUS:    return 1 + plain_program_size(node->unary.node);
+        case MP_NODE_POWI:     return 1 + sizeof(int32_t) + plain_program_size(node->powi.base);
+        case MP_NODE_BRANCHES:
+        case MP_NODE_ARGUMENTS: return plain_program_size(node->binop.lhs)
+                                     + plain_program_size(node->binop.rhs);
+        default:               return 1 + plain_program_size(node->binop.lhs)
+                                        + plain_program_size(node->binop.rhs);
+    }
+}
+
+void benchmark_sizes(Shape *shapes, size_t count)
+{
+    printf("shape,tree_nodes,plain_bytes,program_bytes,ratio\n");
+
     for (size_t i = 0; i < count; ++i) {
-        mp_evaluate(mp);
+        MP_Token_List tokens = {0};
+        MP_Arena arena = {0};
+        MP_Parse_Tree tree = {0};
+        MP_Program program = {0};
+
+        mp_tokenize(&tokens, shapes[i].expr);
+        mp_parse(&arena, &tree, tokens);
+        mp_optimize(&arena, &tree);
+        mp_program_compile(&program, tree);
+
+        size_t plain = plain_program_size(tree.root);
+        printf("%s,%zu,%zu,%zu,%.2f\n", shapes[i].name,
+               mp_tree_node_count(tree.root), plain, program.count,
+               (double)program.count / plain);
+
+        mp_da_free(&program);
+        mp_arena_free(&arena);
+        mp_da_free(&tokens);
+    }
+}
+
+//-------
+// Batch
+//-------
+
+// Time per row of an expression over columns of x and y, evaluated row by row,
+// in batches, reduced without storing the rows, used as a filter and in
+// batches of float
+
+#define BATCH_ROWS (64*1024)
+
+typedef struct {
+    MP_Env *env;
+    const double *const *columns;
+    double *out;
+    MP_Summation summation; // MP_SUM_COUNT for the row by row loop
+    bool reduce;
+    size_t *indices;        // The selected rows when filtering
+    const float *const *columns_f32;
+    float *out_f32;         // The rows when evaluating in float
+} Batch_Context;
+
+void phase_rows(void *ctx, size_t iterations)
+{
+    Batch_Context *c = ctx;
+    for (size_t i = 0; i < iterations; ++i) {
+        size_t row = i % BATCH_ROWS;
+        mp_variable(c->env, 'x', c->columns['x' - 'a'][row]);
+        mp_variable(c->env, 'y', c->columns['y' - 'a'][row]);
+        c->out[row] = mp_evaluate(c->env).value;
+    }
+}
+
+void phase_batch(void *ctx, size_t iterations)
+{
+    Batch_Context *c = ctx;
+    for (size_t i = 0; i < iterations; ++i) {
+        if (c->reduce) {
+            MP_Reduction r;
+            MP_Reduce_Options options = {c->summation, 1};
+            mp_reduce(c->env, c->columns, BATCH_ROWS, options, &r);
+            c->out[0] = r.sum;
+        } else if (c->indices != NULL) {
+            size_t selected = 0;
+            mp_filter_rows(c->env, c->columns, BATCH_ROWS, c->indices, &selected);
+            c->out[0] = selected;
+        } else if (c->out_f32 != NULL) {
+            mp_evaluate_batch_f32(c->env, c->columns_f32, BATCH_ROWS, c->out_f32);
+        } else {
+            mp_evaluate_batch(c->env, c->columns, BATCH_ROWS, c->out);
+        }
+    }
+}
+
+void benchmark_batch(void)
+{
+    const char *exprs[] = {
+        "3*x^2 + 2*x*y - y/4",
+        "sin(x)*cos(y) + sqrt(x*x + y*y)",
+        "(x - 1)*(x + 2)*(y - 3)/(1 + y*y)",
+        "x < 5 ? x*y : y - x/2",
+        "x > 2 && y < 5 || x == y",
+        "clamp(x*y, 1, 50) + min(x, y)",
+        "hypot(x, y) + atan2(y, x)",
+    };
+
+    static double xs[BATCH_ROWS], ys[BATCH_ROWS], out[BATCH_ROWS];
+    static float xs_f32[BATCH_ROWS], ys_f32[BATCH_ROWS], out_f32[BATCH_ROWS];
+    static size_t indices[BATCH_ROWS];
+    const double *columns[26] = {0};
+    const float *columns_f32[26] = {0};
+    columns['x' - 'a'] = xs;
+    columns['y' - 'a'] = ys;
+    columns_f32['x' - 'a'] = xs_f32;
+    columns_f32['y' - 'a'] = ys_f32;
+
+    srand(42);
+    for (size_t i = 0; i < BATCH_ROWS; ++i) {
+        xs[i] = 10.0 * rand() / RAND_MAX;
+        ys[i] = 10.0 * rand() / RAND_MAX;
+        xs_f32[i] = xs[i];
+        ys_f32[i] = ys[i];
+    }
+
+    const char *kinds[] = {"rows", "batch", "sum_plain", "sum_kahan", "sum_pairwise",
+                           "filter", "batch_f32"};
+    printf("expression,kind,ns_per_row,speedup\n");
+
+    for (size_t e = 0; e < sizeof(exprs)/sizeof(exprs[0]); ++e) {
+        MP_Env *env = mp_init_mode(exprs[e], MP_MODE_COMPILE);
+        double rows_ns = 0.0;
+
+        for (size_t k = 0; k < sizeof(kinds)/sizeof(kinds[0]); ++k) {
+            Batch_Context ctx = {env, columns, out, MP_SUM_COUNT, k >= 2 && k <= 4, NULL,
+                                 NULL, NULL};
+            if (ctx.reduce) ctx.summation = MP_SUM_PLAIN + (k - 2);
+            if (k == 5) ctx.indices = indices;
+            if (k == 6) {
+                ctx.columns_f32 = columns_f32;
+                ctx.out_f32 = out_f32;
+            }
+
+            Measurement m = {0};
+            measure(&m, k == 0 ? phase_rows : phase_batch, &ctx);
+            qsort(m.ns, REPETITIONS, sizeof(double), compare_double);
+
+            // Batch phases run BATCH_ROWS rows per iteration
+            double ns = m.ns[REPETITIONS / 2];
+            if (k > 0) ns /= BATCH_ROWS;
+            if (k == 0) rows_ns = ns;
+
+            printf("\"%s\",%s,%.3f,%.2f\n", exprs[e], kinds[k], ns, rows_ns / ns);
+        }
+
+        mp_free(env);
+    }
+}
+
+//---------------
+// Approximation
+//---------------
+
+// Time per row of single variable expressions evaluated row by row, in
+// batches, and by their piecewise polynomial approximation (see mp_approx_init)
+
+#define APPROX_TOLERANCE 1e-9
+
+typedef struct {
+    MP_Env *env;
+    const MP_Approx *approx;
+    const double *xs;
+    double *out;
+    size_t kind;
+} Approx_Context;
+
+void phase_approx(void *ctx, size_t iterations)
+{
+    Approx_Context *c = ctx;
+    const double *columns[26] = {0};
+    columns['x' - 'a'] = c->xs;
+
+    for (size_t i = 0; i < iterations; ++i) {
+        size_t row = i % BATCH_ROWS;
+        switch (c->kind) {
+            case 0: {
+                mp_variable(c->env, 'x', c->xs[row]);
+                c->out[row] = mp_evaluate(c->env).value;
+            } break;
+
+            case 1: mp_evaluate_batch(c->env, columns, BATCH_ROWS, c->out); break;
+            case 2: c->out[row] = mp_approx_eval(c->approx, c->xs[row]);    break;
+            default: mp_approx_eval_batch(c->approx, c->xs, BATCH_ROWS, c->out); break;
+        }
+    }
+}
+
+void benchmark_approx(void)
+{
+    const char *exprs[] = {
+        "tan(x) * sqrt(x) * (2 + x) / 2",
+        "sin(x)*cos(2*x) + ln(1 + x*x)",
+        "hypot(x, 1) * atan2(x, 2) - x^3/7",
+    };
+    const double lo = 0.1, hi = 1.5;
+
+    static double xs[BATCH_ROWS], out[BATCH_ROWS];
+    srand(42);
+    for (size_t i = 0; i < BATCH_ROWS; ++i) {
+        xs[i] = lo + (hi - lo) * rand() / RAND_MAX;
     }
-    clock_gettime(CLOCK_MONOTONIC, &end);
 
-    long delta_us = (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec -
-            start.tv_nsec) / 1000;
-    long ms = delta_us / 1000;
+    const char *kinds[] = {"rows", "batch", "approx", "approx_batch"};
+    printf("expression,kind,ns_per_row,speedup,pieces,max_error\n");
+
+    for (size_t e = 0; e < sizeof(exprs)/sizeof(exprs[0]); ++e) {
+        MP_Env *env = mp_init_mode(exprs[e], MP_MODE_COMPILE);
+        MP_Approx approx;
+        if (!mp_approx_init(&approx, env, 'x', lo, hi, APPROX_TOLERANCE)) {
+            fprintf(stderr, "ERROR: Could not approximate %s\n", exprs[e]);
+            mp_free(env);
+            continue;
+        }
+
+        double rows_ns = 0.0;
+        for (size_t k = 0; k < sizeof(kinds)/sizeof(kinds[0]); ++k) {
+            Approx_Context ctx = {env, &approx, xs, out, k};
+            Measurement m = {0};
+            measure(&m, phase_approx, &ctx);
+            qsort(m.ns, REPETITIONS, sizeof(double), compare_double);
+
+            // Batch phases run BATCH_ROWS rows per iteration
+            double ns = m.ns[REPETITIONS / 2];
+            if (k == 1 || k == 3) ns /= BATCH_ROWS;
+            if (k == 0) rows_ns = ns;
+
+            printf("\"%s\",%s,%.3f,%.2f,%zu,%.3g\n", exprs[e], kinds[k], ns,
+                   rows_ns / ns, approx.pieces, approx.max_error);
+        }
+
+        mp_approx_free(&approx);
+        mp_free(env);
+    }
+}
 
-    mp_free(mp);
+//---------------
+// Formula graph
+//---------------
 
-    return ms;
+// A sheet of independent columns, every formula of a column reads the one
+// above it and the variable of the column. Changing one variable computes
+// again a single column, changing all of them computes the whole sheet.
+
+#define GRAPH_COLUMNS 16
+#define GRAPH_ROWS 64
+
+typedef struct {
+    MP_Graph *graph;
+    size_t changed; // Variables changed before every update
+    double value;
+} Graph_Context;
+
+void phase_graph(void *ctx, size_t iterations)
+{
+    Graph_Context *c = ctx;
+    for (size_t i = 0; i < iterations; ++i) {
+        c->value += 1.0;
+        for (size_t v = 0; v < c->changed; ++v) {
+            mp_graph_variable(c->graph, 'a' + v, c->value);
+        }
+        mp_graph_update(c->graph);
+    }
+}
+
+void benchmark_graph(void)
+{
+    MP_Graph *graph = mp_graph_init();
+    char name[32], expr[128];
+
+    for (size_t col = 0; col < GRAPH_COLUMNS; ++col) {
+        for (size_t row = 0; row < GRAPH_ROWS; ++row) {
+            snprintf(name, sizeof(name), "c%zu_%zu", col, row);
+            if (row == 0) {
+                snprintf(expr, sizeof(expr), "%c * 2 + 1", (char)('a' + col));
+            } else {
+                snprintf(expr, sizeof(expr), "$c%zu_%zu * 0.5 + sin($c%zu_%zu) + %c",
+                         col, row - 1, col, row - 1, (char)('a' + col));
+            }
+            mp_graph_set(graph, name, expr);
+        }
+    }
+
+    MP_Result result = mp_graph_update(graph);
+    assert(!result.error);
+
+    printf("changed_vars,formulas,computed,levels,ns_per_update,ns_per_formula\n");
+
+    size_t changed[] = {1, GRAPH_COLUMNS};
+    for (size_t i = 0; i < sizeof(changed)/sizeof(changed[0]); ++i) {
+        Graph_Context ctx = {graph, changed[i], 0.0};
+        Measurement m = {0};
+        measure(&m, phase_graph, &ctx);
+
+        qsort(m.ns, REPETITIONS, sizeof(double), compare_double);
+        double ns = m.ns[REPETITIONS / 2];
+        printf("%zu,%zu,%zu,%zu,%.2f,%.2f\n", changed[i], graph->formulas.count,
+               graph->computed, graph->level_count, ns, ns / graph->computed);
+    }
+
+    mp_graph_free(graph);
+}
+
+//-----------
+// Fast math
+//-----------
+
+#define MATH_SAMPLES (64*1024)
+
+typedef struct {
+    const char *name;
+    double (*libm)(double);
+    double (*fast)(double);
+    double lo;
+    double hi;
+} Math_Case;
+
+typedef struct {
+    double (*fn)(double);
+    const double *in;
+    double *out;
+} Math_Context;
+
+void phase_math(void *ctx, size_t iterations)
+{
+    Math_Context *c = ctx;
+    for (size_t i = 0; i < iterations; ++i) {
+        c->out[i % MATH_SAMPLES] = c->fn(c->in[i % MATH_SAMPLES]);
+    }
 }
 
-int main(void)
+double ulp_distance(double a, double b)
 {
-    const int count = 1000*1000;
-    const char *expr = "(12+45)*(78-34)/(9^3)+((56*(23+67)-(89/7))^2)-(15*(3+5)/(2^4))+((8-4)*(6+2)/(10-3))+(100/(25-5)*(3^2)-(7+2)*(5-1)+(4*(9+1)/(2^3)))-((11+22)*(33-44)/(55+66)+(77^2)-(88/(4+4))*(3+5)+(2*(6-1)^3))";
+    if (isnan(a) && isnan(b)) return 0.0;
+    if (a == b) return 0.0;
+    if (isnan(a) || isnan(b) || isinf(a) || isinf(b)) return INFINITY;
 
-    long vm_time = benchmark(expr, count, MP_MODE_COMPILE);
-    printf("vm(%d): %ld ms\n", count, vm_time);
+    int64_t ia, ib;
+    memcpy(&ia, &a, sizeof(ia));
+    memcpy(&ib, &b, sizeof(ib));
+    if (ia < 0) ia = INT64_MIN - ia;
+    if (ib < 0) ib = INT64_MIN - ib;
+
+    int64_t d = ia - ib;
+    return (double)(d < 0 ? -d : d);
+}
+
+void benchmark_math(void)
+{
+    Math_Case cases[] = {
+        {"sin", sin, mp_fast_sin, -100, 100},
+        {"cos", cos, mp_fast_cos, -100, 100},
+        {"tan", tan, mp_fast_tan, -100, 100},
+    };
+
+    static double in[MATH_SAMPLES], out[MATH_SAMPLES];
+
+    printf("function,lo,hi,libm_ns,fast_ns,speedup,max_ulp,mean_ulp\n");
+
+    for (size_t i = 0; i < sizeof(cases)/sizeof(cases[0]); ++i) {
+        Math_Case *mc = &cases[i];
+
+        srand(42);
+        for (size_t j = 0; j < MATH_SAMPLES; ++j) {
+            in[j] = mc->lo + (mc->hi - mc->lo) * rand() / RAND_MAX;
+        }
+
+        double max_ulp = 0.0, sum_ulp = 0.0;
+        for (size_t j = 0; j < MATH_SAMPLES; ++j) {
+            double d = ulp_distance(mc->fast(in[j]), mc->libm(in[j]));
+            if (d > max_ulp) max_ulp = d;
+            sum_ulp += d;
+        }
+
+        Math_Context ctx = {mc->libm, in, out};
+        Measurement libm = {0};
+        measure(&libm, phase_math, &ctx);
+
+        ctx.fn = mc->fast;
+        Measurement fast = {0};
+        measure(&fast, phase_math, &ctx);
+
+        qsort(libm.ns, REPETITIONS, sizeof(double), compare_double);
+        qsort(fast.ns, REPETITIONS, sizeof(double), compare_double);
+        double libm_ns = libm.ns[REPETITIONS / 2];
+        double fast_ns = fast.ns[REPETITIONS / 2];
+
+        printf("%s,%g,%g,%.2f,%.2f,%.2f,%.0f,%.3f\n", mc->name, mc->lo, mc->hi,
+               libm_ns, fast_ns, libm_ns / fast_ns, max_ulp,
+               sum_ulp / MATH_SAMPLES);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 2 || (argc == 2 && strcmp(argv[1], "-h") == 0)) {
+        fprintf(stderr, "Usage: %s [baseline.csv | --math | --sizes | --graph | --batch | --approx]\n", argv[0]);
+        fprintf(stderr, "  Prints CSV results to stdout. When a previous run is\n");
+        fprintf(stderr, "  given, the median of each row is compared against it.\n");
+        fprintf(stderr, "  --math compares MP_PRECISION_FAST functions with libm.\n");
+        fprintf(stderr, "  --sizes compares the bytecode size with the plain encoding.\n");
+        fprintf(stderr, "  --graph times the updates of a formula graph.\n");
+        fprintf(stderr, "  --batch times batch evaluation, reductions and filters.\n");
+        fprintf(stderr, "  --approx times polynomial approximations of expressions.\n");
+        return EXIT_FAILURE;
+    }
+
+    if (argc == 2 && strcmp(argv[1], "--math") == 0) {
+        benchmark_math();
+        return EXIT_SUCCESS;
+    }
+
+    if (argc == 2 && strcmp(argv[1], "--batch") == 0) {
+        benchmark_batch();
+        return EXIT_SUCCESS;
+    }
+
+    if (argc == 2 && strcmp(argv[1], "--approx") == 0) {
+        benchmark_approx();
+        return EXIT_SUCCESS;
+    }
+
+    if (argc == 2 && strcmp(argv[1], "--graph") == 0) {
+        benchmark_graph();
+        return EXIT_SUCCESS;
+    }
+
+    static Shape shapes[6];
+    make_mixed(&shapes[0]);
+    make_deep(&shapes[1]);
+    make_wide(&shapes[2]);
+    make_literals(&shapes[3]);
+    make_functions(&shapes[4]);
+    make_variables(&shapes[5]);
+    size_t shape_count = sizeof(shapes)/sizeof(shapes[0]);
+
+    if (argc == 2 && strcmp(argv[1], "--sizes") == 0) {
+        benchmark_sizes(shapes, shape_count);
+        return EXIT_SUCCESS;
+    }
+
+    if (argc == 2) load_baseline(argv[1]);
+
+    print_header();
+    for (size_t i = 0; i < shape_count; ++i) {
+        benchmark_shape(&shapes[i]);
+    }
+    benchmark_large();
 
-    long in_time = benchmark(expr, count, MP_MODE_INTERPRET);
-    printf("in(%d): %ld ms\n", count, in_time);
+    free(baseline);
 
-    return 0;
+    return EXIT_SUCCESS;
 }
@@ -1,4 +1,4 @@
-// mp - v1.4.0 - MIT License - https://github.com/seajee/mp.h
+// mp - v1.27.0 - MIT License - https://github.com/seajee/mp.h
 
 // TODO: Include documentation on how to use the library
 
@@ -11,6 +11,8 @@
 
 #include <assert.h>
 #include <ctype.h>
+#include <float.h>
+#include <locale.h>
 #include <math.h>
 #include <stdbool.h>
 #include <stddef.h>
@@ -19,6 +21,26 @@
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef MP_PROFILE
+#if (defined(__GNUC__) || defined(__clang__)) \
+    && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#define MP_PROFILE_RDTSC
+#else
+#include <time.h>
+#endif
+#endif // MP_PROFILE
+
+#ifdef MP_THREADS
+#include <pthread.h>
+#endif
+
+// Scanning of digits and whitespace 8 bytes at a time
+#if (defined(__GNUC__) || defined(__clang__)) && defined(__BYTE_ORDER__) \
+    && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__ && !defined(MP_NO_SWAR)
+#define MP_SWAR
+#endif
+
 #define MP_STR_UNKNOWN "?"
 
 //------------------------
@@ -28,30 +50,72 @@
 #define MP_PI 3.14159265358979323846 // pi
 #define MP_E  2.7182818284590452354  // e
 
+//------------
+// Allocation
+//------------
+
+// All the memory of mp.h is obtained through MP_MALLOC, MP_REALLOC and MP_FREE,
+// which can be defined before including mp.h. On top of that an MP_Allocator
+// can be given at runtime to an MP_Env (see mp_init_options), its context
+// pointer is passed back to every call. Sizes are passed to realloc and free
+// so that pool allocators and memory accounting don't need headers. A NULL
+// function falls back to the macro, except realloc which is done with alloc,
+// a copy and free when the allocator has alloc.
+
+#ifndef MP_MALLOC
+#define MP_MALLOC(size) malloc(size)
+#endif
+
+#ifndef MP_REALLOC
+#define MP_REALLOC(ptr, size) realloc(ptr, size)
+#endif
+
+#ifndef MP_FREE
+#define MP_FREE(ptr) free(ptr)
+#endif
+
+typedef struct {
+    void *(*alloc)(void *context, size_t size);
+    void *(*realloc)(void *context, void *ptr, size_t old_size, size_t new_size);
+    void (*free)(void *context, void *ptr, size_t size);
+    void *context;
+} MP_Allocator;
+
+// A NULL allocator, or a NULL callback, falls back to the MP_* macros
+void *mp_allocator_alloc(const MP_Allocator *a, size_t size);
+void *mp_allocator_realloc(const MP_Allocator *a, void *ptr, size_t old_size,
+                           size_t new_size);
+void mp_allocator_free(const MP_Allocator *a, void *ptr, size_t size);
+
 //----------------
 // Dynamic array
 //----------------
 
+// Dynamic arrays are structs with count, capacity, items and allocator fields
+
 #define MP_DA_INITIAL_CAPACITY 256
 
 #define mp_da_append(da, item)                                               \
     do {                                                                     \
         if ((da)->count >= (da)->capacity) {                                 \
+            size_t old_capacity = (da)->capacity;                            \
             (da)->capacity = (da)->capacity == 0                             \
                 ? MP_DA_INITIAL_CAPACITY : (da)->capacity * 2;               \
-            (da)->items =                                                    \
-                realloc((da)->items, (da)->capacity * sizeof(*(da)->items)); \
+            (da)->items = mp_allocator_realloc((da)->allocator, (da)->items, \
+                    old_capacity * sizeof(*(da)->items),                     \
+                    (da)->capacity * sizeof(*(da)->items));                  \
             assert((da)->items != NULL && "Buy more RAM LOL");               \
         }                                                                    \
         (da)->items[(da)->count++] = (item);                                 \
     } while (0)
 
-#define mp_da_free(da)      \
-    do {                    \
-        free((da)->items);  \
-        (da)->items = NULL; \
-        (da)->count = 0;    \
-        (da)->capacity = 0; \
+#define mp_da_free(da)                                                 \
+    do {                                                               \
+        mp_allocator_free((da)->allocator, (da)->items,                \
+                          (da)->capacity * sizeof(*(da)->items));      \
+        (da)->items = NULL;                                            \
+        (da)->count = 0;                                               \
+        (da)->capacity = 0;                                            \
     } while (0)
 
 #define mp_da_reset(da)  \
@@ -63,26 +127,40 @@
 // Arena
 //-------
 
-// TODO: Implement the arena as a linked list of regions
+// The arena is a linked list of regions, a new one is added when the last one
+// is full so that trees of any size can be allocated. Regions are kept on reset
+// and reused by the next allocations.
 
 #define MP_ARENA_DEFAULT_CAPACITY (8*1024)
 
+typedef struct MP_Region MP_Region;
+
+struct MP_Region {
+    MP_Region *next;
+    size_t count;    // In words
+    size_t capacity; // In words
+    uintptr_t data[];
+};
+
 typedef struct {
-    size_t count;
-    size_t capacity;
-    void *data;
+    MP_Region *begin;
+    MP_Region *end;
+    const MP_Allocator *allocator;
 } MP_Arena;
 
+MP_Region *mp_region_new(const MP_Allocator *allocator, size_t capacity);
 MP_Arena mp_arena_init(size_t capacity);
+size_t mp_arena_size(const MP_Arena *arena);
 void *mp_arena_alloc(MP_Arena *arena, size_t size);
 void mp_arena_free(MP_Arena *arena);
 void mp_arena_reset(MP_Arena *arena);
+MP_Allocator mp_arena_allocator(MP_Arena *arena);
 
 //-----------
 // Tokenizer
 //-----------
 
-#define MP_NAME_CAPACITY 4
+#define MP_NAME_CAPACITY 15
 
 typedef enum {
     MP_TOKEN_INVALID,
@@ -90,6 +168,7 @@ typedef enum {
     MP_TOKEN_NUMBER,
     MP_TOKEN_SYMBOL,
     MP_TOKEN_NAME,
+    MP_TOKEN_REFERENCE,
     MP_TOKEN_PLUS,
     MP_TOKEN_MINUS,
     MP_TOKEN_MULTIPLY,
@@ -97,6 +176,17 @@ typedef enum {
     MP_TOKEN_POWER,
     MP_TOKEN_LPAREN,
     MP_TOKEN_RPAREN,
+    MP_TOKEN_LESS,          // <
+    MP_TOKEN_LESS_EQUAL,    // <=
+    MP_TOKEN_GREATER,       // >
+    MP_TOKEN_GREATER_EQUAL, // >=
+    MP_TOKEN_EQUAL,         // ==
+    MP_TOKEN_NOT_EQUAL,     // !=
+    MP_TOKEN_AND,           // &&
+    MP_TOKEN_OR,            // ||
+    MP_TOKEN_QUESTION,      // ?
+    MP_TOKEN_COLON,         // :
+    MP_TOKEN_COMMA,         // ,
     MP_TOKEN_COUNT
 } MP_Token_Type;
 
@@ -107,6 +197,7 @@ typedef struct {
         double value;
         char symbol;
         char name[MP_NAME_CAPACITY + 1]; // +1 for '\0'
+        const char *reference;           // Into the expression, see below
     };
 } MP_Token;
 
@@ -114,6 +205,7 @@ typedef struct {
     size_t count;
     size_t capacity;
     MP_Token *items;
+    const MP_Allocator *allocator;
 } MP_Token_List;
 
 //----------------
@@ -122,6 +214,13 @@ typedef struct {
 
 // TODO: Simplify error handling
 
+// Division by zero is an error, MP_ERROR_ZERO_DIVISION, in every backend. Only
+// the divisions the interpreter evaluates count: the branch of a select not
+// taken and the right operand of && and || when the left one decides can't
+// fail, although the VMs compute them. When mp.h is compiled with MP_IEEE the
+// values follow IEEE 754 instead: x/0 is an infinity or NaN and no backend
+// fails on the values. Program sets always follow IEEE 754.
+
 typedef enum {
     MP_ERROR_OK,
     MP_ERROR_INVALID_TOKEN,
@@ -130,6 +229,8 @@ typedef enum {
     MP_ERROR_INVALID_NODE,
     MP_ERROR_INVALID_FUNCTION,
     MP_ERROR_ZERO_DIVISION,
+    MP_ERROR_UNKNOWN_REFERENCE,
+    MP_ERROR_CIRCULAR_REFERENCE,
     MP_ERROR_COUNT
 } MP_Error_Type;
 
@@ -147,10 +248,32 @@ const char *mp_error_to_string(MP_Error_Type err);
 // Tokenizer functions
 //---------------------
 
+// A reference is a '$' followed by a name made of letters, digits and '_', it
+// stands for the value of another formula (see Formula graph). Reference tokens
+// and nodes point to the name in the expression, which must outlive them.
+
+bool mp_is_reference_char(char c);
+size_t mp_reference_length(const char *name);
+
 MP_Result mp_tokenize(MP_Token_List *list, const char *expr);
 const char *mp_token_to_string(MP_Token token);
 void mp_print_token_list(MP_Token_List list);
 
+//----------------
+// Number parsing
+//----------------
+
+// Numbers are parsed without strtod so that they don't depend on the locale.
+// The accepted syntax is the one of strtod for a number starting with a digit:
+// digits, an optional fraction and an optional exponent, or a hexadecimal
+// float starting with 0x. Decimal numbers are correctly rounded by Clinger's
+// and the Eisel-Lemire fast paths, the few that they can't decide and the
+// hexadecimal ones are handed to strtod with the decimal point of the locale.
+// Both functions return the number of characters consumed.
+
+size_t mp_parse_number(const char *str, size_t length, double *value);
+size_t mp_skip_whitespace(const char *str, size_t length);
+
 //--------
 // Parser
 //--------
@@ -167,6 +290,20 @@ typedef enum {
     MP_NODE_POWER,
     MP_NODE_PLUS,
     MP_NODE_MINUS,
+    MP_NODE_POWI, // Power with a small constant integer exponent
+    MP_NODE_REFERENCE,
+    MP_NODE_LESS,
+    MP_NODE_LESS_EQUAL,
+    MP_NODE_GREATER,
+    MP_NODE_GREATER_EQUAL,
+    MP_NODE_EQUAL,
+    MP_NODE_NOT_EQUAL,
+    MP_NODE_AND,
+    MP_NODE_OR,
+    MP_NODE_SELECT,   // c ? a : b, lhs is c and rhs an MP_NODE_BRANCHES
+    MP_NODE_BRANCHES, // The a and b of a select, in lhs and rhs
+    MP_NODE_ARGUMENTS, // Of a function of two or more, the first in lhs and
+                       // the others in rhs
     MP_NODE_COUNT
 } MP_Node_Type;
 
@@ -176,6 +313,13 @@ typedef enum {
 #define MP_FUNCTION_STR_COS  "cos"
 #define MP_FUNCTION_STR_TAN  "tan"
 #define MP_FUNCTION_STR_SQRT "sqrt"
+#define MP_FUNCTION_STR_MIN   "min"
+#define MP_FUNCTION_STR_MAX   "max"
+#define MP_FUNCTION_STR_POW   "pow"
+#define MP_FUNCTION_STR_ATAN2 "atan2"
+#define MP_FUNCTION_STR_HYPOT "hypot"
+#define MP_FUNCTION_STR_FMA   "fma"
+#define MP_FUNCTION_STR_CLAMP "clamp"
 
 typedef enum {
     MP_FUNCTION_INVALID,
@@ -185,9 +329,21 @@ typedef enum {
     MP_FUNCTION_COS,
     MP_FUNCTION_TAN,
     MP_FUNCTION_SQRT,
-    MP_FUNCTION_COUNT
+    MP_FUNCTION_MIN,   // min(a, b), a NaN is ignored like by fmin
+    MP_FUNCTION_MAX,
+    MP_FUNCTION_POW,   // pow(a, b) is a^b
+    MP_FUNCTION_ATAN2, // atan2(y, x)
+    MP_FUNCTION_HYPOT,
+    MP_FUNCTION_FMA,   // fma(a, b, c) is a*b + c with a single rounding
+    MP_FUNCTION_CLAMP, // clamp(x, lo, hi) is min(max(x, lo), hi)
+    MP_FUNCTION_COUNT  // Registered functions come after, see Native functions
 } MP_Function;
 
+#define MP_FUNCTION_MAX_ARITY 8
+#define MP_FUNCTION_CAPACITY 256 // Ids fit the operand of MP_OP_FUNC
+
+#define MP_REFERENCE_UNRESOLVED UINT32_MAX
+
 typedef struct MP_Tree_Node MP_Tree_Node;
 
 struct MP_Tree_Node {
@@ -208,6 +364,17 @@ struct MP_Tree_Node {
             MP_Tree_Node *arg;
         } function;
 
+        struct {
+            MP_Tree_Node *base;
+            int exponent;
+        } powi;
+
+        struct {
+            const char *name;
+            uint32_t length;
+            uint32_t slot; // MP_REFERENCE_UNRESOLVED until a graph sets it
+        } reference;
+
         union {
             double value;
             char symbol;
@@ -226,76 +393,432 @@ typedef struct {
     MP_Result result;
 } MP_Parse_Tree;
 
+// mp_parse doesn't recurse: mp_parse_operators keeps the pending operators and
+// operands on explicit stacks, so the nesting of an expression is only limited
+// by memory.
+
+typedef enum {
+    MP_PARSER_OP_BINARY,
+    MP_PARSER_OP_UNARY,
+    MP_PARSER_OP_POWER,
+    MP_PARSER_OP_GROUP,    // (
+    MP_PARSER_OP_FUNCTION, // name(
+    MP_PARSER_OP_CONDITION,   // c ?
+    MP_PARSER_OP_ALTERNATIVE, // c ? a :
+    MP_PARSER_OP_COUNT
+} MP_Parser_Op_Type;
+
+typedef struct {
+    MP_Parser_Op_Type type;
+    MP_Node_Type node;
+    int precedence;
+    MP_Token token;
+    size_t arguments; // Of a function, the ones before the last comma
+} MP_Parser_Op;
+
+typedef struct {
+    size_t count;
+    size_t capacity;
+    MP_Parser_Op *items;
+    const MP_Allocator *allocator;
+} MP_Parser_Op_Stack;
+
+typedef struct {
+    size_t count;
+    size_t capacity;
+    MP_Tree_Node **items;
+    const MP_Allocator *allocator;
+} MP_Parser_Node_Stack;
+
+// The passes over a tree don't recurse either, they keep the nodes left to
+// visit on an MP_Tree_Stack. state counts the operands of node visited so far,
+// or holds a flag of the pass, and slot is where the pass stores the node
+// replacing node. The passes building something from the operands keep the
+// result of the first one in first while they visit the second.
+typedef struct {
+    MP_Tree_Node *node;
+    MP_Tree_Node **slot;
+    uint32_t state;
+    size_t first;
+} MP_Tree_Frame;
+
+typedef struct {
+    size_t count;
+    size_t capacity;
+    MP_Tree_Frame *items;
+    const MP_Allocator *allocator;
+} MP_Tree_Stack;
+
 MP_Tree_Node *mp_make_node(MP_Arena *a, MP_Node_Type t, double value);
 MP_Tree_Node *mp_make_node_symbol(MP_Arena *a, char symbol);
+MP_Tree_Node *mp_make_node_reference(MP_Arena *a, const char *name);
 MP_Tree_Node *mp_make_node_unary(MP_Arena *a, MP_Node_Type t, MP_Tree_Node *node);
 MP_Tree_Node *mp_make_node_binop(MP_Arena *a, MP_Node_Type t,
                                  MP_Tree_Node *lhs, MP_Tree_Node *rhs);
 MP_Tree_Node *mp_make_node_function(MP_Arena *a, const MP_Token *name,
                                     MP_Tree_Node *arg);
+MP_Tree_Node *mp_make_node_arguments(MP_Arena *a, MP_Tree_Node **args,
+                                     size_t count);
+MP_Tree_Node *mp_make_node_select(MP_Arena *a, MP_Tree_Node *condition,
+                                  MP_Tree_Node *then, MP_Tree_Node *otherwise);
 
 MP_Result mp_parse(MP_Arena *a, MP_Parse_Tree *tree, MP_Token_List list);
 void mp_parser_advance(MP_Parser *parser);
-MP_Tree_Node *mp_parse_expr(MP_Arena *a, MP_Parser *parser, MP_Result *result);
-MP_Tree_Node *mp_parse_term(MP_Arena *a, MP_Parser *parser, MP_Result *result);
-MP_Tree_Node *mp_parse_factor(MP_Arena *a, MP_Parser *parser, MP_Result *result);
-MP_Tree_Node *mp_parse_primary(MP_Arena *a, MP_Parser *parser, MP_Result *result);
+MP_Tree_Node *mp_parse_operators(MP_Arena *a, MP_Parser *parser, MP_Result *result);
 void mp_print_parse_tree(MP_Parse_Tree tree);
 void mp_print_tree_node(MP_Tree_Node *root);
+void mp_tree_push(MP_Tree_Stack *stack, MP_Tree_Node *node, MP_Tree_Node **slot,
+                  uint32_t state);
+size_t mp_tree_operands(MP_Tree_Node *node, MP_Tree_Node **operands[2]);
+size_t mp_tree_node_count(MP_Tree_Node *root);
+size_t mp_tree_height(MP_Tree_Node *root);
+size_t mp_tree_reference_count(MP_Tree_Node *root);
+MP_Tree_Node *mp_tree_node_copy(MP_Arena *a, MP_Tree_Node *root);
+void mp_parse_tree_compact(MP_Arena *arena, MP_Parse_Tree *tree);
 
 const char *mp_function_name_to_string(MP_Function name);
+size_t mp_function_arity(MP_Function name);
+const char *mp_node_type_to_string(MP_Node_Type type);
+
+//------------------
+// Native functions
+//------------------
+
+// Functions written in C can be registered under a name and then called from
+// expressions like the built-in ones, by every backend. They get the ids after
+// MP_FUNCTION_COUNT, mp_function_count() is one past the last one.
+//
+// A pure function gives the same value for the same arguments and has no side
+// effects. Its calls with constant arguments are folded by mp_specialize and
+// its equal calls are made once by a program set. Every call of an impure
+// function is kept, and the incremental mode makes them at every evaluation.
+// Beware that the VMs compute both sides of a select and of && and ||, so an
+// impure function there is called whichever side is taken.
+//
+// The batch VM calls batch once per block of rows when it is given, and fn once
+// per row otherwise. cost is a rough cost of a call in additions, 0 counts as
+// 1. It tells the formula graph how much work a formula is.
+//
+// The registry is global and not synchronized: register the functions before
+// parsing the expressions that call them, never while other threads parse or
+// evaluate expressions.
+
+typedef double (*MP_Native_Fn)(const double *args, void *user);
+
+// Computes count rows, args[i] is the column of the i-th argument. out may be
+// args[0].
+typedef void (*MP_Native_Batch_Fn)(const double *const *args, size_t count,
+                                   double *out, void *user);
+
+typedef struct {
+    char name[MP_NAME_CAPACITY + 1]; // Two letters, then letters and digits
+    size_t arity;                    // 1 to MP_FUNCTION_MAX_ARITY
+    MP_Native_Fn fn;
+    MP_Native_Batch_Fn batch;        // Optional
+    void *user;                      // Given to fn and batch
+    bool pure;
+    uint32_t cost;
+} MP_Native;
+
+MP_Function mp_register_function(const MP_Native *native);
+const MP_Native *mp_native(MP_Function name);
+size_t mp_function_count(void);
+bool mp_function_pure(MP_Function name);
+size_t mp_function_cost(MP_Function name);
+size_t mp_tree_cost(MP_Tree_Node *root);
+bool mp_tree_pure(MP_Tree_Node *root);
+
+//-----------
+// Optimizer
+//-----------
+
+// Rewrites applied to the parse tree before it is interpreted or compiled:
+// - x^n with a constant integer |n| <= MP_POWI_MAX_EXPONENT becomes an
+//   MP_NODE_POWI, computed by square-and-multiply (and a reciprocal for n < 0),
+//   or by pow when the result overflows or underflows
+// - pow(a, b) becomes a^b, and gets the rewrite above
+// - Sums of monomials c*x^k in a single variable of degree >= 2 are rewritten
+//   in Horner form, e.g. 3*x^3 + 2*x + 1 becomes ((3*x)*x + 2)*x + 1. Only a
+//   whole sum is, the sums and differences below its topmost node are not
+//   tried again.
+// x^0.5 is kept, sqrt(x) differs for x = -inf and x = -0.
+// These rewrites may change results in the last bits, and the Horner form may
+// give an infinity where the sum gives a NaN. See MP_Options.strict.
+
+#define MP_POWI_MAX_EXPONENT 32
+#define MP_HORNER_MAX_DEGREE 16
+
+typedef struct {
+    char var;
+    size_t degree;
+    size_t terms;
+    double coeffs[MP_HORNER_MAX_DEGREE + 1];
+    bool present[MP_HORNER_MAX_DEGREE + 1];
+} MP_Polynomial;
+
+double mp_powi(double x, int n);
+bool mp_node_constant(MP_Tree_Node *node, double *value);
+bool mp_monomial(MP_Tree_Node *node, char *var, double *coeff, size_t *degree);
+bool mp_polynomial_collect(MP_Polynomial *p, MP_Tree_Node *node, double sign);
+MP_Tree_Node *mp_make_horner(MP_Arena *a, const MP_Polynomial *p);
+MP_Tree_Node *mp_optimize_node(MP_Arena *a, MP_Tree_Node *node);
+void mp_optimize(MP_Arena *a, MP_Parse_Tree *tree);
+
+//---------
+// Opcodes
+//---------
+
+typedef enum {
+    MP_OP_INVALID,
+    MP_OP_PUSH_NUM,
+    MP_OP_PUSH_VAR,
+    MP_OP_ADD,
+    MP_OP_SUB,
+    MP_OP_MUL,
+    MP_OP_DIV,
+    MP_OP_POW,
+    MP_OP_NEG,
+    MP_OP_FUNC,  // operand: MP_Function (1 byte)
+    MP_OP_STORE, // operand: slot (4 bytes), top of the stack is kept
+    MP_OP_LOAD,  // operand: slot (4 bytes)
+    MP_OP_POP,
+    MP_OP_POWI,  // operand: exponent (4 bytes)
+    MP_OP_LT,    // 1 if a < b else 0
+    MP_OP_LE,
+    MP_OP_GT,
+    MP_OP_GE,
+    MP_OP_EQ,
+    MP_OP_NE,
+    MP_OP_AND,   // 1 if a != 0 and b != 0 else 0
+    MP_OP_OR,
+    MP_OP_SELECT, // c ? a : b with c, a and b on the stack, both are evaluated
+
+    // Dense forms emitted by the compilers instead of PUSH_NUM and PUSH_VAR
+    MP_OP_PUSH_INT,   // operand: int8_t (1 byte)
+    MP_OP_PUSH_FLOAT, // operand: float (4 bytes), exactly the constant
+    MP_OP_ADD_VAR,    // operand: variable (1 byte), top = top + variable
+    MP_OP_SUB_VAR,
+    MP_OP_MUL_VAR,
+    MP_OP_DIV_VAR,
+    MP_OP_ADD_CONST,  // operand: double (8 bytes), top = top + constant
+    MP_OP_SUB_CONST,
+    MP_OP_MUL_CONST,
+    MP_OP_DIV_CONST,
+    MP_OP_ADD_INT,    // operand: int8_t (1 byte), top = top + constant
+    MP_OP_SUB_INT,
+    MP_OP_MUL_INT,
+    MP_OP_DIV_INT,
+    MP_OP_PUSH_VAR_A, // The variable is in the opcode, up to MP_OP_PUSH_VAR_Z
+    MP_OP_PUSH_VAR_Z = MP_OP_PUSH_VAR_A + 25,
+
+    MP_OP_COUNT
+} MP_Opcode;
+
+const char *mp_opcode_to_string(MP_Opcode op);
+
+//-----------
+// Profiling
+//-----------
+
+// Define MP_PROFILE before including mp.h to record how many times each
+// opcode, tree node and function is executed, the time spent in each of them
+// and the maximum stack depth. Time is measured in cycles with rdtsc on x86 and
+// in nanoseconds with clock_gettime elsewhere. Without MP_PROFILE the
+// profiling hooks expand to nothing.
+
+#ifdef MP_PROFILE
+
+typedef struct {
+    uint64_t evaluations;
+    uint64_t op_counts[MP_OP_COUNT];
+    uint64_t op_cycles[MP_OP_COUNT];
+    uint64_t node_counts[MP_NODE_COUNT];
+    uint64_t node_cycles[MP_NODE_COUNT]; // Excluding the children of the node
+    uint64_t function_counts[MP_FUNCTION_CAPACITY];
+    uint64_t function_cycles[MP_FUNCTION_CAPACITY];
+    size_t max_stack_depth; // VM stack or interpreter frame depth
+} MP_Profile;
+
+uint64_t mp_profile_clock(void);
+void mp_print_profile(const MP_Profile *profile);
+
+#define MP_PROFILE_BEGIN(start) uint64_t start = mp_profile_clock()
+
+#define MP_PROFILE_END(profile, kind, index, start)                       \
+    do {                                                                  \
+        (profile).kind##_counts[(index)]++;                               \
+        (profile).kind##_cycles[(index)] += mp_profile_clock() - (start); \
+    } while (0)
+
+#define MP_PROFILE_DEPTH(profile, d)             \
+    do {                                         \
+        if ((d) > (profile).max_stack_depth)     \
+            (profile).max_stack_depth = (d);     \
+    } while (0)
+
+#else
+
+#define MP_PROFILE_BEGIN(start)
+#define MP_PROFILE_END(profile, kind, index, start)
+#define MP_PROFILE_DEPTH(profile, d)
+
+#endif // MP_PROFILE
+
+//-----------
+// Fast math
+//-----------
+
+// With MP_PRECISION_FAST the trigonometric functions are computed with
+// polynomial approximations instead of libm. Apart from the handling of
+// special values they are branchless, so loops over them can be vectorized
+// by the compiler. Maximum errors measured against glibc over 4 million
+// random inputs each:
+//
+//   sin(x)   2 ulp    falls back to libm for |x| >= 2^20
+//   cos(x)   2 ulp    falls back to libm for |x| >= 2^20
+//   tan(x)   5 ulp    falls back to libm for |x| >= 2^20
+//
+// ln, log, sqrt and x^y always use libm, whose ln, log and pow are already
+// faster than approximations of the same accuracy written in C.
+// `benchmark --math` prints the comparison along with the timings.
+
+typedef enum {
+    MP_PRECISION_EXACT,
+    MP_PRECISION_FAST,
+    MP_PRECISION_COUNT
+} MP_Precision;
+
+double mp_fast_sin(double x);
+double mp_fast_cos(double x);
+double mp_fast_tan(double x);
+
+// Like fmin and fmax, a NaN operand is ignored. They are written as selects so
+// that the loops of the batch VM vectorize them.
+double mp_min(double a, double b);
+double mp_max(double a, double b);
 
 //-------------
 // Interpreter
 //-------------
 
+typedef struct {
+    size_t count;
+    size_t capacity;
+    double *items;
+    const MP_Allocator *allocator;
+} MP_Stack;
+
 typedef struct {
     MP_Parse_Tree tree;
     MP_Arena arena;
+    MP_Tree_Stack frames; // Nodes waiting for their operands
+    MP_Stack values;      // Values of the operands computed so far
     double vars[26]; // a - z
+    MP_Precision precision;
+#ifdef MP_PROFILE
+    MP_Profile profile;
+#endif
 } MP_Interpreter;
 
 MP_Result mp_interpret(MP_Interpreter *interpreter);
 MP_Result mp_interpret_node(MP_Interpreter *interpreter, MP_Tree_Node *root);
+bool mp_function_apply(MP_Function name, const double *args,
+                       MP_Precision precision, double *result);
+double mp_logic_apply(MP_Node_Type type, double a, double b);
 
 MP_Interpreter mp_interpreter_init(MP_Parse_Tree tree, MP_Arena arena);
 void mp_interpreter_var(MP_Interpreter *interpreter, char var, double value);
 void mp_interpreter_free(MP_Interpreter *interpreter);
 
-//----------
-// Compiler
-//----------
+// Specialization replaces the variables of a mask (bit i for 'a' + i) with
+// their values and folds the subtrees that became constant. Folding computes
+// exactly what the backends would for the same precision, divisions by zero
+// and unknown functions are left for the evaluation to report.
 
-typedef enum {
-    MP_OP_INVALID,
-    MP_OP_PUSH_NUM,
-    MP_OP_PUSH_VAR,
-    MP_OP_ADD,
-    MP_OP_SUB,
-    MP_OP_MUL,
-    MP_OP_DIV,
-    MP_OP_POW,
-    MP_OP_NEG,
-    MP_OP_COUNT
-} MP_Opcode;
+MP_Tree_Node *mp_fold_node(MP_Tree_Node *node, MP_Precision precision);
+MP_Tree_Node *mp_specialize_node(MP_Tree_Node *node, uint32_t frozen,
+                                 const double vars[26], MP_Precision precision);
+void mp_specialize_tree(MP_Parse_Tree *tree, uint32_t frozen,
+                        const double vars[26], MP_Precision precision);
+
+//-------------
+// Incremental
+//-------------
+
+// The incremental evaluator keeps the value of every node between evaluations.
+// Each node has the set of variables its subtree reads, only the nodes reading
+// a variable changed since the last evaluation are computed again. The nodes
+// are stored in post-order, children before their parent and the root last.
+// Every operand is computed, but a node fails like the interpreter would: the
+// branch a select doesn't take and the right operand of && or || when the left
+// one decides don't fail it. Errors are kept with the values, so they don't
+// discard them.
+
+#define MP_INCREMENTAL_IMPURE (1u << 31) // In deps, calls an impure function
+
+typedef struct {
+    uint8_t type;  // MP_Node_Type
+    uint8_t error; // MP_Error_Type of the subtree at the last evaluation
+    uint32_t deps; // Bit i is set if the subtree reads the variable 'a' + i
+    uint32_t lhs;  // Index of the operand, or of the left operand
+    uint32_t rhs;
+    union {
+        double number;
+        char symbol;
+        MP_Function function;
+        int exponent;
+    };
+    double value;  // Value of the subtree at the last evaluation
+} MP_Incremental_Node;
 
 typedef struct {
     size_t count;
     size_t capacity;
-    uint8_t *items;
-} MP_Program;
+    MP_Incremental_Node *items;
+    const MP_Allocator *allocator;
+} MP_Incremental_Nodes;
+
+typedef struct {
+    MP_Incremental_Nodes nodes;
+    double vars[26]; // a - z
+    uint32_t dirty;  // Variables changed since the last evaluation
+    bool valid;      // The values of the nodes can be reused
+    MP_Precision precision;
+    size_t computed; // Nodes computed by the last evaluation
+} MP_Incremental;
+
+void mp_incremental_build(MP_Incremental *incremental, MP_Parse_Tree tree);
+uint32_t mp_incremental_push(MP_Incremental *incremental, MP_Tree_Node *node);
+void mp_incremental_var(MP_Incremental *incremental, char var, double value);
+MP_Result mp_incremental_evaluate(MP_Incremental *incremental);
+void mp_incremental_free(MP_Incremental *incremental);
+bool mp_incremental_tree(MP_Arena *a, MP_Parse_Tree *tree,
+                         const MP_Incremental *incremental);
+
+//----------
+// Compiler
+//----------
 
 typedef struct {
     size_t count;
     size_t capacity;
-    double *items;
-} MP_Stack;
+    uint8_t *items;
+    const MP_Allocator *allocator;
+} MP_Program;
 
 typedef struct {
     MP_Program program;
     MP_Stack stack;
     double vars[26]; // a - z
+    double *slots;   // Not owned by the VM, used by MP_OP_STORE/MP_OP_LOAD
+    size_t slot_count;
     size_t ip;
+    MP_Precision precision;
+    bool verified;   // Set by mp_vm_verify, selects the unchecked loop
+    MP_Error_Type error; // Of the last failed run, see mp_vm_row_error
+#ifdef MP_PROFILE
+    MP_Profile profile;
+#endif
 } MP_Vm;
 
 typedef struct {
@@ -303,46 +826,547 @@ typedef struct {
     double value;
 } MP_Optional;
 
+MP_Opcode mp_node_opcode(MP_Node_Type type);
 bool mp_program_compile(MP_Program *p, MP_Parse_Tree parse_tree);
 bool mp_program_compile_node(MP_Program *p, MP_Tree_Node *node);
 void mp_program_push_opcode(MP_Program *p, MP_Opcode op);
 void mp_program_push_const(MP_Program *p, double value);
 void mp_program_push_var(MP_Program *p, char var);
+void mp_program_push_function(MP_Program *p, MP_Function name);
+void mp_program_push_slot(MP_Program *p, uint32_t slot);
+void mp_program_push_int(MP_Program *p, int32_t n);
+void mp_program_emit_number(MP_Program *p, double value);
+void mp_program_emit_var(MP_Program *p, char var);
+bool mp_program_emit_var_op(MP_Program *p, MP_Opcode op, char var);
+bool mp_program_emit_const_op(MP_Program *p, MP_Opcode op, double value);
 void mp_print_program(MP_Program p);
+size_t mp_opcode_operand_size(MP_Opcode op);
+size_t mp_program_stack_size(MP_Program p);
+void mp_program_shrink(MP_Program *p);
+bool mp_program_verify(MP_Program p, size_t slot_count, size_t *stack_size);
+bool mp_program_decompile(MP_Arena *a, MP_Parse_Tree *tree, MP_Program p);
 
 void mp_stack_push(MP_Stack *stack, double n);
 MP_Optional mp_stack_pop(MP_Stack *stack);
 MP_Optional mp_stack_peek(MP_Stack *stack);
 
 MP_Vm mp_vm_init(MP_Program program);
+void mp_vm_reserve(MP_Vm *vm);
+bool mp_vm_verify(MP_Vm *vm);
 void mp_vm_var(MP_Vm *vm, char var, double value);
 bool mp_vm_run(MP_Vm *vm);
+bool mp_vm_run_unchecked(MP_Vm *vm);
 double mp_vm_result(MP_Vm *vm);
 void mp_vm_free(MP_Vm *vm);
 
+//----------
+// Batch VM
+//----------
+
+// The batch VM runs a verified program over many rows at once. Every value of
+// its stack is a block of MP_BATCH_SIZE rows and every opcode is a loop over the
+// block, which the compiler vectorizes. The variables are read from columns,
+// an array of rows per variable. A NULL column stands for the value of the
+// variable in the VM on every row. Programs that store to slots (see Program
+// set) or leave other than one value on the stack can't run in batches;
+// loading a slot gives the same value on every row.
+//
+// mp_vm_run_batch_f32 runs the same program over float columns into float
+// rows: the constants and the variables are rounded to float and the rows are
+// computed in float, twice as many per vector. x^y, x^n and the native
+// functions are computed in double and rounded.
+//
+// The reductions fold the rows as they are computed, without writing them
+// anywhere. An MP_Reduction holds their sum, minimum, maximum, mean and count.
+// NaN values are left out of all of them, like missing values. The sums are
+// split in MP_BATCH_LANES lanes so that they are vectorized too, and the
+// summation can be:
+// - MP_SUM_PLAIN: a sum per lane, the error grows with the number of rows
+// - MP_SUM_KAHAN: a compensated (Neumaier) sum per lane, the error doesn't
+//   depend on the number of rows
+// - MP_SUM_PAIRWISE: blocks summed pairwise, the error grows with the
+//   logarithm of the number of rows
+// With MP_THREADS the rows can be split across threads. Each thread computes a
+// partial reduction, and the partials are combined at the end.
+//
+// mp_vm_run_batch gives the IEEE 754 values of all the rows. The rows that fail
+// (see Error handling) are told by mp_vm_run_batch_errors, which gives the
+// MP_Error_Type of every row in errors, MP_ERROR_OK for the others. One row
+// failing doesn't stop the others, and the errors are computed alongside the
+// values without branching on them. Programs that don't divide skip it.
+//
+// The filters use the expression as a predicate: a row is selected when its
+// value is true, i.e. not 0 (NaN is true, like in C), which is what the
+// comparisons and logical operators give. mp_vm_filter sets bit row % 64 of
+// bitmap[row / 64] for the selected rows and clears the others, the bitmap
+// has MP_FILTER_WORDS(rows) words. mp_vm_filter_rows writes the indices of the
+// selected rows in increasing order, indices has room for rows of them. Both
+// give the number of selected rows in selected, and neither branches on the
+// values.
+
+#ifndef MP_BATCH_SIZE
+#define MP_BATCH_SIZE 256
+#endif
+
+#define MP_BATCH_LANES 8
+
+#define MP_FILTER_WORDS(rows) (((rows) + 63) / 64)
+
+typedef enum {
+    MP_SUM_PLAIN,
+    MP_SUM_KAHAN,
+    MP_SUM_PAIRWISE,
+    MP_SUM_COUNT
+} MP_Summation;
+
+typedef struct {
+    MP_Summation summation;
+    size_t threads; // Needs MP_THREADS, 0 or 1 for the calling thread only
+} MP_Reduce_Options;
+
+typedef struct {
+    double sum;
+    double min;   // NaN if there are no values
+    double max;   // NaN if there are no values
+    double mean;  // NaN if there are no values
+    size_t count; // Rows whose value is not NaN
+} MP_Reduction;
+
+// Partial reduction of a range of rows
+typedef struct {
+    double sum[MP_BATCH_LANES];
+    double compensation[MP_BATCH_LANES];
+    double min[MP_BATCH_LANES];
+    double max[MP_BATCH_LANES];
+    double count[MP_BATCH_LANES];
+    double cascade[64]; // cascade[k] is the sum of 2^k blocks for pairwise
+    size_t blocks;
+} MP_Reduction_State;
+
+bool mp_program_batchable(MP_Program p);
+bool mp_vm_run_batch(const MP_Vm *vm, const double *const columns[26],
+                     size_t rows, double *out);
+bool mp_vm_run_batch_f32(const MP_Vm *vm, const float *const columns[26],
+                         size_t rows, float *out);
+bool mp_vm_run_batch_errors(const MP_Vm *vm, const double *const columns[26],
+                            size_t rows, double *out, uint8_t *errors);
+bool mp_vm_run_batch_errors_f32(const MP_Vm *vm, const float *const columns[26],
+                                size_t rows, float *out, uint8_t *errors);
+bool mp_program_can_fail(MP_Program p);
+MP_Error_Type mp_vm_row_error(const MP_Vm *vm);
+bool mp_vm_reduce(const MP_Vm *vm, const double *const columns[26],
+                  size_t rows, MP_Reduce_Options options,
+                  MP_Reduction *reduction);
+void mp_reduction_state_init(MP_Reduction_State *state);
+void mp_reduction_state_add(MP_Reduction_State *state, const double *values,
+                            size_t count, MP_Summation summation);
+MP_Reduction mp_reduction_state_finish(const MP_Reduction_State *states,
+                                       size_t count);
+bool mp_vm_filter(const MP_Vm *vm, const double *const columns[26],
+                  size_t rows, uint64_t *bitmap, size_t *selected);
+bool mp_vm_filter_rows(const MP_Vm *vm, const double *const columns[26],
+                       size_t rows, size_t *indices, size_t *selected);
+
+//---------
+// Solvers
+//---------
+
+// The solvers find where the expression of a VM is 0, or smallest, as a
+// function of one of its variables (of several for Nelder-Mead); the other
+// variables keep their value in the VM. They set the variable in the VM and
+// run it directly on the stack reserved by mp_vm_init, so an iteration costs
+// one run of the program and nothing is allocated. The variables are given
+// back their value at the end.
+// - mp_solve_bisection halves [a, b], where f(a) and f(b) have different
+//   signs, until it's shorter than the tolerance.
+// - mp_solve_brent works on the same bracket with inverse quadratic
+//   interpolation and secant steps, and bisects when they don't shrink it
+//   fast enough. It usually takes far fewer runs than bisection.
+// - mp_solve_newton follows the tangent from x. The slope is given by
+//   derivative, a VM for the derivative of the expression with respect to var,
+//   whose variables are set to the ones of vm; or by central differences when
+//   it's NULL. It may diverge or stop at a zero slope.
+// - mp_minimize_golden narrows [a, b] around a minimum by the golden ratio, f
+//   must have a single minimum in it.
+// - mp_minimize_nelder_mead moves a simplex of the variables named by vars from
+//   point, the values they start at, and writes the minimum found in point. x
+//   is the first of them. NaN values count as +inf.
+// An evaluation that fails (see Error handling) stops the solver with its
+// error, and a bracket or a starting point that isn't finite is rejected with
+// MP_ERROR_INVALID_EXPRESSION; x and value are NaN then, and point is left as
+// it was. converged tells whether the tolerance was reached: a bracket or a
+// step shorter than it, plus a few ulps of x.
+//
+// mp_solve_bisection_batch solves one problem per row with the batch VM: the
+// other variables are read from columns (see Batch VM), the brackets from a
+// and b, and the roots are written in roots, NaN for the rows where f(a) and
+// f(b) have the same sign or the bracket isn't finite. The rows are computed
+// like by mp_vm_run_batch, without errors. The rows of a block are bisected
+// together, without branching, until the widest of their brackets is shorter
+// than the tolerance.
+
+#ifndef MP_SOLVE_TOLERANCE
+#define MP_SOLVE_TOLERANCE 1e-12
+#endif
+
+#ifndef MP_SOLVE_MAX_ITERATIONS
+#define MP_SOLVE_MAX_ITERATIONS 200 // Per variable for Nelder-Mead
+#endif
+
+typedef struct {
+    double tolerance;      // On x, 0 for MP_SOLVE_TOLERANCE
+    size_t max_iterations; // 0 for MP_SOLVE_MAX_ITERATIONS
+} MP_Solve_Options;
+
+typedef struct {
+    double x;            // The root or the minimum, NaN if none was found
+    double value;        // f(x)
+    size_t iterations;
+    size_t evaluations;  // Runs of the VMs
+    bool converged;
+    MP_Error_Type error; // Of the evaluation that failed
+} MP_Solution;
+
+MP_Solution mp_solve_bisection(MP_Vm *vm, char var, double a, double b,
+                               MP_Solve_Options options);
+MP_Solution mp_solve_brent(MP_Vm *vm, char var, double a, double b,
+                           MP_Solve_Options options);
+MP_Solution mp_solve_newton(MP_Vm *vm, MP_Vm *derivative, char var, double x,
+                            MP_Solve_Options options);
+MP_Solution mp_minimize_golden(MP_Vm *vm, char var, double a, double b,
+                               MP_Solve_Options options);
+MP_Solution mp_minimize_nelder_mead(MP_Vm *vm, const char *vars, double *point,
+                                    MP_Solve_Options options);
+bool mp_solve_bisection_batch(const MP_Vm *vm, char var,
+                              const double *const columns[26], size_t rows,
+                              const double *a, const double *b,
+                              MP_Solve_Options options, double *roots);
+
 //----------------
 // Simplified API
 //----------------
 
+// MP_MODE_ADAPTIVE starts with the interpreter, which has no setup cost, and
+// compiles the expression for the VM once it has been evaluated a number of
+// times. The switch is transparent: both backends give the same results.
+//
+// MP_MODE_INCREMENTAL keeps the value of every subexpression and computes
+// again only the ones that read a variable changed by mp_variable.
+
+#ifndef MP_ADAPTIVE_THRESHOLD
+#define MP_ADAPTIVE_THRESHOLD 8
+#endif
+
 typedef enum {
     MP_MODE_INTERPRET,
     MP_MODE_COMPILE,
+    MP_MODE_ADAPTIVE,
+    MP_MODE_INCREMENTAL,
     MP_MODE_COUNT
 } MP_Mode;
 
 typedef struct {
     MP_Mode mode;
+    const MP_Allocator *allocator; // NULL for MP_MALLOC/MP_REALLOC/MP_FREE
+    bool strict;                   // Skip the rewrites of mp_optimize
+    MP_Precision precision;
+    size_t adaptive_threshold;     // 0 for MP_ADAPTIVE_THRESHOLD
+} MP_Options;
+
+typedef struct {
+    MP_Mode mode;
+    MP_Mode backend; // MP_MODE_INTERPRET, MP_MODE_COMPILE or MP_MODE_INCREMENTAL
+    MP_Allocator allocator;
+    bool strict;
+    size_t evaluations;
+    size_t adaptive_threshold;
+    bool promotion_failed; // Until mp_reinit, the expression can't be compiled
     union {
         MP_Interpreter interpreter;
         MP_Vm vm;
+        MP_Incremental incremental;
     };
+
+    // Buffers kept by mp_reinit for the next expression
+    MP_Token_List tokens;
+    MP_Arena arena;
+    MP_Tree_Stack stack; // Frames of the compiler and of mp_incremental_build
 } MP_Env;
 
 MP_Env *mp_init(const char *expression);
 MP_Env *mp_init_mode(const char *expression, MP_Mode mode);
+MP_Env *mp_init_options(const char *expression, MP_Options options);
 void mp_variable(MP_Env *env, char var, double value);
 MP_Result mp_evaluate(MP_Env *env);
+bool mp_promote(MP_Env *env);
+bool mp_reinit(MP_Env *env, const char *expression);
+MP_Env *mp_specialize(MP_Env *env, const char *vars);
+bool mp_evaluate_batch(MP_Env *env, const double *const columns[26],
+                       size_t rows, double *out);
+bool mp_evaluate_batch_f32(MP_Env *env, const float *const columns[26],
+                           size_t rows, float *out);
+bool mp_evaluate_batch_errors(MP_Env *env, const double *const columns[26],
+                              size_t rows, double *out, uint8_t *errors);
+bool mp_evaluate_batch_errors_f32(MP_Env *env, const float *const columns[26],
+                                  size_t rows, float *out, uint8_t *errors);
+bool mp_reduce(MP_Env *env, const double *const columns[26], size_t rows,
+               MP_Reduce_Options options, MP_Reduction *reduction);
+bool mp_filter(MP_Env *env, const double *const columns[26], size_t rows,
+               uint64_t *bitmap, size_t *selected);
+bool mp_filter_rows(MP_Env *env, const double *const columns[26], size_t rows,
+                    size_t *indices, size_t *selected);
 void mp_free(MP_Env *env);
+size_t mp_memory_usage(const MP_Env *env);
+const char *mp_mode_to_string(MP_Mode mode);
+
+// A pool of environments for callers that replace expressions often. Released
+// environments keep their buffers and are handed out again by mp_pool_acquire
+// through mp_reinit, so that once the pool is warm no allocation is made.
+
+typedef struct {
+    MP_Env **items;
+    size_t count;
+    size_t capacity;
+    const MP_Allocator *allocator;
+    MP_Options options;
+} MP_Env_Pool;
+
+MP_Env_Pool mp_pool_init(MP_Options options);
+MP_Env *mp_pool_acquire(MP_Env_Pool *pool, const char *expression);
+void mp_pool_release(MP_Env_Pool *pool, MP_Env *env);
+void mp_pool_free(MP_Env_Pool *pool);
+
+#ifdef MP_PROFILE
+MP_Profile *mp_profile(MP_Env *env);
+void mp_profile_reset(MP_Env *env);
+#endif
+
+//---------------
+// Approximation
+//---------------
+
+// mp_approx_init builds an MP_Approx of the expression of env, as a function of
+// var over [lo, hi], out of piecewise polynomials; env itself is left as it
+// was. The other variables keep the value they have in env at the time of the
+// call. The domain is split in pieces of the same width, and on each one the
+// expression is interpolated at the Chebyshev nodes of degree
+// MP_APPROX_DEGREE. The polynomials are stored as powers, so that
+// mp_approx_eval costs finding the piece and MP_APPROX_DEGREE multiply-adds
+// whatever the expression.
+//
+// The samples are computed by mp_evaluate_batch. The number of pieces doubles
+// until the absolute error, measured at MP_APPROX_CHECKS points per piece, is
+// below half the tolerance. The other half covers the error between the checks
+// as long as the derivatives of the expression are bounded over the domain,
+// e.g. not around a pole or at 0 for sqrt(x). mp_approx_init fails if a sample
+// isn't finite or if MP_APPROX_MAX_PIECES pieces don't reach the tolerance.
+//
+// x outside [lo, hi] is clamped to it, NaN gives NaN. An approximation without
+// pieces, after mp_approx_init failed or mp_approx_free, gives NaN too.
+// mp_approx_eval_batch computes rows values of x at once.
+
+#ifndef MP_APPROX_DEGREE
+#define MP_APPROX_DEGREE 8
+#endif
+
+#ifndef MP_APPROX_MAX_PIECES
+#define MP_APPROX_MAX_PIECES (64*1024)
+#endif
+
+#define MP_APPROX_CHECKS 16
+
+typedef struct {
+    double lo;
+    double hi;
+    double scale;         // Pieces per unit of x
+    size_t pieces;
+    double *coefficients; // MP_APPROX_DEGREE + 1 per piece, highest power first
+    double max_error;     // At the checks
+    MP_Allocator allocator;
+} MP_Approx;
+
+bool mp_approx_init(MP_Approx *approx, MP_Env *env, char var, double lo,
+                    double hi, double tolerance);
+double mp_approx_eval(const MP_Approx *approx, double x);
+void mp_approx_eval_batch(const MP_Approx *approx, const double *x,
+                          size_t rows, double *out);
+void mp_approx_free(MP_Approx *approx);
+
+//-------------
+// Program set
+//-------------
+
+// A program set compiles many expressions into a single program. Common
+// subexpressions are shared across all of the expressions: they are computed
+// once per evaluation and reused from a slot afterwards. The value of the i-th
+// expression is stored in slot i.
+
+#define MP_SET_NO_SLOT ((size_t)-1)
+
+typedef struct {
+    MP_Node_Type type;
+    MP_Function function;
+    size_t lhs;
+    size_t rhs;
+    double value;
+    char symbol;
+    size_t uses;
+    size_t slot;
+    bool emitted;
+} MP_Set_Node;
+
+typedef struct {
+    size_t count;
+    size_t capacity;
+    MP_Set_Node *items;
+    const MP_Allocator *allocator;
+} MP_Set_Node_List;
+
+// mp_set_builder_emit keeps the nodes waiting for their operands on a stack,
+// like the passes over a tree
+typedef struct {
+    size_t id;
+    uint32_t state;
+} MP_Set_Frame;
+
+typedef struct {
+    size_t count;
+    size_t capacity;
+    MP_Set_Frame *items;
+    const MP_Allocator *allocator;
+} MP_Set_Stack;
+
+typedef struct {
+    MP_Set_Node_List nodes;
+    size_t *table; // Open addressing, stores node index + 1
+    size_t table_capacity;
+} MP_Set_Builder;
+
+typedef struct {
+    MP_Vm vm;
+    size_t output_count;
+    size_t shared_count;
+    double *slots; // outputs first, then shared subexpressions
+} MP_Program_Set;
+
+MP_Program_Set *mp_program_set_init(const char **expressions, size_t count);
+void mp_program_set_variable(MP_Program_Set *set, char var, double value);
+bool mp_program_set_evaluate(MP_Program_Set *set);
+double mp_program_set_output(MP_Program_Set *set, size_t index);
+void mp_program_set_free(MP_Program_Set *set);
+
+size_t mp_set_builder_intern(MP_Set_Builder *b, MP_Tree_Node *node);
+void mp_set_builder_emit(MP_Set_Builder *b, MP_Program *p, size_t id,
+                         size_t *slot_count);
+void mp_set_builder_free(MP_Set_Builder *b);
+
+//---------------
+// Formula graph
+//---------------
+
+// A formula graph holds named formulas that read the values of other formulas
+// through references, like the cells of a spreadsheet: "net" = "$gross * (1 -
+// t)". mp_graph_update computes the formulas in an order where every formula
+// comes after the ones it reads, and only the formulas downstream of a change:
+// the ones set since the last update, the ones reading a variable changed by
+// mp_graph_variable, the ones calling an impure native function and the ones
+// reading a formula whose value changed.
+//
+// The formulas are grouped in levels, a formula of level n reads formulas of
+// the levels below n only. The formulas of a level are independent: when mp.h
+// is compiled with MP_THREADS (and linked with pthread) the workers started by
+// mp_graph_threads compute them in parallel with the calling thread.
+
+#ifndef MP_GRAPH_PARALLEL_THRESHOLD
+#define MP_GRAPH_PARALLEL_THRESHOLD 64 // Formulas of a level worth the workers
+#endif
+
+// A level of fewer formulas is still given to the workers when their summed
+// mp_tree_cost reaches this, e.g. a few calls of an expensive native function
+#ifndef MP_GRAPH_PARALLEL_COST
+#define MP_GRAPH_PARALLEL_COST 4096
+#endif
+
+#define MP_GRAPH_NO_FORMULA ((size_t)-1)
+
+typedef struct {
+    char *name;
+    char *expression;
+    MP_Vm vm;
+    size_t *inputs;   // Formulas read by this formula, without duplicates
+    size_t input_count;
+    uint32_t vars;    // Variables read by this formula
+    size_t cost;      // mp_tree_cost of the expression
+    size_t level;
+    bool pure;        // Calls no impure function, else computed by every update
+    bool compiled;
+    bool changed;     // Set since the last update
+    bool dirty;       // To be computed by the current update
+    bool updated;     // The last computation changed the value
+    bool failed;
+} MP_Formula;
+
+typedef struct {
+    size_t count;
+    size_t capacity;
+    MP_Formula *items;
+    const MP_Allocator *allocator;
+} MP_Formula_List;
+
+#ifdef MP_THREADS
+typedef struct {
+    pthread_t *threads;
+    size_t count;
+    pthread_mutex_t mutex;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    size_t generation; // Incremented for every level given to the workers
+    size_t running;    // Workers that haven't finished the current level
+    size_t next;       // Next formula of the work list, claimed atomically
+    bool stop;
+} MP_Graph_Workers;
+#endif
+
+typedef struct {
+    MP_Formula_List formulas;
+    double *values;       // Value of the i-th formula, the slots of the programs
+    size_t *table;        // Names, open addressing, stores formula index + 1
+    size_t table_capacity;
+    double vars[26];      // a - z
+    uint32_t dirty_vars;  // Variables changed since the last update
+    MP_Precision precision;
+
+    // Set by the ordering of mp_graph_update
+    bool ordered;
+    size_t *order;        // Formulas sorted by level
+    size_t *level_start;  // Level l is order[level_start[l]..level_start[l+1]]
+    size_t level_count;
+    size_t *users;        // Formulas reading formula i are
+    size_t *user_start;   // users[user_start[i]..user_start[i+1]]
+    size_t *work;         // Dirty formulas of the level being computed
+    size_t work_count;
+    size_t work_cost;     // Summed cost of the work list
+
+    size_t computed;      // Formulas computed by the last update
+    size_t error_formula; // Formula that made the last update fail
+
+    // Buffers reused by the compilation of the formulas
+    MP_Token_List tokens;
+    MP_Arena arena;
+
+#ifdef MP_THREADS
+    MP_Graph_Workers workers;
+#endif
+} MP_Graph;
+
+MP_Graph *mp_graph_init(void);
+size_t mp_graph_set(MP_Graph *g, const char *name, const char *expression);
+size_t mp_graph_find(const MP_Graph *g, const char *name);
+void mp_graph_variable(MP_Graph *g, char var, double value);
+MP_Result mp_graph_update(MP_Graph *g);
+double mp_graph_value(const MP_Graph *g, size_t index);
+bool mp_graph_threads(MP_Graph *g, size_t count);
+void mp_graph_free(MP_Graph *g);
 
 #endif // MP_H_
 
@@ -352,31 +1376,116 @@ void mp_free(MP_Env *env);
 
 #ifdef MP_IMPLEMENTATION
 
+//------------
+// Allocation
+//------------
+
+void *mp_allocator_alloc(const MP_Allocator *a, size_t size)
+{
+    if (a != NULL && a->alloc != NULL)
+        return a->alloc(a->context, size);
+
+    return MP_MALLOC(size);
+}
+
+void *mp_allocator_realloc(const MP_Allocator *a, void *ptr, size_t old_size,
+                           size_t new_size)
+{
+    if (a != NULL && a->realloc != NULL)
+        return a->realloc(a->context, ptr, old_size, new_size);
+
+    // Memory from a->alloc can't go to MP_REALLOC, it is moved instead
+    if (a != NULL && a->alloc != NULL) {
+        void *moved = a->alloc(a->context, new_size);
+        if (moved != NULL && ptr != NULL) {
+            memcpy(moved, ptr, old_size < new_size ? old_size : new_size);
+            mp_allocator_free(a, ptr, old_size);
+        }
+        return moved;
+    }
+
+    return MP_REALLOC(ptr, new_size);
+}
+
+void mp_allocator_free(const MP_Allocator *a, void *ptr, size_t size)
+{
+    if (ptr == NULL)
+        return;
+
+    if (a != NULL && a->free != NULL) {
+        a->free(a->context, ptr, size);
+        return;
+    }
+
+    (void)size;
+    MP_FREE(ptr);
+}
+
 //-------
 // Arena
 //-------
 
+MP_Region *mp_region_new(const MP_Allocator *allocator, size_t capacity)
+{
+    size_t size = sizeof(MP_Region) + capacity * sizeof(uintptr_t);
+    MP_Region *region = mp_allocator_alloc(allocator, size);
+    assert(region != NULL && "Buy more RAM LOL");
+
+    region->next = NULL;
+    region->count = 0;
+    region->capacity = capacity;
+
+    return region;
+}
+
 MP_Arena mp_arena_init(size_t capacity)
 {
     MP_Arena arena = {0};
-    arena.capacity = capacity;
-    arena.count = 0;
-    arena.data = malloc(capacity);
-    assert(arena.data != NULL);
+    size_t words = (capacity + sizeof(uintptr_t) - 1) / sizeof(uintptr_t);
+    arena.begin = mp_region_new(arena.allocator, words);
+    arena.end = arena.begin;
 
     return arena;
 }
 
+// Bytes obtained from the allocator, including the region headers
+size_t mp_arena_size(const MP_Arena *arena)
+{
+    size_t size = 0;
+    for (MP_Region *region = arena->begin; region != NULL; region = region->next) {
+        size += sizeof(MP_Region) + region->capacity * sizeof(uintptr_t);
+    }
+    return size;
+}
+
 void *mp_arena_alloc(MP_Arena *arena, size_t size)
 {
-    if (arena->data == NULL) {
-        *arena = mp_arena_init(MP_ARENA_DEFAULT_CAPACITY);
+    size_t words = (size + sizeof(uintptr_t) - 1) / sizeof(uintptr_t);
+
+    if (arena->end == NULL) {
+        assert(arena->begin == NULL);
+        size_t capacity = MP_ARENA_DEFAULT_CAPACITY / sizeof(uintptr_t);
+        if (capacity < words) capacity = words;
+        arena->begin = mp_region_new(arena->allocator, capacity);
+        arena->end = arena->begin;
+    }
+
+    // Regions left over by mp_arena_reset are reused before adding new ones
+    while (arena->end->count + words > arena->end->capacity
+            && arena->end->next != NULL) {
+        arena->end = arena->end->next;
     }
 
-    assert(arena->count + size <= arena->capacity);
+    if (arena->end->count + words > arena->end->capacity) {
+        assert(arena->end->next == NULL);
+        size_t capacity = MP_ARENA_DEFAULT_CAPACITY / sizeof(uintptr_t);
+        if (capacity < words) capacity = words;
+        arena->end->next = mp_region_new(arena->allocator, capacity);
+        arena->end = arena->end->next;
+    }
 
-    void *result = (uint8_t*)arena->data + arena->count;
-    arena->count += size;
+    void *result = &arena->end->data[arena->end->count];
+    arena->end->count += words;
 
     return result;
 }
@@ -386,11 +1495,16 @@ void mp_arena_free(MP_Arena *arena)
     if (arena == NULL)
         return;
 
-    arena->count = 0;
-    arena->capacity = 0;
+    MP_Region *region = arena->begin;
+    while (region != NULL) {
+        MP_Region *next = region->next;
+        mp_allocator_free(arena->allocator, region,
+                sizeof(MP_Region) + region->capacity * sizeof(uintptr_t));
+        region = next;
+    }
 
-    free(arena->data);
-    arena->data = NULL;
+    arena->begin = NULL;
+    arena->end = NULL;
 }
 
 void mp_arena_reset(MP_Arena *arena)
@@ -398,29 +1512,736 @@ void mp_arena_reset(MP_Arena *arena)
     if (arena == NULL)
         return;
 
-    arena->count = 0;
+    for (MP_Region *region = arena->begin; region != NULL; region = region->next) {
+        region->count = 0;
+    }
+    arena->end = arena->begin;
 }
 
-//-----------
-// Tokenizer
-//-----------
+static void *mp_arena_allocator_alloc(void *context, size_t size)
+{
+    return mp_arena_alloc(context, size);
+}
 
-MP_Result mp_tokenize(MP_Token_List *list, const char *expr)
+static void *mp_arena_allocator_realloc(void *context, void *ptr,
+                                        size_t old_size, size_t new_size)
 {
-    MP_Result result = {0};
-    size_t cursor = 0;
-    size_t end = strlen(expr);
+    void *result = mp_arena_alloc(context, new_size);
+    if (ptr != NULL) {
+        memcpy(result, ptr, old_size < new_size ? old_size : new_size);
+    }
+    return result;
+}
 
-    while (cursor < end) {
-        char c = expr[cursor];
-        MP_Token token = {0};
-        token.position = cursor;
+static void mp_arena_allocator_free(void *context, void *ptr, size_t size)
+{
+    (void)context;
+    (void)ptr;
+    (void)size;
+}
 
-        switch (c) {
-            case '\n':
-            case '\t':
-            case ' ': {
+// An allocator for temporary dynamic arrays, that live until the arena is
+// reset or freed. Growing an array leaves its old items behind.
+MP_Allocator mp_arena_allocator(MP_Arena *arena)
+{
+    MP_Allocator allocator = {0};
+    allocator.alloc = mp_arena_allocator_alloc;
+    allocator.realloc = mp_arena_allocator_realloc;
+    allocator.free = mp_arena_allocator_free;
+    allocator.context = arena;
+    return allocator;
+}
+
+//----------------
+// Number parsing
+//----------------
+
+static const uint64_t mp_number_powers_of_five[651][2] = {
+    // 5^q for q in [-342, 308] normalized to 128 bits as {hi, lo}
+    {0xeef453d6923bd65aULL, 0x113faa2906a13b3fULL}, {0x9558b4661b6565f8ULL, 0x4ac7ca59a424c507ULL},
+    {0xbaaee17fa23ebf76ULL, 0x5d79bcf00d2df649ULL}, {0xe95a99df8ace6f53ULL, 0xf4d82c2c107973dcULL},
+    {0x91d8a02bb6c10594ULL, 0x79071b9b8a4be869ULL}, {0xb64ec836a47146f9ULL, 0x9748e2826cdee284ULL},
+    {0xe3e27a444d8d98b7ULL, 0xfd1b1b2308169b25ULL}, {0x8e6d8c6ab0787f72ULL, 0xfe30f0f5e50e20f7ULL},
+    {0xb208ef855c969f4fULL, 0xbdbd2d335e51a935ULL}, {0xde8b2b66b3bc4723ULL, 0xad2c788035e61382ULL},
+    {0x8b16fb203055ac76ULL, 0x4c3bcb5021afcc31ULL}, {0xaddcb9e83c6b1793ULL, 0xdf4abe242a1bbf3dULL},
+    {0xd953e8624b85dd78ULL, 0xd71d6dad34a2af0dULL}, {0x87d4713d6f33aa6bULL, 0x8672648c40e5ad68ULL},
+    {0xa9c98d8ccb009506ULL, 0x680efdaf511f18c2ULL}, {0xd43bf0effdc0ba48ULL, 0x0212bd1b2566def2ULL},
+    {0x84a57695fe98746dULL, 0x014bb630f7604b57ULL}, {0xa5ced43b7e3e9188ULL, 0x419ea3bd35385e2dULL},
+    {0xcf42894a5dce35eaULL, 0x52064cac828675b9ULL}, {0x818995ce7aa0e1b2ULL, 0x7343efebd1940993ULL},
+    {0xa1ebfb4219491a1fULL, 0x1014ebe6c5f90bf8ULL}, {0xca66fa129f9b60a6ULL, 0xd41a26e077774ef6ULL},
+    {0xfd00b897478238d0ULL, 0x8920b098955522b4ULL}, {0x9e20735e8cb16382ULL, 0x55b46e5f5d5535b0ULL},
+    {0xc5a890362fddbc62ULL, 0xeb2189f734aa831dULL}, {0xf712b443bbd52b7bULL, 0xa5e9ec7501d523e4ULL},
+    {0x9a6bb0aa55653b2dULL, 0x47b233c92125366eULL}, {0xc1069cd4eabe89f8ULL, 0x999ec0bb696e840aULL},
+    {0xf148440a256e2c76ULL, 0xc00670ea43ca250dULL}, {0x96cd2a865764dbcaULL, 0x380406926a5e5728ULL},
+    {0xbc807527ed3e12bcULL, 0xc605083704f5ecf2ULL}, {0xeba09271e88d976bULL, 0xf7864a44c633682eULL},
+    {0x93445b8731587ea3ULL, 0x7ab3ee6afbe0211dULL}, {0xb8157268fdae9e4cULL, 0x5960ea05bad82964ULL},
+    {0xe61acf033d1a45dfULL, 0x6fb92487298e33bdULL}, {0x8fd0c16206306babULL, 0xa5d3b6d479f8e056ULL},
+    {0xb3c4f1ba87bc8696ULL, 0x8f48a4899877186cULL}, {0xe0b62e2929aba83cULL, 0x331acdabfe94de87ULL},
+    {0x8c71dcd9ba0b4925ULL, 0x9ff0c08b7f1d0b14ULL}, {0xaf8e5410288e1b6fULL, 0x07ecf0ae5ee44dd9ULL},
+    {0xdb71e91432b1a24aULL, 0xc9e82cd9f69d6150ULL}, {0x892731ac9faf056eULL, 0xbe311c083a225cd2ULL},
+    {0xab70fe17c79ac6caULL, 0x6dbd630a48aaf406ULL}, {0xd64d3d9db981787dULL, 0x092cbbccdad5b108ULL},
+    {0x85f0468293f0eb4eULL, 0x25bbf56008c58ea5ULL}, {0xa76c582338ed2621ULL, 0xaf2af2b80af6f24eULL},
+    {0xd1476e2c07286faaULL, 0x1af5af660db4aee1ULL}, {0x82cca4db847945caULL, 0x50d98d9fc890ed4dULL},
+    {0xa37fce126597973cULL, 0xe50ff107bab528a0ULL}, {0xcc5fc196fefd7d0cULL, 0x1e53ed49a96272c8ULL},
+    {0xff77b1fcbebcdc4fULL, 0x25e8e89c13bb0f7aULL}, {0x9faacf3df73609b1ULL, 0x77b191618c54e9acULL},
+    {0xc795830d75038c1dULL, 0xd59df5b9ef6a2417ULL}, {0xf97ae3d0d2446f25ULL, 0x4b0573286b44ad1dULL},
+    {0x9becce62836ac577ULL, 0x4ee367f9430aec32ULL}, {0xc2e801fb244576d5ULL, 0x229c41f793cda73fULL},
+    {0xf3a20279ed56d48aULL, 0x6b43527578c1110fULL}, {0x9845418c345644d6ULL, 0x830a13896b78aaa9ULL},
+    {0xbe5691ef416bd60cULL, 0x23cc986bc656d553ULL}, {0xedec366b11c6cb8fULL, 0x2cbfbe86b7ec8aa8ULL},
+    {0x94b3a202eb1c3f39ULL, 0x7bf7d71432f3d6a9ULL}, {0xb9e08a83a5e34f07ULL, 0xdaf5ccd93fb0cc53ULL},
+    {0xe858ad248f5c22c9ULL, 0xd1b3400f8f9cff68ULL}, {0x91376c36d99995beULL, 0x23100809b9c21fa1ULL},
+    {0xb58547448ffffb2dULL, 0xabd40a0c2832a78aULL}, {0xe2e69915b3fff9f9ULL, 0x16c90c8f323f516cULL},
+    {0x8dd01fad907ffc3bULL, 0xae3da7d97f6792e3ULL}, {0xb1442798f49ffb4aULL, 0x99cd11cfdf41779cULL},
+    {0xdd95317f31c7fa1dULL, 0x40405643d711d583ULL}, {0x8a7d3eef7f1cfc52ULL, 0x482835ea666b2572ULL},
+    {0xad1c8eab5ee43b66ULL, 0xda3243650005eecfULL}, {0xd863b256369d4a40ULL, 0x90bed43e40076a82ULL},
+    {0x873e4f75e2224e68ULL, 0x5a7744a6e804a291ULL}, {0xa90de3535aaae202ULL, 0x711515d0a205cb36ULL},
+    {0xd3515c2831559a83ULL, 0x0d5a5b44ca873e03ULL}, {0x8412d9991ed58091ULL, 0xe858790afe9486c2ULL},
+    {0xa5178fff668ae0b6ULL, 0x626e974dbe39a872ULL}, {0xce5d73ff402d98e3ULL, 0xfb0a3d212dc8128fULL},
+    {0x80fa687f881c7f8eULL, 0x7ce66634bc9d0b99ULL}, {0xa139029f6a239f72ULL, 0x1c1fffc1ebc44e80ULL},
+    {0xc987434744ac874eULL, 0xa327ffb266b56220ULL}, {0xfbe9141915d7a922ULL, 0x4bf1ff9f0062baa8ULL},
+    {0x9d71ac8fada6c9b5ULL, 0x6f773fc3603db4a9ULL}, {0xc4ce17b399107c22ULL, 0xcb550fb4384d21d3ULL},
+    {0xf6019da07f549b2bULL, 0x7e2a53a146606a48ULL}, {0x99c102844f94e0fbULL, 0x2eda7444cbfc426dULL},
+    {0xc0314325637a1939ULL, 0xfa911155fefb5308ULL}, {0xf03d93eebc589f88ULL, 0x793555ab7eba27caULL},
+    {0x96267c7535b763b5ULL, 0x4bc1558b2f3458deULL}, {0xbbb01b9283253ca2ULL, 0x9eb1aaedfb016f16ULL},
+    {0xea9c227723ee8bcbULL, 0x465e15a979c1cadcULL}, {0x92a1958a7675175fULL, 0x0bfacd89ec191ec9ULL},
+    {0xb749faed14125d36ULL, 0xcef980ec671f667bULL}, {0xe51c79a85916f484ULL, 0x82b7e12780e7401aULL},
+    {0x8f31cc0937ae58d2ULL, 0xd1b2ecb8b0908810ULL}, {0xb2fe3f0b8599ef07ULL, 0x861fa7e6dcb4aa15ULL},
+    {0xdfbdcece67006ac9ULL, 0x67a791e093e1d49aULL}, {0x8bd6a141006042bdULL, 0xe0c8bb2c5c6d24e0ULL},
+    {0xaecc49914078536dULL, 0x58fae9f773886e18ULL}, {0xda7f5bf590966848ULL, 0xaf39a475506a899eULL},
+    {0x888f99797a5e012dULL, 0x6d8406c952429603ULL}, {0xaab37fd7d8f58178ULL, 0xc8e5087ba6d33b83ULL},
+    {0xd5605fcdcf32e1d6ULL, 0xfb1e4a9a90880a64ULL}, {0x855c3be0a17fcd26ULL, 0x5cf2eea09a55067fULL},
+    {0xa6b34ad8c9dfc06fULL, 0xf42faa48c0ea481eULL}, {0xd0601d8efc57b08bULL, 0xf13b94daf124da26ULL},
+    {0x823c12795db6ce57ULL, 0x76c53d08d6b70858ULL}, {0xa2cb1717b52481edULL, 0x54768c4b0c64ca6eULL},
+    {0xcb7ddcdda26da268ULL, 0xa9942f5dcf7dfd09ULL}, {0xfe5d54150b090b02ULL, 0xd3f93b35435d7c4cULL},
+    {0x9efa548d26e5a6e1ULL, 0xc47bc5014a1a6dafULL}, {0xc6b8e9b0709f109aULL, 0x359ab6419ca1091bULL},
+    {0xf867241c8cc6d4c0ULL, 0xc30163d203c94b62ULL}, {0x9b407691d7fc44f8ULL, 0x79e0de63425dcf1dULL},
+    {0xc21094364dfb5636ULL, 0x985915fc12f542e4ULL}, {0xf294b943e17a2bc4ULL, 0x3e6f5b7b17b2939dULL},
+    {0x979cf3ca6cec5b5aULL, 0xa705992ceecf9c42ULL}, {0xbd8430bd08277231ULL, 0x50c6ff782a838353ULL},
+    {0xece53cec4a314ebdULL, 0xa4f8bf5635246428ULL}, {0x940f4613ae5ed136ULL, 0x871b7795e136be99ULL},
+    {0xb913179899f68584ULL, 0x28e2557b59846e3fULL}, {0xe757dd7ec07426e5ULL, 0x331aeada2fe589cfULL},
+    {0x9096ea6f3848984fULL, 0x3ff0d2c85def7621ULL}, {0xb4bca50b065abe63ULL, 0x0fed077a756b53a9ULL},
+    {0xe1ebce4dc7f16dfbULL, 0xd3e8495912c62894ULL}, {0x8d3360f09cf6e4bdULL, 0x64712dd7abbbd95cULL},
+    {0xb080392cc4349decULL, 0xbd8d794d96aacfb3ULL}, {0xdca04777f541c567ULL, 0xecf0d7a0fc5583a0ULL},
+    {0x89e42caaf9491b60ULL, 0xf41686c49db57244ULL}, {0xac5d37d5b79b6239ULL, 0x311c2875c522ced5ULL},
+    {0xd77485cb25823ac7ULL, 0x7d633293366b828bULL}, {0x86a8d39ef77164bcULL, 0xae5dff9c02033197ULL},
+    {0xa8530886b54dbdebULL, 0xd9f57f830283fdfcULL}, {0xd267caa862a12d66ULL, 0xd072df63c324fd7bULL},
+    {0x8380dea93da4bc60ULL, 0x4247cb9e59f71e6dULL}, {0xa46116538d0deb78ULL, 0x52d9be85f074e608ULL},
+    {0xcd795be870516656ULL, 0x67902e276c921f8bULL}, {0x806bd9714632dff6ULL, 0x00ba1cd8a3db53b6ULL},
+    {0xa086cfcd97bf97f3ULL, 0x80e8a40eccd228a4ULL}, {0xc8a883c0fdaf7df0ULL, 0x6122cd128006b2cdULL},
+    {0xfad2a4b13d1b5d6cULL, 0x796b805720085f81ULL}, {0x9cc3a6eec6311a63ULL, 0xcbe3303674053bb0ULL},
+    {0xc3f490aa77bd60fcULL, 0xbedbfc4411068a9cULL}, {0xf4f1b4d515acb93bULL, 0xee92fb5515482d44ULL},
+    {0x991711052d8bf3c5ULL, 0x751bdd152d4d1c4aULL}, {0xbf5cd54678eef0b6ULL, 0xd262d45a78a0635dULL},
+    {0xef340a98172aace4ULL, 0x86fb897116c87c34ULL}, {0x9580869f0e7aac0eULL, 0xd45d35e6ae3d4da0ULL},
+    {0xbae0a846d2195712ULL, 0x8974836059cca109ULL}, {0xe998d258869facd7ULL, 0x2bd1a438703fc94bULL},
+    {0x91ff83775423cc06ULL, 0x7b6306a34627ddcfULL}, {0xb67f6455292cbf08ULL, 0x1a3bc84c17b1d542ULL},
+    {0xe41f3d6a7377eecaULL, 0x20caba5f1d9e4a93ULL}, {0x8e938662882af53eULL, 0x547eb47b7282ee9cULL},
+    {0xb23867fb2a35b28dULL, 0xe99e619a4f23aa43ULL}, {0xdec681f9f4c31f31ULL, 0x6405fa00e2ec94d4ULL},
+    {0x8b3c113c38f9f37eULL, 0xde83bc408dd3dd04ULL}, {0xae0b158b4738705eULL, 0x9624ab50b148d445ULL},
+    {0xd98ddaee19068c76ULL, 0x3badd624dd9b0957ULL}, {0x87f8a8d4cfa417c9ULL, 0xe54ca5d70a80e5d6ULL},
+    {0xa9f6d30a038d1dbcULL, 0x5e9fcf4ccd211f4cULL}, {0xd47487cc8470652bULL, 0x7647c3200069671fULL},
+    {0x84c8d4dfd2c63f3bULL, 0x29ecd9f40041e073ULL}, {0xa5fb0a17c777cf09ULL, 0xf468107100525890ULL},
+    {0xcf79cc9db955c2ccULL, 0x7182148d4066eeb4ULL}, {0x81ac1fe293d599bfULL, 0xc6f14cd848405530ULL},
+    {0xa21727db38cb002fULL, 0xb8ada00e5a506a7cULL}, {0xca9cf1d206fdc03bULL, 0xa6d90811f0e4851cULL},
+    {0xfd442e4688bd304aULL, 0x908f4a166d1da663ULL}, {0x9e4a9cec15763e2eULL, 0x9a598e4e043287feULL},
+    {0xc5dd44271ad3cdbaULL, 0x40eff1e1853f29fdULL}, {0xf7549530e188c128ULL, 0xd12bee59e68ef47cULL},
+    {0x9a94dd3e8cf578b9ULL, 0x82bb74f8301958ceULL}, {0xc13a148e3032d6e7ULL, 0xe36a52363c1faf01ULL},
+    {0xf18899b1bc3f8ca1ULL, 0xdc44e6c3cb279ac1ULL}, {0x96f5600f15a7b7e5ULL, 0x29ab103a5ef8c0b9ULL},
+    {0xbcb2b812db11a5deULL, 0x7415d448f6b6f0e7ULL}, {0xebdf661791d60f56ULL, 0x111b495b3464ad21ULL},
+    {0x936b9fcebb25c995ULL, 0xcab10dd900beec34ULL}, {0xb84687c269ef3bfbULL, 0x3d5d514f40eea742ULL},
+    {0xe65829b3046b0afaULL, 0x0cb4a5a3112a5112ULL}, {0x8ff71a0fe2c2e6dcULL, 0x47f0e785eaba72abULL},
+    {0xb3f4e093db73a093ULL, 0x59ed216765690f56ULL}, {0xe0f218b8d25088b8ULL, 0x306869c13ec3532cULL},
+    {0x8c974f7383725573ULL, 0x1e414218c73a13fbULL}, {0xafbd2350644eeacfULL, 0xe5d1929ef90898faULL},
+    {0xdbac6c247d62a583ULL, 0xdf45f746b74abf39ULL}, {0x894bc396ce5da772ULL, 0x6b8bba8c328eb783ULL},
+    {0xab9eb47c81f5114fULL, 0x066ea92f3f326564ULL}, {0xd686619ba27255a2ULL, 0xc80a537b0efefebdULL},
+    {0x8613fd0145877585ULL, 0xbd06742ce95f5f36ULL}, {0xa798fc4196e952e7ULL, 0x2c48113823b73704ULL},
+    {0xd17f3b51fca3a7a0ULL, 0xf75a15862ca504c5ULL}, {0x82ef85133de648c4ULL, 0x9a984d73dbe722fbULL},
+    {0xa3ab66580d5fdaf5ULL, 0xc13e60d0d2e0ebbaULL}, {0xcc963fee10b7d1b3ULL, 0x318df905079926a8ULL},
+    {0xffbbcfe994e5c61fULL, 0xfdf17746497f7052ULL}, {0x9fd561f1fd0f9bd3ULL, 0xfeb6ea8bedefa633ULL},
+    {0xc7caba6e7c5382c8ULL, 0xfe64a52ee96b8fc0ULL}, {0xf9bd690a1b68637bULL, 0x3dfdce7aa3c673b0ULL},
+    {0x9c1661a651213e2dULL, 0x06bea10ca65c084eULL}, {0xc31bfa0fe5698db8ULL, 0x486e494fcff30a62ULL},
+    {0xf3e2f893dec3f126ULL, 0x5a89dba3c3efccfaULL}, {0x986ddb5c6b3a76b7ULL, 0xf89629465a75e01cULL},
+    {0xbe89523386091465ULL, 0xf6bbb397f1135823ULL}, {0xee2ba6c0678b597fULL, 0x746aa07ded582e2cULL},
+    {0x94db483840b717efULL, 0xa8c2a44eb4571cdcULL}, {0xba121a4650e4ddebULL, 0x92f34d62616ce413ULL},
+    {0xe896a0d7e51e1566ULL, 0x77b020baf9c81d17ULL}, {0x915e2486ef32cd60ULL, 0x0ace1474dc1d122eULL},
+    {0xb5b5ada8aaff80b8ULL, 0x0d819992132456baULL}, {0xe3231912d5bf60e6ULL, 0x10e1fff697ed6c69ULL},
+    {0x8df5efabc5979c8fULL, 0xca8d3ffa1ef463c1ULL}, {0xb1736b96b6fd83b3ULL, 0xbd308ff8a6b17cb2ULL},
+    {0xddd0467c64bce4a0ULL, 0xac7cb3f6d05ddbdeULL}, {0x8aa22c0dbef60ee4ULL, 0x6bcdf07a423aa96bULL},
+    {0xad4ab7112eb3929dULL, 0x86c16c98d2c953c6ULL}, {0xd89d64d57a607744ULL, 0xe871c7bf077ba8b7ULL},
+    {0x87625f056c7c4a8bULL, 0x11471cd764ad4972ULL}, {0xa93af6c6c79b5d2dULL, 0xd598e40d3dd89bcfULL},
+    {0xd389b47879823479ULL, 0x4aff1d108d4ec2c3ULL}, {0x843610cb4bf160cbULL, 0xcedf722a585139baULL},
+    {0xa54394fe1eedb8feULL, 0xc2974eb4ee658828ULL}, {0xce947a3da6a9273eULL, 0x733d226229feea32ULL},
+    {0x811ccc668829b887ULL, 0x0806357d5a3f525fULL}, {0xa163ff802a3426a8ULL, 0xca07c2dcb0cf26f7ULL},
+    {0xc9bcff6034c13052ULL, 0xfc89b393dd02f0b5ULL}, {0xfc2c3f3841f17c67ULL, 0xbbac2078d443ace2ULL},
+    {0x9d9ba7832936edc0ULL, 0xd54b944b84aa4c0dULL}, {0xc5029163f384a931ULL, 0x0a9e795e65d4df11ULL},
+    {0xf64335bcf065d37dULL, 0x4d4617b5ff4a16d5ULL}, {0x99ea0196163fa42eULL, 0x504bced1bf8e4e45ULL},
+    {0xc06481fb9bcf8d39ULL, 0xe45ec2862f71e1d6ULL}, {0xf07da27a82c37088ULL, 0x5d767327bb4e5a4cULL},
+    {0x964e858c91ba2655ULL, 0x3a6a07f8d510f86fULL}, {0xbbe226efb628afeaULL, 0x890489f70a55368bULL},
+    {0xeadab0aba3b2dbe5ULL, 0x2b45ac74ccea842eULL}, {0x92c8ae6b464fc96fULL, 0x3b0b8bc90012929dULL},
+    {0xb77ada0617e3bbcbULL, 0x09ce6ebb40173744ULL}, {0xe55990879ddcaabdULL, 0xcc420a6a101d0515ULL},
+    {0x8f57fa54c2a9eab6ULL, 0x9fa946824a12232dULL}, {0xb32df8e9f3546564ULL, 0x47939822dc96abf9ULL},
+    {0xdff9772470297ebdULL, 0x59787e2b93bc56f7ULL}, {0x8bfbea76c619ef36ULL, 0x57eb4edb3c55b65aULL},
+    {0xaefae51477a06b03ULL, 0xede622920b6b23f1ULL}, {0xdab99e59958885c4ULL, 0xe95fab368e45ecedULL},
+    {0x88b402f7fd75539bULL, 0x11dbcb0218ebb414ULL}, {0xaae103b5fcd2a881ULL, 0xd652bdc29f26a119ULL},
+    {0xd59944a37c0752a2ULL, 0x4be76d3346f0495fULL}, {0x857fcae62d8493a5ULL, 0x6f70a4400c562ddbULL},
+    {0xa6dfbd9fb8e5b88eULL, 0xcb4ccd500f6bb952ULL}, {0xd097ad07a71f26b2ULL, 0x7e2000a41346a7a7ULL},
+    {0x825ecc24c873782fULL, 0x8ed400668c0c28c8ULL}, {0xa2f67f2dfa90563bULL, 0x728900802f0f32faULL},
+    {0xcbb41ef979346bcaULL, 0x4f2b40a03ad2ffb9ULL}, {0xfea126b7d78186bcULL, 0xe2f610c84987bfa8ULL},
+    {0x9f24b832e6b0f436ULL, 0x0dd9ca7d2df4d7c9ULL}, {0xc6ede63fa05d3143ULL, 0x91503d1c79720dbbULL},
+    {0xf8a95fcf88747d94ULL, 0x75a44c6397ce912aULL}, {0x9b69dbe1b548ce7cULL, 0xc986afbe3ee11abaULL},
+    {0xc24452da229b021bULL, 0xfbe85badce996168ULL}, {0xf2d56790ab41c2a2ULL, 0xfae27299423fb9c3ULL},
+    {0x97c560ba6b0919a5ULL, 0xdccd879fc967d41aULL}, {0xbdb6b8e905cb600fULL, 0x5400e987bbc1c920ULL},
+    {0xed246723473e3813ULL, 0x290123e9aab23b68ULL}, {0x9436c0760c86e30bULL, 0xf9a0b6720aaf6521ULL},
+    {0xb94470938fa89bceULL, 0xf808e40e8d5b3e69ULL}, {0xe7958cb87392c2c2ULL, 0xb60b1d1230b20e04ULL},
+    {0x90bd77f3483bb9b9ULL, 0xb1c6f22b5e6f48c2ULL}, {0xb4ecd5f01a4aa828ULL, 0x1e38aeb6360b1af3ULL},
+    {0xe2280b6c20dd5232ULL, 0x25c6da63c38de1b0ULL}, {0x8d590723948a535fULL, 0x579c487e5a38ad0eULL},
+    {0xb0af48ec79ace837ULL, 0x2d835a9df0c6d851ULL}, {0xdcdb1b2798182244ULL, 0xf8e431456cf88e65ULL},
+    {0x8a08f0f8bf0f156bULL, 0x1b8e9ecb641b58ffULL}, {0xac8b2d36eed2dac5ULL, 0xe272467e3d222f3fULL},
+    {0xd7adf884aa879177ULL, 0x5b0ed81dcc6abb0fULL}, {0x86ccbb52ea94baeaULL, 0x98e947129fc2b4e9ULL},
+    {0xa87fea27a539e9a5ULL, 0x3f2398d747b36224ULL}, {0xd29fe4b18e88640eULL, 0x8eec7f0d19a03aadULL},
+    {0x83a3eeeef9153e89ULL, 0x1953cf68300424acULL}, {0xa48ceaaab75a8e2bULL, 0x5fa8c3423c052dd7ULL},
+    {0xcdb02555653131b6ULL, 0x3792f412cb06794dULL}, {0x808e17555f3ebf11ULL, 0xe2bbd88bbee40bd0ULL},
+    {0xa0b19d2ab70e6ed6ULL, 0x5b6aceaeae9d0ec4ULL}, {0xc8de047564d20a8bULL, 0xf245825a5a445275ULL},
+    {0xfb158592be068d2eULL, 0xeed6e2f0f0d56712ULL}, {0x9ced737bb6c4183dULL, 0x55464dd69685606bULL},
+    {0xc428d05aa4751e4cULL, 0xaa97e14c3c26b886ULL}, {0xf53304714d9265dfULL, 0xd53dd99f4b3066a8ULL},
+    {0x993fe2c6d07b7fabULL, 0xe546a8038efe4029ULL}, {0xbf8fdb78849a5f96ULL, 0xde98520472bdd033ULL},
+    {0xef73d256a5c0f77cULL, 0x963e66858f6d4440ULL}, {0x95a8637627989aadULL, 0xdde7001379a44aa8ULL},
+    {0xbb127c53b17ec159ULL, 0x5560c018580d5d52ULL}, {0xe9d71b689dde71afULL, 0xaab8f01e6e10b4a6ULL},
+    {0x9226712162ab070dULL, 0xcab3961304ca70e8ULL}, {0xb6b00d69bb55c8d1ULL, 0x3d607b97c5fd0d22ULL},
+    {0xe45c10c42a2b3b05ULL, 0x8cb89a7db77c506aULL}, {0x8eb98a7a9a5b04e3ULL, 0x77f3608e92adb242ULL},
+    {0xb267ed1940f1c61cULL, 0x55f038b237591ed3ULL}, {0xdf01e85f912e37a3ULL, 0x6b6c46dec52f6688ULL},
+    {0x8b61313bbabce2c6ULL, 0x2323ac4b3b3da015ULL}, {0xae397d8aa96c1b77ULL, 0xabec975e0a0d081aULL},
+    {0xd9c7dced53c72255ULL, 0x96e7bd358c904a21ULL}, {0x881cea14545c7575ULL, 0x7e50d64177da2e54ULL},
+    {0xaa242499697392d2ULL, 0xdde50bd1d5d0b9e9ULL}, {0xd4ad2dbfc3d07787ULL, 0x955e4ec64b44e864ULL},
+    {0x84ec3c97da624ab4ULL, 0xbd5af13bef0b113eULL}, {0xa6274bbdd0fadd61ULL, 0xecb1ad8aeacdd58eULL},
+    {0xcfb11ead453994baULL, 0x67de18eda5814af2ULL}, {0x81ceb32c4b43fcf4ULL, 0x80eacf948770ced7ULL},
+    {0xa2425ff75e14fc31ULL, 0xa1258379a94d028dULL}, {0xcad2f7f5359a3b3eULL, 0x096ee45813a04330ULL},
+    {0xfd87b5f28300ca0dULL, 0x8bca9d6e188853fcULL}, {0x9e74d1b791e07e48ULL, 0x775ea264cf55347eULL},
+    {0xc612062576589ddaULL, 0x95364afe032a819eULL}, {0xf79687aed3eec551ULL, 0x3a83ddbd83f52205ULL},
+    {0x9abe14cd44753b52ULL, 0xc4926a9672793543ULL}, {0xc16d9a0095928a27ULL, 0x75b7053c0f178294ULL},
+    {0xf1c90080baf72cb1ULL, 0x5324c68b12dd6339ULL}, {0x971da05074da7beeULL, 0xd3f6fc16ebca5e04ULL},
+    {0xbce5086492111aeaULL, 0x88f4bb1ca6bcf585ULL}, {0xec1e4a7db69561a5ULL, 0x2b31e9e3d06c32e6ULL},
+    {0x9392ee8e921d5d07ULL, 0x3aff322e62439fd0ULL}, {0xb877aa3236a4b449ULL, 0x09befeb9fad487c3ULL},
+    {0xe69594bec44de15bULL, 0x4c2ebe687989a9b4ULL}, {0x901d7cf73ab0acd9ULL, 0x0f9d37014bf60a11ULL},
+    {0xb424dc35095cd80fULL, 0x538484c19ef38c95ULL}, {0xe12e13424bb40e13ULL, 0x2865a5f206b06fbaULL},
+    {0x8cbccc096f5088cbULL, 0xf93f87b7442e45d4ULL}, {0xafebff0bcb24aafeULL, 0xf78f69a51539d749ULL},
+    {0xdbe6fecebdedd5beULL, 0xb573440e5a884d1cULL}, {0x89705f4136b4a597ULL, 0x31680a88f8953031ULL},
+    {0xabcc77118461cefcULL, 0xfdc20d2b36ba7c3eULL}, {0xd6bf94d5e57a42bcULL, 0x3d32907604691b4dULL},
+    {0x8637bd05af6c69b5ULL, 0xa63f9a49c2c1b110ULL}, {0xa7c5ac471b478423ULL, 0x0fcf80dc33721d54ULL},
+    {0xd1b71758e219652bULL, 0xd3c36113404ea4a9ULL}, {0x83126e978d4fdf3bULL, 0x645a1cac083126eaULL},
+    {0xa3d70a3d70a3d70aULL, 0x3d70a3d70a3d70a4ULL}, {0xccccccccccccccccULL, 0xcccccccccccccccdULL},
+    {0x8000000000000000ULL, 0x0000000000000000ULL}, {0xa000000000000000ULL, 0x0000000000000000ULL},
+    {0xc800000000000000ULL, 0x0000000000000000ULL}, {0xfa00000000000000ULL, 0x0000000000000000ULL},
+    {0x9c40000000000000ULL, 0x0000000000000000ULL}, {0xc350000000000000ULL, 0x0000000000000000ULL},
+    {0xf424000000000000ULL, 0x0000000000000000ULL}, {0x9896800000000000ULL, 0x0000000000000000ULL},
+    {0xbebc200000000000ULL, 0x0000000000000000ULL}, {0xee6b280000000000ULL, 0x0000000000000000ULL},
+    {0x9502f90000000000ULL, 0x0000000000000000ULL}, {0xba43b74000000000ULL, 0x0000000000000000ULL},
+    {0xe8d4a51000000000ULL, 0x0000000000000000ULL}, {0x9184e72a00000000ULL, 0x0000000000000000ULL},
+    {0xb5e620f480000000ULL, 0x0000000000000000ULL}, {0xe35fa931a0000000ULL, 0x0000000000000000ULL},
+    {0x8e1bc9bf04000000ULL, 0x0000000000000000ULL}, {0xb1a2bc2ec5000000ULL, 0x0000000000000000ULL},
+    {0xde0b6b3a76400000ULL, 0x0000000000000000ULL}, {0x8ac7230489e80000ULL, 0x0000000000000000ULL},
+    {0xad78ebc5ac620000ULL, 0x0000000000000000ULL}, {0xd8d726b7177a8000ULL, 0x0000000000000000ULL},
+    {0x878678326eac9000ULL, 0x0000000000000000ULL}, {0xa968163f0a57b400ULL, 0x0000000000000000ULL},
+    {0xd3c21bcecceda100ULL, 0x0000000000000000ULL}, {0x84595161401484a0ULL, 0x0000000000000000ULL},
+    {0xa56fa5b99019a5c8ULL, 0x0000000000000000ULL}, {0xcecb8f27f4200f3aULL, 0x0000000000000000ULL},
+    {0x813f3978f8940984ULL, 0x4000000000000000ULL}, {0xa18f07d736b90be5ULL, 0x5000000000000000ULL},
+    {0xc9f2c9cd04674edeULL, 0xa400000000000000ULL}, {0xfc6f7c4045812296ULL, 0x4d00000000000000ULL},
+    {0x9dc5ada82b70b59dULL, 0xf020000000000000ULL}, {0xc5371912364ce305ULL, 0x6c28000000000000ULL},
+    {0xf684df56c3e01bc6ULL, 0xc732000000000000ULL}, {0x9a130b963a6c115cULL, 0x3c7f400000000000ULL},
+    {0xc097ce7bc90715b3ULL, 0x4b9f100000000000ULL}, {0xf0bdc21abb48db20ULL, 0x1e86d40000000000ULL},
+    {0x96769950b50d88f4ULL, 0x1314448000000000ULL}, {0xbc143fa4e250eb31ULL, 0x17d955a000000000ULL},
+    {0xeb194f8e1ae525fdULL, 0x5dcfab0800000000ULL}, {0x92efd1b8d0cf37beULL, 0x5aa1cae500000000ULL},
+    {0xb7abc627050305adULL, 0xf14a3d9e40000000ULL}, {0xe596b7b0c643c719ULL, 0x6d9ccd05d0000000ULL},
+    {0x8f7e32ce7bea5c6fULL, 0xe4820023a2000000ULL}, {0xb35dbf821ae4f38bULL, 0xdda2802c8a800000ULL},
+    {0xe0352f62a19e306eULL, 0xd50b2037ad200000ULL}, {0x8c213d9da502de45ULL, 0x4526f422cc340000ULL},
+    {0xaf298d050e4395d6ULL, 0x9670b12b7f410000ULL}, {0xdaf3f04651d47b4cULL, 0x3c0cdd765f114000ULL},
+    {0x88d8762bf324cd0fULL, 0xa5880a69fb6ac800ULL}, {0xab0e93b6efee0053ULL, 0x8eea0d047a457a00ULL},
+    {0xd5d238a4abe98068ULL, 0x72a4904598d6d880ULL}, {0x85a36366eb71f041ULL, 0x47a6da2b7f864750ULL},
+    {0xa70c3c40a64e6c51ULL, 0x999090b65f67d924ULL}, {0xd0cf4b50cfe20765ULL, 0xfff4b4e3f741cf6dULL},
+    {0x82818f1281ed449fULL, 0xbff8f10e7a8921a4ULL}, {0xa321f2d7226895c7ULL, 0xaff72d52192b6a0dULL},
+    {0xcbea6f8ceb02bb39ULL, 0x9bf4f8a69f764490ULL}, {0xfee50b7025c36a08ULL, 0x02f236d04753d5b4ULL},
+    {0x9f4f2726179a2245ULL, 0x01d762422c946590ULL}, {0xc722f0ef9d80aad6ULL, 0x424d3ad2b7b97ef5ULL},
+    {0xf8ebad2b84e0d58bULL, 0xd2e0898765a7deb2ULL}, {0x9b934c3b330c8577ULL, 0x63cc55f49f88eb2fULL},
+    {0xc2781f49ffcfa6d5ULL, 0x3cbf6b71c76b25fbULL}, {0xf316271c7fc3908aULL, 0x8bef464e3945ef7aULL},
+    {0x97edd871cfda3a56ULL, 0x97758bf0e3cbb5acULL}, {0xbde94e8e43d0c8ecULL, 0x3d52eeed1cbea317ULL},
+    {0xed63a231d4c4fb27ULL, 0x4ca7aaa863ee4bddULL}, {0x945e455f24fb1cf8ULL, 0x8fe8caa93e74ef6aULL},
+    {0xb975d6b6ee39e436ULL, 0xb3e2fd538e122b44ULL}, {0xe7d34c64a9c85d44ULL, 0x60dbbca87196b616ULL},
+    {0x90e40fbeea1d3a4aULL, 0xbc8955e946fe31cdULL}, {0xb51d13aea4a488ddULL, 0x6babab6398bdbe41ULL},
+    {0xe264589a4dcdab14ULL, 0xc696963c7eed2dd1ULL}, {0x8d7eb76070a08aecULL, 0xfc1e1de5cf543ca2ULL},
+    {0xb0de65388cc8ada8ULL, 0x3b25a55f43294bcbULL}, {0xdd15fe86affad912ULL, 0x49ef0eb713f39ebeULL},
+    {0x8a2dbf142dfcc7abULL, 0x6e3569326c784337ULL}, {0xacb92ed9397bf996ULL, 0x49c2c37f07965404ULL},
+    {0xd7e77a8f87daf7fbULL, 0xdc33745ec97be906ULL}, {0x86f0ac99b4e8dafdULL, 0x69a028bb3ded71a3ULL},
+    {0xa8acd7c0222311bcULL, 0xc40832ea0d68ce0cULL}, {0xd2d80db02aabd62bULL, 0xf50a3fa490c30190ULL},
+    {0x83c7088e1aab65dbULL, 0x792667c6da79e0faULL}, {0xa4b8cab1a1563f52ULL, 0x577001b891185938ULL},
+    {0xcde6fd5e09abcf26ULL, 0xed4c0226b55e6f86ULL}, {0x80b05e5ac60b6178ULL, 0x544f8158315b05b4ULL},
+    {0xa0dc75f1778e39d6ULL, 0x696361ae3db1c721ULL}, {0xc913936dd571c84cULL, 0x03bc3a19cd1e38e9ULL},
+    {0xfb5878494ace3a5fULL, 0x04ab48a04065c723ULL}, {0x9d174b2dcec0e47bULL, 0x62eb0d64283f9c76ULL},
+    {0xc45d1df942711d9aULL, 0x3ba5d0bd324f8394ULL}, {0xf5746577930d6500ULL, 0xca8f44ec7ee36479ULL},
+    {0x9968bf6abbe85f20ULL, 0x7e998b13cf4e1ecbULL}, {0xbfc2ef456ae276e8ULL, 0x9e3fedd8c321a67eULL},
+    {0xefb3ab16c59b14a2ULL, 0xc5cfe94ef3ea101eULL}, {0x95d04aee3b80ece5ULL, 0xbba1f1d158724a12ULL},
+    {0xbb445da9ca61281fULL, 0x2a8a6e45ae8edc97ULL}, {0xea1575143cf97226ULL, 0xf52d09d71a3293bdULL},
+    {0x924d692ca61be758ULL, 0x593c2626705f9c56ULL}, {0xb6e0c377cfa2e12eULL, 0x6f8b2fb00c77836cULL},
+    {0xe498f455c38b997aULL, 0x0b6dfb9c0f956447ULL}, {0x8edf98b59a373fecULL, 0x4724bd4189bd5eacULL},
+    {0xb2977ee300c50fe7ULL, 0x58edec91ec2cb657ULL}, {0xdf3d5e9bc0f653e1ULL, 0x2f2967b66737e3edULL},
+    {0x8b865b215899f46cULL, 0xbd79e0d20082ee74ULL}, {0xae67f1e9aec07187ULL, 0xecd8590680a3aa11ULL},
+    {0xda01ee641a708de9ULL, 0xe80e6f4820cc9495ULL}, {0x884134fe908658b2ULL, 0x3109058d147fdcddULL},
+    {0xaa51823e34a7eedeULL, 0xbd4b46f0599fd415ULL}, {0xd4e5e2cdc1d1ea96ULL, 0x6c9e18ac7007c91aULL},
+    {0x850fadc09923329eULL, 0x03e2cf6bc604ddb0ULL}, {0xa6539930bf6bff45ULL, 0x84db8346b786151cULL},
+    {0xcfe87f7cef46ff16ULL, 0xe612641865679a63ULL}, {0x81f14fae158c5f6eULL, 0x4fcb7e8f3f60c07eULL},
+    {0xa26da3999aef7749ULL, 0xe3be5e330f38f09dULL}, {0xcb090c8001ab551cULL, 0x5cadf5bfd3072cc5ULL},
+    {0xfdcb4fa002162a63ULL, 0x73d9732fc7c8f7f6ULL}, {0x9e9f11c4014dda7eULL, 0x2867e7fddcdd9afaULL},
+    {0xc646d63501a1511dULL, 0xb281e1fd541501b8ULL}, {0xf7d88bc24209a565ULL, 0x1f225a7ca91a4226ULL},
+    {0x9ae757596946075fULL, 0x3375788de9b06958ULL}, {0xc1a12d2fc3978937ULL, 0x0052d6b1641c83aeULL},
+    {0xf209787bb47d6b84ULL, 0xc0678c5dbd23a49aULL}, {0x9745eb4d50ce6332ULL, 0xf840b7ba963646e0ULL},
+    {0xbd176620a501fbffULL, 0xb650e5a93bc3d898ULL}, {0xec5d3fa8ce427affULL, 0xa3e51f138ab4cebeULL},
+    {0x93ba47c980e98cdfULL, 0xc66f336c36b10137ULL}, {0xb8a8d9bbe123f017ULL, 0xb80b0047445d4184ULL},
+    {0xe6d3102ad96cec1dULL, 0xa60dc059157491e5ULL}, {0x9043ea1ac7e41392ULL, 0x87c89837ad68db2fULL},
+    {0xb454e4a179dd1877ULL, 0x29babe4598c311fbULL}, {0xe16a1dc9d8545e94ULL, 0xf4296dd6fef3d67aULL},
+    {0x8ce2529e2734bb1dULL, 0x1899e4a65f58660cULL}, {0xb01ae745b101e9e4ULL, 0x5ec05dcff72e7f8fULL},
+    {0xdc21a1171d42645dULL, 0x76707543f4fa1f73ULL}, {0x899504ae72497ebaULL, 0x6a06494a791c53a8ULL},
+    {0xabfa45da0edbde69ULL, 0x0487db9d17636892ULL}, {0xd6f8d7509292d603ULL, 0x45a9d2845d3c42b6ULL},
+    {0x865b86925b9bc5c2ULL, 0x0b8a2392ba45a9b2ULL}, {0xa7f26836f282b732ULL, 0x8e6cac7768d7141eULL},
+    {0xd1ef0244af2364ffULL, 0x3207d795430cd926ULL}, {0x8335616aed761f1fULL, 0x7f44e6bd49e807b8ULL},
+    {0xa402b9c5a8d3a6e7ULL, 0x5f16206c9c6209a6ULL}, {0xcd036837130890a1ULL, 0x36dba887c37a8c0fULL},
+    {0x802221226be55a64ULL, 0xc2494954da2c9789ULL}, {0xa02aa96b06deb0fdULL, 0xf2db9baa10b7bd6cULL},
+    {0xc83553c5c8965d3dULL, 0x6f92829494e5acc7ULL}, {0xfa42a8b73abbf48cULL, 0xcb772339ba1f17f9ULL},
+    {0x9c69a97284b578d7ULL, 0xff2a760414536efbULL}, {0xc38413cf25e2d70dULL, 0xfef5138519684abaULL},
+    {0xf46518c2ef5b8cd1ULL, 0x7eb258665fc25d69ULL}, {0x98bf2f79d5993802ULL, 0xef2f773ffbd97a61ULL},
+    {0xbeeefb584aff8603ULL, 0xaafb550ffacfd8faULL}, {0xeeaaba2e5dbf6784ULL, 0x95ba2a53f983cf38ULL},
+    {0x952ab45cfa97a0b2ULL, 0xdd945a747bf26183ULL}, {0xba756174393d88dfULL, 0x94f971119aeef9e4ULL},
+    {0xe912b9d1478ceb17ULL, 0x7a37cd5601aab85dULL}, {0x91abb422ccb812eeULL, 0xac62e055c10ab33aULL},
+    {0xb616a12b7fe617aaULL, 0x577b986b314d6009ULL}, {0xe39c49765fdf9d94ULL, 0xed5a7e85fda0b80bULL},
+    {0x8e41ade9fbebc27dULL, 0x14588f13be847307ULL}, {0xb1d219647ae6b31cULL, 0x596eb2d8ae258fc8ULL},
+    {0xde469fbd99a05fe3ULL, 0x6fca5f8ed9aef3bbULL}, {0x8aec23d680043beeULL, 0x25de7bb9480d5854ULL},
+    {0xada72ccc20054ae9ULL, 0xaf561aa79a10ae6aULL}, {0xd910f7ff28069da4ULL, 0x1b2ba1518094da04ULL},
+    {0x87aa9aff79042286ULL, 0x90fb44d2f05d0842ULL}, {0xa99541bf57452b28ULL, 0x353a1607ac744a53ULL},
+    {0xd3fa922f2d1675f2ULL, 0x42889b8997915ce8ULL}, {0x847c9b5d7c2e09b7ULL, 0x69956135febada11ULL},
+    {0xa59bc234db398c25ULL, 0x43fab9837e699095ULL}, {0xcf02b2c21207ef2eULL, 0x94f967e45e03f4bbULL},
+    {0x8161afb94b44f57dULL, 0x1d1be0eebac278f5ULL}, {0xa1ba1ba79e1632dcULL, 0x6462d92a69731732ULL},
+    {0xca28a291859bbf93ULL, 0x7d7b8f7503cfdcfeULL}, {0xfcb2cb35e702af78ULL, 0x5cda735244c3d43eULL},
+    {0x9defbf01b061adabULL, 0x3a0888136afa64a7ULL}, {0xc56baec21c7a1916ULL, 0x088aaa1845b8fdd0ULL},
+    {0xf6c69a72a3989f5bULL, 0x8aad549e57273d45ULL}, {0x9a3c2087a63f6399ULL, 0x36ac54e2f678864bULL},
+    {0xc0cb28a98fcf3c7fULL, 0x84576a1bb416a7ddULL}, {0xf0fdf2d3f3c30b9fULL, 0x656d44a2a11c51d5ULL},
+    {0x969eb7c47859e743ULL, 0x9f644ae5a4b1b325ULL}, {0xbc4665b596706114ULL, 0x873d5d9f0dde1feeULL},
+    {0xeb57ff22fc0c7959ULL, 0xa90cb506d155a7eaULL}, {0x9316ff75dd87cbd8ULL, 0x09a7f12442d588f2ULL},
+    {0xb7dcbf5354e9beceULL, 0x0c11ed6d538aeb2fULL}, {0xe5d3ef282a242e81ULL, 0x8f1668c8a86da5faULL},
+    {0x8fa475791a569d10ULL, 0xf96e017d694487bcULL}, {0xb38d92d760ec4455ULL, 0x37c981dcc395a9acULL},
+    {0xe070f78d3927556aULL, 0x85bbe253f47b1417ULL}, {0x8c469ab843b89562ULL, 0x93956d7478ccec8eULL},
+    {0xaf58416654a6babbULL, 0x387ac8d1970027b2ULL}, {0xdb2e51bfe9d0696aULL, 0x06997b05fcc0319eULL},
+    {0x88fcf317f22241e2ULL, 0x441fece3bdf81f03ULL}, {0xab3c2fddeeaad25aULL, 0xd527e81cad7626c3ULL},
+    {0xd60b3bd56a5586f1ULL, 0x8a71e223d8d3b074ULL}, {0x85c7056562757456ULL, 0xf6872d5667844e49ULL},
+    {0xa738c6bebb12d16cULL, 0xb428f8ac016561dbULL}, {0xd106f86e69d785c7ULL, 0xe13336d701beba52ULL},
+    {0x82a45b450226b39cULL, 0xecc0024661173473ULL}, {0xa34d721642b06084ULL, 0x27f002d7f95d0190ULL},
+    {0xcc20ce9bd35c78a5ULL, 0x31ec038df7b441f4ULL}, {0xff290242c83396ceULL, 0x7e67047175a15271ULL},
+    {0x9f79a169bd203e41ULL, 0x0f0062c6e984d386ULL}, {0xc75809c42c684dd1ULL, 0x52c07b78a3e60868ULL},
+    {0xf92e0c3537826145ULL, 0xa7709a56ccdf8a82ULL}, {0x9bbcc7a142b17ccbULL, 0x88a66076400bb691ULL},
+    {0xc2abf989935ddbfeULL, 0x6acff893d00ea435ULL}, {0xf356f7ebf83552feULL, 0x0583f6b8c4124d43ULL},
+    {0x98165af37b2153deULL, 0xc3727a337a8b704aULL}, {0xbe1bf1b059e9a8d6ULL, 0x744f18c0592e4c5cULL},
+    {0xeda2ee1c7064130cULL, 0x1162def06f79df73ULL}, {0x9485d4d1c63e8be7ULL, 0x8addcb5645ac2ba8ULL},
+    {0xb9a74a0637ce2ee1ULL, 0x6d953e2bd7173692ULL}, {0xe8111c87c5c1ba99ULL, 0xc8fa8db6ccdd0437ULL},
+    {0x910ab1d4db9914a0ULL, 0x1d9c9892400a22a2ULL}, {0xb54d5e4a127f59c8ULL, 0x2503beb6d00cab4bULL},
+    {0xe2a0b5dc971f303aULL, 0x2e44ae64840fd61dULL}, {0x8da471a9de737e24ULL, 0x5ceaecfed289e5d2ULL},
+    {0xb10d8e1456105dadULL, 0x7425a83e872c5f47ULL}, {0xdd50f1996b947518ULL, 0xd12f124e28f77719ULL},
+    {0x8a5296ffe33cc92fULL, 0x82bd6b70d99aaa6fULL}, {0xace73cbfdc0bfb7bULL, 0x636cc64d1001550bULL},
+    {0xd8210befd30efa5aULL, 0x3c47f7e05401aa4eULL}, {0x8714a775e3e95c78ULL, 0x65acfaec34810a71ULL},
+    {0xa8d9d1535ce3b396ULL, 0x7f1839a741a14d0dULL}, {0xd31045a8341ca07cULL, 0x1ede48111209a050ULL},
+    {0x83ea2b892091e44dULL, 0x934aed0aab460432ULL}, {0xa4e4b66b68b65d60ULL, 0xf81da84d5617853fULL},
+    {0xce1de40642e3f4b9ULL, 0x36251260ab9d668eULL}, {0x80d2ae83e9ce78f3ULL, 0xc1d72b7c6b426019ULL},
+    {0xa1075a24e4421730ULL, 0xb24cf65b8612f81fULL}, {0xc94930ae1d529cfcULL, 0xdee033f26797b627ULL},
+    {0xfb9b7cd9a4a7443cULL, 0x169840ef017da3b1ULL}, {0x9d412e0806e88aa5ULL, 0x8e1f289560ee864eULL},
+    {0xc491798a08a2ad4eULL, 0xf1a6f2bab92a27e2ULL}, {0xf5b5d7ec8acb58a2ULL, 0xae10af696774b1dbULL},
+    {0x9991a6f3d6bf1765ULL, 0xacca6da1e0a8ef29ULL}, {0xbff610b0cc6edd3fULL, 0x17fd090a58d32af3ULL},
+    {0xeff394dcff8a948eULL, 0xddfc4b4cef07f5b0ULL}, {0x95f83d0a1fb69cd9ULL, 0x4abdaf101564f98eULL},
+    {0xbb764c4ca7a4440fULL, 0x9d6d1ad41abe37f1ULL}, {0xea53df5fd18d5513ULL, 0x84c86189216dc5edULL},
+    {0x92746b9be2f8552cULL, 0x32fd3cf5b4e49bb4ULL}, {0xb7118682dbb66a77ULL, 0x3fbc8c33221dc2a1ULL},
+    {0xe4d5e82392a40515ULL, 0x0fabaf3feaa5334aULL}, {0x8f05b1163ba6832dULL, 0x29cb4d87f2a7400eULL},
+    {0xb2c71d5bca9023f8ULL, 0x743e20e9ef511012ULL}, {0xdf78e4b2bd342cf6ULL, 0x914da9246b255416ULL},
+    {0x8bab8eefb6409c1aULL, 0x1ad089b6c2f7548eULL}, {0xae9672aba3d0c320ULL, 0xa184ac2473b529b1ULL},
+    {0xda3c0f568cc4f3e8ULL, 0xc9e5d72d90a2741eULL}, {0x8865899617fb1871ULL, 0x7e2fa67c7a658892ULL},
+    {0xaa7eebfb9df9de8dULL, 0xddbb901b98feeab7ULL}, {0xd51ea6fa85785631ULL, 0x552a74227f3ea565ULL},
+    {0x8533285c936b35deULL, 0xd53a88958f87275fULL}, {0xa67ff273b8460356ULL, 0x8a892abaf368f137ULL},
+    {0xd01fef10a657842cULL, 0x2d2b7569b0432d85ULL}, {0x8213f56a67f6b29bULL, 0x9c3b29620e29fc73ULL},
+    {0xa298f2c501f45f42ULL, 0x8349f3ba91b47b8fULL}, {0xcb3f2f7642717713ULL, 0x241c70a936219a73ULL},
+    {0xfe0efb53d30dd4d7ULL, 0xed238cd383aa0110ULL}, {0x9ec95d1463e8a506ULL, 0xf4363804324a40aaULL},
+    {0xc67bb4597ce2ce48ULL, 0xb143c6053edcd0d5ULL}, {0xf81aa16fdc1b81daULL, 0xdd94b7868e94050aULL},
+    {0x9b10a4e5e9913128ULL, 0xca7cf2b4191c8326ULL}, {0xc1d4ce1f63f57d72ULL, 0xfd1c2f611f63a3f0ULL},
+    {0xf24a01a73cf2dccfULL, 0xbc633b39673c8cecULL}, {0x976e41088617ca01ULL, 0xd5be0503e085d813ULL},
+    {0xbd49d14aa79dbc82ULL, 0x4b2d8644d8a74e18ULL}, {0xec9c459d51852ba2ULL, 0xddf8e7d60ed1219eULL},
+    {0x93e1ab8252f33b45ULL, 0xcabb90e5c942b503ULL}, {0xb8da1662e7b00a17ULL, 0x3d6a751f3b936243ULL},
+    {0xe7109bfba19c0c9dULL, 0x0cc512670a783ad4ULL}, {0x906a617d450187e2ULL, 0x27fb2b80668b24c5ULL},
+    {0xb484f9dc9641e9daULL, 0xb1f9f660802dedf6ULL}, {0xe1a63853bbd26451ULL, 0x5e7873f8a0396973ULL},
+    {0x8d07e33455637eb2ULL, 0xdb0b487b6423e1e8ULL}, {0xb049dc016abc5e5fULL, 0x91ce1a9a3d2cda62ULL},
+    {0xdc5c5301c56b75f7ULL, 0x7641a140cc7810fbULL}, {0x89b9b3e11b6329baULL, 0xa9e904c87fcb0a9dULL},
+    {0xac2820d9623bf429ULL, 0x546345fa9fbdcd44ULL}, {0xd732290fbacaf133ULL, 0xa97c177947ad4095ULL},
+    {0x867f59a9d4bed6c0ULL, 0x49ed8eabcccc485dULL}, {0xa81f301449ee8c70ULL, 0x5c68f256bfff5a74ULL},
+    {0xd226fc195c6a2f8cULL, 0x73832eec6fff3111ULL}, {0x83585d8fd9c25db7ULL, 0xc831fd53c5ff7eabULL},
+    {0xa42e74f3d032f525ULL, 0xba3e7ca8b77f5e55ULL}, {0xcd3a1230c43fb26fULL, 0x28ce1bd2e55f35ebULL},
+    {0x80444b5e7aa7cf85ULL, 0x7980d163cf5b81b3ULL}, {0xa0555e361951c366ULL, 0xd7e105bcc332621fULL},
+    {0xc86ab5c39fa63440ULL, 0x8dd9472bf3fefaa7ULL}, {0xfa856334878fc150ULL, 0xb14f98f6f0feb951ULL},
+    {0x9c935e00d4b9d8d2ULL, 0x6ed1bf9a569f33d3ULL}, {0xc3b8358109e84f07ULL, 0x0a862f80ec4700c8ULL},
+    {0xf4a642e14c6262c8ULL, 0xcd27bb612758c0faULL}, {0x98e7e9cccfbd7dbdULL, 0x8038d51cb897789cULL},
+    {0xbf21e44003acdd2cULL, 0xe0470a63e6bd56c3ULL}, {0xeeea5d5004981478ULL, 0x1858ccfce06cac74ULL},
+    {0x95527a5202df0ccbULL, 0x0f37801e0c43ebc8ULL}, {0xbaa718e68396cffdULL, 0xd30560258f54e6baULL},
+    {0xe950df20247c83fdULL, 0x47c6b82ef32a2069ULL}, {0x91d28b7416cdd27eULL, 0x4cdc331d57fa5441ULL},
+    {0xb6472e511c81471dULL, 0xe0133fe4adf8e952ULL}, {0xe3d8f9e563a198e5ULL, 0x58180fddd97723a6ULL},
+    {0x8e679c2f5e44ff8fULL, 0x570f09eaa7ea7648ULL},
+};
+static const double mp_number_exact_powers_of_ten[] = {
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+#ifdef MP_SWAR
+
+static inline uint64_t mp_swar_load(const char *str)
+{
+    uint64_t chunk;
+    memcpy(&chunk, str, sizeof(chunk));
+    return chunk;
+}
+
+// 0x80 in every byte of chunk that is equal to c, 0x00 in the others
+static inline uint64_t mp_swar_equal(uint64_t chunk, unsigned char c)
+{
+    uint64_t x = chunk ^ (0x0101010101010101ULL * c);
+    return ~(((x & 0x7f7f7f7f7f7f7f7fULL) + 0x7f7f7f7f7f7f7f7fULL)
+             | x | 0x7f7f7f7f7f7f7f7fULL);
+}
+
+static inline bool mp_swar_all_digits(uint64_t chunk)
+{
+    return ((chunk & 0xf0f0f0f0f0f0f0f0ULL)
+            | (((chunk + 0x0606060606060606ULL) & 0xf0f0f0f0f0f0f0f0ULL) >> 4))
+           == 0x3333333333333333ULL;
+}
+
+// Value of 8 ASCII digits, the first one being the most significant
+static inline uint32_t mp_swar_parse_digits(uint64_t chunk)
+{
+    const uint64_t mask = 0x000000ff000000ffULL;
+    const uint64_t mul1 = 0x000f424000000064ULL; // 100 + (1000000 << 32)
+    const uint64_t mul2 = 0x0000271000000001ULL; // 1 + (10000 << 32)
+    chunk -= 0x3030303030303030ULL;
+    chunk = (chunk * 10) + (chunk >> 8);
+    chunk = (((chunk & mask) * mul1) + (((chunk >> 16) & mask) * mul2)) >> 32;
+    return (uint32_t)chunk;
+}
+
+#endif // MP_SWAR
+
+// Low 64 bits of a*b, the high ones are stored in high
+static inline uint64_t mp_number_mul(uint64_t a, uint64_t b, uint64_t *high)
+{
+#ifdef __SIZEOF_INT128__
+    __uint128_t p = (__uint128_t)a * b;
+    *high = (uint64_t)(p >> 64);
+    return (uint64_t)p;
+#else
+    uint64_t a_lo = (uint32_t)a, a_hi = a >> 32;
+    uint64_t b_lo = (uint32_t)b, b_hi = b >> 32;
+    uint64_t lo_lo = a_lo * b_lo;
+    uint64_t hi_lo = a_hi * b_lo;
+    uint64_t lo_hi = a_lo * b_hi;
+    uint64_t hi_hi = a_hi * b_hi;
+    uint64_t cross = (lo_lo >> 32) + (uint32_t)hi_lo + lo_hi;
+    *high = (hi_lo >> 32) + (cross >> 32) + hi_hi;
+    return (cross << 32) | (uint32_t)lo_lo;
+#endif
+}
+
+static inline int mp_number_leading_zeros(uint64_t x)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_clzll(x);
+#else
+    int n = 0;
+    while (!(x & 0x8000000000000000ULL)) {
+        x <<= 1;
+        ++n;
+    }
+    return n;
+#endif
+}
+
+// Correctly rounded w * 10^q for w != 0 with the Eisel-Lemire algorithm.
+// Returns false in the rare cases it can't decide the rounding and for
+// results that are subnormal, zero or infinite.
+static bool mp_number_eisel_lemire(uint64_t w, int64_t q, double *value)
+{
+    if (q < -342 || q > 308) return false;
+
+    const uint64_t *power = mp_number_powers_of_five[q + 342];
+    int lz = mp_number_leading_zeros(w);
+    w <<= lz;
+
+    uint64_t upper;
+    uint64_t lower = mp_number_mul(w, power[0], &upper);
+
+    // The truncated product may be off, refine it with the low 64 bits of 5^q
+    if ((upper & 0x1ff) == 0x1ff && lower + w < lower) {
+        uint64_t middle;
+        uint64_t low = mp_number_mul(w, power[1], &middle);
+        uint64_t sum = lower + middle;
+        if (sum < lower) ++upper;
+        if (sum + 1 == 0 && (upper & 0x1ff) == 0x1ff && low + w < low) {
+            return false;
+        }
+        lower = sum;
+    }
+
+    uint64_t upper_bit = upper >> 63;
+    uint64_t mantissa = upper >> (upper_bit + 9);
+    lz += (int)(1 ^ upper_bit);
+
+    // Exactly halfway between two doubles, leave ties-to-even to the fallback
+    if (lower == 0 && (upper & 0x1ff) == 0 && (mantissa & 3) == 1) return false;
+
+    mantissa += mantissa & 1;
+    mantissa >>= 1;
+    if (mantissa >= (1ULL << 53)) {
+        mantissa = 1ULL << 52;
+        --lz;
+    }
+    mantissa &= ~(1ULL << 52);
+
+    // floor(q * log2(10)) + 1023 + 63
+    int64_t exponent = ((((152170 + 65536) * q) >> 16) + 1024 + 63) - lz;
+    if (exponent < 1 || exponent > 2046) return false;
+
+    uint64_t bits = mantissa | ((uint64_t)exponent << 52);
+    memcpy(value, &bits, sizeof(*value));
+    return true;
+}
+
+// strtod on a copy of the number using the decimal point of the locale
+static double mp_number_fallback(const char *str, size_t length)
+{
+    const char *point = localeconv()->decimal_point;
+    size_t point_length = strlen(point);
+
+    char buffer[128];
+    char *copy = buffer;
+    size_t capacity = length * (point_length > 0 ? point_length : 1) + 1;
+    if (capacity > sizeof(buffer)) {
+        copy = MP_MALLOC(capacity);
+        assert(copy != NULL && "Buy more RAM LOL");
+    }
+
+    size_t count = 0;
+    for (size_t i = 0; i < length; ++i) {
+        if (str[i] == '.') {
+            memcpy(&copy[count], point, point_length);
+            count += point_length;
+        } else {
+            copy[count++] = str[i];
+        }
+    }
+    copy[count] = '\0';
+
+    double value = strtod(copy, NULL);
+
+    if (copy != buffer) MP_FREE(copy);
+
+    return value;
+}
+
+static size_t mp_number_scan_hex(const char *str, size_t length)
+{
+    size_t cursor = 2;
+    size_t digits = 0;
+
+    while (cursor < length && isxdigit((unsigned char)str[cursor])) {
+        ++cursor;
+        ++digits;
+    }
+    if (cursor < length && str[cursor] == '.') {
+        ++cursor;
+        while (cursor < length && isxdigit((unsigned char)str[cursor])) {
+            ++cursor;
+            ++digits;
+        }
+    }
+    if (digits == 0) return 0;
+
+    if (cursor < length && (str[cursor] == 'p' || str[cursor] == 'P')) {
+        size_t exp = cursor + 1;
+        if (exp < length && (str[exp] == '+' || str[exp] == '-')) ++exp;
+        if (exp < length && isdigit((unsigned char)str[exp])) {
+            cursor = exp;
+            while (cursor < length && isdigit((unsigned char)str[cursor])) {
                 ++cursor;
+            }
+        }
+    }
+
+    return cursor;
+}
+
+size_t mp_parse_number(const char *str, size_t length, double *value)
+{
+    if (length == 0 || !isdigit((unsigned char)str[0])) return 0;
+
+    // Hexadecimal floats are rare enough to always go through strtod
+    if (length > 2 && str[0] == '0' && (str[1] == 'x' || str[1] == 'X')) {
+        size_t hex_length = mp_number_scan_hex(str, length);
+        if (hex_length > 0) {
+            *value = mp_number_fallback(str, hex_length);
+            return hex_length;
+        }
+    }
+
+    // Up to 19 significant digits are kept in w, the value is w * 10^q
+    uint64_t w = 0;
+    int64_t q = 0;
+    bool truncated = false;
+    size_t cursor = 0;
+
+    while (cursor < length && isdigit((unsigned char)str[cursor])) {
+#ifdef MP_SWAR
+        if (w < 100000000000ULL && cursor + 8 <= length) {
+            uint64_t chunk = mp_swar_load(&str[cursor]);
+            if (mp_swar_all_digits(chunk)) {
+                w = w * 100000000 + mp_swar_parse_digits(chunk);
+                cursor += 8;
+                continue;
+            }
+        }
+#endif
+        char digit = str[cursor++] - '0';
+        if (w < 1000000000000000000ULL) {
+            w = w * 10 + digit;
+        } else {
+            ++q;
+            truncated |= digit != 0;
+        }
+    }
+
+    if (cursor < length && str[cursor] == '.') {
+        ++cursor;
+        while (cursor < length && isdigit((unsigned char)str[cursor])) {
+#ifdef MP_SWAR
+            if (w < 100000000000ULL && cursor + 8 <= length) {
+                uint64_t chunk = mp_swar_load(&str[cursor]);
+                if (mp_swar_all_digits(chunk)) {
+                    w = w * 100000000 + mp_swar_parse_digits(chunk);
+                    q -= 8;
+                    cursor += 8;
+                    continue;
+                }
+            }
+#endif
+            char digit = str[cursor++] - '0';
+            if (w < 1000000000000000000ULL) {
+                w = w * 10 + digit;
+                --q;
+            } else {
+                truncated |= digit != 0;
+            }
+        }
+    }
+
+    // The exponent is only part of the number when it has digits
+    if (cursor < length && (str[cursor] == 'e' || str[cursor] == 'E')) {
+        size_t exp = cursor + 1;
+        bool negative = false;
+        if (exp < length && (str[exp] == '+' || str[exp] == '-')) {
+            negative = str[exp] == '-';
+            ++exp;
+        }
+        if (exp < length && isdigit((unsigned char)str[exp])) {
+            int64_t e = 0;
+            while (exp < length && isdigit((unsigned char)str[exp])) {
+                if (e < 100000) e = e * 10 + (str[exp] - '0');
+                ++exp;
+            }
+            q += negative ? -e : e;
+            cursor = exp;
+        }
+    }
+
+    if (w == 0) {
+        *value = 0.0;
+        return cursor;
+    }
+
+    if (!truncated && w <= (1ULL << 53) && q >= -22 && q <= 22) {
+        // Clinger's fast path: both operands are exact, so is the rounding
+        double m = (double)w;
+        *value = q < 0 ? m / mp_number_exact_powers_of_ten[-q]
+                       : m * mp_number_exact_powers_of_ten[q];
+        return cursor;
+    }
+
+    double lower, upper;
+    if (mp_number_eisel_lemire(w, q, &lower)) {
+        // The dropped digits put the value between w and w + 1
+        if (!truncated
+                || (mp_number_eisel_lemire(w + 1, q, &upper) && lower == upper)) {
+            *value = lower;
+            return cursor;
+        }
+    }
+
+    *value = mp_number_fallback(str, cursor);
+    return cursor;
+}
+
+size_t mp_skip_whitespace(const char *str, size_t length)
+{
+    size_t cursor = 0;
+
+#ifdef MP_SWAR
+    while (cursor + 8 <= length) {
+        uint64_t chunk = mp_swar_load(&str[cursor]);
+        uint64_t space = mp_swar_equal(chunk, ' ')
+                       | mp_swar_equal(chunk, '\t')
+                       | mp_swar_equal(chunk, '\n');
+        uint64_t other = ~space & 0x8080808080808080ULL;
+        if (other != 0) return cursor + (__builtin_ctzll(other) >> 3);
+        cursor += 8;
+    }
+#endif
+
+    while (cursor < length
+            && (str[cursor] == ' ' || str[cursor] == '\t' || str[cursor] == '\n')) {
+        ++cursor;
+    }
+
+    return cursor;
+}
+
+//-----------
+// Tokenizer
+//-----------
+
+bool mp_is_reference_char(char c)
+{
+    return isalnum((unsigned char)c) || c == '_';
+}
+
+size_t mp_reference_length(const char *name)
+{
+    size_t length = 0;
+    while (mp_is_reference_char(name[length]))
+        ++length;
+    return length;
+}
+
+MP_Result mp_tokenize(MP_Token_List *list, const char *expr)
+{
+    MP_Result result = {0};
+    size_t cursor = 0;
+    size_t end = strlen(expr);
+
+    while (cursor < end) {
+        char c = expr[cursor];
+        MP_Token token = {0};
+        token.position = cursor;
+
+        switch (c) {
+            case '\n':
+            case '\t':
+            case ' ': {
+                cursor += mp_skip_whitespace(&expr[cursor], end - cursor);
             } break;
 
             case '+': {
@@ -465,13 +2286,81 @@ MP_Result mp_tokenize(MP_Token_List *list, const char *expr)
                 ++cursor;
             } break;
 
+            case '<':
+            case '>': {
+                bool equal = cursor + 1 < end && expr[cursor + 1] == '=';
+                if (c == '<') {
+                    token.type = equal ? MP_TOKEN_LESS_EQUAL : MP_TOKEN_LESS;
+                } else {
+                    token.type = equal ? MP_TOKEN_GREATER_EQUAL : MP_TOKEN_GREATER;
+                }
+                mp_da_append(list, token);
+                cursor += equal ? 2 : 1;
+            } break;
+
+            case '?': {
+                token.type = MP_TOKEN_QUESTION;
+                mp_da_append(list, token);
+                ++cursor;
+            } break;
+
+            case ':': {
+                token.type = MP_TOKEN_COLON;
+                mp_da_append(list, token);
+                ++cursor;
+            } break;
+
+            case ',': {
+                token.type = MP_TOKEN_COMMA;
+                mp_da_append(list, token);
+                ++cursor;
+            } break;
+
+            // The operators of two characters that have no meaning alone
+            case '=':
+            case '!':
+            case '&':
+            case '|': {
+                char second = c == '=' || c == '!' ? '=' : c;
+                if (cursor + 1 >= end || expr[cursor + 1] != second) {
+                    token.type = MP_TOKEN_INVALID;
+                    result.error = true;
+                    result.error_type = MP_ERROR_INVALID_TOKEN;
+                    result.error_position = cursor;
+                    result.faulty_token = token;
+                    return result;
+                }
+
+                token.type = c == '=' ? MP_TOKEN_EQUAL
+                           : c == '!' ? MP_TOKEN_NOT_EQUAL
+                           : c == '&' ? MP_TOKEN_AND : MP_TOKEN_OR;
+                mp_da_append(list, token);
+                cursor += 2;
+            } break;
+
+            case '$': {
+                size_t length = mp_reference_length(&expr[cursor + 1]);
+                if (length == 0) {
+                    token.type = MP_TOKEN_INVALID;
+                    result.error = true;
+                    result.error_type = MP_ERROR_INVALID_TOKEN;
+                    result.error_position = cursor;
+                    result.faulty_token = token;
+                    return result;
+                }
+
+                token.type = MP_TOKEN_REFERENCE;
+                token.reference = &expr[cursor + 1];
+                mp_da_append(list, token);
+                cursor += 1 + length;
+            } break;
+
             default: {
                 // Numbers
                 if (isdigit(c)) {
-                    char *end;
                     token.type = MP_TOKEN_NUMBER;
-                    token.value = strtod(&expr[cursor], &end);
-                    cursor = end - expr;
+                    cursor += mp_parse_number(&expr[cursor], end - cursor,
+                                              &token.value);
                     mp_da_append(list, token);
                     break;
                 }
@@ -487,14 +2376,14 @@ MP_Result mp_tokenize(MP_Token_List *list, const char *expr)
                         break;
                     }
 
-                    // Name
+                    // Name, digits may follow its first two letters
                     token.type = MP_TOKEN_NAME;
                     size_t name_len = 0;
                     do {
                         token.name[name_len++] = expr[cursor];
                         cursor++;
-                    } while (name_len <= MP_NAME_CAPACITY
-                            && cursor < end && islower(expr[cursor]));
+                    } while (name_len <= MP_NAME_CAPACITY && cursor < end
+                            && (islower(expr[cursor]) || isdigit(expr[cursor])));
 
                     if (name_len <= MP_NAME_CAPACITY) {
                         mp_da_append(list, token);
@@ -519,19 +2408,31 @@ MP_Result mp_tokenize(MP_Token_List *list, const char *expr)
 const char *mp_token_to_string(MP_Token token)
 {
     switch (token.type) {
-        case MP_TOKEN_EOF:      return "TOKEN_EOF";
-        case MP_TOKEN_INVALID:  return "TOKEN_INVALID";
-        case MP_TOKEN_NUMBER:   return "TOKEN_NUMBER";
-        case MP_TOKEN_SYMBOL:   return "TOKEN_SYMBOL";
-        case MP_TOKEN_NAME:     return "TOKEN_NAME";
-        case MP_TOKEN_PLUS:     return "TOKEN_PLUS";
-        case MP_TOKEN_MINUS:    return "TOKEN_MINUS";
-        case MP_TOKEN_MULTIPLY: return "TOKEN_MULTIPLY";
-        case MP_TOKEN_DIVIDE:   return "TOKEN_DIVIDE";
-        case MP_TOKEN_POWER:    return "TOKEN_POWER";
-        case MP_TOKEN_LPAREN:   return "TOKEN_LPAREN";
-        case MP_TOKEN_RPAREN:   return "TOKEN_RPAREN";
-        default:                return MP_STR_UNKNOWN;
+        case MP_TOKEN_EOF:           return "TOKEN_EOF";
+        case MP_TOKEN_INVALID:       return "TOKEN_INVALID";
+        case MP_TOKEN_NUMBER:        return "TOKEN_NUMBER";
+        case MP_TOKEN_SYMBOL:        return "TOKEN_SYMBOL";
+        case MP_TOKEN_NAME:          return "TOKEN_NAME";
+        case MP_TOKEN_REFERENCE:     return "TOKEN_REFERENCE";
+        case MP_TOKEN_PLUS:          return "TOKEN_PLUS";
+        case MP_TOKEN_MINUS:         return "TOKEN_MINUS";
+        case MP_TOKEN_MULTIPLY:      return "TOKEN_MULTIPLY";
+        case MP_TOKEN_DIVIDE:        return "TOKEN_DIVIDE";
+        case MP_TOKEN_POWER:         return "TOKEN_POWER";
+        case MP_TOKEN_LPAREN:        return "TOKEN_LPAREN";
+        case MP_TOKEN_RPAREN:        return "TOKEN_RPAREN";
+        case MP_TOKEN_LESS:          return "TOKEN_LESS";
+        case MP_TOKEN_LESS_EQUAL:    return "TOKEN_LESS_EQUAL";
+        case MP_TOKEN_GREATER:       return "TOKEN_GREATER";
+        case MP_TOKEN_GREATER_EQUAL: return "TOKEN_GREATER_EQUAL";
+        case MP_TOKEN_EQUAL:         return "TOKEN_EQUAL";
+        case MP_TOKEN_NOT_EQUAL:     return "TOKEN_NOT_EQUAL";
+        case MP_TOKEN_AND:           return "TOKEN_AND";
+        case MP_TOKEN_OR:            return "TOKEN_OR";
+        case MP_TOKEN_QUESTION:      return "TOKEN_QUESTION";
+        case MP_TOKEN_COLON:         return "TOKEN_COLON";
+        case MP_TOKEN_COMMA:         return "TOKEN_COMMA";
+        default:                     return MP_STR_UNKNOWN;
     }
 }
 
@@ -546,6 +2447,9 @@ void mp_print_token_list(MP_Token_List list)
             printf(" %c", token.symbol);
         } else if (token.type == MP_TOKEN_NAME) {
             printf(" %s", token.name);
+        } else if (token.type == MP_TOKEN_REFERENCE) {
+            printf(" $%.*s", (int)mp_reference_length(token.reference),
+                   token.reference);
         }
         printf("\n");
     }
@@ -561,6 +2465,8 @@ const char *mp_error_to_string(MP_Error_Type err)
         case MP_ERROR_INVALID_NODE:       return "Invalid expression";
         case MP_ERROR_INVALID_FUNCTION:   return "Invalid function";
         case MP_ERROR_ZERO_DIVISION:      return "Division by zero";
+        case MP_ERROR_UNKNOWN_REFERENCE:  return "Unknown reference";
+        case MP_ERROR_CIRCULAR_REFERENCE: return "Circular reference";
         default:                          return "Unknown error";
     }
 }
@@ -575,36 +2481,41 @@ MP_Tree_Node *mp_make_node_binop(MP_Arena *a, MP_Node_Type t,
     return r;
 }
 
+// arg is the only argument or an MP_NODE_ARGUMENTS of all of them. A call
+// with the wrong number of arguments is an invalid function, like an unknown
+// name, and mp_parse rejects both.
 MP_Tree_Node *mp_make_node_function(MP_Arena *a, const MP_Token *name,
                                     MP_Tree_Node *arg)
 {
     MP_Tree_Node *r = mp_arena_alloc(a, sizeof(*r));
     r->type = MP_NODE_FUNCTION;
-    
-    const char *name_str = name->name;
-    if (strcmp(MP_FUNCTION_STR_LN, name_str) == 0) {
-        r->function.name = MP_FUNCTION_LN;
-
-    } else if (strcmp(MP_FUNCTION_STR_LOG, name_str) == 0) {
-        r->function.name = MP_FUNCTION_LOG;
-
-    } else if (strcmp(MP_FUNCTION_STR_SIN, name_str) == 0) {
-        r->function.name = MP_FUNCTION_SIN;
+    r->function.name = MP_FUNCTION_INVALID;
+    r->function.arg = arg;
 
-    } else if (strcmp(MP_FUNCTION_STR_COS, name_str) == 0) {
-        r->function.name = MP_FUNCTION_COS;
+    size_t count = 1;
+    for (MP_Tree_Node *n = arg; n != NULL && n->type == MP_NODE_ARGUMENTS;
+            n = n->binop.rhs) {
+        ++count;
+    }
 
-    } else if (strcmp(MP_FUNCTION_STR_TAN, name_str) == 0) {
-        r->function.name = MP_FUNCTION_TAN;
+    for (size_t f = MP_FUNCTION_INVALID + 1; f < mp_function_count(); ++f) {
+        if (strcmp(mp_function_name_to_string(f), name->name) == 0
+                && mp_function_arity(f) == count) {
+            r->function.name = f;
+        }
+    }
 
-    } else if (strcmp(MP_FUNCTION_STR_SQRT, name_str) == 0) {
-        r->function.name = MP_FUNCTION_SQRT;
+    return r;
+}
 
-    } else {
-        r->function.name = MP_FUNCTION_INVALID;
+MP_Tree_Node *mp_make_node_arguments(MP_Arena *a, MP_Tree_Node **args,
+                                     size_t count)
+{
+    assert(count > 0);
+    MP_Tree_Node *r = args[count - 1];
+    for (size_t i = count - 1; i > 0; --i) {
+        r = mp_make_node_binop(a, MP_NODE_ARGUMENTS, args[i - 1], r);
     }
-
-    r->function.arg = arg;
     return r;
 }
 
@@ -624,6 +2535,23 @@ MP_Tree_Node *mp_make_node_symbol(MP_Arena *a, char symbol)
     return r;
 }
 
+MP_Tree_Node *mp_make_node_reference(MP_Arena *a, const char *name)
+{
+    MP_Tree_Node *r = mp_arena_alloc(a, sizeof(*r));
+    r->type = MP_NODE_REFERENCE;
+    r->reference.name = name;
+    r->reference.length = mp_reference_length(name);
+    r->reference.slot = MP_REFERENCE_UNRESOLVED;
+    return r;
+}
+
+MP_Tree_Node *mp_make_node_select(MP_Arena *a, MP_Tree_Node *condition,
+                                  MP_Tree_Node *then, MP_Tree_Node *otherwise)
+{
+    return mp_make_node_binop(a, MP_NODE_SELECT, condition,
+            mp_make_node_binop(a, MP_NODE_BRANCHES, then, otherwise));
+}
+
 MP_Tree_Node *mp_make_node(MP_Arena *a, MP_Node_Type t, double value)
 {
     MP_Tree_Node *r = mp_arena_alloc(a, sizeof(*r));
@@ -647,7 +2575,7 @@ MP_Result mp_parse(MP_Arena *a, MP_Parse_Tree *tree, MP_Token_List list)
         return result;
     }
 
-    MP_Tree_Node *tree_root = mp_parse_expr(a, &parser, &result);
+    MP_Tree_Node *tree_root = mp_parse_operators(a, &parser, &result);
     tree->root = tree_root;
 
     if (parser.current.type != MP_TOKEN_EOF) {
@@ -670,142 +2598,303 @@ void mp_parser_advance(MP_Parser *parser)
     parser->current = parser->tokens.items[parser->cursor++];
 }
 
-MP_Tree_Node *mp_parse_expr(MP_Arena *a, MP_Parser *parser, MP_Result *result)
-{
-    MP_Tree_Node *result_node = mp_parse_term(a, parser, result);
-    MP_Token *cur = &parser->current;
+enum {
+    MP_PRECEDENCE_OR = 1,
+    MP_PRECEDENCE_AND,
+    MP_PRECEDENCE_EQUALITY,
+    MP_PRECEDENCE_RELATION,
+    MP_PRECEDENCE_SUM,
+    MP_PRECEDENCE_PRODUCT,
+};
 
-    while (!result->error
-        && (cur->type == MP_TOKEN_PLUS || cur->type == MP_TOKEN_MINUS)) {
+// Binary operators by token, all left associative. The power is handled apart
+// since its operands are primaries, and the conditional since it has three.
+static const struct {
+    MP_Node_Type node;
+    int precedence;
+} mp_parser_binary_ops[MP_TOKEN_COUNT] = {
+    [MP_TOKEN_OR]            = {MP_NODE_OR,            MP_PRECEDENCE_OR},
+    [MP_TOKEN_AND]           = {MP_NODE_AND,           MP_PRECEDENCE_AND},
+    [MP_TOKEN_EQUAL]         = {MP_NODE_EQUAL,         MP_PRECEDENCE_EQUALITY},
+    [MP_TOKEN_NOT_EQUAL]     = {MP_NODE_NOT_EQUAL,     MP_PRECEDENCE_EQUALITY},
+    [MP_TOKEN_LESS]          = {MP_NODE_LESS,          MP_PRECEDENCE_RELATION},
+    [MP_TOKEN_LESS_EQUAL]    = {MP_NODE_LESS_EQUAL,    MP_PRECEDENCE_RELATION},
+    [MP_TOKEN_GREATER]       = {MP_NODE_GREATER,       MP_PRECEDENCE_RELATION},
+    [MP_TOKEN_GREATER_EQUAL] = {MP_NODE_GREATER_EQUAL, MP_PRECEDENCE_RELATION},
+    [MP_TOKEN_PLUS]          = {MP_NODE_ADD,           MP_PRECEDENCE_SUM},
+    [MP_TOKEN_MINUS]         = {MP_NODE_SUBTRACT,      MP_PRECEDENCE_SUM},
+    [MP_TOKEN_MULTIPLY]      = {MP_NODE_MULTIPLY,      MP_PRECEDENCE_PRODUCT},
+    [MP_TOKEN_DIVIDE]        = {MP_NODE_DIVIDE,        MP_PRECEDENCE_PRODUCT},
+};
 
-        if (cur->type == MP_TOKEN_PLUS) {
-            mp_parser_advance(parser);
-            result_node = mp_make_node_binop(a, MP_NODE_ADD, result_node,
-                                             mp_parse_term(a, parser, result));
-        } else if (cur->type == MP_TOKEN_MINUS) {
-            mp_parser_advance(parser);
-            result_node = mp_make_node_binop(a, MP_NODE_SUBTRACT, result_node,
-                                             mp_parse_term(a, parser, result));
-        }
-    }
 
-    return result_node;
-}
+typedef enum {
+    MP_PARSER_EXPECT_FACTOR,
+    MP_PARSER_EXPECT_PRIMARY,
+    MP_PARSER_AFTER_PRIMARY,
+    MP_PARSER_AFTER_FACTOR,
+} MP_Parser_State;
 
-MP_Tree_Node *mp_parse_term(MP_Arena *a, MP_Parser *parser, MP_Result *result)
+static void mp_parser_error(MP_Parser *parser, MP_Result *result, bool faulty)
 {
-    MP_Tree_Node *result_node = mp_parse_factor(a, parser, result);
-    MP_Token *cur = &parser->current;
-
-    while (!result->error
-        && (cur->type == MP_TOKEN_MULTIPLY || cur->type == MP_TOKEN_DIVIDE)) {
+    result->error = true;
+    result->error_type = MP_ERROR_INVALID_EXPRESSION;
+    result->error_position = parser->current.position;
+    if (faulty) result->faulty_token = parser->current;
+}
 
-        if (cur->type == MP_TOKEN_MULTIPLY) {
-            mp_parser_advance(parser);
-            result_node = mp_make_node_binop(a, MP_NODE_MULTIPLY, result_node,
-                                             mp_parse_factor(a, parser, result));
-        } else if (cur->type == MP_TOKEN_DIVIDE) {
-            mp_parser_advance(parser);
-            result_node = mp_make_node_binop(a, MP_NODE_DIVIDE, result_node,
-                                             mp_parse_factor(a, parser, result));
-        }
+// Builds the binary nodes of the operators on top of the stack that bind at
+// least as tight as precedence
+static void mp_parser_reduce(MP_Arena *a, MP_Parser_Op_Stack *ops,
+                             MP_Parser_Node_Stack *nodes, int precedence)
+{
+    while (ops->count > 0
+            && ops->items[ops->count - 1].type == MP_PARSER_OP_BINARY
+            && ops->items[ops->count - 1].precedence >= precedence) {
+        MP_Parser_Op op = ops->items[--ops->count];
+        MP_Tree_Node *rhs = nodes->items[--nodes->count];
+        MP_Tree_Node *lhs = nodes->items[--nodes->count];
+        nodes->items[nodes->count++] = mp_make_node_binop(a, op.node, lhs, rhs);
     }
-
-    return result_node;
 }
 
-MP_Tree_Node *mp_parse_factor(MP_Arena *a, MP_Parser *parser, MP_Result *result)
+// Builds the conditionals whose alternative is complete, they are right
+// associative: c ? a : d ? b : e is c ? a : (d ? b : e)
+static void mp_parser_reduce_conditionals(MP_Arena *a, MP_Parser_Op_Stack *ops,
+                                          MP_Parser_Node_Stack *nodes)
 {
-    MP_Token *cur = &parser->current;
-    MP_Tree_Node *result_node;
-
-    if (cur->type == MP_TOKEN_NAME) {
-        MP_Token name = parser->current;
-        mp_parser_advance(parser);
-
-        if (cur->type != MP_TOKEN_LPAREN) {
-            result->error = true;
-            result->error_type = MP_ERROR_INVALID_EXPRESSION;
-            result->error_position = cur->position;
-            return NULL;
-        }
-        mp_parser_advance(parser);
+    while (ops->count > 0
+            && ops->items[ops->count - 1].type == MP_PARSER_OP_ALTERNATIVE) {
+        --ops->count;
+        MP_Tree_Node *otherwise = nodes->items[--nodes->count];
+        MP_Tree_Node *then = nodes->items[--nodes->count];
+        MP_Tree_Node *condition = nodes->items[--nodes->count];
+        nodes->items[nodes->count++] =
+            mp_make_node_select(a, condition, then, otherwise);
+    }
+}
 
-        result_node = mp_make_node_function(a, &name,
-                mp_parse_expr(a, parser, result));
+MP_Tree_Node *mp_parse_operators(MP_Arena *a, MP_Parser *parser, MP_Result *result)
+{
+    // The stacks live in the arena next to the tree, so that a parse into a
+    // reset arena makes no allocation. They start with room for the whole
+    // expression when it is small.
+    MP_Allocator scratch = mp_arena_allocator(a);
+    MP_Parser_Op_Stack ops = {0};
+    MP_Parser_Node_Stack nodes = {0};
+    ops.allocator = &scratch;
+    nodes.allocator = &scratch;
+
+    size_t reserve = parser->tokens.count < MP_DA_INITIAL_CAPACITY
+        ? parser->tokens.count + 1 : MP_DA_INITIAL_CAPACITY;
+    ops.items = mp_arena_alloc(a, reserve * sizeof(*ops.items));
+    ops.capacity = reserve;
+    nodes.items = mp_arena_alloc(a, reserve * sizeof(*nodes.items));
+    nodes.capacity = reserve;
 
-        if (cur->type != MP_TOKEN_RPAREN) {
-            result->error = true;
-            result->error_type = MP_ERROR_INVALID_EXPRESSION;
-            result->error_position = cur->position;
-            return NULL;
-        }
+    MP_Token *cur = &parser->current;
+    MP_Parser_State state = MP_PARSER_EXPECT_FACTOR;
+    MP_Tree_Node *root = NULL;
+
+    while (root == NULL && !result->error) {
+        switch (state) {
+            case MP_PARSER_EXPECT_FACTOR:
+            case MP_PARSER_EXPECT_PRIMARY: {
+                MP_Parser_Op op = {0};
+                MP_Tree_Node *node = NULL;
+
+                switch (cur->type) {
+                    case MP_TOKEN_NAME: {
+                        // The right side of a power is a primary
+                        if (state == MP_PARSER_EXPECT_PRIMARY) {
+                            mp_parser_error(parser, result, true);
+                            break;
+                        }
+                        op.type = MP_PARSER_OP_FUNCTION;
+                        op.token = *cur;
+                        mp_parser_advance(parser);
+                        if (cur->type != MP_TOKEN_LPAREN) {
+                            mp_parser_error(parser, result, false);
+                            break;
+                        }
+                    } break;
+
+                    case MP_TOKEN_LPAREN: {
+                        op.type = MP_PARSER_OP_GROUP;
+                    } break;
+
+                    case MP_TOKEN_PLUS: {
+                        op.type = MP_PARSER_OP_UNARY;
+                        op.node = MP_NODE_PLUS;
+                    } break;
+
+                    case MP_TOKEN_MINUS: {
+                        op.type = MP_PARSER_OP_UNARY;
+                        op.node = MP_NODE_MINUS;
+                    } break;
+
+                    case MP_TOKEN_NUMBER: {
+                        node = mp_make_node(a, MP_NODE_NUMBER, cur->value);
+                    } break;
+
+                    case MP_TOKEN_SYMBOL: {
+                        node = mp_make_node_symbol(a, cur->symbol);
+                    } break;
+
+                    case MP_TOKEN_REFERENCE: {
+                        node = mp_make_node_reference(a, cur->reference);
+                    } break;
+
+                    default: {
+                        mp_parser_error(parser, result, true);
+                    } break;
+                }
 
-        mp_parser_advance(parser);
-        return result_node;
-    }
+                if (result->error) break;
+                mp_parser_advance(parser);
 
-    result_node = mp_parse_primary(a, parser, result);
+                if (node != NULL) {
+                    mp_da_append(&nodes, node);
+                    state = MP_PARSER_AFTER_PRIMARY;
+                } else {
+                    mp_da_append(&ops, op);
+                    state = MP_PARSER_EXPECT_FACTOR;
+                }
+            } break;
 
-    if (cur->type == MP_TOKEN_POWER) {
-        mp_parser_advance(parser);
-        result_node = mp_make_node_binop(a, MP_NODE_POWER, result_node,
-                                         mp_parse_primary(a, parser, result));
-    }
+            case MP_PARSER_AFTER_PRIMARY: {
+                MP_Parser_Op *top = ops.count > 0 ? &ops.items[ops.count - 1] : NULL;
+
+                if (top != NULL && top->type == MP_PARSER_OP_POWER) {
+                    --ops.count;
+                    MP_Tree_Node *rhs = nodes.items[--nodes.count];
+                    MP_Tree_Node *lhs = nodes.items[--nodes.count];
+                    nodes.items[nodes.count++] =
+                        mp_make_node_binop(a, MP_NODE_POWER, lhs, rhs);
+                    state = MP_PARSER_AFTER_FACTOR;
+
+                } else if (cur->type == MP_TOKEN_POWER) {
+                    MP_Parser_Op op = {0};
+                    op.type = MP_PARSER_OP_POWER;
+                    mp_da_append(&ops, op);
+                    mp_parser_advance(parser);
+                    state = MP_PARSER_EXPECT_PRIMARY;
+
+                } else {
+                    state = MP_PARSER_AFTER_FACTOR;
+                }
+            } break;
 
-    return result_node;
-}
+            case MP_PARSER_AFTER_FACTOR: {
+                MP_Parser_Op *top = ops.count > 0 ? &ops.items[ops.count - 1] : NULL;
 
-MP_Tree_Node *mp_parse_primary(MP_Arena *a, MP_Parser *parser, MP_Result *result)
-{
-    MP_Token *cur = &parser->current;
+                // A unary operator applies to a factor and makes a primary
+                if (top != NULL && top->type == MP_PARSER_OP_UNARY) {
+                    --ops.count;
+                    MP_Tree_Node *node = nodes.items[nodes.count - 1];
+                    nodes.items[nodes.count - 1] =
+                        mp_make_node_unary(a, top->node, node);
+                    state = MP_PARSER_AFTER_PRIMARY;
+                    break;
+                }
 
-    if (cur->type == MP_TOKEN_LPAREN) {
-        mp_parser_advance(parser);
-        MP_Tree_Node *result_node = mp_parse_expr(a, parser, result);
+                int precedence = mp_parser_binary_ops[cur->type].precedence;
+                if (precedence > 0) {
+                    mp_parser_reduce(a, &ops, &nodes, precedence);
+                    MP_Parser_Op op = {0};
+                    op.type = MP_PARSER_OP_BINARY;
+                    op.node = mp_parser_binary_ops[cur->type].node;
+                    op.precedence = precedence;
+                    mp_da_append(&ops, op);
+                    mp_parser_advance(parser);
+                    state = MP_PARSER_EXPECT_FACTOR;
+                    break;
+                }
 
-        if (cur->type != MP_TOKEN_RPAREN) {
-            result->error = true;
-            result->error_type = MP_ERROR_INVALID_EXPRESSION;
-            result->error_position = cur->position;
-            return result_node;
-        }
+                // The condition is everything since the last (, ? or :
+                if (cur->type == MP_TOKEN_QUESTION) {
+                    mp_parser_reduce(a, &ops, &nodes, MP_PRECEDENCE_OR);
+                    MP_Parser_Op op = {0};
+                    op.type = MP_PARSER_OP_CONDITION;
+                    mp_da_append(&ops, op);
+                    mp_parser_advance(parser);
+                    state = MP_PARSER_EXPECT_FACTOR;
+                    break;
+                }
 
-        mp_parser_advance(parser);
-        return result_node;
-    }
+                mp_parser_reduce(a, &ops, &nodes, 0);
+                mp_parser_reduce_conditionals(a, &ops, &nodes);
 
-    if (cur->type == MP_TOKEN_NUMBER) {
-        MP_Tree_Node *number = mp_make_node(a, MP_NODE_NUMBER, cur->value);
-        mp_parser_advance(parser);
-        return number;
-    }
+                if (cur->type == MP_TOKEN_COLON) {
+                    if (ops.count == 0
+                            || ops.items[ops.count - 1].type != MP_PARSER_OP_CONDITION) {
+                        mp_parser_error(parser, result, true);
+                        break;
+                    }
+                    ops.items[ops.count - 1].type = MP_PARSER_OP_ALTERNATIVE;
+                    mp_parser_advance(parser);
+                    state = MP_PARSER_EXPECT_FACTOR;
+                    break;
+                }
 
-    if (cur->type == MP_TOKEN_SYMBOL) {
-        MP_Tree_Node *symbol = mp_make_node_symbol(a, cur->symbol);
-        mp_parser_advance(parser);
-        return symbol;
-    }
+                // The argument stays on the stack until the )
+                if (cur->type == MP_TOKEN_COMMA) {
+                    if (ops.count == 0
+                            || ops.items[ops.count - 1].type != MP_PARSER_OP_FUNCTION) {
+                        mp_parser_error(parser, result, true);
+                        break;
+                    }
+                    ops.items[ops.count - 1].arguments++;
+                    mp_parser_advance(parser);
+                    state = MP_PARSER_EXPECT_FACTOR;
+                    break;
+                }
 
-    if (cur->type == MP_TOKEN_PLUS) {
-        mp_parser_advance(parser);
-        return mp_make_node_unary(a, MP_NODE_PLUS,
-                                  mp_parse_factor(a, parser, result));
-    }
+                if (ops.count == 0) {
+                    // Anything left is reported by mp_parse
+                    root = nodes.items[--nodes.count];
+                    break;
+                }
 
-    if (cur->type == MP_TOKEN_MINUS) {
-        mp_parser_advance(parser);
-        return mp_make_node_unary(a, MP_NODE_MINUS,
-                                  mp_parse_factor(a, parser, result));
+                // A ( or a ? without its : is left
+                if (cur->type != MP_TOKEN_RPAREN
+                        || ops.items[ops.count - 1].type == MP_PARSER_OP_CONDITION) {
+                    mp_parser_error(parser, result, false);
+                    break;
+                }
+                mp_parser_advance(parser);
+
+                MP_Parser_Op op = ops.items[--ops.count];
+                if (op.type == MP_PARSER_OP_GROUP) {
+                    state = MP_PARSER_AFTER_PRIMARY;
+                } else {
+                    // A function call is a factor, it can't be raised to a power
+                    size_t count = op.arguments + 1;
+                    nodes.count -= count;
+                    MP_Tree_Node *arg = mp_make_node_arguments(a,
+                            &nodes.items[nodes.count], count);
+                    MP_Tree_Node *node = mp_make_node_function(a, &op.token, arg);
+                    nodes.items[nodes.count++] = node;
+                    state = MP_PARSER_AFTER_FACTOR;
+
+                    // An unknown name or a wrong number of arguments
+                    if (node->function.name == MP_FUNCTION_INVALID) {
+                        result->error = true;
+                        result->error_type = MP_ERROR_INVALID_FUNCTION;
+                        result->error_position = op.token.position;
+                        result->faulty_token = op.token;
+                    }
+                }
+            } break;
+        }
     }
 
-    result->error = true;
-    result->error_type = MP_ERROR_INVALID_EXPRESSION;
-    result->error_position = cur->position;
-    result->faulty_token = *cur;
+    assert(result->error || nodes.count == 0);
 
-    return NULL;
+    mp_da_free(&ops);
+    mp_da_free(&nodes);
 
+    return root;
 }
 
 void mp_print_parse_tree(MP_Parse_Tree tree)
@@ -816,723 +2905,6713 @@ void mp_print_parse_tree(MP_Parse_Tree tree)
 
 void mp_print_tree_node(MP_Tree_Node *root)
 {
-    if (root == NULL)
-        return;
-
-    switch (root->type) {
-        case MP_NODE_INVALID: {
-            printf("INVALID");
-        } break;
+    static const char *names[MP_NODE_COUNT] = {
+        [MP_NODE_ADD]           = "add",
+        [MP_NODE_SUBTRACT]      = "sub",
+        [MP_NODE_MULTIPLY]      = "mul",
+        [MP_NODE_DIVIDE]        = "div",
+        [MP_NODE_POWER]         = "pow",
+        [MP_NODE_PLUS]          = "plus",
+        [MP_NODE_MINUS]         = "minus",
+        [MP_NODE_POWI]          = "powi",
+        [MP_NODE_LESS]          = "lt",
+        [MP_NODE_LESS_EQUAL]    = "le",
+        [MP_NODE_GREATER]       = "gt",
+        [MP_NODE_GREATER_EQUAL] = "ge",
+        [MP_NODE_EQUAL]         = "eq",
+        [MP_NODE_NOT_EQUAL]     = "ne",
+        [MP_NODE_AND]           = "and",
+        [MP_NODE_OR]            = "or",
+        [MP_NODE_SELECT]        = "select",
+    };
 
-        case MP_NODE_NUMBER: {
-            printf("%f", root->value);
-        } break;
+    MP_Tree_Stack stack = {0};
+    if (root != NULL) {
+        mp_tree_push(&stack, root, NULL, 0);
+    }
 
-        case MP_NODE_SYMBOL: {
-            printf("%c", root->symbol);
-        } break;
+    while (stack.count > 0) {
+        MP_Tree_Frame *frame = &stack.items[stack.count - 1];
+        MP_Tree_Node *node = frame->node;
+        MP_Tree_Node **operands[2];
+        size_t count = mp_tree_operands(node, operands);
+        uint32_t state = frame->state++;
 
-        case MP_NODE_FUNCTION: {
-            printf("%s(", mp_function_name_to_string(root->function.name));
-            mp_print_tree_node(root->function.arg);
-            printf(")");
-        } break;
+        // The operands of the branches and the arguments are only separated
+        bool call = node->type != MP_NODE_BRANCHES
+            && node->type != MP_NODE_ARGUMENTS;
 
-        case MP_NODE_ADD: {
-            printf("add(");
-            mp_print_tree_node(root->binop.lhs);
+        if (state > 0 && state < count) {
             printf(",");
-            mp_print_tree_node(root->binop.rhs);
-            printf(")");
-        } break;
+        } else if (state == 0) {
+            switch (node->type) {
+                case MP_NODE_INVALID: {
+                    printf("INVALID");
+                } break;
+
+                case MP_NODE_NUMBER: {
+                    printf("%f", node->value);
+                } break;
+
+                case MP_NODE_SYMBOL: {
+                    printf("%c", node->symbol);
+                } break;
+
+                case MP_NODE_REFERENCE: {
+                    printf("$%.*s", (int)node->reference.length,
+                           node->reference.name);
+                } break;
+
+                case MP_NODE_FUNCTION: {
+                    printf("%s(",
+                           mp_function_name_to_string(node->function.name));
+                } break;
+
+                default: {
+                    if (node->type < MP_NODE_COUNT && names[node->type] != NULL) {
+                        printf("%s(", names[node->type]);
+                    } else if (call) {
+                        printf(MP_STR_UNKNOWN);
+                    }
+                } break;
+            }
+        }
 
-        case MP_NODE_SUBTRACT: {
-            printf("sub(");
-            mp_print_tree_node(root->binop.lhs);
-            printf(",");
-            mp_print_tree_node(root->binop.rhs);
-            printf(")");
-        } break;
+        if (state < count) {
+            if (*operands[state] != NULL) {
+                mp_tree_push(&stack, *operands[state], NULL, 0);
+            }
+            continue;
+        }
 
-        case MP_NODE_MULTIPLY: {
-            printf("mul(");
-            mp_print_tree_node(root->binop.lhs);
-            printf(",");
-            mp_print_tree_node(root->binop.rhs);
+        --stack.count;
+        if (node->type == MP_NODE_POWI) {
+            printf(",%d)", node->powi.exponent);
+        } else if (count > 0 && call) {
             printf(")");
-        } break;
+        }
+    }
 
-        case MP_NODE_DIVIDE: {
-            printf("div(");
-            mp_print_tree_node(root->binop.lhs);
-            printf(",");
-            mp_print_tree_node(root->binop.rhs);
-            printf(")");
+    mp_da_free(&stack);
+}
+
+void mp_tree_push(MP_Tree_Stack *stack, MP_Tree_Node *node, MP_Tree_Node **slot,
+                  uint32_t state)
+{
+    MP_Tree_Frame frame = {0};
+    frame.node = node;
+    frame.slot = slot;
+    frame.state = state;
+    mp_da_append(stack, frame);
+}
+
+// Stores where the operands of node are in operands, in the order they are
+// evaluated, and returns how many it has
+size_t mp_tree_operands(MP_Tree_Node *node, MP_Tree_Node **operands[2])
+{
+    switch (node->type) {
+        case MP_NODE_FUNCTION: {
+            operands[0] = &node->function.arg;
+            return 1;
         } break;
 
-        case MP_NODE_POWER: {
-            printf("pow(");
-            mp_print_tree_node(root->binop.lhs);
-            printf(",");
-            mp_print_tree_node(root->binop.rhs);
-            printf(")");
+        case MP_NODE_PLUS:
+        case MP_NODE_MINUS: {
+            operands[0] = &node->unary.node;
+            return 1;
         } break;
 
-        case MP_NODE_PLUS: {
-            printf("plus(");
-            mp_print_tree_node(root->unary.node);
-            printf(")");
+        case MP_NODE_POWI: {
+            operands[0] = &node->powi.base;
+            return 1;
         } break;
 
-        case MP_NODE_MINUS: {
-            printf("minus(");
-            mp_print_tree_node(root->unary.node);
-            printf(")");
+        case MP_NODE_ADD:
+        case MP_NODE_SUBTRACT:
+        case MP_NODE_MULTIPLY:
+        case MP_NODE_DIVIDE:
+        case MP_NODE_POWER:
+        case MP_NODE_LESS:
+        case MP_NODE_LESS_EQUAL:
+        case MP_NODE_GREATER:
+        case MP_NODE_GREATER_EQUAL:
+        case MP_NODE_EQUAL:
+        case MP_NODE_NOT_EQUAL:
+        case MP_NODE_AND:
+        case MP_NODE_OR:
+        case MP_NODE_SELECT:
+        case MP_NODE_ARGUMENTS:
+        case MP_NODE_BRANCHES: {
+            operands[0] = &node->binop.lhs;
+            operands[1] = &node->binop.rhs;
+            return 2;
         } break;
 
         default: {
-            printf(MP_STR_UNKNOWN);
+            return 0;
         } break;
     }
 }
 
-const char *mp_function_name_to_string(MP_Function name)
+// Pushes the operands of node on stack so that the first one is popped first
+static void mp_tree_push_operands(MP_Tree_Stack *stack, MP_Tree_Node *node)
 {
-    switch (name) {
-        case MP_FUNCTION_LN:   return MP_FUNCTION_STR_LN;
-        case MP_FUNCTION_LOG:  return MP_FUNCTION_STR_LOG;
-        case MP_FUNCTION_SIN:  return MP_FUNCTION_STR_SIN;
-        case MP_FUNCTION_COS:  return MP_FUNCTION_STR_COS;
-        case MP_FUNCTION_TAN:  return MP_FUNCTION_STR_TAN;
-        case MP_FUNCTION_SQRT: return MP_FUNCTION_STR_SQRT;
-        default:               return MP_STR_UNKNOWN;
+    MP_Tree_Node **operands[2];
+    for (size_t i = mp_tree_operands(node, operands); i-- > 0;) {
+        if (*operands[i] != NULL) {
+            mp_tree_push(stack, *operands[i], operands[i], 0);
+        }
     }
 }
 
-//-------------
-// Interpreter
-//-------------
-
-MP_Result mp_interpret(MP_Interpreter *interpreter)
+// Counts on the frames of stack, which is left empty
+static size_t mp_tree_node_count_with(MP_Tree_Node *root, MP_Tree_Stack *stack)
 {
-    MP_Result r = {0};
-    if (interpreter == NULL) {
-        r.error = true;
-        return r;
+    size_t count = 0;
+
+    if (root != NULL) {
+        mp_tree_push(stack, root, NULL, 0);
     }
 
-    if (interpreter->tree.root == NULL) {
-        r.error = true;
-        r.error_type = MP_ERROR_EMPTY_EXPRESSION;
-        return r;
+    while (stack->count > 0) {
+        MP_Tree_Node *node = stack->items[--stack->count].node;
+        mp_tree_push_operands(stack, node);
+        ++count;
     }
 
-    return mp_interpret_node(interpreter, interpreter->tree.root);
+    return count;
 }
 
-MP_Result mp_interpret_node(MP_Interpreter *interpreter, MP_Tree_Node *root)
+size_t mp_tree_node_count(MP_Tree_Node *root)
 {
-    MP_Result result = {0};
+    MP_Tree_Stack stack = {0};
+    size_t count = mp_tree_node_count_with(root, &stack);
+    mp_da_free(&stack);
+    return count;
+}
 
-    if (root == NULL) {
-        result.error = true;
-        result.error_type = MP_ERROR_INVALID_NODE;
-        return result;
+// Nodes on the longest path from root to a leaf, state holds the depth of
+// the node of a frame
+size_t mp_tree_height(MP_Tree_Node *root)
+{
+    MP_Tree_Stack stack = {0};
+    size_t height = 0;
+
+    if (root != NULL) {
+        mp_tree_push(&stack, root, NULL, 1);
     }
 
-    switch (root->type) {
-        case MP_NODE_INVALID: {
-            result.error = true;
-            result.error_type = MP_ERROR_INVALID_NODE;
-            return result;
-        } break;
+    while (stack.count > 0) {
+        MP_Tree_Frame frame = stack.items[--stack.count];
+        if (frame.state > height) height = frame.state;
 
-        case MP_NODE_NUMBER: {
-            result.value = root->value;
-        } break;
+        MP_Tree_Node **operands[2];
+        size_t count = mp_tree_operands(frame.node, operands);
+        for (size_t i = 0; i < count; ++i) {
+            if (*operands[i] != NULL) {
+                mp_tree_push(&stack, *operands[i], NULL, frame.state + 1);
+            }
+        }
+    }
 
-        case MP_NODE_SYMBOL: {
-            assert('a' <= root->symbol && root->symbol <= 'z');
-            result.value = interpreter->vars[root->symbol - 'a'];
-            return result;
-        } break;
+    mp_da_free(&stack);
+    return height;
+}
 
-        case MP_NODE_FUNCTION: {
-            MP_Result arg = mp_interpret_node(interpreter, root->function.arg);
-            if (arg.error) return arg;
+size_t mp_tree_reference_count(MP_Tree_Node *root)
+{
+    MP_Tree_Stack stack = {0};
+    size_t count = 0;
 
-            switch (root->function.name) {
-                case MP_FUNCTION_LN:
-                    result.value = log(arg.value);
-                    break;
+    if (root != NULL) {
+        mp_tree_push(&stack, root, NULL, 0);
+    }
 
-                case MP_FUNCTION_LOG:
-                    result.value = log10(arg.value);
-                    break;
+    while (stack.count > 0) {
+        MP_Tree_Node *node = stack.items[--stack.count].node;
+        mp_tree_push_operands(&stack, node);
+        if (node->type == MP_NODE_REFERENCE) ++count;
+    }
 
-                case MP_FUNCTION_SIN:
-                    result.value = sin(arg.value);
-                    break;
+    mp_da_free(&stack);
+    return count;
+}
 
-                case MP_FUNCTION_COS:
-                    result.value = cos(arg.value);
-                    break;
+// The nodes are copied before their operands, each copy still points to the
+// operands of the original until they are copied in turn
+MP_Tree_Node *mp_tree_node_copy(MP_Arena *a, MP_Tree_Node *root)
+{
+    MP_Tree_Stack stack = {0};
+    stack.allocator = a->allocator;
+    MP_Tree_Node *copy = NULL;
 
-                case MP_FUNCTION_TAN:
-                    result.value = tan(arg.value);
-                    break;
+    if (root != NULL) {
+        mp_tree_push(&stack, root, &copy, 0);
+    }
 
-                case MP_FUNCTION_SQRT:
-                    result.value = sqrt(arg.value);
-                    break;
+    while (stack.count > 0) {
+        MP_Tree_Frame frame = stack.items[--stack.count];
+        MP_Tree_Node *r = mp_arena_alloc(a, sizeof(*r));
+        *r = *frame.node;
+        *frame.slot = r;
+        mp_tree_push_operands(&stack, r);
+    }
 
-                default:
-                    result.error = true;
-                    result.error_type = MP_ERROR_INVALID_FUNCTION;
-                    break;
-            }
+    mp_da_free(&stack);
+    return copy;
+}
 
-            return result;
-        } break;
+// Moves the tree into a single region of the exact size, dropping the nodes
+// left behind by mp_optimize and the unused space of the regions
+void mp_parse_tree_compact(MP_Arena *arena, MP_Parse_Tree *tree)
+{
+    size_t size = mp_tree_node_count(tree->root) * sizeof(MP_Tree_Node);
+    size_t words = (size + sizeof(uintptr_t) - 1) / sizeof(uintptr_t);
+
+    MP_Arena compact = {0};
+    compact.allocator = arena->allocator;
+    if (words > 0) {
+        compact.begin = mp_region_new(compact.allocator, words);
+        compact.end = compact.begin;
+    }
 
-        case MP_NODE_ADD: {
-            MP_Result a = mp_interpret_node(interpreter, root->binop.lhs);
-            if (a.error) return a;
-            MP_Result b = mp_interpret_node(interpreter, root->binop.rhs);
-            if (b.error) return b;
-            result.value = a.value + b.value;
-        } break;
+    tree->root = mp_tree_node_copy(&compact, tree->root);
 
-        case MP_NODE_SUBTRACT: {
-            MP_Result a = mp_interpret_node(interpreter, root->binop.lhs);
-            if (a.error) return a;
-            MP_Result b = mp_interpret_node(interpreter, root->binop.rhs);
-            if (b.error) return b;
-            result.value = a.value - b.value;
-        } break;
+    mp_arena_free(arena);
+    *arena = compact;
+}
 
-        case MP_NODE_MULTIPLY: {
-            MP_Result a = mp_interpret_node(interpreter, root->binop.lhs);
-            if (a.error) return a;
-            MP_Result b = mp_interpret_node(interpreter, root->binop.rhs);
-            if (b.error) return b;
-            result.value = a.value * b.value;
+const char *mp_function_name_to_string(MP_Function name)
+{
+    switch (name) {
+        case MP_FUNCTION_LN:    return MP_FUNCTION_STR_LN;
+        case MP_FUNCTION_LOG:   return MP_FUNCTION_STR_LOG;
+        case MP_FUNCTION_SIN:   return MP_FUNCTION_STR_SIN;
+        case MP_FUNCTION_COS:   return MP_FUNCTION_STR_COS;
+        case MP_FUNCTION_TAN:   return MP_FUNCTION_STR_TAN;
+        case MP_FUNCTION_SQRT:  return MP_FUNCTION_STR_SQRT;
+        case MP_FUNCTION_MIN:   return MP_FUNCTION_STR_MIN;
+        case MP_FUNCTION_MAX:   return MP_FUNCTION_STR_MAX;
+        case MP_FUNCTION_POW:   return MP_FUNCTION_STR_POW;
+        case MP_FUNCTION_ATAN2: return MP_FUNCTION_STR_ATAN2;
+        case MP_FUNCTION_HYPOT: return MP_FUNCTION_STR_HYPOT;
+        case MP_FUNCTION_FMA:   return MP_FUNCTION_STR_FMA;
+        case MP_FUNCTION_CLAMP: return MP_FUNCTION_STR_CLAMP;
+        default: {
+            const MP_Native *native = mp_native(name);
+            return native != NULL ? native->name : MP_STR_UNKNOWN;
         } break;
+    }
+}
 
-        case MP_NODE_DIVIDE: {
-            MP_Result b = mp_interpret_node(interpreter, root->binop.rhs);
-            if (b.error) return b;
-            if (b.value == 0.0) {
-                result.error = true;
-                result.error_type = MP_ERROR_ZERO_DIVISION;
-                return result;
-            }
+size_t mp_function_arity(MP_Function name)
+{
+    if (name >= MP_FUNCTION_COUNT) {
+        const MP_Native *native = mp_native(name);
+        return native != NULL ? native->arity : 0;
+    }
 
-            MP_Result a = mp_interpret_node(interpreter, root->binop.lhs);
-            if (a.error) return a;
-            result.value = a.value / b.value;
-        } break;
+    switch (name) {
+        case MP_FUNCTION_INVALID: return 0;
+        case MP_FUNCTION_MIN:
+        case MP_FUNCTION_MAX:
+        case MP_FUNCTION_POW:
+        case MP_FUNCTION_ATAN2:
+        case MP_FUNCTION_HYPOT:   return 2;
+        case MP_FUNCTION_FMA:
+        case MP_FUNCTION_CLAMP:   return 3;
+        default:                  return 1;
+    }
+}
 
-        case MP_NODE_POWER: {
-            MP_Result b = mp_interpret_node(interpreter, root->binop.rhs);
-            if (b.error) return b;
-            MP_Result a = mp_interpret_node(interpreter, root->binop.lhs);
-            if (a.error) return a;
-            result.value = pow(a.value, b.value);
-        } break;
+const char *mp_node_type_to_string(MP_Node_Type type)
+{
+    switch (type) {
+        case MP_NODE_INVALID:       return "INVALID";
+        case MP_NODE_NUMBER:        return "NUMBER";
+        case MP_NODE_SYMBOL:        return "SYMBOL";
+        case MP_NODE_FUNCTION:      return "FUNCTION";
+        case MP_NODE_ADD:           return "ADD";
+        case MP_NODE_SUBTRACT:      return "SUBTRACT";
+        case MP_NODE_MULTIPLY:      return "MULTIPLY";
+        case MP_NODE_DIVIDE:        return "DIVIDE";
+        case MP_NODE_POWER:         return "POWER";
+        case MP_NODE_PLUS:          return "PLUS";
+        case MP_NODE_MINUS:         return "MINUS";
+        case MP_NODE_POWI:          return "POWI";
+        case MP_NODE_REFERENCE:     return "REFERENCE";
+        case MP_NODE_LESS:          return "LESS";
+        case MP_NODE_LESS_EQUAL:    return "LESS_EQUAL";
+        case MP_NODE_GREATER:       return "GREATER";
+        case MP_NODE_GREATER_EQUAL: return "GREATER_EQUAL";
+        case MP_NODE_EQUAL:         return "EQUAL";
+        case MP_NODE_NOT_EQUAL:     return "NOT_EQUAL";
+        case MP_NODE_AND:           return "AND";
+        case MP_NODE_OR:            return "OR";
+        case MP_NODE_SELECT:        return "SELECT";
+        case MP_NODE_BRANCHES:      return "BRANCHES";
+        case MP_NODE_ARGUMENTS:     return "ARGUMENTS";
+        default:                    return MP_STR_UNKNOWN;
+    }
+}
 
-        case MP_NODE_PLUS: {
-            result = mp_interpret_node(interpreter, root->unary.node);
-        } break;
+//------------------
+// Native functions
+//------------------
 
-        case MP_NODE_MINUS: {
-            MP_Result n = mp_interpret_node(interpreter, root->unary.node);
-            result.value = -n.value;
-        } break;
+static MP_Native mp_natives[MP_FUNCTION_CAPACITY - MP_FUNCTION_COUNT];
+static size_t mp_native_count;
 
-        default: {
-            result.error = true;
-            result.error_type = MP_ERROR_INVALID_NODE;
-            return result;
-        } break;
+// Returns the id of the function, or MP_FUNCTION_INVALID if it can't be
+// registered: its name isn't a name token or is taken, its arity is out of
+// range or the registry is full
+MP_Function mp_register_function(const MP_Native *native)
+{
+    if (native == NULL || native->fn == NULL || native->arity == 0
+            || native->arity > MP_FUNCTION_MAX_ARITY
+            || mp_function_count() >= MP_FUNCTION_CAPACITY)
+        return MP_FUNCTION_INVALID;
+
+    const unsigned char *name = (const unsigned char*)native->name;
+    if (memchr(name, '\0', sizeof(native->name)) == NULL
+            || !islower(name[0]) || !islower(name[1]))
+        return MP_FUNCTION_INVALID;
+
+    for (size_t i = 2; name[i] != '\0'; ++i) {
+        if (!islower(name[i]) && !isdigit(name[i]))
+            return MP_FUNCTION_INVALID;
     }
 
-    return result;
+    for (size_t f = MP_FUNCTION_INVALID + 1; f < mp_function_count(); ++f) {
+        if (strcmp(mp_function_name_to_string(f), native->name) == 0)
+            return MP_FUNCTION_INVALID;
+    }
+
+    mp_natives[mp_native_count] = *native;
+    return MP_FUNCTION_COUNT + mp_native_count++;
 }
 
-MP_Interpreter mp_interpreter_init(MP_Parse_Tree tree, MP_Arena arena)
+// NULL for the built-in functions
+const MP_Native *mp_native(MP_Function name)
 {
-    MP_Interpreter intpr = {0};
-    intpr.tree = tree;
-    intpr.arena = arena;
+    if (name < MP_FUNCTION_COUNT || name >= mp_function_count())
+        return NULL;
 
-    return intpr;
+    return &mp_natives[name - MP_FUNCTION_COUNT];
 }
 
-void mp_interpreter_var(MP_Interpreter *interpreter, char var, double value)
+size_t mp_function_count(void)
 {
-    if (interpreter == NULL)
-        return;
-
-    assert('a' <= var && var <= 'z');
-    interpreter->vars[var - 'a'] = value;
+    return MP_FUNCTION_COUNT + mp_native_count;
 }
 
-void mp_interpreter_free(MP_Interpreter *interpreter)
+bool mp_function_pure(MP_Function name)
 {
-    mp_arena_free(&interpreter->arena);
+    const MP_Native *native = mp_native(name);
+    return native == NULL || native->pure;
 }
 
-//----------
-// Compiler
-//----------
-
-// TODO: Implement function evaluation in the compiler and the VM
-
-bool mp_program_compile(MP_Program *p, MP_Parse_Tree parse_tree)
+size_t mp_function_cost(MP_Function name)
 {
-    if (p == NULL)
-        return false;
+    const MP_Native *native = mp_native(name);
+    if (native != NULL)
+        return native->cost > 0 ? native->cost : 1;
 
-    return mp_program_compile_node(p, parse_tree.root);
+    switch (name) {
+        case MP_FUNCTION_MIN:
+        case MP_FUNCTION_MAX:
+        case MP_FUNCTION_CLAMP: return 1;
+        case MP_FUNCTION_SQRT:
+        case MP_FUNCTION_FMA:   return 4;
+        default:                return 20;
+    }
 }
 
-bool mp_program_compile_node(MP_Program *p, MP_Tree_Node *node)
+// Rough cost of an evaluation of the tree in additions
+size_t mp_tree_cost(MP_Tree_Node *root)
 {
-    switch (node->type) {
-        case MP_NODE_INVALID: {
-            return false;
-        } break;
-
-        case MP_NODE_NUMBER: {
-            mp_program_push_opcode(p, MP_OP_PUSH_NUM);
-            mp_program_push_const(p, node->value);
-        } break;
-
-        case MP_NODE_SYMBOL: {
-            assert('a' <= node->symbol && node->symbol <= 'z');
-            mp_program_push_opcode(p, MP_OP_PUSH_VAR);
-            mp_program_push_var(p, node->symbol - 'a');
-        } break;
+    MP_Tree_Stack stack = {0};
+    size_t cost = 0;
 
-        case MP_NODE_ADD: {
-            if (!mp_program_compile_node(p, node->binop.lhs)) return false;
-            if (!mp_program_compile_node(p, node->binop.rhs)) return false;
-            mp_program_push_opcode(p, MP_OP_ADD);
-        } break;
+    if (root != NULL) {
+        mp_tree_push(&stack, root, NULL, 0);
+    }
 
-        case MP_NODE_SUBTRACT: {
-            if (!mp_program_compile_node(p, node->binop.lhs)) return false;
-            if (!mp_program_compile_node(p, node->binop.rhs)) return false;
-            mp_program_push_opcode(p, MP_OP_SUB);
-        } break;
+    while (stack.count > 0) {
+        MP_Tree_Node *node = stack.items[--stack.count].node;
+        mp_tree_push_operands(&stack, node);
 
-        case MP_NODE_MULTIPLY: {
-            if (!mp_program_compile_node(p, node->binop.lhs)) return false;
-            if (!mp_program_compile_node(p, node->binop.rhs)) return false;
-            mp_program_push_opcode(p, MP_OP_MUL);
-        } break;
+        if (node->type == MP_NODE_FUNCTION) {
+            cost += mp_function_cost(node->function.name);
+        } else {
+            cost += node->type == MP_NODE_POWER ? 20 : 1;
+        }
+    }
 
-        case MP_NODE_DIVIDE: {
-            if (!mp_program_compile_node(p, node->binop.lhs)) return false;
-            if (!mp_program_compile_node(p, node->binop.rhs)) return false;
-            mp_program_push_opcode(p, MP_OP_DIV);
-        } break;
+    mp_da_free(&stack);
+    return cost;
+}
 
-        case MP_NODE_POWER: {
-            if (!mp_program_compile_node(p, node->binop.lhs)) return false;
-            if (!mp_program_compile_node(p, node->binop.rhs)) return false;
-            mp_program_push_opcode(p, MP_OP_POW);
-        } break;
+// Whether the tree calls no impure function
+bool mp_tree_pure(MP_Tree_Node *root)
+{
+    MP_Tree_Stack stack = {0};
+    bool pure = true;
 
-        case MP_NODE_PLUS: {
-            if (!mp_program_compile_node(p, node->unary.node)) return false;
-        } break;
+    if (root != NULL) {
+        mp_tree_push(&stack, root, NULL, 0);
+    }
 
-        case MP_NODE_MINUS: {
-            if (!mp_program_compile_node(p, node->unary.node)) return false;
-            mp_program_push_opcode(p, MP_OP_NEG);
-        } break;
+    while (pure && stack.count > 0) {
+        MP_Tree_Node *node = stack.items[--stack.count].node;
+        mp_tree_push_operands(&stack, node);
 
-        default: {
-            return false;
-        } break;
+        if (node->type == MP_NODE_FUNCTION
+                && !mp_function_pure(node->function.name))
+            pure = false;
     }
 
-    return true;
+    mp_da_free(&stack);
+    return pure;
 }
 
-void mp_program_push_opcode(MP_Program *p, MP_Opcode op)
+//-----------
+// Optimizer
+//-----------
+
+double mp_powi(double x, int n)
 {
-    if (p == NULL)
-        return;
+    unsigned int e = n < 0 ? -(unsigned int)n : (unsigned int)n;
+    double base = x;
+    double power = 1.0;
+
+    while (e != 0) {
+        if (e & 1) power *= x;
+        x *= x;
+        e >>= 1;
+    }
 
-    mp_da_append(p, op);
+    // What overflows or underflows on the way is left to pow, e.g. x^-2 for
+    // x = 1e160 whose x^2 is inf although x^-2 is 1e-320
+    double result = n < 0 ? 1.0 / power : power;
+    if (!(isnormal(power) && isnormal(result)) && isfinite(base) && base != 0.0)
+        return pow(base, n);
+
+    return result;
 }
 
-void mp_program_push_const(MP_Program *p, double value)
+// A number under any number of signs
+bool mp_node_constant(MP_Tree_Node *node, double *value)
 {
-    if (p == NULL)
-        return;
-
-    for (size_t i = 0; i < sizeof(value); ++i) {
-        mp_da_append(p, 0);
+    bool negative = false;
+    while (node != NULL
+            && (node->type == MP_NODE_PLUS || node->type == MP_NODE_MINUS)) {
+        if (node->type == MP_NODE_MINUS) negative = !negative;
+        node = node->unary.node;
     }
-    double *loc = (double*)((p->items + p->count) - sizeof(*loc));
-    *loc = value;
+
+    if (node == NULL || node->type != MP_NODE_NUMBER)
+        return false;
+
+    *value = negative ? -node->value : node->value;
+    return true;
 }
 
-void mp_program_push_var(MP_Program *p, char var)
+static bool mp_node_small_integer(MP_Tree_Node *node, int *n)
 {
-    if (p == NULL)
-        return;
+    double value = 0.0;
+    if (!mp_node_constant(node, &value))
+        return false;
 
-    mp_da_append(p, var);
+    if (value != floor(value) || fabs(value) > MP_POWI_MAX_EXPONENT)
+        return false;
+
+    *n = (int)value;
+    return true;
 }
 
-void mp_print_program(MP_Program p)
+// The factors of the product are visited on stack above its current top, which
+// is left as it was
+static bool mp_monomial_walk(MP_Tree_Stack *stack, MP_Tree_Node *node,
+                             char *var, double *coeff, size_t *degree)
 {
-    size_t ip = 0;
-    for (size_t i = 0; i < p.count; ++i) {
-        MP_Opcode op = p.items[i];
-
-        switch (op) {
-            case MP_OP_PUSH_NUM: {
-                printf("%ld: PUSH_NUM ", ip++);
-                double num = 0.0;
+    size_t base = stack->count;
+    bool negative = false;
+    *coeff = 1.0;
+    *degree = 0;
 
-                if (i + sizeof(num) >= p.count)
-                    continue;
+    mp_tree_push(stack, node, NULL, 0);
 
-                ++i;
-                num = *(double*)&p.items[i];
-                i += sizeof(num) - 1;
+    while (stack->count > base) {
+        MP_Tree_Node *factor = stack->items[--stack->count].node;
+        double c = 1.0;
+        size_t d = 0;
 
-                printf("%f\n", num);
+        switch (factor->type) {
+            case MP_NODE_NUMBER: {
+                c = factor->value;
             } break;
 
-            case MP_OP_PUSH_VAR: {
-                printf("%ld: PUSH_VAR ", ip++);
-                char var = 0;
-
-                if (i + sizeof(var) >= p.count)
-                    continue;
+            case MP_NODE_SYMBOL: {
+                if (*var != '\0' && *var != factor->symbol) goto fail;
+                *var = factor->symbol;
+                d = 1;
+            } break;
 
-                ++i;
-                var = p.items[i] + 'a';
-                // i += sizeof(var) - 1; // Increment by 0
+            case MP_NODE_POWER:
+            case MP_NODE_POWI: {
+                MP_Tree_Node *b = factor->type == MP_NODE_POWER
+                    ? factor->binop.lhs : factor->powi.base;
+                int n = factor->powi.exponent;
+                if (factor->type == MP_NODE_POWER
+                    && !mp_node_small_integer(factor->binop.rhs, &n)) goto fail;
+
+                if (b->type != MP_NODE_SYMBOL) goto fail;
+                if (n < 0 || n > MP_HORNER_MAX_DEGREE) goto fail;
+                if (*var != '\0' && *var != b->symbol) goto fail;
+                *var = b->symbol;
+                d = n;
+            } break;
 
-                printf("%c\n", var);
+            // The left factor is visited first
+            case MP_NODE_MULTIPLY: {
+                mp_tree_push(stack, factor->binop.rhs, NULL, 0);
+                mp_tree_push(stack, factor->binop.lhs, NULL, 0);
+                continue;
             } break;
 
-            case MP_OP_ADD: printf("%ld: ADD\n", ip++); break;
-            case MP_OP_SUB: printf("%ld: SUB\n", ip++); break;
-            case MP_OP_MUL: printf("%ld: MUL\n", ip++); break;
-            case MP_OP_DIV: printf("%ld: DIV\n", ip++); break;
-            case MP_OP_POW: printf("%ld: POW\n", ip++); break;
-            case MP_OP_NEG: printf("%ld: NEG\n", ip++); break;
+            case MP_NODE_PLUS:
+            case MP_NODE_MINUS: {
+                if (factor->type == MP_NODE_MINUS) negative = !negative;
+                mp_tree_push(stack, factor->unary.node, NULL, 0);
+                continue;
+            } break;
 
             default: {
-                printf("%ld: ?\n", ip++);
+                goto fail;
             } break;
         }
+
+        *coeff *= c;
+        *degree += d;
+        if (*degree > MP_HORNER_MAX_DEGREE) goto fail;
     }
-}
 
-void mp_stack_push(MP_Stack *stack, double n)
-{
-    if (stack == NULL)
-        return;
+    if (negative) *coeff = -*coeff;
+    return true;
 
-    mp_da_append(stack, n);
+fail:
+    stack->count = base;
+    return false;
 }
 
-MP_Optional mp_stack_pop(MP_Stack *stack)
+// Same as mp_polynomial_collect, with the terms visited on stack above its
+// current top
+static bool mp_polynomial_walk(MP_Tree_Stack *stack, MP_Polynomial *p,
+                               MP_Tree_Node *node, double sign)
 {
-    MP_Optional result = mp_stack_peek(stack);
-    if (result.present) {
-        stack->count--;
-    }
+    size_t base = stack->count;
 
-    return result;
-}
+    // state is set for the terms that are subtracted
+    mp_tree_push(stack, node, NULL, sign < 0.0);
 
-MP_Optional mp_stack_peek(MP_Stack *stack)
+    while (stack->count > base) {
+        MP_Tree_Frame term = stack->items[--stack->count];
+        MP_Tree_Node *n = term.node;
+
+        switch (n->type) {
+            case MP_NODE_ADD:
+            case MP_NODE_SUBTRACT: {
+                bool flip = n->type == MP_NODE_SUBTRACT;
+                mp_tree_push(stack, n->binop.rhs, NULL, term.state ^ flip);
+                mp_tree_push(stack, n->binop.lhs, NULL, term.state);
+            } break;
+
+            case MP_NODE_PLUS:
+            case MP_NODE_MINUS: {
+                bool flip = n->type == MP_NODE_MINUS;
+                mp_tree_push(stack, n->unary.node, NULL, term.state ^ flip);
+            } break;
+
+            default: {
+                double coeff = 0.0;
+                size_t degree = 0;
+                if (!mp_monomial_walk(stack, n, &p->var, &coeff, &degree)) {
+                    stack->count = base;
+                    return false;
+                }
+
+                p->coeffs[degree] += term.state ? -coeff : coeff;
+                p->present[degree] = true;
+                if (degree > p->degree) p->degree = degree;
+                p->terms++;
+            } break;
+        }
+    }
+
+    return true;
+}
+
+bool mp_monomial(MP_Tree_Node *node, char *var, double *coeff, size_t *degree)
 {
-    MP_Optional result = {0};
-    if (stack == NULL || stack->count == 0) {
-        return result;
+    MP_Tree_Stack stack = {0};
+    bool ok = mp_monomial_walk(&stack, node, var, coeff, degree);
+    mp_da_free(&stack);
+    return ok;
+}
+
+bool mp_polynomial_collect(MP_Polynomial *p, MP_Tree_Node *node, double sign)
+{
+    MP_Tree_Stack stack = {0};
+    bool ok = mp_polynomial_walk(&stack, p, node, sign);
+    mp_da_free(&stack);
+    return ok;
+}
+
+MP_Tree_Node *mp_make_horner(MP_Arena *a, const MP_Polynomial *p)
+{
+    MP_Tree_Node *result = p->coeffs[p->degree] == 1.0
+        ? mp_make_node_symbol(a, p->var)
+        : mp_make_node_binop(a, MP_NODE_MULTIPLY,
+                             mp_make_node(a, MP_NODE_NUMBER, p->coeffs[p->degree]),
+                             mp_make_node_symbol(a, p->var));
+
+    for (size_t k = p->degree; k-- > 0;) {
+        if (p->coeffs[k] != 0.0) {
+            result = mp_make_node_binop(a, MP_NODE_ADD, result,
+                    mp_make_node(a, MP_NODE_NUMBER, p->coeffs[k]));
+        }
+
+        if (k > 0) {
+            result = mp_make_node_binop(a, MP_NODE_MULTIPLY, result,
+                                        mp_make_node_symbol(a, p->var));
+        }
     }
 
-    result.present = true;
-    result.value = stack->items[stack->count - 1];
     return result;
 }
 
-MP_Vm mp_vm_init(MP_Program program)
+// The Horner form of the sum at node, or NULL if it isn't a polynomial
+static MP_Tree_Node *mp_optimize_sum(MP_Arena *a, MP_Tree_Stack *stack,
+                                     MP_Tree_Node *node)
 {
-    MP_Vm vm = {0};
-    vm.program = program;
-    return vm;
+    MP_Polynomial p = {0};
+    if (!mp_polynomial_walk(stack, &p, node, 1.0)
+            || p.var == '\0' || p.terms < 2 || p.degree < 2)
+        return NULL;
+
+    // Terms that cancel out would turn inf - inf into 0
+    for (size_t k = 0; k <= p.degree; ++k) {
+        if (p.present[k] && p.coeffs[k] == 0.0) return NULL;
+    }
+
+    return mp_make_horner(a, &p);
 }
 
-void mp_vm_var(MP_Vm *vm, char var, double value)
+// The rewrites of a node only depend on the node and its operands as parsed,
+// so the tree is rewritten top-down. The state of a frame is set when its node
+// is part of a sum that was tried already.
+MP_Tree_Node *mp_optimize_node(MP_Arena *a, MP_Tree_Node *node)
 {
-    if (vm == NULL)
+    // The stack lives in the arena, like the ones of mp_parse_operators
+    MP_Allocator scratch = mp_arena_allocator(a);
+    MP_Tree_Stack stack = {0};
+    stack.allocator = &scratch;
+
+    MP_Tree_Node *root = node;
+    mp_tree_push(&stack, root, &root, 0);
+
+    while (stack.count > 0) {
+        MP_Tree_Frame frame = stack.items[--stack.count];
+        MP_Tree_Node *n = frame.node;
+        if (n == NULL)
+            continue;
+
+        bool sum = false;
+
+        switch (n->type) {
+            case MP_NODE_ADD:
+            case MP_NODE_SUBTRACT: {
+                if (!frame.state) {
+                    MP_Tree_Node *horner = mp_optimize_sum(a, &stack, n);
+                    if (horner != NULL) {
+                        *frame.slot = horner;
+                        continue;
+                    }
+                }
+                sum = true;
+            } break;
+
+            case MP_NODE_PLUS:
+            case MP_NODE_MINUS: {
+                sum = frame.state;
+            } break;
+
+            case MP_NODE_POWER: {
+                int exponent = 0;
+                if (mp_node_small_integer(n->binop.rhs, &exponent)) {
+                    MP_Tree_Node *base = n->binop.lhs;
+                    n->type = MP_NODE_POWI;
+                    n->powi.base = base;
+                    n->powi.exponent = exponent;
+                }
+            } break;
+
+            // Visited again as a power
+            case MP_NODE_FUNCTION: {
+                if (n->function.name == MP_FUNCTION_POW) {
+                    MP_Tree_Node *args = n->function.arg;
+                    n->type = MP_NODE_POWER;
+                    n->binop.lhs = args->binop.lhs;
+                    n->binop.rhs = args->binop.rhs;
+                    mp_tree_push(&stack, n, frame.slot, frame.state);
+                    continue;
+                }
+            } break;
+
+            default: break;
+        }
+
+        MP_Tree_Node **operands[2];
+        size_t count = mp_tree_operands(n, operands);
+        for (size_t i = 0; i < count; ++i) {
+            mp_tree_push(&stack, *operands[i], operands[i], sum);
+        }
+    }
+
+    mp_da_free(&stack);
+
+    return root;
+}
+
+void mp_optimize(MP_Arena *a, MP_Parse_Tree *tree)
+{
+    if (tree == NULL)
+        return;
+
+    tree->root = mp_optimize_node(a, tree->root);
+}
+
+//---------
+// Opcodes
+//---------
+
+const char *mp_opcode_to_string(MP_Opcode op)
+{
+    switch (op) {
+        case MP_OP_INVALID:  return "INVALID";
+        case MP_OP_PUSH_NUM: return "PUSH_NUM";
+        case MP_OP_PUSH_VAR: return "PUSH_VAR";
+        case MP_OP_ADD:      return "ADD";
+        case MP_OP_SUB:      return "SUB";
+        case MP_OP_MUL:      return "MUL";
+        case MP_OP_DIV:      return "DIV";
+        case MP_OP_POW:      return "POW";
+        case MP_OP_NEG:      return "NEG";
+        case MP_OP_FUNC:     return "FUNC";
+        case MP_OP_STORE:    return "STORE";
+        case MP_OP_LOAD:     return "LOAD";
+        case MP_OP_POP:      return "POP";
+        case MP_OP_POWI:     return "POWI";
+        case MP_OP_LT:       return "LT";
+        case MP_OP_LE:       return "LE";
+        case MP_OP_GT:       return "GT";
+        case MP_OP_GE:       return "GE";
+        case MP_OP_EQ:       return "EQ";
+        case MP_OP_NE:       return "NE";
+        case MP_OP_AND:      return "AND";
+        case MP_OP_OR:       return "OR";
+        case MP_OP_SELECT:   return "SELECT";
+        case MP_OP_PUSH_INT:   return "PUSH_INT";
+        case MP_OP_PUSH_FLOAT: return "PUSH_FLOAT";
+        case MP_OP_ADD_VAR:    return "ADD_VAR";
+        case MP_OP_SUB_VAR:    return "SUB_VAR";
+        case MP_OP_MUL_VAR:    return "MUL_VAR";
+        case MP_OP_DIV_VAR:    return "DIV_VAR";
+        case MP_OP_ADD_CONST:  return "ADD_CONST";
+        case MP_OP_SUB_CONST:  return "SUB_CONST";
+        case MP_OP_MUL_CONST:  return "MUL_CONST";
+        case MP_OP_DIV_CONST:  return "DIV_CONST";
+        case MP_OP_ADD_INT:    return "ADD_INT";
+        case MP_OP_SUB_INT:    return "SUB_INT";
+        case MP_OP_MUL_INT:    return "MUL_INT";
+        case MP_OP_DIV_INT:    return "DIV_INT";
+        default: break;
+    }
+
+    static const char *push_var[] = {
+        "PUSH_VAR_A", "PUSH_VAR_B", "PUSH_VAR_C", "PUSH_VAR_D", "PUSH_VAR_E",
+        "PUSH_VAR_F", "PUSH_VAR_G", "PUSH_VAR_H", "PUSH_VAR_I", "PUSH_VAR_J",
+        "PUSH_VAR_K", "PUSH_VAR_L", "PUSH_VAR_M", "PUSH_VAR_N", "PUSH_VAR_O",
+        "PUSH_VAR_P", "PUSH_VAR_Q", "PUSH_VAR_R", "PUSH_VAR_S", "PUSH_VAR_T",
+        "PUSH_VAR_U", "PUSH_VAR_V", "PUSH_VAR_W", "PUSH_VAR_X", "PUSH_VAR_Y",
+        "PUSH_VAR_Z",
+    };
+    if (MP_OP_PUSH_VAR_A <= op && op <= MP_OP_PUSH_VAR_Z)
+        return push_var[op - MP_OP_PUSH_VAR_A];
+
+    return MP_STR_UNKNOWN;
+}
+
+//-----------
+// Profiling
+//-----------
+
+#ifdef MP_PROFILE
+
+uint64_t mp_profile_clock(void)
+{
+#ifdef MP_PROFILE_RDTSC
+    return __rdtsc();
+#else
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+#endif
+}
+
+void mp_print_profile(const MP_Profile *profile)
+{
+    if (profile == NULL)
+        return;
+
+    printf("evaluations: %lu\n", (unsigned long)profile->evaluations);
+    printf("max stack depth: %zu\n", profile->max_stack_depth);
+
+    printf("%-10s %-10s %14s %16s %10s\n",
+           "kind", "name", "count", "cycles", "cycles/op");
+
+    for (size_t i = 0; i < MP_OP_COUNT; ++i) {
+        if (profile->op_counts[i] == 0) continue;
+        printf("%-10s %-10s %14lu %16lu %10.1f\n", "opcode",
+               mp_opcode_to_string(i),
+               (unsigned long)profile->op_counts[i],
+               (unsigned long)profile->op_cycles[i],
+               (double)profile->op_cycles[i] / profile->op_counts[i]);
+    }
+
+    for (size_t i = 0; i < MP_NODE_COUNT; ++i) {
+        if (profile->node_counts[i] == 0) continue;
+        printf("%-10s %-10s %14lu %16lu %10.1f\n", "node",
+               mp_node_type_to_string(i),
+               (unsigned long)profile->node_counts[i],
+               (unsigned long)profile->node_cycles[i],
+               (double)profile->node_cycles[i] / profile->node_counts[i]);
+    }
+
+    for (size_t i = 0; i < mp_function_count(); ++i) {
+        if (profile->function_counts[i] == 0) continue;
+        printf("%-10s %-10s %14lu %16lu %10.1f\n", "function",
+               mp_function_name_to_string(i),
+               (unsigned long)profile->function_counts[i],
+               (unsigned long)profile->function_cycles[i],
+               (double)profile->function_cycles[i] / profile->function_counts[i]);
+    }
+}
+
+#endif // MP_PROFILE
+
+//-----------
+// Fast math
+//-----------
+
+#define MP_PIO2_1      1.57079632673412561417e+00
+#define MP_PIO2_2      6.07710050630396597660e-11
+#define MP_PIO2_3      2.02226624871116645580e-21
+#define MP_TWO_OVER_PI 6.36619772367581382433e-01
+
+// Reduces x to r in [-pi/4, pi/4] with x = r + q*pi/2, valid for |x| < 2^20
+static inline double mp_fast_trig_reduce(double x, int64_t *q)
+{
+    double k = (x * MP_TWO_OVER_PI + 0x1.8p52) - 0x1.8p52;
+    *q = (int64_t)k;
+    return ((x - k * MP_PIO2_1) - k * MP_PIO2_2) - k * MP_PIO2_3;
+}
+
+static inline double mp_fast_sin_poly(double r)
+{
+    double z = r * r;
+    double p = -1.0/1307674368000.0;
+    p = p*z + 1.0/6227020800.0;
+    p = p*z - 1.0/39916800.0;
+    p = p*z + 1.0/362880.0;
+    p = p*z - 1.0/5040.0;
+    p = p*z + 1.0/120.0;
+    p = p*z - 1.0/6.0;
+    return r + r * z * p;
+}
+
+static inline double mp_fast_cos_poly(double r)
+{
+    double z = r * r;
+    double p = 1.0/20922789888000.0;
+    p = p*z - 1.0/87178291200.0;
+    p = p*z + 1.0/479001600.0;
+    p = p*z - 1.0/3628800.0;
+    p = p*z + 1.0/40320.0;
+    p = p*z - 1.0/720.0;
+    p = p*z + 1.0/24.0;
+    return 1.0 - 0.5 * z + z * z * p;
+}
+
+double mp_fast_sin(double x)
+{
+    if (!(fabs(x) < 0x1p20)) return sin(x);
+
+    int64_t q;
+    double r = mp_fast_trig_reduce(x, &q);
+    double s = mp_fast_sin_poly(r);
+    double c = mp_fast_cos_poly(r);
+    double result = (q & 1) ? c : s;
+    result = (q & 2) ? -result : result;
+    return x == 0.0 ? x : result; // Keep the sign of zero
+}
+
+double mp_fast_cos(double x)
+{
+    if (!(fabs(x) < 0x1p20)) return cos(x);
+
+    int64_t q;
+    double r = mp_fast_trig_reduce(x, &q);
+    double s = mp_fast_sin_poly(r);
+    double c = mp_fast_cos_poly(r);
+    double result = (q & 1) ? s : c;
+    return ((q + 1) & 2) ? -result : result;
+}
+
+double mp_fast_tan(double x)
+{
+    if (!(fabs(x) < 0x1p20)) return tan(x);
+
+    int64_t q;
+    double r = mp_fast_trig_reduce(x, &q);
+    double s = mp_fast_sin_poly(r);
+    double c = mp_fast_cos_poly(r);
+    double result = (q & 1) ? -c / s : s / c;
+    return x == 0.0 ? x : result; // Keep the sign of zero
+}
+
+double mp_min(double a, double b)
+{
+    return a < b || b != b ? a : b;
+}
+
+double mp_max(double a, double b)
+{
+    return a > b || b != b ? a : b;
+}
+
+//-------------
+// Interpreter
+//-------------
+
+MP_Result mp_interpret(MP_Interpreter *interpreter)
+{
+    MP_Result r = {0};
+    if (interpreter == NULL) {
+        r.error = true;
+        return r;
+    }
+
+    if (interpreter->tree.root == NULL) {
+        r.error = true;
+        r.error_type = MP_ERROR_EMPTY_EXPRESSION;
+        return r;
+    }
+
+#ifdef MP_PROFILE
+    interpreter->profile.evaluations++;
+#endif
+
+    return mp_interpret_node(interpreter, interpreter->tree.root);
+}
+
+// The nodes waiting for their operands are kept on interpreter->frames and the
+// values computed so far on interpreter->values. Both are reused by the next
+// evaluations.
+MP_Result mp_interpret_node(MP_Interpreter *interpreter, MP_Tree_Node *root)
+{
+    MP_Result result = {0};
+    MP_Tree_Stack *frames = &interpreter->frames;
+    MP_Stack *values = &interpreter->values;
+    mp_da_reset(frames);
+    mp_da_reset(values);
+
+    mp_tree_push(frames, root, NULL, 0);
+
+    while (frames->count > 0) {
+        MP_Tree_Frame *frame = &frames->items[frames->count - 1];
+        MP_Tree_Node *node = frame->node;
+        uint32_t state = frame->state;
+
+        // The operand to evaluate before going on with node, if descend
+        MP_Tree_Node *next = NULL;
+        bool descend = false;
+        double *top = values->count > 0 ? &values->items[values->count - 1] : NULL;
+
+        MP_PROFILE_BEGIN(node_start);
+
+        if (node == NULL) {
+            result.error = true;
+            result.error_type = MP_ERROR_INVALID_NODE;
+            return result;
+        }
+
+        switch (node->type) {
+            case MP_NODE_NUMBER: {
+                mp_da_append(values, node->value);
+            } break;
+
+            case MP_NODE_SYMBOL: {
+                assert('a' <= node->symbol && node->symbol <= 'z');
+                mp_da_append(values, interpreter->vars[node->symbol - 'a']);
+            } break;
+
+            case MP_NODE_REFERENCE: {
+                // Only the programs of a formula graph can read other formulas
+                result.error = true;
+                result.error_type = MP_ERROR_UNKNOWN_REFERENCE;
+                return result;
+            } break;
+
+            case MP_NODE_FUNCTION: {
+                // The arguments are evaluated in order, also those of an
+                // invalid function, so that the first error is the one reported
+                size_t count = 1;
+                for (MP_Tree_Node *arg = node->function.arg;
+                        arg->type == MP_NODE_ARGUMENTS; arg = arg->binop.rhs) {
+                    ++count;
+                }
+
+                if (state < count) {
+                    MP_Tree_Node *arg = node->function.arg;
+                    for (uint32_t i = 0; i < state; ++i) {
+                        arg = arg->binop.rhs;
+                    }
+                    next = state + 1 < count ? arg->binop.lhs : arg;
+                    descend = true;
+                    break;
+                }
+
+                // The result replaces the first argument
+                double *args = values->items + values->count - count;
+                MP_PROFILE_BEGIN(function_start);
+                if (count != mp_function_arity(node->function.name)
+                        || !mp_function_apply(node->function.name, args,
+                                              interpreter->precision, &args[0])) {
+                    result.error = true;
+                    result.error_type = MP_ERROR_INVALID_FUNCTION;
+                    return result;
+                }
+                MP_PROFILE_END(interpreter->profile, function,
+                               node->function.name, function_start);
+                values->count -= count - 1;
+            } break;
+
+            case MP_NODE_ADD:
+            case MP_NODE_SUBTRACT:
+            case MP_NODE_MULTIPLY:
+            case MP_NODE_LESS:
+            case MP_NODE_LESS_EQUAL:
+            case MP_NODE_GREATER:
+            case MP_NODE_GREATER_EQUAL:
+            case MP_NODE_EQUAL:
+            case MP_NODE_NOT_EQUAL: {
+                if (state < 2) {
+                    next = state == 0 ? node->binop.lhs : node->binop.rhs;
+                    descend = true;
+                    break;
+                }
+
+                double b = *top;
+                double *a = top - 1;
+                --values->count;
+
+                switch (node->type) {
+                    case MP_NODE_ADD:      *a = *a + b; break;
+                    case MP_NODE_SUBTRACT: *a = *a - b; break;
+                    case MP_NODE_MULTIPLY: *a = *a * b; break;
+                    default: *a = mp_logic_apply(node->type, *a, b); break;
+                }
+            } break;
+
+            // The right operand is evaluated first, a division checks it
+            // before the left one is
+            case MP_NODE_DIVIDE:
+            case MP_NODE_POWER: {
+                if (state == 0) {
+                    next = node->binop.rhs;
+                    descend = true;
+                    break;
+                }
+
+                if (state == 1) {
+#ifndef MP_IEEE
+                    if (node->type == MP_NODE_DIVIDE && *top == 0.0) {
+                        result.error = true;
+                        result.error_type = MP_ERROR_ZERO_DIVISION;
+                        return result;
+                    }
+#endif
+                    next = node->binop.lhs;
+                    descend = true;
+                    break;
+                }
+
+                double a = *top;
+                double *b = top - 1;
+                --values->count;
+                *b = node->type == MP_NODE_DIVIDE ? a / *b
+                   : pow(a, *b);
+            } break;
+
+            case MP_NODE_POWI:
+            case MP_NODE_PLUS:
+            case MP_NODE_MINUS: {
+                if (state == 0) {
+                    next = node->type == MP_NODE_POWI
+                        ? node->powi.base : node->unary.node;
+                    descend = true;
+                    break;
+                }
+
+                if (node->type == MP_NODE_POWI) {
+                    *top = mp_powi(*top, node->powi.exponent);
+                } else if (node->type == MP_NODE_MINUS) {
+                    *top = -*top;
+                }
+            } break;
+
+            // The right operand is only evaluated when it decides the result,
+            // so that a guard like x != 0 && 1/x > 2 doesn't fail
+            case MP_NODE_AND:
+            case MP_NODE_OR: {
+                if (state == 0) {
+                    next = node->binop.lhs;
+                    descend = true;
+                } else if (state == 1) {
+                    if ((*top != 0.0) == (node->type == MP_NODE_OR)) {
+                        *top = node->type == MP_NODE_OR;
+                        break;
+                    }
+                    --values->count;
+                    next = node->binop.rhs;
+                    descend = true;
+                } else {
+                    *top = *top != 0.0;
+                }
+            } break;
+
+            // Only the branch taken is evaluated, like the operands of AND
+            // and OR
+            case MP_NODE_SELECT: {
+                if (state == 0) {
+                    next = node->binop.lhs;
+                    descend = true;
+                } else if (state == 1) {
+                    MP_Tree_Node *branches = node->binop.rhs;
+                    assert(branches->type == MP_NODE_BRANCHES);
+                    next = *top != 0.0 ? branches->binop.lhs : branches->binop.rhs;
+                    --values->count;
+                    descend = true;
+                }
+            } break;
+
+            default: {
+                result.error = true;
+                result.error_type = MP_ERROR_INVALID_NODE;
+                return result;
+            } break;
+        }
+
+#ifdef MP_PROFILE
+        // A node is counted once, the time of all of its steps is added up
+        MP_Profile *profile = &interpreter->profile;
+        profile->node_cycles[node->type] += mp_profile_clock() - node_start;
+        if (!descend) profile->node_counts[node->type]++;
+        MP_PROFILE_DEPTH(*profile, frames->count);
+#endif
+
+        if (!descend) {
+            --frames->count;
+            continue;
+        }
+        frame->state++;
+
+        // The value of a leaf is pushed right away, without a frame
+        if (next != NULL && (next->type == MP_NODE_NUMBER
+                             || next->type == MP_NODE_SYMBOL)) {
+            assert(next->type == MP_NODE_NUMBER
+                   || ('a' <= next->symbol && next->symbol <= 'z'));
+            mp_da_append(values, next->type == MP_NODE_NUMBER
+                         ? next->value : interpreter->vars[next->symbol - 'a']);
+#ifdef MP_PROFILE
+            interpreter->profile.node_counts[next->type]++;
+#endif
+        } else {
+            mp_tree_push(frames, next, NULL, 0);
+        }
+    }
+
+    assert(values->count == 1);
+    result.value = values->items[0];
+    return result;
+}
+
+// args holds mp_function_arity(name) values, result may point into it
+bool mp_function_apply(MP_Function name, const double *args,
+                       MP_Precision precision, double *result)
+{
+    if (name >= MP_FUNCTION_COUNT) {
+        const MP_Native *native = mp_native(name);
+        if (native == NULL) return false;
+        *result = native->fn(args, native->user);
+        return true;
+    }
+
+    double x = args[0];
+
+    if (precision == MP_PRECISION_FAST) {
+        switch (name) {
+            case MP_FUNCTION_SIN: *result = mp_fast_sin(x); return true;
+            case MP_FUNCTION_COS: *result = mp_fast_cos(x); return true;
+            case MP_FUNCTION_TAN: *result = mp_fast_tan(x); return true;
+            default:              break;
+        }
+    }
+
+    switch (name) {
+        case MP_FUNCTION_LN:    *result = log(x);   return true;
+        case MP_FUNCTION_LOG:   *result = log10(x); return true;
+        case MP_FUNCTION_SIN:   *result = sin(x);   return true;
+        case MP_FUNCTION_COS:   *result = cos(x);   return true;
+        case MP_FUNCTION_TAN:   *result = tan(x);   return true;
+        case MP_FUNCTION_SQRT:  *result = sqrt(x);  return true;
+
+        case MP_FUNCTION_MIN:   *result = mp_min(x, args[1]); return true;
+        case MP_FUNCTION_MAX:   *result = mp_max(x, args[1]); return true;
+        case MP_FUNCTION_ATAN2: *result = atan2(x, args[1]);  return true;
+        case MP_FUNCTION_HYPOT: *result = hypot(x, args[1]);  return true;
+
+        case MP_FUNCTION_POW: {
+            *result = pow(x, args[1]);
+            return true;
+        } break;
+
+        case MP_FUNCTION_FMA: {
+            *result = fma(x, args[1], args[2]);
+            return true;
+        } break;
+
+        case MP_FUNCTION_CLAMP: {
+            *result = mp_min(mp_max(x, args[1]), args[2]);
+            return true;
+        } break;
+
+        default:                return false;
+    }
+}
+
+double mp_logic_apply(MP_Node_Type type, double a, double b)
+{
+    switch (type) {
+        case MP_NODE_LESS:          return a < b;
+        case MP_NODE_LESS_EQUAL:    return a <= b;
+        case MP_NODE_GREATER:       return a > b;
+        case MP_NODE_GREATER_EQUAL: return a >= b;
+        case MP_NODE_EQUAL:         return a == b;
+        case MP_NODE_NOT_EQUAL:     return a != b;
+        case MP_NODE_AND:           return a != 0.0 && b != 0.0;
+        case MP_NODE_OR:            return a != 0.0 || b != 0.0;
+        default: assert(false && "Unreachable MP_Node_Type"); return 0.0;
+    }
+}
+
+MP_Interpreter mp_interpreter_init(MP_Parse_Tree tree, MP_Arena arena)
+{
+    MP_Interpreter intpr = {0};
+    intpr.tree = tree;
+    intpr.arena = arena;
+
+    return intpr;
+}
+
+void mp_interpreter_var(MP_Interpreter *interpreter, char var, double value)
+{
+    if (interpreter == NULL)
         return;
 
     assert('a' <= var && var <= 'z');
-    vm->vars[var - 'a'] = value;
+    interpreter->vars[var - 'a'] = value;
+}
+
+void mp_interpreter_free(MP_Interpreter *interpreter)
+{
+    mp_arena_free(&interpreter->arena);
+    mp_da_free(&interpreter->frames);
+    mp_da_free(&interpreter->values);
+}
+
+// Turns node into a number if its operands are numbers, they must have been
+// folded already
+MP_Tree_Node *mp_fold_node(MP_Tree_Node *node, MP_Precision precision)
+{
+    double a = 0.0;
+    double b = 0.0;
+    double value = 0.0;
+
+    switch (node->type) {
+        case MP_NODE_FUNCTION: {
+            size_t arity = mp_function_arity(node->function.name);
+            if (arity == 0 || !mp_function_pure(node->function.name)) return node;
+
+            double args[MP_FUNCTION_MAX_ARITY];
+            MP_Tree_Node *arg = node->function.arg;
+            for (size_t i = 0; i < arity; ++i) {
+                bool last = i + 1 == arity;
+                MP_Tree_Node *n = last ? arg : arg->binop.lhs;
+                if (n->type != MP_NODE_NUMBER) return node;
+                args[i] = n->value;
+                if (!last) arg = arg->binop.rhs;
+            }
+
+            if (!mp_function_apply(node->function.name, args, precision,
+                                   &value)) return node;
+        } break;
+
+        case MP_NODE_PLUS: {
+            return node->unary.node;
+        } break;
+
+        case MP_NODE_MINUS: {
+            if (node->unary.node->type != MP_NODE_NUMBER) return node;
+            value = -node->unary.node->value;
+        } break;
+
+        case MP_NODE_POWI: {
+            if (node->powi.base->type != MP_NODE_NUMBER) return node;
+            value = mp_powi(node->powi.base->value, node->powi.exponent);
+        } break;
+
+        case MP_NODE_ADD:
+        case MP_NODE_SUBTRACT:
+        case MP_NODE_MULTIPLY:
+        case MP_NODE_DIVIDE:
+        case MP_NODE_POWER: {
+            if (node->binop.lhs->type != MP_NODE_NUMBER
+                    || node->binop.rhs->type != MP_NODE_NUMBER) return node;
+            a = node->binop.lhs->value;
+            b = node->binop.rhs->value;
+
+            switch (node->type) {
+                case MP_NODE_ADD:      value = a + b; break;
+                case MP_NODE_SUBTRACT: value = a - b; break;
+                case MP_NODE_MULTIPLY: value = a * b; break;
+                case MP_NODE_POWER:    value = pow(a, b); break;
+                default: {
+                    if (b == 0.0) return node;
+                    value = a / b;
+                } break;
+            }
+        } break;
+
+        case MP_NODE_LESS:
+        case MP_NODE_LESS_EQUAL:
+        case MP_NODE_GREATER:
+        case MP_NODE_GREATER_EQUAL:
+        case MP_NODE_EQUAL:
+        case MP_NODE_NOT_EQUAL:
+        case MP_NODE_AND:
+        case MP_NODE_OR: {
+            if (node->binop.lhs->type != MP_NODE_NUMBER) return node;
+            a = node->binop.lhs->value;
+
+            // 0 && b and 1 || b don't depend on b
+            if (node->type == MP_NODE_AND && a == 0.0) {
+                value = 0.0;
+                break;
+            }
+            if (node->type == MP_NODE_OR && a != 0.0) {
+                value = 1.0;
+                break;
+            }
+
+            if (node->binop.rhs->type != MP_NODE_NUMBER) return node;
+            value = mp_logic_apply(node->type, a, node->binop.rhs->value);
+        } break;
+
+        case MP_NODE_SELECT: {
+            if (node->binop.lhs->type != MP_NODE_NUMBER) return node;
+            MP_Tree_Node *branches = node->binop.rhs;
+            return node->binop.lhs->value != 0.0
+                ? branches->binop.lhs : branches->binop.rhs;
+        } break;
+
+        default: {
+            return node;
+        } break;
+    }
+
+    // The node is reused, its operands are left unreachable in the arena
+    node->type = MP_NODE_NUMBER;
+    node->value = value;
+    return node;
+}
+
+// The operands are specialized before the node, which is then folded into the
+// slot that held it
+MP_Tree_Node *mp_specialize_node(MP_Tree_Node *node, uint32_t frozen,
+                                 const double vars[26], MP_Precision precision)
+{
+    MP_Tree_Stack stack = {0};
+    MP_Tree_Node *root = node;
+
+    if (root != NULL) {
+        mp_tree_push(&stack, root, &root, 0);
+    }
+
+    while (stack.count > 0) {
+        MP_Tree_Frame *frame = &stack.items[stack.count - 1];
+        MP_Tree_Node *n = frame->node;
+
+        if (n->type == MP_NODE_SYMBOL) {
+            assert('a' <= n->symbol && n->symbol <= 'z');
+            if (frozen & (1u << (n->symbol - 'a'))) {
+                double value = vars[n->symbol - 'a'];
+                n->type = MP_NODE_NUMBER;
+                n->value = value;
+            }
+            --stack.count;
+            continue;
+        }
+
+        MP_Tree_Node **operands[2];
+        size_t count = mp_tree_operands(n, operands);
+        if (frame->state < count) {
+            MP_Tree_Node **operand = operands[frame->state++];
+            mp_tree_push(&stack, *operand, operand, 0);
+            continue;
+        }
+
+        --stack.count;
+        if (count > 0) {
+            *frame->slot = mp_fold_node(n, precision);
+        }
+    }
+
+    mp_da_free(&stack);
+    return root;
+}
+
+void mp_specialize_tree(MP_Parse_Tree *tree, uint32_t frozen,
+                        const double vars[26], MP_Precision precision)
+{
+    if (tree == NULL)
+        return;
+
+    tree->root = mp_specialize_node(tree->root, frozen, vars, precision);
+}
+
+//-------------
+// Incremental
+//-------------
+
+// Appends the subtree of node after its operands, returns its index. last is
+// the index of the subtree appended last, the one of the left operand of a
+// binary node is kept in its frame while the right one is appended. The frames
+// go on stack, which is left empty.
+static uint32_t mp_incremental_push_with(MP_Incremental *incremental,
+                                         MP_Tree_Node *node, MP_Tree_Stack *stack)
+{
+    MP_Incremental_Nodes *nodes = &incremental->nodes;
+    uint32_t last = 0;
+
+    mp_tree_push(stack, node, NULL, 0);
+
+    while (stack->count > 0) {
+        MP_Tree_Frame *frame = &stack->items[stack->count - 1];
+        MP_Tree_Node *t = frame->node;
+        MP_Tree_Node **operands[2];
+        size_t count = t != NULL ? mp_tree_operands(t, operands) : 0;
+
+        if (frame->state < count) {
+            if (frame->state == 1) frame->first = last;
+            MP_Tree_Node *operand = *operands[frame->state++];
+            mp_tree_push(stack, operand, NULL, 0);
+            continue;
+        }
+        --stack->count;
+
+        // A plus is its operand
+        if (t != NULL && t->type == MP_NODE_PLUS)
+            continue;
+
+        MP_Incremental_Node n = {0};
+        n.type = t != NULL ? t->type : MP_NODE_INVALID;
+
+        switch (n.type) {
+            case MP_NODE_NUMBER: {
+                n.number = t->value;
+            } break;
+
+            case MP_NODE_SYMBOL: {
+                assert('a' <= t->symbol && t->symbol <= 'z');
+                n.symbol = t->symbol;
+                n.deps = 1u << (t->symbol - 'a');
+            } break;
+
+            case MP_NODE_FUNCTION: {
+                n.lhs = last;
+                n.function = t->function.name;
+                if (!mp_function_pure(n.function)) n.deps = MP_INCREMENTAL_IMPURE;
+            } break;
+
+            case MP_NODE_MINUS: {
+                n.lhs = last;
+            } break;
+
+            case MP_NODE_POWI: {
+                n.lhs = last;
+                n.exponent = t->powi.exponent;
+            } break;
+
+            case MP_NODE_REFERENCE: {
+                // Fails on evaluation, like in the interpreter
+            } break;
+
+            case MP_NODE_ADD:
+            case MP_NODE_SUBTRACT:
+            case MP_NODE_MULTIPLY:
+            case MP_NODE_DIVIDE:
+            case MP_NODE_POWER:
+            case MP_NODE_LESS:
+            case MP_NODE_LESS_EQUAL:
+            case MP_NODE_GREATER:
+            case MP_NODE_GREATER_EQUAL:
+            case MP_NODE_EQUAL:
+            case MP_NODE_NOT_EQUAL:
+            case MP_NODE_AND:
+            case MP_NODE_OR:
+            case MP_NODE_SELECT:
+            case MP_NODE_ARGUMENTS:
+            case MP_NODE_BRANCHES: {
+                n.lhs = frame->first;
+                n.rhs = last;
+                n.deps = nodes->items[n.rhs].deps;
+            } break;
+
+            default: {
+                n.type = MP_NODE_INVALID;
+            } break;
+        }
+
+        if (n.type != MP_NODE_NUMBER && n.type != MP_NODE_SYMBOL
+                && n.type != MP_NODE_REFERENCE && n.type != MP_NODE_INVALID) {
+            n.deps |= nodes->items[n.lhs].deps;
+        }
+
+        mp_da_append(nodes, n);
+        last = nodes->count - 1;
+    }
+
+    return last;
+}
+
+// Replaces the nodes with the ones of tree, keeping the capacity. The values
+// are computed again on the next evaluation. The passes over the tree keep
+// their frames on stack.
+static void mp_incremental_build_with(MP_Incremental *incremental,
+                                      MP_Parse_Tree tree, MP_Tree_Stack *stack)
+{
+    MP_Incremental_Nodes *nodes = &incremental->nodes;
+    mp_da_reset(nodes);
+    incremental->valid = false;
+
+    size_t count = mp_tree_node_count_with(tree.root, stack);
+    if (count > nodes->capacity) {
+        nodes->items = mp_allocator_realloc(nodes->allocator, nodes->items,
+                                            nodes->capacity * sizeof(*nodes->items),
+                                            count * sizeof(*nodes->items));
+        assert(nodes->items != NULL && "Buy more RAM LOL");
+        nodes->capacity = count;
+    }
+
+    if (tree.root != NULL) {
+        mp_incremental_push_with(incremental, tree.root, stack);
+    }
+}
+
+void mp_incremental_build(MP_Incremental *incremental, MP_Parse_Tree tree)
+{
+    MP_Tree_Stack stack = {0};
+    stack.allocator = incremental->nodes.allocator;
+    mp_incremental_build_with(incremental, tree, &stack);
+    mp_da_free(&stack);
+}
+
+uint32_t mp_incremental_push(MP_Incremental *incremental, MP_Tree_Node *node)
+{
+    MP_Tree_Stack stack = {0};
+    stack.allocator = incremental->nodes.allocator;
+    uint32_t last = mp_incremental_push_with(incremental, node, &stack);
+    mp_da_free(&stack);
+    return last;
+}
+
+void mp_incremental_var(MP_Incremental *incremental, char var, double value)
+{
+    if (incremental == NULL)
+        return;
+
+    assert('a' <= var && var <= 'z');
+    double *v = &incremental->vars[var - 'a'];
+
+    // Compared bitwise so that setting a NaN again doesn't dirty anything
+    if (memcmp(v, &value, sizeof(value)) != 0) {
+        *v = value;
+        incremental->dirty |= 1u << (var - 'a');
+    }
+}
+
+MP_Result mp_incremental_evaluate(MP_Incremental *incremental)
+{
+    MP_Result result = {0};
+    if (incremental == NULL) {
+        result.error = true;
+        return result;
+    }
+
+    MP_Incremental_Nodes *nodes = &incremental->nodes;
+    if (nodes->count == 0) {
+        result.error = true;
+        result.error_type = MP_ERROR_EMPTY_EXPRESSION;
+        return result;
+    }
+
+    bool valid = incremental->valid;
+    uint32_t dirty = incremental->dirty | MP_INCREMENTAL_IMPURE;
+    size_t computed = 0;
+
+    for (size_t i = 0; i < nodes->count; ++i) {
+        MP_Incremental_Node *n = &nodes->items[i];
+        if (valid && (n->deps & dirty) == 0)
+            continue;
+
+        const MP_Incremental_Node *l = &nodes->items[n->lhs];
+        const MP_Incremental_Node *r = &nodes->items[n->rhs];
+        double a = l->value;
+        double b = r->value;
+
+        // The error of the operand the interpreter evaluates first
+        uint8_t lr = l->error != MP_ERROR_OK ? l->error : r->error;
+        uint8_t rl = r->error != MP_ERROR_OK ? r->error : l->error;
+        n->error = MP_ERROR_OK;
+
+        switch (n->type) {
+            case MP_NODE_NUMBER:   n->value = n->number; break;
+            case MP_NODE_SYMBOL:   n->value = incremental->vars[n->symbol - 'a']; break;
+            case MP_NODE_MINUS:    n->value = -a;    n->error = l->error; break;
+            case MP_NODE_ADD:      n->value = a + b; n->error = lr; break;
+            case MP_NODE_SUBTRACT: n->value = a - b; n->error = lr; break;
+            case MP_NODE_MULTIPLY: n->value = a * b; n->error = lr; break;
+            case MP_NODE_BRANCHES: n->value = 0.0;   break; // Read by the select
+
+            // Only the programs of a formula graph can read other formulas
+            case MP_NODE_REFERENCE: {
+                n->value = 0.0;
+                n->error = MP_ERROR_UNKNOWN_REFERENCE;
+            } break;
+
+            // Read by the function, with the error of its first argument
+            case MP_NODE_ARGUMENTS: n->value = 0.0; n->error = lr; break;
+
+            case MP_NODE_POWI: {
+                n->value = mp_powi(a, n->exponent);
+                n->error = l->error;
+            } break;
+
+            case MP_NODE_POWER: {
+                n->value = pow(a, b);
+                n->error = rl;
+            } break;
+
+            case MP_NODE_DIVIDE: {
+                n->value = a / b;
+#ifdef MP_IEEE
+                n->error = rl;
+#else
+                n->error = r->error != MP_ERROR_OK ? r->error
+                         : b == 0.0 ? MP_ERROR_ZERO_DIVISION : l->error;
+#endif
+            } break;
+
+            case MP_NODE_FUNCTION: {
+                double args[MP_FUNCTION_MAX_ARITY];
+                size_t count = 0;
+                const MP_Incremental_Node *arg = l;
+                for (;;) {
+                    bool last = arg->type != MP_NODE_ARGUMENTS;
+                    if (count < MP_FUNCTION_MAX_ARITY) {
+                        args[count] = last ? arg->value
+                                           : nodes->items[arg->lhs].value;
+                    }
+                    ++count;
+                    if (last) break;
+                    arg = &nodes->items[arg->rhs];
+                }
+
+                n->error = l->error;
+                if ((count != mp_function_arity(n->function)
+                        || !mp_function_apply(n->function, args,
+                                              incremental->precision, &n->value))
+                        && n->error == MP_ERROR_OK) {
+                    n->error = MP_ERROR_INVALID_FUNCTION;
+                }
+            } break;
+
+            case MP_NODE_LESS:
+            case MP_NODE_LESS_EQUAL:
+            case MP_NODE_GREATER:
+            case MP_NODE_GREATER_EQUAL:
+            case MP_NODE_EQUAL:
+            case MP_NODE_NOT_EQUAL: {
+                n->value = mp_logic_apply(n->type, a, b);
+                n->error = lr;
+            } break;
+
+            case MP_NODE_AND:
+            case MP_NODE_OR: {
+                bool decided = (a != 0.0) == (n->type == MP_NODE_OR);
+                n->value = mp_logic_apply(n->type, a, b);
+                n->error = l->error != MP_ERROR_OK || !decided ? lr : MP_ERROR_OK;
+            } break;
+
+            case MP_NODE_SELECT: {
+                const MP_Incremental_Node *taken =
+                    &nodes->items[a != 0.0 ? r->lhs : r->rhs];
+                n->value = taken->value;
+                n->error = l->error != MP_ERROR_OK ? l->error : taken->error;
+            } break;
+
+            default: {
+                n->error = MP_ERROR_INVALID_NODE;
+            } break;
+        }
+
+        ++computed;
+    }
+
+    incremental->valid = true;
+    incremental->dirty = 0;
+    incremental->computed = computed;
+
+    const MP_Incremental_Node *root = &nodes->items[nodes->count - 1];
+    if (root->error != MP_ERROR_OK) {
+        result.error = true;
+        result.error_type = root->error;
+        return result;
+    }
+
+    result.value = root->value;
+    return result;
+}
+
+void mp_incremental_free(MP_Incremental *incremental)
+{
+    if (incremental == NULL)
+        return;
+
+    mp_da_free(&incremental->nodes);
+}
+
+// Rebuilds the tree the nodes were made from
+bool mp_incremental_tree(MP_Arena *a, MP_Parse_Tree *tree,
+                         const MP_Incremental *incremental)
+{
+    const MP_Incremental_Nodes *nodes = &incremental->nodes;
+    if (nodes->count == 0)
+        return false;
+
+    MP_Tree_Node **built = mp_arena_alloc(a, nodes->count * sizeof(*built));
+
+    for (size_t i = 0; i < nodes->count; ++i) {
+        const MP_Incremental_Node *n = &nodes->items[i];
+        MP_Tree_Node *r = mp_arena_alloc(a, sizeof(*r));
+        r->type = n->type;
+
+        switch (n->type) {
+            case MP_NODE_NUMBER:   r->value = n->number; break;
+            case MP_NODE_SYMBOL:   r->symbol = n->symbol; break;
+            case MP_NODE_MINUS:    r->unary.node = built[n->lhs]; break;
+
+            case MP_NODE_FUNCTION: {
+                r->function.name = n->function;
+                r->function.arg = built[n->lhs];
+            } break;
+
+            case MP_NODE_POWI: {
+                r->powi.base = built[n->lhs];
+                r->powi.exponent = n->exponent;
+            } break;
+
+            case MP_NODE_ADD:
+            case MP_NODE_SUBTRACT:
+            case MP_NODE_MULTIPLY:
+            case MP_NODE_DIVIDE:
+            case MP_NODE_POWER:
+            case MP_NODE_LESS:
+            case MP_NODE_LESS_EQUAL:
+            case MP_NODE_GREATER:
+            case MP_NODE_GREATER_EQUAL:
+            case MP_NODE_EQUAL:
+            case MP_NODE_NOT_EQUAL:
+            case MP_NODE_AND:
+            case MP_NODE_OR:
+            case MP_NODE_SELECT:
+            case MP_NODE_ARGUMENTS:
+            case MP_NODE_BRANCHES: {
+                r->binop.lhs = built[n->lhs];
+                r->binop.rhs = built[n->rhs];
+            } break;
+
+            default: {
+                return false;
+            } break;
+        }
+
+        built[i] = r;
+    }
+
+    tree->root = built[nodes->count - 1];
+    return true;
+}
+
+//----------
+// Compiler
+//----------
+
+// The opcode of a binary node
+MP_Opcode mp_node_opcode(MP_Node_Type type)
+{
+    switch (type) {
+        case MP_NODE_ADD:           return MP_OP_ADD;
+        case MP_NODE_SUBTRACT:      return MP_OP_SUB;
+        case MP_NODE_MULTIPLY:      return MP_OP_MUL;
+        case MP_NODE_DIVIDE:        return MP_OP_DIV;
+        case MP_NODE_POWER:         return MP_OP_POW;
+        case MP_NODE_LESS:          return MP_OP_LT;
+        case MP_NODE_LESS_EQUAL:    return MP_OP_LE;
+        case MP_NODE_GREATER:       return MP_OP_GT;
+        case MP_NODE_GREATER_EQUAL: return MP_OP_GE;
+        case MP_NODE_EQUAL:         return MP_OP_EQ;
+        case MP_NODE_NOT_EQUAL:     return MP_OP_NE;
+        case MP_NODE_AND:           return MP_OP_AND;
+        case MP_NODE_OR:            return MP_OP_OR;
+        default:                    return MP_OP_INVALID;
+    }
+}
+
+bool mp_program_compile(MP_Program *p, MP_Parse_Tree parse_tree)
+{
+    if (p == NULL)
+        return false;
+
+    return mp_program_compile_node(p, parse_tree.root);
+}
+
+static bool mp_program_small_int(double value)
+{
+    return value >= INT8_MIN && value <= INT8_MAX && value == (int8_t)value
+        && !(value == 0.0 && signbit(value));
+}
+
+// Whether mp_program_emit_const_op has a form for the constant value: the small
+// integers, and the constants that have no short push
+static bool mp_program_has_const_op(double value)
+{
+    return mp_program_small_int(value)
+        || !((double)(float)value == value || isnan(value));
+}
+
+// A node is compiled after its operands, frame.state counts the operands
+// compiled so far. The frames go on stack, which is left empty.
+static bool mp_program_compile_with(MP_Program *p, MP_Tree_Node *node,
+                                    MP_Tree_Stack *stack)
+{
+    bool ok = true;
+
+    mp_tree_push(stack, node, NULL, 0);
+
+    while (ok && stack->count > 0) {
+        MP_Tree_Frame *frame = &stack->items[stack->count - 1];
+        MP_Tree_Node *n = frame->node;
+        uint32_t state = frame->state++;
+
+        // The operand to compile before going on with n, if descend
+        MP_Tree_Node *next = NULL;
+        bool descend = false;
+
+        if (n == NULL) {
+            ok = false;
+            break;
+        }
+
+        switch (n->type) {
+            case MP_NODE_NUMBER: {
+                mp_program_emit_number(p, n->value);
+            } break;
+
+            case MP_NODE_SYMBOL: {
+                assert('a' <= n->symbol && n->symbol <= 'z');
+                mp_program_emit_var(p, n->symbol - 'a');
+            } break;
+
+            case MP_NODE_REFERENCE: {
+                if (n->reference.slot == MP_REFERENCE_UNRESOLVED) {
+                    ok = false;
+                    break;
+                }
+                mp_program_push_opcode(p, MP_OP_LOAD);
+                mp_program_push_slot(p, n->reference.slot);
+            } break;
+
+            case MP_NODE_FUNCTION: {
+                if (n->function.name == MP_FUNCTION_INVALID) {
+                    ok = false;
+                } else if (state == 0) {
+                    next = n->function.arg;
+                    descend = true;
+                } else {
+                    mp_program_push_opcode(p, MP_OP_FUNC);
+                    mp_program_push_function(p, n->function.name);
+                }
+            } break;
+
+            case MP_NODE_ADD:
+            case MP_NODE_SUBTRACT:
+            case MP_NODE_MULTIPLY:
+            case MP_NODE_DIVIDE:
+            case MP_NODE_POWER:
+            case MP_NODE_LESS:
+            case MP_NODE_LESS_EQUAL:
+            case MP_NODE_GREATER:
+            case MP_NODE_GREATER_EQUAL:
+            case MP_NODE_EQUAL:
+            case MP_NODE_NOT_EQUAL:
+            case MP_NODE_AND:
+            case MP_NODE_OR: {
+                MP_Opcode op = mp_node_opcode(n->type);
+                MP_Tree_Node *lhs = n->binop.lhs;
+                MP_Tree_Node *rhs = n->binop.rhs;
+
+                // + and * commute, a constant on the left is moved to the
+                // right where it fits in the opcode: 3*x is x MUL_INT 3
+                if ((op == MP_OP_ADD || op == MP_OP_MUL)
+                        && lhs != NULL && lhs->type == MP_NODE_NUMBER
+                        && rhs != NULL && rhs->type != MP_NODE_NUMBER
+                        && mp_program_has_const_op(lhs->value)) {
+                    lhs = n->binop.rhs;
+                    rhs = n->binop.lhs;
+                }
+
+                if (state == 0) {
+                    next = lhs;
+                    descend = true;
+                } else if (state == 1) {
+                    if (rhs != NULL && rhs->type == MP_NODE_SYMBOL
+                            && mp_program_emit_var_op(p, op, rhs->symbol - 'a'))
+                        break;
+                    if (rhs != NULL && rhs->type == MP_NODE_NUMBER
+                            && mp_program_emit_const_op(p, op, rhs->value))
+                        break;
+                    next = rhs;
+                    descend = true;
+                } else {
+                    mp_program_push_opcode(p, op);
+                }
+            } break;
+
+            // The arguments of a function are pushed in order
+            case MP_NODE_ARGUMENTS: {
+                if (state < 2) {
+                    next = state == 0 ? n->binop.lhs : n->binop.rhs;
+                    descend = true;
+                }
+            } break;
+
+            // Both branches are computed and the select picks one, without a
+            // jump
+            case MP_NODE_SELECT: {
+                MP_Tree_Node *branches = n->binop.rhs;
+                if (branches == NULL || branches->type != MP_NODE_BRANCHES) {
+                    ok = false;
+                } else if (state < 3) {
+                    next = state == 0 ? n->binop.lhs
+                         : state == 1 ? branches->binop.lhs : branches->binop.rhs;
+                    descend = true;
+                } else {
+                    mp_program_push_opcode(p, MP_OP_SELECT);
+                }
+            } break;
+
+            case MP_NODE_POWI: {
+                if (state == 0) {
+                    next = n->powi.base;
+                    descend = true;
+                } else {
+                    mp_program_push_opcode(p, MP_OP_POWI);
+                    mp_program_push_int(p, n->powi.exponent);
+                }
+            } break;
+
+            case MP_NODE_PLUS:
+            case MP_NODE_MINUS: {
+                if (state == 0) {
+                    next = n->unary.node;
+                    descend = true;
+                } else if (n->type == MP_NODE_MINUS) {
+                    mp_program_push_opcode(p, MP_OP_NEG);
+                }
+            } break;
+
+            default: {
+                ok = false;
+            } break;
+        }
+
+        if (descend) {
+            mp_tree_push(stack, next, NULL, 0);
+        } else {
+            --stack->count;
+        }
+    }
+
+    stack->count = 0;
+    return ok;
+}
+
+bool mp_program_compile_node(MP_Program *p, MP_Tree_Node *node)
+{
+    MP_Tree_Stack stack = {0};
+    stack.allocator = p->allocator;
+    bool ok = mp_program_compile_with(p, node, &stack);
+    mp_da_free(&stack);
+    return ok;
+}
+
+void mp_program_push_opcode(MP_Program *p, MP_Opcode op)
+{
+    if (p == NULL)
+        return;
+
+    mp_da_append(p, op);
+}
+
+void mp_program_push_const(MP_Program *p, double value)
+{
+    if (p == NULL)
+        return;
+
+    for (size_t i = 0; i < sizeof(value); ++i) {
+        mp_da_append(p, 0);
+    }
+    memcpy(p->items + p->count - sizeof(value), &value, sizeof(value));
+}
+
+void mp_program_push_var(MP_Program *p, char var)
+{
+    if (p == NULL)
+        return;
+
+    mp_da_append(p, var);
+}
+
+// Pushes value with the shortest encoding that holds it exactly
+void mp_program_emit_number(MP_Program *p, double value)
+{
+    if (p == NULL)
+        return;
+
+    if (mp_program_small_int(value)) {
+        mp_program_push_opcode(p, MP_OP_PUSH_INT);
+        mp_da_append(p, (uint8_t)(int8_t)value);
+
+    } else if ((double)(float)value == value || isnan(value)) {
+        float f = (float)value;
+        mp_program_push_opcode(p, MP_OP_PUSH_FLOAT);
+        for (size_t i = 0; i < sizeof(f); ++i) {
+            mp_da_append(p, ((uint8_t*)&f)[i]);
+        }
+
+    } else {
+        mp_program_push_opcode(p, MP_OP_PUSH_NUM);
+        mp_program_push_const(p, value);
+    }
+}
+
+void mp_program_emit_var(MP_Program *p, char var)
+{
+    assert(0 <= var && var < 26);
+    mp_program_push_opcode(p, MP_OP_PUSH_VAR_A + var);
+}
+
+// Emits op with a variable as its right operand, returns false if op has no
+// such form
+bool mp_program_emit_var_op(MP_Program *p, MP_Opcode op, char var)
+{
+    switch (op) {
+        case MP_OP_ADD: mp_program_push_opcode(p, MP_OP_ADD_VAR); break;
+        case MP_OP_SUB: mp_program_push_opcode(p, MP_OP_SUB_VAR); break;
+        case MP_OP_MUL: mp_program_push_opcode(p, MP_OP_MUL_VAR); break;
+        case MP_OP_DIV: mp_program_push_opcode(p, MP_OP_DIV_VAR); break;
+        default:        return false;
+    }
+
+    mp_program_push_var(p, var);
+    return true;
+}
+
+// Emits op with a constant as its right operand, in one byte for the small
+// integers. The other constants that have a short push are left to
+// mp_program_emit_number, false is returned for them.
+bool mp_program_emit_const_op(MP_Program *p, MP_Opcode op, double value)
+{
+    if (!mp_program_has_const_op(value))
+        return false;
+    if (op < MP_OP_ADD || op > MP_OP_DIV)
+        return false;
+
+    if (mp_program_small_int(value)) {
+        mp_program_push_opcode(p, MP_OP_ADD_INT + (op - MP_OP_ADD));
+        mp_da_append(p, (uint8_t)(int8_t)value);
+    } else {
+        mp_program_push_opcode(p, MP_OP_ADD_CONST + (op - MP_OP_ADD));
+        mp_program_push_const(p, value);
+    }
+    return true;
+}
+
+void mp_program_push_function(MP_Program *p, MP_Function name)
+{
+    if (p == NULL)
+        return;
+
+    mp_da_append(p, name);
+}
+
+void mp_program_push_slot(MP_Program *p, uint32_t slot)
+{
+    if (p == NULL)
+        return;
+
+    for (size_t i = 0; i < sizeof(slot); ++i) {
+        mp_da_append(p, 0);
+    }
+    memcpy(p->items + p->count - sizeof(slot), &slot, sizeof(slot));
+}
+
+void mp_program_push_int(MP_Program *p, int32_t n)
+{
+    if (p == NULL)
+        return;
+
+    for (size_t i = 0; i < sizeof(n); ++i) {
+        mp_da_append(p, 0);
+    }
+    memcpy(p->items + p->count - sizeof(n), &n, sizeof(n));
+}
+
+size_t mp_opcode_operand_size(MP_Opcode op)
+{
+    switch (op) {
+        case MP_OP_PUSH_NUM: return sizeof(double);
+        case MP_OP_PUSH_VAR: return sizeof(char);
+        case MP_OP_FUNC:     return sizeof(uint8_t);
+        case MP_OP_STORE:
+        case MP_OP_LOAD:     return sizeof(uint32_t);
+        case MP_OP_POWI:     return sizeof(int32_t);
+        case MP_OP_PUSH_INT:   return sizeof(int8_t);
+        case MP_OP_PUSH_FLOAT: return sizeof(float);
+        case MP_OP_ADD_VAR:
+        case MP_OP_SUB_VAR:
+        case MP_OP_MUL_VAR:
+        case MP_OP_DIV_VAR:    return sizeof(char);
+        case MP_OP_ADD_CONST:
+        case MP_OP_SUB_CONST:
+        case MP_OP_MUL_CONST:
+        case MP_OP_DIV_CONST:  return sizeof(double);
+        case MP_OP_ADD_INT:
+        case MP_OP_SUB_INT:
+        case MP_OP_MUL_INT:
+        case MP_OP_DIV_INT:    return sizeof(int8_t);
+        default:               return 0;
+    }
+}
+
+// ADD for ADD_VAR, ADD_CONST and ADD_INT, and so on up to DIV
+static MP_Opcode mp_opcode_plain(MP_Opcode op)
+{
+    if (MP_OP_ADD_VAR <= op && op <= MP_OP_DIV_VAR)
+        return MP_OP_ADD + (op - MP_OP_ADD_VAR);
+    if (MP_OP_ADD_CONST <= op && op <= MP_OP_DIV_CONST)
+        return MP_OP_ADD + (op - MP_OP_ADD_CONST);
+    if (MP_OP_ADD_INT <= op && op <= MP_OP_DIV_INT)
+        return MP_OP_ADD + (op - MP_OP_ADD_INT);
+    return op;
+}
+
+// The constant of an ADD_CONST to DIV_INT opcode, whose operand is at operand
+static double mp_opcode_constant(MP_Opcode op, const uint8_t *operand)
+{
+    if (MP_OP_ADD_INT <= op && op <= MP_OP_DIV_INT)
+        return (int8_t)*operand;
+
+    double value;
+    memcpy(&value, operand, sizeof(value));
+    return value;
+}
+
+// Maximum number of values on the stack while running p, the number left at
+// the end goes to end_depth if not NULL
+static size_t mp_program_depth(MP_Program p, size_t *end_depth)
+{
+    size_t depth = 0;
+    size_t max_depth = 0;
+
+    for (size_t i = 0; i < p.count; i += 1 + mp_opcode_operand_size(p.items[i])) {
+        MP_Opcode op = p.items[i];
+        if (MP_OP_PUSH_VAR_A <= op && op <= MP_OP_PUSH_VAR_Z)
+            op = MP_OP_PUSH_VAR;
+
+        switch (op) {
+            case MP_OP_PUSH_NUM:
+            case MP_OP_PUSH_VAR:
+            case MP_OP_PUSH_INT:
+            case MP_OP_PUSH_FLOAT:
+            case MP_OP_LOAD: {
+                ++depth;
+            } break;
+
+            case MP_OP_ADD:
+            case MP_OP_SUB:
+            case MP_OP_MUL:
+            case MP_OP_DIV:
+            case MP_OP_POW:
+            case MP_OP_LT:
+            case MP_OP_LE:
+            case MP_OP_GT:
+            case MP_OP_GE:
+            case MP_OP_EQ:
+            case MP_OP_NE:
+            case MP_OP_AND:
+            case MP_OP_OR:
+            case MP_OP_POP: {
+                if (depth > 0) --depth;
+            } break;
+
+            case MP_OP_SELECT: {
+                depth = depth > 2 ? depth - 2 : 0;
+            } break;
+
+            case MP_OP_FUNC: {
+                size_t arity = 1;
+                if (i + 1 < p.count) arity = mp_function_arity(p.items[i + 1]);
+                depth = depth > arity ? depth - arity + 1 : 1;
+            } break;
+
+            default: break;
+        }
+
+        if (depth > max_depth) max_depth = depth;
+    }
+
+    if (end_depth != NULL) *end_depth = depth;
+    return max_depth;
+}
+
+// Maximum number of values on the stack while running p
+size_t mp_program_stack_size(MP_Program p)
+{
+    return mp_program_depth(p, NULL);
+}
+
+// Checks that p can be run without any of the checks of mp_vm_run: opcodes are
+// valid, operands are within the program, variables, functions and slots
+// exist, and the stack never underflows. The maximum depth of the stack is
+// returned in stack_size.
+bool mp_program_verify(MP_Program p, size_t slot_count, size_t *stack_size)
+{
+    size_t depth = 0;
+    size_t max_depth = 0;
+
+    for (size_t i = 0; i < p.count;) {
+        MP_Opcode op = p.items[i];
+        if (op <= MP_OP_INVALID || op >= MP_OP_COUNT)
+            return false;
+
+        size_t operand = i + 1;
+        if (operand + mp_opcode_operand_size(op) > p.count)
+            return false;
+
+        if (MP_OP_PUSH_VAR_A <= op && op <= MP_OP_PUSH_VAR_Z) {
+            if (++depth > max_depth) max_depth = depth;
+            ++i;
+            continue;
+        }
+
+        switch (op) {
+            case MP_OP_PUSH_NUM:
+            case MP_OP_PUSH_INT:
+            case MP_OP_PUSH_FLOAT: {
+                ++depth;
+            } break;
+
+            case MP_OP_PUSH_VAR: {
+                if ((unsigned char)p.items[operand] >= 26)
+                    return false;
+                ++depth;
+            } break;
+
+            case MP_OP_ADD_VAR:
+            case MP_OP_SUB_VAR:
+            case MP_OP_MUL_VAR:
+            case MP_OP_DIV_VAR: {
+                if ((unsigned char)p.items[operand] >= 26)
+                    return false;
+                if (depth < 1)
+                    return false;
+            } break;
+
+            case MP_OP_ADD:
+            case MP_OP_SUB:
+            case MP_OP_MUL:
+            case MP_OP_DIV:
+            case MP_OP_POW:
+            case MP_OP_LT:
+            case MP_OP_LE:
+            case MP_OP_GT:
+            case MP_OP_GE:
+            case MP_OP_EQ:
+            case MP_OP_NE:
+            case MP_OP_AND:
+            case MP_OP_OR: {
+                if (depth < 2)
+                    return false;
+                --depth;
+            } break;
+
+            case MP_OP_SELECT: {
+                if (depth < 3)
+                    return false;
+                depth -= 2;
+            } break;
+
+            case MP_OP_FUNC: {
+                MP_Function name = p.items[operand];
+                if (mp_function_arity(name) == 0)
+                    return false;
+                if (depth < mp_function_arity(name))
+                    return false;
+                depth -= mp_function_arity(name) - 1;
+            } break;
+
+            case MP_OP_STORE:
+            case MP_OP_LOAD: {
+                uint32_t slot = 0;
+                memcpy(&slot, &p.items[operand], sizeof(slot));
+                if (slot >= slot_count)
+                    return false;
+                if (op == MP_OP_STORE && depth < 1)
+                    return false;
+                if (op == MP_OP_LOAD)
+                    ++depth;
+            } break;
+
+            case MP_OP_NEG:
+            case MP_OP_POWI:
+            case MP_OP_ADD_CONST:
+            case MP_OP_SUB_CONST:
+            case MP_OP_MUL_CONST:
+            case MP_OP_DIV_CONST:
+            case MP_OP_ADD_INT:
+            case MP_OP_SUB_INT:
+            case MP_OP_MUL_INT:
+            case MP_OP_DIV_INT: {
+                if (depth < 1)
+                    return false;
+            } break;
+
+            case MP_OP_POP: {
+                if (depth < 1)
+                    return false;
+                --depth;
+            } break;
+
+            default: {
+                return false;
+            } break;
+        }
+
+        if (depth > max_depth) max_depth = depth;
+        i = operand + mp_opcode_operand_size(op);
+    }
+
+    if (stack_size != NULL) *stack_size = max_depth;
+    return true;
+}
+
+// Rebuilds the tree of a program made by mp_program_compile. Programs using
+// slots are not supported.
+bool mp_program_decompile(MP_Arena *a, MP_Parse_Tree *tree, MP_Program p)
+{
+    size_t stack_size = 0;
+    if (!mp_program_verify(p, 0, &stack_size))
+        return false;
+
+    MP_Tree_Node **stack = mp_arena_alloc(a, (stack_size + 1) * sizeof(*stack));
+    size_t depth = 0;
+
+    for (size_t i = 0; i < p.count; i += 1 + mp_opcode_operand_size(p.items[i])) {
+        MP_Opcode op = p.items[i];
+        const uint8_t *operand = &p.items[i + 1];
+
+        if (MP_OP_PUSH_VAR_A <= op && op <= MP_OP_PUSH_VAR_Z) {
+            stack[depth++] = mp_make_node_symbol(a, 'a' + (op - MP_OP_PUSH_VAR_A));
+            continue;
+        }
+
+        MP_Node_Type type = MP_NODE_INVALID;
+        MP_Tree_Node *rhs = NULL;
+
+        switch (op) {
+            case MP_OP_PUSH_NUM: {
+                double value;
+                memcpy(&value, operand, sizeof(value));
+                stack[depth++] = mp_make_node(a, MP_NODE_NUMBER, value);
+            } break;
+
+            case MP_OP_PUSH_INT: {
+                stack[depth++] = mp_make_node(a, MP_NODE_NUMBER, (int8_t)*operand);
+            } break;
+
+            case MP_OP_PUSH_FLOAT: {
+                float value;
+                memcpy(&value, operand, sizeof(value));
+                stack[depth++] = mp_make_node(a, MP_NODE_NUMBER, value);
+            } break;
+
+            case MP_OP_PUSH_VAR: {
+                stack[depth++] = mp_make_node_symbol(a, 'a' + *operand);
+            } break;
+
+            case MP_OP_ADD: type = MP_NODE_ADD;      rhs = stack[--depth]; break;
+            case MP_OP_SUB: type = MP_NODE_SUBTRACT; rhs = stack[--depth]; break;
+            case MP_OP_MUL: type = MP_NODE_MULTIPLY; rhs = stack[--depth]; break;
+            case MP_OP_DIV: type = MP_NODE_DIVIDE;   rhs = stack[--depth]; break;
+            case MP_OP_POW: type = MP_NODE_POWER;    rhs = stack[--depth]; break;
+            case MP_OP_LT:  type = MP_NODE_LESS;          rhs = stack[--depth]; break;
+            case MP_OP_LE:  type = MP_NODE_LESS_EQUAL;    rhs = stack[--depth]; break;
+            case MP_OP_GT:  type = MP_NODE_GREATER;       rhs = stack[--depth]; break;
+            case MP_OP_GE:  type = MP_NODE_GREATER_EQUAL; rhs = stack[--depth]; break;
+            case MP_OP_EQ:  type = MP_NODE_EQUAL;         rhs = stack[--depth]; break;
+            case MP_OP_NE:  type = MP_NODE_NOT_EQUAL;     rhs = stack[--depth]; break;
+            case MP_OP_AND: type = MP_NODE_AND;           rhs = stack[--depth]; break;
+            case MP_OP_OR:  type = MP_NODE_OR;            rhs = stack[--depth]; break;
+
+            case MP_OP_SELECT: {
+                MP_Tree_Node *otherwise = stack[--depth];
+                MP_Tree_Node *then = stack[--depth];
+                stack[depth - 1] = mp_make_node_select(a, stack[depth - 1],
+                                                       then, otherwise);
+            } break;
+
+            case MP_OP_ADD_VAR:
+            case MP_OP_SUB_VAR:
+            case MP_OP_MUL_VAR:
+            case MP_OP_DIV_VAR: {
+                type = op == MP_OP_ADD_VAR ? MP_NODE_ADD
+                     : op == MP_OP_SUB_VAR ? MP_NODE_SUBTRACT
+                     : op == MP_OP_MUL_VAR ? MP_NODE_MULTIPLY : MP_NODE_DIVIDE;
+                rhs = mp_make_node_symbol(a, 'a' + *operand);
+            } break;
+
+            case MP_OP_ADD_CONST:
+            case MP_OP_SUB_CONST:
+            case MP_OP_MUL_CONST:
+            case MP_OP_DIV_CONST:
+            case MP_OP_ADD_INT:
+            case MP_OP_SUB_INT:
+            case MP_OP_MUL_INT:
+            case MP_OP_DIV_INT: {
+                MP_Opcode plain = mp_opcode_plain(op);
+                type = plain == MP_OP_ADD ? MP_NODE_ADD
+                     : plain == MP_OP_SUB ? MP_NODE_SUBTRACT
+                     : plain == MP_OP_MUL ? MP_NODE_MULTIPLY : MP_NODE_DIVIDE;
+                rhs = mp_make_node(a, MP_NODE_NUMBER,
+                                   mp_opcode_constant(op, operand));
+            } break;
+
+            case MP_OP_NEG: {
+                stack[depth - 1] = mp_make_node_unary(a, MP_NODE_MINUS, stack[depth - 1]);
+            } break;
+
+            case MP_OP_FUNC: {
+                size_t arity = mp_function_arity(*operand);
+                depth -= arity;
+                MP_Tree_Node *r = mp_arena_alloc(a, sizeof(*r));
+                r->type = MP_NODE_FUNCTION;
+                r->function.name = *operand;
+                r->function.arg = mp_make_node_arguments(a, &stack[depth], arity);
+                stack[depth++] = r;
+            } break;
+
+            case MP_OP_POWI: {
+                MP_Tree_Node *r = mp_arena_alloc(a, sizeof(*r));
+                r->type = MP_NODE_POWI;
+                memcpy(&r->powi.exponent, operand, sizeof(int32_t));
+                r->powi.base = stack[depth - 1];
+                stack[depth - 1] = r;
+            } break;
+
+            default: {
+                return false;
+            } break;
+        }
+
+        if (rhs != NULL) {
+            stack[depth - 1] = mp_make_node_binop(a, type, stack[depth - 1], rhs);
+        }
+    }
+
+    if (depth != 1)
+        return false;
+
+    tree->root = stack[0];
+    return true;
+}
+
+// Gives back the capacity the program grew beyond its size
+void mp_program_shrink(MP_Program *p)
+{
+    if (p == NULL || p->count == p->capacity || p->count == 0)
+        return;
+
+    p->items = mp_allocator_realloc(p->allocator, p->items,
+                                    p->capacity * sizeof(*p->items),
+                                    p->count * sizeof(*p->items));
+    assert(p->items != NULL && "Buy more RAM LOL");
+    p->capacity = p->count;
+}
+
+void mp_print_program(MP_Program p)
+{
+    size_t ip = 0;
+    for (size_t i = 0; i < p.count; ++i) {
+        MP_Opcode op = p.items[i];
+
+        switch (op) {
+            case MP_OP_PUSH_NUM: {
+                printf("%ld: PUSH_NUM ", ip++);
+                double num = 0.0;
+
+                if (i + sizeof(num) >= p.count)
+                    continue;
+
+                ++i;
+                memcpy(&num, &p.items[i], sizeof(num));
+                i += sizeof(num) - 1;
+
+                printf("%f\n", num);
+            } break;
+
+            case MP_OP_PUSH_VAR: {
+                printf("%ld: PUSH_VAR ", ip++);
+                char var = 0;
+
+                if (i + sizeof(var) >= p.count)
+                    continue;
+
+                ++i;
+                var = p.items[i] + 'a';
+                // i += sizeof(var) - 1; // Increment by 0
+
+                printf("%c\n", var);
+            } break;
+
+            case MP_OP_FUNC: {
+                printf("%ld: FUNC ", ip++);
+
+                if (i + 1 >= p.count)
+                    continue;
+
+                ++i;
+                printf("%s\n", mp_function_name_to_string(p.items[i]));
+            } break;
+
+            case MP_OP_STORE:
+            case MP_OP_LOAD: {
+                printf("%ld: %s ", ip++, op == MP_OP_STORE ? "STORE" : "LOAD");
+                uint32_t slot = 0;
+
+                if (i + sizeof(slot) >= p.count)
+                    continue;
+
+                ++i;
+                memcpy(&slot, &p.items[i], sizeof(slot));
+                i += sizeof(slot) - 1;
+
+                printf("%u\n", slot);
+            } break;
+
+            case MP_OP_POWI: {
+                printf("%ld: POWI ", ip++);
+                int32_t n = 0;
+
+                if (i + sizeof(n) >= p.count)
+                    continue;
+
+                ++i;
+                memcpy(&n, &p.items[i], sizeof(n));
+                i += sizeof(n) - 1;
+
+                printf("%d\n", n);
+            } break;
+
+            case MP_OP_PUSH_INT:
+            case MP_OP_ADD_INT:
+            case MP_OP_SUB_INT:
+            case MP_OP_MUL_INT:
+            case MP_OP_DIV_INT: {
+                printf("%ld: %s ", ip++, mp_opcode_to_string(op));
+
+                if (i + sizeof(int8_t) >= p.count)
+                    continue;
+
+                ++i;
+                printf("%d\n", (int8_t)p.items[i]);
+            } break;
+
+            case MP_OP_PUSH_FLOAT:
+            case MP_OP_ADD_CONST:
+            case MP_OP_SUB_CONST:
+            case MP_OP_MUL_CONST:
+            case MP_OP_DIV_CONST: {
+                printf("%ld: %s ", ip++, mp_opcode_to_string(op));
+                size_t size = mp_opcode_operand_size(op);
+                double num = 0.0;
+
+                if (i + size >= p.count)
+                    continue;
+
+                if (op == MP_OP_PUSH_FLOAT) {
+                    float f;
+                    memcpy(&f, &p.items[i + 1], sizeof(f));
+                    num = f;
+                } else {
+                    memcpy(&num, &p.items[i + 1], sizeof(num));
+                }
+                i += size;
+
+                printf("%f\n", num);
+            } break;
+
+            case MP_OP_ADD_VAR:
+            case MP_OP_SUB_VAR:
+            case MP_OP_MUL_VAR:
+            case MP_OP_DIV_VAR: {
+                printf("%ld: %s ", ip++, mp_opcode_to_string(op));
+
+                if (i + 1 >= p.count)
+                    continue;
+
+                ++i;
+                printf("%c\n", p.items[i] + 'a');
+            } break;
+
+            case MP_OP_ADD: printf("%ld: ADD\n", ip++); break;
+            case MP_OP_SUB: printf("%ld: SUB\n", ip++); break;
+            case MP_OP_MUL: printf("%ld: MUL\n", ip++); break;
+            case MP_OP_DIV: printf("%ld: DIV\n", ip++); break;
+            case MP_OP_POW: printf("%ld: POW\n", ip++); break;
+            case MP_OP_NEG: printf("%ld: NEG\n", ip++); break;
+            case MP_OP_POP: printf("%ld: POP\n", ip++); break;
+
+            case MP_OP_LT:
+            case MP_OP_LE:
+            case MP_OP_GT:
+            case MP_OP_GE:
+            case MP_OP_EQ:
+            case MP_OP_NE:
+            case MP_OP_AND:
+            case MP_OP_OR:
+            case MP_OP_SELECT: {
+                printf("%ld: %s\n", ip++, mp_opcode_to_string(op));
+            } break;
+
+            default: {
+                if (MP_OP_PUSH_VAR_A <= op && op <= MP_OP_PUSH_VAR_Z) {
+                    printf("%ld: PUSH_VAR %c\n", ip++, 'a' + (op - MP_OP_PUSH_VAR_A));
+                } else {
+                    printf("%ld: ?\n", ip++);
+                }
+            } break;
+        }
+    }
+}
+
+void mp_stack_push(MP_Stack *stack, double n)
+{
+    if (stack == NULL)
+        return;
+
+    mp_da_append(stack, n);
+}
+
+MP_Optional mp_stack_pop(MP_Stack *stack)
+{
+    MP_Optional result = mp_stack_peek(stack);
+    if (result.present) {
+        stack->count--;
+    }
+
+    return result;
+}
+
+MP_Optional mp_stack_peek(MP_Stack *stack)
+{
+    MP_Optional result = {0};
+    if (stack == NULL || stack->count == 0) {
+        return result;
+    }
+
+    result.present = true;
+    result.value = stack->items[stack->count - 1];
+    return result;
+}
+
+MP_Vm mp_vm_init(MP_Program program)
+{
+    MP_Vm vm = {0};
+    vm.program = program;
+    vm.stack.allocator = program.allocator;
+    mp_vm_reserve(&vm);
+    return vm;
+}
+
+// Grows the stack to the exact size the program needs, so that mp_vm_run
+// never has to
+void mp_vm_reserve(MP_Vm *vm)
+{
+    if (vm == NULL)
+        return;
+
+    size_t stack_size = mp_program_stack_size(vm->program);
+    if (stack_size <= vm->stack.capacity)
+        return;
+
+    vm->stack.items = mp_allocator_realloc(vm->stack.allocator, vm->stack.items,
+                                           vm->stack.capacity * sizeof(*vm->stack.items),
+                                           stack_size * sizeof(*vm->stack.items));
+    assert(vm->stack.items != NULL && "Buy more RAM LOL");
+    vm->stack.capacity = stack_size;
+}
+
+void mp_vm_var(MP_Vm *vm, char var, double value)
+{
+    if (vm == NULL)
+        return;
+
+    assert('a' <= var && var <= 'z');
+    vm->vars[var - 'a'] = value;
+}
+
+// Verifies the program of vm against its slots and reserves the stack. If it
+// succeeds mp_vm_run uses mp_vm_run_unchecked, the program and the slots must
+// not change afterwards without verifying again.
+bool mp_vm_verify(MP_Vm *vm)
+{
+    if (vm == NULL)
+        return false;
+
+    size_t stack_size = 0;
+    vm->verified = mp_program_verify(vm->program, vm->slot_count, &stack_size);
+    if (vm->verified) {
+        mp_vm_reserve(vm);
+        assert(vm->stack.capacity >= stack_size);
+    }
+
+    return vm->verified;
+}
+
+// The VMs note whether a divisor was 0, without branching. The division may be
+// in a branch the interpreter doesn't take, mp_vm_row_error tells.
+static bool mp_vm_check_division(MP_Vm *vm, bool zero_divisor)
+{
+#ifdef MP_IEEE
+    (void)zero_divisor;
+    vm->error = MP_ERROR_OK;
+#else
+    vm->error = zero_divisor ? mp_vm_row_error(vm) : MP_ERROR_OK;
+#endif
+    return vm->error == MP_ERROR_OK;
+}
+
+bool mp_vm_run(MP_Vm *vm)
+{
+#define ASSERT_PRESENT(o) if (!(o).present) return false
+
+    if (vm == NULL)
+        return false;;
+
+    if (vm->verified)
+        return mp_vm_run_unchecked(vm);
+
+    MP_Stack *stack = &vm->stack;
+    MP_Program *program = &vm->program;
+    vm->ip = 0;
+    vm->error = MP_ERROR_INVALID_EXPRESSION; // Until the program completes
+    mp_da_reset(stack);
+    bool zero_divisor = false;
+
+#ifdef MP_PROFILE
+    vm->profile.evaluations++;
+#endif
+
+    while (vm->ip < program->count) {
+        MP_Opcode op = program->items[vm->ip];
+        MP_PROFILE_BEGIN(op_start);
+
+        switch (op) {
+            case MP_OP_PUSH_NUM: {
+                ++vm->ip;
+                double operand;
+                memcpy(&operand, &program->items[vm->ip], sizeof(operand));
+                mp_stack_push(stack, operand);
+                vm->ip += sizeof(operand);
+            } break;
+
+            case MP_OP_PUSH_VAR: {
+                ++vm->ip;
+                char var = *(char*)&program->items[vm->ip];
+                mp_stack_push(stack, vm->vars[(int)var]);
+                vm->ip += sizeof(var);
+            } break;
+
+            case MP_OP_ADD: {
+                MP_Optional b = mp_stack_pop(stack); ASSERT_PRESENT(b);
+                MP_Optional a = mp_stack_pop(stack); ASSERT_PRESENT(a);
+                mp_stack_push(stack, a.value + b.value);
+                ++vm->ip;
+            } break;
+
+            case MP_OP_SUB: {
+                MP_Optional b = mp_stack_pop(stack); ASSERT_PRESENT(b);
+                MP_Optional a = mp_stack_pop(stack); ASSERT_PRESENT(a);
+                mp_stack_push(stack, a.value - b.value);
+                ++vm->ip;
+            } break;
+
+            case MP_OP_MUL: {
+                MP_Optional b = mp_stack_pop(stack); ASSERT_PRESENT(b);
+                MP_Optional a = mp_stack_pop(stack); ASSERT_PRESENT(a);
+                mp_stack_push(stack, a.value * b.value);
+                ++vm->ip;
+            } break;
+
+            case MP_OP_DIV: {
+                MP_Optional b = mp_stack_pop(stack); ASSERT_PRESENT(b);
+                MP_Optional a = mp_stack_pop(stack); ASSERT_PRESENT(a);
+                zero_divisor |= b.value == 0.0;
+                mp_stack_push(stack, a.value / b.value);
+                ++vm->ip;
+            } break;
+
+            case MP_OP_POW: {
+                MP_Optional b = mp_stack_pop(stack); ASSERT_PRESENT(b);
+                MP_Optional a = mp_stack_pop(stack); ASSERT_PRESENT(a);
+                mp_stack_push(stack, pow(a.value, b.value));
+                ++vm->ip;
+            } break;
+
+            case MP_OP_NEG: {
+                MP_Optional n = mp_stack_pop(stack); ASSERT_PRESENT(n);
+                mp_stack_push(stack, -n.value);
+                ++vm->ip;
+            } break;
+
+            case MP_OP_LT:
+            case MP_OP_LE:
+            case MP_OP_GT:
+            case MP_OP_GE:
+            case MP_OP_EQ:
+            case MP_OP_NE:
+            case MP_OP_AND:
+            case MP_OP_OR: {
+                MP_Optional b = mp_stack_pop(stack); ASSERT_PRESENT(b);
+                MP_Optional a = mp_stack_pop(stack); ASSERT_PRESENT(a);
+                double value = 0.0;
+                switch (op) {
+                    case MP_OP_LT:  value = a.value < b.value; break;
+                    case MP_OP_LE:  value = a.value <= b.value; break;
+                    case MP_OP_GT:  value = a.value > b.value; break;
+                    case MP_OP_GE:  value = a.value >= b.value; break;
+                    case MP_OP_EQ:  value = a.value == b.value; break;
+                    case MP_OP_NE:  value = a.value != b.value; break;
+                    case MP_OP_AND: value = a.value != 0.0 && b.value != 0.0; break;
+                    default:        value = a.value != 0.0 || b.value != 0.0; break;
+                }
+                mp_stack_push(stack, value);
+                ++vm->ip;
+            } break;
+
+            case MP_OP_SELECT: {
+                MP_Optional b = mp_stack_pop(stack); ASSERT_PRESENT(b);
+                MP_Optional a = mp_stack_pop(stack); ASSERT_PRESENT(a);
+                MP_Optional c = mp_stack_pop(stack); ASSERT_PRESENT(c);
+                mp_stack_push(stack, c.value != 0.0 ? a.value : b.value);
+                ++vm->ip;
+            } break;
+
+            case MP_OP_FUNC: {
+                ++vm->ip;
+                MP_Function name = program->items[vm->ip];
+                size_t arity = mp_function_arity(name);
+                if (arity == 0) return false;
+                double args[MP_FUNCTION_MAX_ARITY];
+                for (size_t i = arity; i > 0; --i) {
+                    MP_Optional n = mp_stack_pop(stack); ASSERT_PRESENT(n);
+                    args[i - 1] = n.value;
+                }
+                double value = 0.0;
+                MP_PROFILE_BEGIN(function_start);
+                if (!mp_function_apply(name, args, vm->precision, &value))
+                    return false;
+                MP_PROFILE_END(vm->profile, function, name, function_start);
+                mp_stack_push(stack, value);
+                ++vm->ip;
+            } break;
+
+            case MP_OP_STORE: {
+                ++vm->ip;
+                uint32_t slot;
+                memcpy(&slot, &program->items[vm->ip], sizeof(slot));
+                if (slot >= vm->slot_count) return false;
+                MP_Optional n = mp_stack_peek(stack); ASSERT_PRESENT(n);
+                vm->slots[slot] = n.value;
+                vm->ip += sizeof(slot);
+            } break;
+
+            case MP_OP_LOAD: {
+                ++vm->ip;
+                uint32_t slot;
+                memcpy(&slot, &program->items[vm->ip], sizeof(slot));
+                if (slot >= vm->slot_count) return false;
+                mp_stack_push(stack, vm->slots[slot]);
+                vm->ip += sizeof(slot);
+            } break;
+
+            case MP_OP_POP: {
+                MP_Optional n = mp_stack_pop(stack); ASSERT_PRESENT(n);
+                ++vm->ip;
+            } break;
+
+            case MP_OP_POWI: {
+                ++vm->ip;
+                int32_t exponent;
+                memcpy(&exponent, &program->items[vm->ip], sizeof(exponent));
+                MP_Optional n = mp_stack_pop(stack); ASSERT_PRESENT(n);
+                mp_stack_push(stack, mp_powi(n.value, exponent));
+                vm->ip += sizeof(exponent);
+            } break;
+
+            case MP_OP_PUSH_INT: {
+                ++vm->ip;
+                int8_t operand = (int8_t)program->items[vm->ip];
+                mp_stack_push(stack, operand);
+                vm->ip += sizeof(operand);
+            } break;
+
+            case MP_OP_PUSH_FLOAT: {
+                ++vm->ip;
+                float operand;
+                memcpy(&operand, &program->items[vm->ip], sizeof(operand));
+                mp_stack_push(stack, operand);
+                vm->ip += sizeof(operand);
+            } break;
+
+            case MP_OP_ADD_VAR:
+            case MP_OP_SUB_VAR:
+            case MP_OP_MUL_VAR:
+            case MP_OP_DIV_VAR:
+            case MP_OP_ADD_CONST:
+            case MP_OP_SUB_CONST:
+            case MP_OP_MUL_CONST:
+            case MP_OP_DIV_CONST:
+            case MP_OP_ADD_INT:
+            case MP_OP_SUB_INT:
+            case MP_OP_MUL_INT:
+            case MP_OP_DIV_INT: {
+                ++vm->ip;
+                double b = 0.0;
+                if (op <= MP_OP_DIV_VAR) {
+                    unsigned char var = program->items[vm->ip];
+                    if (var >= 26) return false;
+                    b = vm->vars[var];
+                } else {
+                    b = mp_opcode_constant(op, &program->items[vm->ip]);
+                }
+                vm->ip += mp_opcode_operand_size(op);
+
+                MP_Optional a = mp_stack_pop(stack); ASSERT_PRESENT(a);
+                switch (mp_opcode_plain(op)) {
+                    case MP_OP_ADD: a.value += b; break;
+                    case MP_OP_SUB: a.value -= b; break;
+                    case MP_OP_MUL: a.value *= b; break;
+                    default: {
+                        zero_divisor |= b == 0.0;
+                        a.value /= b;
+                    } break;
+                }
+                mp_stack_push(stack, a.value);
+            } break;
+
+            default: {
+                if (op < MP_OP_PUSH_VAR_A || op > MP_OP_PUSH_VAR_Z)
+                    return false;
+                mp_stack_push(stack, vm->vars[op - MP_OP_PUSH_VAR_A]);
+                ++vm->ip;
+            } break;
+        }
+
+        MP_PROFILE_END(vm->profile, op, op, op_start);
+        MP_PROFILE_DEPTH(vm->profile, stack->count);
+    }
+
+    return mp_vm_check_division(vm, zero_divisor);
+
+#undef ASSERT_PRESENT
+}
+
+// Runs a program accepted by mp_vm_verify. The stack is accessed through a
+// raw pointer: it can't underflow nor outgrow the capacity reserved for it.
+bool mp_vm_run_unchecked(MP_Vm *vm)
+{
+    const uint8_t *code = vm->program.items;
+    const uint8_t *end = code + vm->program.count;
+    double *base = vm->stack.items;
+    double *sp = base;
+    bool zero_divisor = false;
+
+#ifdef MP_PROFILE
+    vm->profile.evaluations++;
+#endif
+
+    while (code < end) {
+        MP_Opcode op = *code++;
+        MP_PROFILE_BEGIN(op_start);
+
+        switch (op) {
+            case MP_OP_PUSH_NUM: {
+                memcpy(sp++, code, sizeof(double));
+                code += sizeof(double);
+            } break;
+
+            case MP_OP_PUSH_VAR: {
+                *sp++ = vm->vars[*code++];
+            } break;
+
+            case MP_OP_ADD: {
+                --sp;
+                sp[-1] = sp[-1] + sp[0];
+            } break;
+
+            case MP_OP_SUB: {
+                --sp;
+                sp[-1] = sp[-1] - sp[0];
+            } break;
+
+            case MP_OP_MUL: {
+                --sp;
+                sp[-1] = sp[-1] * sp[0];
+            } break;
+
+            case MP_OP_DIV: {
+                --sp;
+                zero_divisor |= sp[0] == 0.0;
+                sp[-1] = sp[-1] / sp[0];
+            } break;
+
+            case MP_OP_POW: {
+                --sp;
+                sp[-1] = pow(sp[-1], sp[0]);
+            } break;
+
+            case MP_OP_NEG: {
+                sp[-1] = -sp[-1];
+            } break;
+
+            case MP_OP_LT:  --sp; sp[-1] = sp[-1] < sp[0];  break;
+            case MP_OP_LE:  --sp; sp[-1] = sp[-1] <= sp[0]; break;
+            case MP_OP_GT:  --sp; sp[-1] = sp[-1] > sp[0];  break;
+            case MP_OP_GE:  --sp; sp[-1] = sp[-1] >= sp[0]; break;
+            case MP_OP_EQ:  --sp; sp[-1] = sp[-1] == sp[0]; break;
+            case MP_OP_NE:  --sp; sp[-1] = sp[-1] != sp[0]; break;
+            case MP_OP_AND: --sp; sp[-1] = sp[-1] != 0.0 && sp[0] != 0.0; break;
+            case MP_OP_OR:  --sp; sp[-1] = sp[-1] != 0.0 || sp[0] != 0.0; break;
+
+            case MP_OP_SELECT: {
+                sp -= 2;
+                sp[-1] = sp[-1] != 0.0 ? sp[0] : sp[1];
+            } break;
+
+            case MP_OP_FUNC: {
+                MP_Function name = *code++;
+                sp -= mp_function_arity(name) - 1;
+                MP_PROFILE_BEGIN(function_start);
+                mp_function_apply(name, &sp[-1], vm->precision, &sp[-1]);
+                MP_PROFILE_END(vm->profile, function, name, function_start);
+            } break;
+
+            case MP_OP_STORE: {
+                uint32_t slot;
+                memcpy(&slot, code, sizeof(slot));
+                code += sizeof(slot);
+                vm->slots[slot] = sp[-1];
+            } break;
+
+            case MP_OP_LOAD: {
+                uint32_t slot;
+                memcpy(&slot, code, sizeof(slot));
+                code += sizeof(slot);
+                *sp++ = vm->slots[slot];
+            } break;
+
+            case MP_OP_POP: {
+                --sp;
+            } break;
+
+            case MP_OP_POWI: {
+                int32_t exponent;
+                memcpy(&exponent, code, sizeof(exponent));
+                code += sizeof(exponent);
+                sp[-1] = mp_powi(sp[-1], exponent);
+            } break;
+
+            case MP_OP_PUSH_INT: {
+                *sp++ = (int8_t)*code++;
+            } break;
+
+            case MP_OP_PUSH_FLOAT: {
+                float operand;
+                memcpy(&operand, code, sizeof(operand));
+                code += sizeof(operand);
+                *sp++ = operand;
+            } break;
+
+            case MP_OP_ADD_VAR: sp[-1] += vm->vars[*code++]; break;
+            case MP_OP_SUB_VAR: sp[-1] -= vm->vars[*code++]; break;
+            case MP_OP_MUL_VAR: sp[-1] *= vm->vars[*code++]; break;
+            case MP_OP_DIV_VAR: {
+                double b = vm->vars[*code++];
+                zero_divisor |= b == 0.0;
+                sp[-1] /= b;
+            } break;
+
+            case MP_OP_ADD_CONST:
+            case MP_OP_SUB_CONST:
+            case MP_OP_MUL_CONST:
+            case MP_OP_DIV_CONST: {
+                double operand;
+                memcpy(&operand, code, sizeof(operand));
+                code += sizeof(operand);
+                switch (op) {
+                    case MP_OP_ADD_CONST: sp[-1] += operand; break;
+                    case MP_OP_SUB_CONST: sp[-1] -= operand; break;
+                    case MP_OP_MUL_CONST: sp[-1] *= operand; break;
+                    default: {
+                        zero_divisor |= operand == 0.0;
+                        sp[-1] /= operand;
+                    } break;
+                }
+            } break;
+
+            case MP_OP_ADD_INT: sp[-1] += (int8_t)*code++; break;
+            case MP_OP_SUB_INT: sp[-1] -= (int8_t)*code++; break;
+            case MP_OP_MUL_INT: sp[-1] *= (int8_t)*code++; break;
+            case MP_OP_DIV_INT: {
+                double b = (int8_t)*code++;
+                zero_divisor |= b == 0.0;
+                sp[-1] /= b;
+            } break;
+
+            default: {
+                assert(MP_OP_PUSH_VAR_A <= op && op <= MP_OP_PUSH_VAR_Z
+                       && "Unreachable, the program is verified");
+                *sp++ = vm->vars[op - MP_OP_PUSH_VAR_A];
+            } break;
+        }
+
+        MP_PROFILE_END(vm->profile, op, op, op_start);
+        MP_PROFILE_DEPTH(vm->profile, (size_t)(sp - base));
+    }
+
+    vm->ip = vm->program.count;
+    vm->stack.count = sp - base;
+    return mp_vm_check_division(vm, zero_divisor);
+}
+
+double mp_vm_result(MP_Vm *vm)
+{
+    if (vm == NULL)
+        return 0.0;
+
+    return mp_stack_peek(&vm->stack).value;
+}
+
+void mp_vm_free(MP_Vm *vm)
+{
+    if (vm == NULL)
+        return;
+
+    mp_da_free(&vm->stack);
+    mp_da_free(&vm->program);
+}
+
+//----------
+// Batch VM
+//----------
+
+// Programs that don't store to slots, whose values would differ by row, and
+// that leave a single value, the one of the row
+bool mp_program_batchable(MP_Program p)
+{
+    for (size_t i = 0; i < p.count; i += 1 + mp_opcode_operand_size(p.items[i])) {
+        if (p.items[i] == MP_OP_STORE) return false;
+    }
+
+    size_t end_depth = 0;
+    mp_program_depth(p, &end_depth);
+    return end_depth == 1;
+}
+
+// Programs that divide, the only opcodes that can fail on the values
+bool mp_program_can_fail(MP_Program p)
+{
+#ifdef MP_IEEE
+    (void)p;
+    return false;
+#else
+    for (size_t i = 0; i < p.count; i += 1 + mp_opcode_operand_size(p.items[i])) {
+        MP_Opcode op = p.items[i];
+        if (op == MP_OP_DIV || op == MP_OP_DIV_VAR || op == MP_OP_DIV_CONST
+                || op == MP_OP_DIV_INT)
+            return true;
+    }
+    return false;
+#endif
+}
+
+// The loops over blocks always run over MP_BATCH_SIZE values, the rows past the
+// end of a partial block are computed and ignored. With a constant trip count
+// and restrict pointers the compiler vectorizes them without checks.
+//
+// The batch VM is written once for any element type T by MP_BATCH_DEFINE(T, S,
+// F), which defines mp_vm_run_rows_S and the functions it calls, and is
+// instantiated for every row of MP_BATCH_TYPES. F is the suffix of the <math.h>
+// functions for T. The native functions compute in double, a type also needs an
+// mp_block_native_S that converts its blocks. In the generated functions:
+// - mp_block_var_S gives the rows of a variable: its column, or scratch filled
+//   with its value. The rows of a partial block are copied into scratch, so
+//   that the column isn't overrun.
+// - mp_block_binop_S computes a = a op b for the arithmetic, comparison and
+//   logical opcodes but MP_OP_POW. The comparisons are written as selects of 1
+//   and 0, which vectorize to a compare and a mask.
+// - mp_block_select_S computes c = c != 0 ? a : b, a blend of the two branches.
+//   Both are loaded first, a load under the condition would keep the loop from
+//   being vectorized.
+// - mp_block_function_S computes x = name(x, y, z), y and z are the blocks above
+//   x and are only read by the functions with that many arguments. min, max and
+//   clamp vectorize.
+// - mp_block_track_S updates errors, a stack of error blocks parallel to stack,
+//   for the opcode at code before it runs. The error codes are stored as T,
+//   loops mixing widths are not vectorized. Every row gets the error the
+//   interpreter would report, with blends in place of its branches: e.g. the
+//   error of a select is the one of its condition, else the one of the branch
+//   taken. The merges are done by the mp_block_error_* functions, one per
+//   kind of opcode, which take restrict pointers like the ones above.
+// - mp_vm_run_block_S computes the rows [row, row + n) into stack[0..n), and
+//   their errors into errors[0..n) when it's not NULL. The stack has room for
+//   mp_program_stack_size() + 1 blocks, the one above the top is scratch space.
+
+#define MP_BATCH_TYPES(X) \
+    X(double, f64, )      \
+    X(float, f32, f)
+
+#define MP_BLOCK_EACH(statement) \
+    for (size_t i = 0; i < MP_BATCH_SIZE; ++i) statement
+#define MP_BLOCK_SELECT(cond) MP_BLOCK_EACH(a[i] = (cond) ? 1 : 0)
+#define MP_BLOCK_APPLY(f) MP_BLOCK_EACH(x[i] = f(x[i]))
+#define MP_BLOCK_APPLY2(f) MP_BLOCK_EACH(x[i] = f(x[i], y[i]))
+#define MP_BLOCK_MIN(a, b) ((a) < (b) || (b) != (b) ? (a) : (b))
+#define MP_BLOCK_MAX(a, b) ((a) > (b) || (b) != (b) ? (a) : (b))
+
+// x = native(x, ...) for the first n rows, the arguments are the blocks from x
+// up. One call of batch for the block, or of fn for each row.
+static void mp_block_native_f64(const MP_Native *native, double *x, size_t n)
+{
+    const double *args[MP_FUNCTION_MAX_ARITY];
+    for (size_t k = 0; k < native->arity; ++k) {
+        args[k] = x + k * MP_BATCH_SIZE;
+    }
+
+    if (native->batch != NULL) {
+        native->batch(args, n, x, native->user);
+        return;
+    }
+
+    double row[MP_FUNCTION_MAX_ARITY];
+    for (size_t i = 0; i < n; ++i) {
+        for (size_t k = 0; k < native->arity; ++k) {
+            row[k] = args[k][i];
+        }
+        x[i] = native->fn(row, native->user);
+    }
+}
+
+// Same as mp_block_native_f64, through blocks of double
+static void mp_block_native_f32(const MP_Native *native, float *x, size_t n)
+{
+    double blocks[MP_FUNCTION_MAX_ARITY][MP_BATCH_SIZE];
+    for (size_t k = 0; k < native->arity; ++k) {
+        for (size_t i = 0; i < n; ++i) {
+            blocks[k][i] = x[k * MP_BATCH_SIZE + i];
+        }
+    }
+
+    mp_block_native_f64(native, blocks[0], n);
+    for (size_t i = 0; i < n; ++i) {
+        x[i] = (float)blocks[0][i];
+    }
+}
+
+static void *mp_vm_batch_stack(const MP_Vm *vm, size_t item_size)
+{
+    size_t size = (mp_program_stack_size(vm->program) + 1)
+        * MP_BATCH_SIZE * item_size;
+    void *stack = mp_allocator_alloc(vm->program.allocator, size);
+    assert(stack != NULL && "Buy more RAM LOL");
+
+    // The rows past the end of a partial block are never left uninitialized
+    memset(stack, 0, size);
+    return stack;
+}
+
+static void mp_vm_batch_stack_free(const MP_Vm *vm, void *stack,
+                                   size_t item_size)
+{
+    size_t size = (mp_program_stack_size(vm->program) + 1)
+        * MP_BATCH_SIZE * item_size;
+    mp_allocator_free(vm->program.allocator, stack, size);
+}
+
+#define MP_BATCH_DEFINE(T, S, F)                                               \
+static void mp_block_fill_##S(T *block, T value)                               \
+{                                                                              \
+    for (size_t i = 0; i < MP_BATCH_SIZE; ++i) {                               \
+        block[i] = value;                                                      \
+    }                                                                          \
+}                                                                              \
+                                                                               \
+static const T *mp_block_var_##S(const MP_Vm *vm, const T *const columns[26],  \
+                                 size_t var, size_t row, size_t n, T *scratch) \
+{                                                                              \
+    const T *column = columns[var];                                            \
+                                                                               \
+    if (column == NULL) {                                                      \
+        mp_block_fill_##S(scratch, (T)vm->vars[var]);                          \
+    } else if (n == MP_BATCH_SIZE) {                                           \
+        return column + row;                                                   \
+    } else {                                                                   \
+        memcpy(scratch, column + row, n * sizeof(*scratch));                   \
+        memset(scratch + n, 0, (MP_BATCH_SIZE - n) * sizeof(*scratch));        \
+    }                                                                          \
+                                                                               \
+    return scratch;                                                            \
+}                                                                              \
+                                                                               \
+static void mp_block_binop_##S(MP_Opcode op, T *restrict a,                    \
+                               const T *restrict b)                            \
+{                                                                              \
+    switch (op) {                                                              \
+        case MP_OP_ADD: MP_BLOCK_EACH(a[i] += b[i]);  break;                   \
+        case MP_OP_SUB: MP_BLOCK_EACH(a[i] -= b[i]);  break;                   \
+        case MP_OP_MUL: MP_BLOCK_EACH(a[i] *= b[i]);  break;                   \
+        case MP_OP_LT:  MP_BLOCK_SELECT(a[i] < b[i]);  break;                  \
+        case MP_OP_LE:  MP_BLOCK_SELECT(a[i] <= b[i]);  break;                 \
+        case MP_OP_GT:  MP_BLOCK_SELECT(a[i] > b[i]);  break;                  \
+        case MP_OP_GE:  MP_BLOCK_SELECT(a[i] >= b[i]);  break;                 \
+        case MP_OP_EQ:  MP_BLOCK_SELECT(a[i] == b[i]);  break;                 \
+        case MP_OP_NE:  MP_BLOCK_SELECT(a[i] != b[i]);  break;                 \
+        case MP_OP_AND: MP_BLOCK_SELECT((a[i] != 0) & (b[i] != 0)); break;     \
+        case MP_OP_OR:  MP_BLOCK_SELECT((a[i] != 0) | (b[i] != 0)); break;     \
+        default:        MP_BLOCK_EACH(a[i] /= b[i]);  break;                   \
+    }                                                                          \
+}                                                                              \
+                                                                               \
+static void mp_block_select_##S(T *restrict c, const T *restrict a,            \
+                                const T *restrict b)                           \
+{                                                                              \
+    for (size_t i = 0; i < MP_BATCH_SIZE; ++i) {                               \
+        T then = a[i];                                                         \
+        T otherwise = b[i];                                                    \
+        c[i] = c[i] != 0 ? then : otherwise;                                   \
+    }                                                                          \
+}                                                                              \
+                                                                               \
+static void mp_block_binop_scalar_##S(MP_Opcode op, T *a, T b)                 \
+{                                                                              \
+    switch (op) {                                                              \
+        case MP_OP_ADD: MP_BLOCK_EACH(a[i] += b); break;                       \
+        case MP_OP_SUB: MP_BLOCK_EACH(a[i] -= b); break;                       \
+        case MP_OP_MUL: MP_BLOCK_EACH(a[i] *= b); break;                       \
+        default:        MP_BLOCK_EACH(a[i] /= b); break;                       \
+    }                                                                          \
+}                                                                              \
+                                                                               \
+static void mp_block_function_##S(MP_Function name, T *restrict x,             \
+                                  const T *restrict y, const T *restrict z,    \
+                                  MP_Precision precision)                      \
+{                                                                              \
+    if (precision == MP_PRECISION_FAST) {                                      \
+        switch (name) {                                                        \
+            case MP_FUNCTION_SIN: MP_BLOCK_APPLY(mp_fast_sin); return;         \
+            case MP_FUNCTION_COS: MP_BLOCK_APPLY(mp_fast_cos); return;         \
+            case MP_FUNCTION_TAN: MP_BLOCK_APPLY(mp_fast_tan); return;         \
+            default:              break;                                       \
+        }                                                                      \
+    }                                                                          \
+                                                                               \
+    switch (name) {                                                            \
+        case MP_FUNCTION_LN:    MP_BLOCK_APPLY(log##F);        break;          \
+        case MP_FUNCTION_LOG:   MP_BLOCK_APPLY(log10##F);      break;          \
+        case MP_FUNCTION_SIN:   MP_BLOCK_APPLY(sin##F);        break;          \
+        case MP_FUNCTION_COS:   MP_BLOCK_APPLY(cos##F);        break;          \
+        case MP_FUNCTION_TAN:   MP_BLOCK_APPLY(tan##F);        break;          \
+        case MP_FUNCTION_SQRT:  MP_BLOCK_APPLY(sqrt##F);       break;          \
+        case MP_FUNCTION_MIN:   MP_BLOCK_APPLY2(MP_BLOCK_MIN); break;          \
+        case MP_FUNCTION_MAX:   MP_BLOCK_APPLY2(MP_BLOCK_MAX); break;          \
+        case MP_FUNCTION_POW:   MP_BLOCK_APPLY2(pow##F);       break;          \
+        case MP_FUNCTION_ATAN2: MP_BLOCK_APPLY2(atan2##F);     break;          \
+        case MP_FUNCTION_HYPOT: MP_BLOCK_APPLY2(hypot##F);     break;          \
+                                                                               \
+        case MP_FUNCTION_FMA: {                                                \
+            for (size_t i = 0; i < MP_BATCH_SIZE; ++i) {                       \
+                x[i] = fma##F(x[i], y[i], z[i]);                               \
+            }                                                                  \
+        } break;                                                               \
+                                                                               \
+        case MP_FUNCTION_CLAMP: {                                              \
+            for (size_t i = 0; i < MP_BATCH_SIZE; ++i) {                       \
+                T low = MP_BLOCK_MAX(x[i], y[i]);                              \
+                x[i] = MP_BLOCK_MIN(low, z[i]);                                \
+            }                                                                  \
+        } break;                                                               \
+                                                                               \
+        default: break;                                                        \
+    }                                                                          \
+}                                                                              \
+                                                                               \
+static void mp_block_error_left_##S(T *restrict a, const T *restrict b)        \
+{                                                                              \
+    for (size_t i = 0; i < MP_BATCH_SIZE; ++i) {                               \
+        T left = a[i];                                                         \
+        T right = b[i];                                                        \
+        a[i] = left != MP_ERROR_OK ? left : right;                             \
+    }                                                                          \
+}                                                                              \
+                                                                               \
+static void mp_block_error_right_##S(T *restrict a, const T *restrict b)       \
+{                                                                              \
+    for (size_t i = 0; i < MP_BATCH_SIZE; ++i) {                               \
+        T left = a[i];                                                         \
+        T right = b[i];                                                        \
+        a[i] = right != MP_ERROR_OK ? right : left;                            \
+    }                                                                          \
+}                                                                              \
+                                                                               \
+static void mp_block_error_divide_##S(T *restrict a, const T *restrict b,      \
+                                      const T *restrict divisor)               \
+{                                                                              \
+    for (size_t i = 0; i < MP_BATCH_SIZE; ++i) {                               \
+        T left = divisor[i] == 0 ? MP_ERROR_ZERO_DIVISION : a[i];              \
+        T right = b[i];                                                        \
+        a[i] = right != MP_ERROR_OK ? right : left;                            \
+    }                                                                          \
+}                                                                              \
+                                                                               \
+static void mp_block_error_divisor_##S(T *restrict a,                          \
+                                       const T *restrict divisor)              \
+{                                                                              \
+    for (size_t i = 0; i < MP_BATCH_SIZE; ++i) {                               \
+        T left = a[i];                                                         \
+        a[i] = divisor[i] == 0 ? MP_ERROR_ZERO_DIVISION : left;                \
+    }                                                                          \
+}                                                                              \
+                                                                               \
+static void mp_block_error_logic_##S(T *restrict a, const T *restrict b,       \
+                                     const T *restrict lhs, T decides)         \
+{                                                                              \
+    for (size_t i = 0; i < MP_BATCH_SIZE; ++i) {                               \
+        T left = a[i];                                                         \
+        T right = b[i];                                                        \
+        T decided = (lhs[i] != 0) == decides;                                  \
+        a[i] = left != MP_ERROR_OK || decided ? left : right;                  \
+    }                                                                          \
+}                                                                              \
+                                                                               \
+static void mp_block_error_select_##S(T *restrict c, const T *restrict a,      \
+                                      const T *restrict b,                     \
+                                      const T *restrict condition)             \
+{                                                                              \
+    for (size_t i = 0; i < MP_BATCH_SIZE; ++i) {                               \
+        T first = c[i];                                                        \
+        T then = a[i];                                                         \
+        T otherwise = b[i];                                                    \
+        T taken = condition[i] != 0 ? then : otherwise;                        \
+        c[i] = first != MP_ERROR_OK ? first : taken;                           \
+    }                                                                          \
+}                                                                              \
+                                                                               \
+static void mp_block_track_##S(const MP_Vm *vm, const T *const columns[26],    \
+                               size_t row, size_t n, const uint8_t *code,      \
+                               T *stack, T *sp, T *errors)                     \
+{                                                                              \
+    T *e = errors + (sp - stack);                                              \
+    T *ea = e - 2 * MP_BATCH_SIZE;                                             \
+    T *eb = e - MP_BATCH_SIZE;                                                 \
+                                                                               \
+    switch (code[0]) {                                                         \
+        case MP_OP_ADD:                                                        \
+        case MP_OP_SUB:                                                        \
+        case MP_OP_MUL:                                                        \
+        case MP_OP_LT:                                                         \
+        case MP_OP_LE:                                                         \
+        case MP_OP_GT:                                                         \
+        case MP_OP_GE:                                                         \
+        case MP_OP_EQ:                                                         \
+        case MP_OP_NE: {                                                       \
+            mp_block_error_left_##S(ea, eb);                                   \
+        } break;                                                               \
+                                                                               \
+        case MP_OP_POW: {                                                      \
+            mp_block_error_right_##S(ea, eb);                                  \
+        } break;                                                               \
+                                                                               \
+        case MP_OP_DIV: {                                                      \
+            mp_block_error_divide_##S(ea, eb, sp - MP_BATCH_SIZE);             \
+        } break;                                                               \
+                                                                               \
+        case MP_OP_AND:                                                        \
+        case MP_OP_OR: {                                                       \
+            T decides = code[0] == MP_OP_OR;                                   \
+            mp_block_error_logic_##S(ea, eb, sp - 2 * MP_BATCH_SIZE, decides); \
+        } break;                                                               \
+                                                                               \
+        case MP_OP_SELECT: {                                                   \
+            T *ec = e - 3 * MP_BATCH_SIZE;                                     \
+            const T *c = sp - 3 * MP_BATCH_SIZE;                               \
+            mp_block_error_select_##S(ec, ea, eb, c);                          \
+        } break;                                                               \
+                                                                               \
+        case MP_OP_FUNC: {                                                     \
+            size_t arity = mp_function_arity(code[1]);                         \
+            for (size_t k = 1; k < arity; ++k) {                               \
+                T *first = e - (k + 1) * MP_BATCH_SIZE;                        \
+                mp_block_error_left_##S(first, first + MP_BATCH_SIZE);         \
+            }                                                                  \
+        } break;                                                               \
+                                                                               \
+        case MP_OP_DIV_VAR: {                                                  \
+            const T *v = mp_block_var_##S(vm, columns, code[1], row, n, sp);   \
+            mp_block_error_divisor_##S(eb, v);                                 \
+        } break;                                                               \
+                                                                               \
+        case MP_OP_DIV_CONST:                                                  \
+        case MP_OP_DIV_INT: {                                                  \
+            if ((T)mp_opcode_constant(code[0], code + 1) == 0) {               \
+                mp_block_fill_##S(eb, MP_ERROR_ZERO_DIVISION);                 \
+            }                                                                  \
+        } break;                                                               \
+                                                                               \
+        case MP_OP_NEG:                                                        \
+        case MP_OP_POP:                                                        \
+        case MP_OP_POWI:                                                       \
+        case MP_OP_ADD_VAR:                                                    \
+        case MP_OP_SUB_VAR:                                                    \
+        case MP_OP_MUL_VAR:                                                    \
+        case MP_OP_ADD_CONST:                                                  \
+        case MP_OP_SUB_CONST:                                                  \
+        case MP_OP_MUL_CONST:                                                  \
+        case MP_OP_ADD_INT:                                                    \
+        case MP_OP_SUB_INT:                                                    \
+        case MP_OP_MUL_INT: break;                                             \
+                                                                               \
+        default: {                                                             \
+            mp_block_fill_##S(e, MP_ERROR_OK);                                 \
+        } break;                                                               \
+    }                                                                          \
+}                                                                              \
+                                                                               \
+static void mp_vm_run_block_##S(const MP_Vm *vm, const T *const columns[26],   \
+                                size_t row, size_t n, T *stack, T *errors)     \
+{                                                                              \
+    const uint8_t *code = vm->program.items;                                   \
+    const uint8_t *end = code + vm->program.count;                             \
+    T *sp = stack;                                                             \
+                                                                               \
+    while (code < end) {                                                       \
+        if (errors != NULL) {                                                  \
+            mp_block_track_##S(vm, columns, row, n, code, stack, sp, errors);  \
+        }                                                                      \
+                                                                               \
+        MP_Opcode op = *code++;                                                \
+        T *top = sp - MP_BATCH_SIZE;                                           \
+                                                                               \
+        switch (op) {                                                          \
+            case MP_OP_PUSH_NUM: {                                             \
+                double operand;                                                \
+                memcpy(&operand, code, sizeof(operand));                       \
+                code += sizeof(operand);                                       \
+                mp_block_fill_##S(sp, (T)operand);                             \
+                sp += MP_BATCH_SIZE;                                           \
+            } break;                                                           \
+                                                                               \
+            case MP_OP_PUSH_VAR: {                                             \
+                size_t var = *code++;                                          \
+                const T *v = mp_block_var_##S(vm, columns, var, row, n, sp);   \
+                if (v != sp) memcpy(sp, v, MP_BATCH_SIZE * sizeof(*sp));       \
+                sp += MP_BATCH_SIZE;                                           \
+            } break;                                                           \
+                                                                               \
+            case MP_OP_ADD:                                                    \
+            case MP_OP_SUB:                                                    \
+            case MP_OP_MUL:                                                    \
+            case MP_OP_DIV:                                                    \
+            case MP_OP_LT:                                                     \
+            case MP_OP_LE:                                                     \
+            case MP_OP_GT:                                                     \
+            case MP_OP_GE:                                                     \
+            case MP_OP_EQ:                                                     \
+            case MP_OP_NE:                                                     \
+            case MP_OP_AND:                                                    \
+            case MP_OP_OR: {                                                   \
+                sp -= MP_BATCH_SIZE;                                           \
+                mp_block_binop_##S(op, top - MP_BATCH_SIZE, top);              \
+            } break;                                                           \
+                                                                               \
+            case MP_OP_SELECT: {                                               \
+                sp -= 2 * MP_BATCH_SIZE;                                       \
+                mp_block_select_##S(top - 2 * MP_BATCH_SIZE,                   \
+                                    top - MP_BATCH_SIZE, top);                 \
+            } break;                                                           \
+                                                                               \
+            case MP_OP_POW: {                                                  \
+                sp -= MP_BATCH_SIZE;                                           \
+                T *a = top - MP_BATCH_SIZE;                                    \
+                for (size_t i = 0; i < n; ++i) {                               \
+                    a[i] = (T)pow(a[i], top[i]);                               \
+                }                                                              \
+            } break;                                                           \
+                                                                               \
+            case MP_OP_NEG: {                                                  \
+                MP_BLOCK_EACH(top[i] = -top[i]);                               \
+            } break;                                                           \
+                                                                               \
+            case MP_OP_FUNC: {                                                 \
+                MP_Function name = *code++;                                    \
+                sp -= (mp_function_arity(name) - 1) * MP_BATCH_SIZE;           \
+                T *x = sp - MP_BATCH_SIZE;                                     \
+                const MP_Native *native = mp_native(name);                     \
+                if (native != NULL) {                                          \
+                    mp_block_native_##S(native, x, n);                         \
+                } else {                                                       \
+                    mp_block_function_##S(name, x, x + MP_BATCH_SIZE,          \
+                                          x + 2 * MP_BATCH_SIZE,               \
+                                          vm->precision);                      \
+                }                                                              \
+            } break;                                                           \
+                                                                               \
+            case MP_OP_LOAD: {                                                 \
+                uint32_t slot;                                                 \
+                memcpy(&slot, code, sizeof(slot));                             \
+                code += sizeof(slot);                                          \
+                mp_block_fill_##S(sp, (T)vm->slots[slot]);                     \
+                sp += MP_BATCH_SIZE;                                           \
+            } break;                                                           \
+                                                                               \
+            case MP_OP_POP: {                                                  \
+                sp -= MP_BATCH_SIZE;                                           \
+            } break;                                                           \
+                                                                               \
+            case MP_OP_POWI: {                                                 \
+                int32_t exponent;                                              \
+                memcpy(&exponent, code, sizeof(exponent));                     \
+                code += sizeof(exponent);                                      \
+                for (size_t i = 0; i < n; ++i) {                               \
+                    top[i] = (T)mp_powi(top[i], exponent);                     \
+                }                                                              \
+            } break;                                                           \
+                                                                               \
+            case MP_OP_PUSH_INT: {                                             \
+                mp_block_fill_##S(sp, (T)(int8_t)*code++);                     \
+                sp += MP_BATCH_SIZE;                                           \
+            } break;                                                           \
+                                                                               \
+            case MP_OP_PUSH_FLOAT: {                                           \
+                float operand;                                                 \
+                memcpy(&operand, code, sizeof(operand));                       \
+                code += sizeof(operand);                                       \
+                mp_block_fill_##S(sp, (T)operand);                             \
+                sp += MP_BATCH_SIZE;                                           \
+            } break;                                                           \
+                                                                               \
+            case MP_OP_ADD_VAR:                                                \
+            case MP_OP_SUB_VAR:                                                \
+            case MP_OP_MUL_VAR:                                                \
+            case MP_OP_DIV_VAR: {                                              \
+                size_t var = *code++;                                          \
+                const T *v = mp_block_var_##S(vm, columns, var, row, n, sp);   \
+                mp_block_binop_##S(MP_OP_ADD + (op - MP_OP_ADD_VAR), top, v);  \
+            } break;                                                           \
+                                                                               \
+            case MP_OP_ADD_CONST:                                              \
+            case MP_OP_SUB_CONST:                                              \
+            case MP_OP_MUL_CONST:                                              \
+            case MP_OP_DIV_CONST:                                              \
+            case MP_OP_ADD_INT:                                                \
+            case MP_OP_SUB_INT:                                                \
+            case MP_OP_MUL_INT:                                                \
+            case MP_OP_DIV_INT: {                                              \
+                double operand = mp_opcode_constant(op, code);                 \
+                code += mp_opcode_operand_size(op);                            \
+                mp_block_binop_scalar_##S(mp_opcode_plain(op), top,            \
+                                          (T)operand);                         \
+            } break;                                                           \
+                                                                               \
+            default: {                                                         \
+                assert(MP_OP_PUSH_VAR_A <= op && op <= MP_OP_PUSH_VAR_Z        \
+                       && "Unreachable, verified and batchable program");      \
+                size_t var = op - MP_OP_PUSH_VAR_A;                            \
+                const T *v = mp_block_var_##S(vm, columns, var, row, n, sp);   \
+                if (v != sp) memcpy(sp, v, MP_BATCH_SIZE * sizeof(*sp));       \
+                sp += MP_BATCH_SIZE;                                           \
+            } break;                                                           \
+        }                                                                      \
+    }                                                                          \
+}                                                                              \
+                                                                               \
+static bool mp_vm_run_rows_##S(const MP_Vm *vm, const T *const columns[26],    \
+                               size_t rows, T *out, uint8_t *errors)           \
+{                                                                              \
+    if (vm == NULL || columns == NULL || out == NULL)                          \
+        return false;                                                          \
+                                                                               \
+    if (!vm->verified || !mp_program_batchable(vm->program))                   \
+        return false;                                                          \
+                                                                               \
+    T *stack_errors = NULL;                                                    \
+    if (errors != NULL && mp_program_can_fail(vm->program)) {                  \
+        stack_errors = mp_vm_batch_stack(vm, sizeof(*stack_errors));           \
+    } else if (errors != NULL) {                                               \
+        memset(errors, MP_ERROR_OK, rows * sizeof(*errors));                   \
+    }                                                                          \
+                                                                               \
+    T *stack = mp_vm_batch_stack(vm, sizeof(T));                               \
+    for (size_t row = 0; row < rows; row += MP_BATCH_SIZE) {                   \
+        size_t n = rows - row < MP_BATCH_SIZE ? rows - row : MP_BATCH_SIZE;    \
+        mp_vm_run_block_##S(vm, columns, row, n, stack, stack_errors);         \
+        memcpy(out + row, stack, n * sizeof(*out));                            \
+        for (size_t i = 0; stack_errors != NULL && i < n; ++i) {               \
+            errors[row + i] = (uint8_t)stack_errors[i];                        \
+        }                                                                      \
+    }                                                                          \
+    mp_vm_batch_stack_free(vm, stack, sizeof(T));                              \
+    if (stack_errors != NULL) {                                                \
+        mp_vm_batch_stack_free(vm, stack_errors, sizeof(*stack_errors));       \
+    }                                                                          \
+                                                                               \
+    return true;                                                               \
+}
+
+MP_BATCH_TYPES(MP_BATCH_DEFINE)
+
+#undef MP_BLOCK_MAX
+#undef MP_BLOCK_MIN
+#undef MP_BLOCK_APPLY2
+#undef MP_BLOCK_APPLY
+#undef MP_BLOCK_SELECT
+#undef MP_BLOCK_EACH
+
+// Computes the value of every row into out. The VM must be verified (see
+// mp_vm_verify) and its program batchable.
+bool mp_vm_run_batch(const MP_Vm *vm, const double *const columns[26],
+                     size_t rows, double *out)
+{
+    return mp_vm_run_rows_f64(vm, columns, rows, out, NULL);
+}
+
+// Same as mp_vm_run_batch with float columns, computed in float
+bool mp_vm_run_batch_f32(const MP_Vm *vm, const float *const columns[26],
+                         size_t rows, float *out)
+{
+    return mp_vm_run_rows_f32(vm, columns, rows, out, NULL);
+}
+
+// Same as mp_vm_run_batch, errors gets the MP_Error_Type of every row
+bool mp_vm_run_batch_errors(const MP_Vm *vm, const double *const columns[26],
+                            size_t rows, double *out, uint8_t *errors)
+{
+    if (errors == NULL)
+        return false;
+
+    return mp_vm_run_rows_f64(vm, columns, rows, out, errors);
+}
+
+bool mp_vm_run_batch_errors_f32(const MP_Vm *vm, const float *const columns[26],
+                                size_t rows, float *out, uint8_t *errors)
+{
+    if (errors == NULL)
+        return false;
+
+    return mp_vm_run_rows_f32(vm, columns, rows, out, errors);
+}
+
+// The error of the program of vm for the values of its variables, the one the
+// interpreter would report. The program runs again as a single row of the
+// batch VM, which calls the native functions again too.
+MP_Error_Type mp_vm_row_error(const MP_Vm *vm)
+{
+    size_t stack_size = 0;
+    if (vm == NULL || !mp_program_can_fail(vm->program)
+            || !mp_program_batchable(vm->program)
+            || !mp_program_verify(vm->program, vm->slot_count, &stack_size))
+        return MP_ERROR_OK;
+
+    const double *columns[26] = {0};
+    double *stack = mp_vm_batch_stack(vm, sizeof(*stack));
+    double *errors = mp_vm_batch_stack(vm, sizeof(*errors));
+
+    mp_vm_run_block_f64(vm, columns, 0, 1, stack, errors);
+    MP_Error_Type error = (MP_Error_Type)errors[0];
+
+    mp_vm_batch_stack_free(vm, errors, sizeof(*errors));
+    mp_vm_batch_stack_free(vm, stack, sizeof(*stack));
+
+    return error;
+}
+
+void mp_reduction_state_init(MP_Reduction_State *state)
+{
+    memset(state, 0, sizeof(*state));
+    for (size_t j = 0; j < MP_BATCH_LANES; ++j) {
+        state->min[j] = INFINITY;
+        state->max[j] = -INFINITY;
+    }
+}
+
+// Folds count values in lane i % MP_BATCH_LANES, count is a multiple of it.
+// The lanes are copied to locals and every selection is a ternary so that the
+// loops are vectorized.
+static void mp_reduction_lanes(MP_Reduction_State *state,
+                               const double *restrict values, size_t count,
+                               MP_Summation summation, double *sum_lanes)
+{
+    double sum[MP_BATCH_LANES], c[MP_BATCH_LANES], lo[MP_BATCH_LANES],
+           hi[MP_BATCH_LANES], n[MP_BATCH_LANES];
+    for (size_t j = 0; j < MP_BATCH_LANES; ++j) {
+        sum[j] = sum_lanes[j];
+        c[j] = state->compensation[j];
+        lo[j] = state->min[j];
+        hi[j] = state->max[j];
+        n[j] = state->count[j];
+    }
+
+    // Comparisons with NaN are false, they don't change min and max
+#define MP_REDUCE_LANES(accumulate)                                         \
+    for (size_t i = 0; i < count; i += MP_BATCH_LANES) {                    \
+        for (size_t j = 0; j < MP_BATCH_LANES; ++j) {                       \
+            double x = values[i + j];                                       \
+            bool present = x == x;                                          \
+            n[j] += present ? 1.0 : 0.0;                                    \
+            lo[j] = x < lo[j] ? x : lo[j];                                  \
+            hi[j] = x > hi[j] ? x : hi[j];                                  \
+            x = present ? x : 0.0;                                          \
+            accumulate;                                                     \
+        }                                                                   \
+    }
+
+    if (summation == MP_SUM_KAHAN) {
+        MP_REDUCE_LANES({
+            double t = sum[j] + x;
+            bool larger = fabs(sum[j]) >= fabs(x);
+            double big = larger ? sum[j] : x;
+            double small = larger ? x : sum[j];
+            c[j] += (big - t) + small;
+            sum[j] = t;
+        });
+    } else {
+        MP_REDUCE_LANES(sum[j] += x);
+    }
+
+#undef MP_REDUCE_LANES
+
+    for (size_t j = 0; j < MP_BATCH_LANES; ++j) {
+        sum_lanes[j] = sum[j];
+        state->compensation[j] = c[j];
+        state->min[j] = lo[j];
+        state->max[j] = hi[j];
+        state->count[j] = n[j];
+    }
+}
+
+// Folds a block of values into state. With MP_SUM_PAIRWISE every call is one
+// block of the pairwise summation.
+void mp_reduction_state_add(MP_Reduction_State *state, const double *values,
+                            size_t count, MP_Summation summation)
+{
+    double block[MP_BATCH_LANES] = {0};
+    double *sum = summation == MP_SUM_PAIRWISE ? block : state->sum;
+
+    size_t full = count - count % MP_BATCH_LANES;
+    mp_reduction_lanes(state, values, full, summation, sum);
+
+    if (full < count) {
+        // NaN is left out of the reduction, it pads the last lanes
+        double tail[MP_BATCH_LANES];
+        for (size_t j = 0; j < MP_BATCH_LANES; ++j) {
+            tail[j] = full + j < count ? values[full + j] : NAN;
+        }
+        mp_reduction_lanes(state, tail, MP_BATCH_LANES, summation, sum);
+    }
+
+    if (summation != MP_SUM_PAIRWISE)
+        return;
+
+    for (size_t width = MP_BATCH_LANES / 2; width > 0; width /= 2) {
+        for (size_t j = 0; j < width; ++j) {
+            block[j] = block[2*j] + block[2*j + 1];
+        }
+    }
+
+    // The k-th bit of blocks tells whether cascade[k] holds 2^k blocks, adding
+    // a block carries like a binary counter
+    double s = block[0];
+    size_t k = 0;
+    while (state->blocks & ((size_t)1 << k)) {
+        s = state->cascade[k] + s;
+        ++k;
+    }
+    state->cascade[k] = s;
+    state->blocks++;
+}
+
+static void mp_neumaier_add(double *sum, double *compensation, double x)
+{
+    double t = *sum + x;
+    *compensation += fabs(*sum) >= fabs(x) ? (*sum - t) + x : (x - t) + *sum;
+    *sum = t;
+}
+
+// Combines the partial reductions of count states
+MP_Reduction mp_reduction_state_finish(const MP_Reduction_State *states,
+                                       size_t count)
+{
+    MP_Reduction r = {0};
+    double sum = 0.0;
+    double compensation = 0.0;
+    double total = 0.0;
+    r.min = INFINITY;
+    r.max = -INFINITY;
+
+    for (size_t i = 0; i < count; ++i) {
+        const MP_Reduction_State *s = &states[i];
+
+        for (size_t j = 0; j < MP_BATCH_LANES; ++j) {
+            mp_neumaier_add(&sum, &compensation, s->sum[j]);
+            compensation += s->compensation[j];
+            total += s->count[j];
+            if (s->min[j] < r.min) r.min = s->min[j];
+            if (s->max[j] > r.max) r.max = s->max[j];
+        }
+
+        for (size_t k = 0; k < sizeof(s->cascade)/sizeof(s->cascade[0]); ++k) {
+            if (s->blocks & ((size_t)1 << k))
+                mp_neumaier_add(&sum, &compensation, s->cascade[k]);
+        }
+    }
+
+    // The compensation of infinite sums is NaN
+    r.sum = isfinite(sum) ? sum + compensation : sum;
+    r.count = (size_t)total;
+
+    if (r.count == 0) {
+        r.min = NAN;
+        r.max = NAN;
+        r.mean = NAN;
+    } else {
+        r.mean = r.sum / total;
+    }
+
+    return r;
+}
+
+static void mp_vm_reduce_range(const MP_Vm *vm, const double *const columns[26],
+                               size_t begin, size_t end, MP_Summation summation,
+                               MP_Reduction_State *state)
+{
+    double *stack = mp_vm_batch_stack(vm, sizeof(double));
+    for (size_t row = begin; row < end; row += MP_BATCH_SIZE) {
+        size_t n = end - row < MP_BATCH_SIZE ? end - row : MP_BATCH_SIZE;
+        mp_vm_run_block_f64(vm, columns, row, n, stack, NULL);
+        mp_reduction_state_add(state, stack, n, summation);
+    }
+    mp_vm_batch_stack_free(vm, stack, sizeof(double));
+}
+
+#ifdef MP_THREADS
+typedef struct {
+    const MP_Vm *vm;
+    const double *const *columns;
+    size_t begin;
+    size_t end;
+    MP_Summation summation;
+    MP_Reduction_State *state;
+    pthread_t thread;
+    bool started;
+} MP_Reduce_Task;
+
+static void *mp_reduce_task(void *arg)
+{
+    MP_Reduce_Task *task = arg;
+    mp_vm_reduce_range(task->vm, task->columns, task->begin, task->end,
+                       task->summation, task->state);
+    return NULL;
+}
+#endif // MP_THREADS
+
+// Reduces the values of the rows without storing them. The VM must be verified
+// (see mp_vm_verify) and its program batchable.
+bool mp_vm_reduce(const MP_Vm *vm, const double *const columns[26],
+                  size_t rows, MP_Reduce_Options options,
+                  MP_Reduction *reduction)
+{
+    if (vm == NULL || columns == NULL || reduction == NULL)
+        return false;
+
+    if (!vm->verified || !mp_program_batchable(vm->program)
+            || options.summation >= MP_SUM_COUNT)
+        return false;
+
+#ifdef MP_THREADS
+    // Threads get whole blocks, only the last block of the rows is partial
+    size_t blocks = (rows + MP_BATCH_SIZE - 1) / MP_BATCH_SIZE;
+    size_t thread_count = options.threads < blocks ? options.threads : blocks;
+
+    if (thread_count > 1) {
+        MP_Reduce_Task *tasks = MP_MALLOC(thread_count * sizeof(*tasks));
+        MP_Reduction_State *states = MP_MALLOC(thread_count * sizeof(*states));
+        assert(tasks != NULL && states != NULL && "Buy more RAM LOL");
+
+        size_t per_thread = (blocks + thread_count - 1) / thread_count * MP_BATCH_SIZE;
+        for (size_t t = 0; t < thread_count; ++t) {
+            MP_Reduce_Task *task = &tasks[t];
+            task->vm = vm;
+            task->columns = columns;
+            task->begin = t * per_thread < rows ? t * per_thread : rows;
+            task->end = rows - task->begin > per_thread ? task->begin + per_thread : rows;
+            task->summation = options.summation;
+            task->state = &states[t];
+            mp_reduction_state_init(task->state);
+        }
+
+        // The calling thread takes the first task, and the ones whose thread
+        // couldn't be created
+        for (size_t t = 1; t < thread_count; ++t) {
+            tasks[t].started = pthread_create(&tasks[t].thread, NULL,
+                                              mp_reduce_task, &tasks[t]) == 0;
+        }
+        mp_reduce_task(&tasks[0]);
+        for (size_t t = 1; t < thread_count; ++t) {
+            if (tasks[t].started) {
+                pthread_join(tasks[t].thread, NULL);
+            } else {
+                mp_reduce_task(&tasks[t]);
+            }
+        }
+
+        *reduction = mp_reduction_state_finish(states, thread_count);
+
+        MP_FREE(states);
+        MP_FREE(tasks);
+        return true;
+    }
+#endif
+
+    MP_Reduction_State state;
+    mp_reduction_state_init(&state);
+    mp_vm_reduce_range(vm, columns, 0, rows, options.summation, &state);
+    *reduction = mp_reduction_state_finish(&state, 1);
+
+    return true;
+}
+
+bool mp_vm_filter(const MP_Vm *vm, const double *const columns[26],
+                  size_t rows, uint64_t *bitmap, size_t *selected)
+{
+    if (vm == NULL || columns == NULL || bitmap == NULL)
+        return false;
+
+    if (!vm->verified || !mp_program_batchable(vm->program))
+        return false;
+
+    memset(bitmap, 0, MP_FILTER_WORDS(rows) * sizeof(*bitmap));
+    size_t count = 0;
+
+    double *stack = mp_vm_batch_stack(vm, sizeof(double));
+    for (size_t row = 0; row < rows; row += MP_BATCH_SIZE) {
+        size_t n = rows - row < MP_BATCH_SIZE ? rows - row : MP_BATCH_SIZE;
+        mp_vm_run_block_f64(vm, columns, row, n, stack, NULL);
+
+        for (size_t i = 0; i < n; ++i) {
+            uint64_t bit = stack[i] != 0.0;
+            bitmap[(row + i) / 64] |= bit << ((row + i) % 64);
+            count += bit;
+        }
+    }
+    mp_vm_batch_stack_free(vm, stack, sizeof(double));
+
+    if (selected != NULL) *selected = count;
+    return true;
+}
+
+bool mp_vm_filter_rows(const MP_Vm *vm, const double *const columns[26],
+                       size_t rows, size_t *indices, size_t *selected)
+{
+    if (vm == NULL || columns == NULL || indices == NULL)
+        return false;
+
+    if (!vm->verified || !mp_program_batchable(vm->program))
+        return false;
+
+    size_t count = 0;
+
+    double *stack = mp_vm_batch_stack(vm, sizeof(double));
+    for (size_t row = 0; row < rows; row += MP_BATCH_SIZE) {
+        size_t n = rows - row < MP_BATCH_SIZE ? rows - row : MP_BATCH_SIZE;
+        mp_vm_run_block_f64(vm, columns, row, n, stack, NULL);
+
+        // Every row is written, the next one overwrites it if it isn't kept
+        for (size_t i = 0; i < n; ++i) {
+            indices[count] = row + i;
+            count += stack[i] != 0.0;
+        }
+    }
+    mp_vm_batch_stack_free(vm, stack, sizeof(double));
+
+    if (selected != NULL) *selected = count;
+    return true;
+}
+
+//---------
+// Solvers
+//---------
+
+static bool mp_solve_start(MP_Vm *vm, char var, MP_Solution *s)
+{
+    *s = (MP_Solution){0};
+    s->x = NAN;
+    s->value = NAN;
+
+    if (vm == NULL || var < 'a' || var > 'z') {
+        s->error = MP_ERROR_INVALID_EXPRESSION;
+        return false;
+    }
+
+    return true;
+}
+
+static MP_Solve_Options mp_solve_defaults(MP_Solve_Options options)
+{
+    if (!(options.tolerance > 0))
+        options.tolerance = MP_SOLVE_TOLERANCE;
+    if (options.max_iterations == 0)
+        options.max_iterations = MP_SOLVE_MAX_ITERATIONS;
+    return options;
+}
+
+// Whether a bracket or a step of width around x is below the tolerance. The
+// ulps of x are added so that large roots, whose neighbouring doubles are
+// further apart than the tolerance, converge too.
+static bool mp_solve_done(double width, double x, double tolerance)
+{
+    return fabs(width) <= tolerance + 4 * DBL_EPSILON * fabs(x);
+}
+
+// Gives var back its value. An evaluation that failed leaves no solution.
+static MP_Solution mp_solve_end(MP_Vm *vm, size_t var, double saved, MP_Solution s)
+{
+    vm->vars[var] = saved;
+    if (s.error != MP_ERROR_OK) {
+        s.x = NAN;
+        s.value = NAN;
+        s.converged = false;
+    }
+    return s;
+}
+
+static bool mp_solve_eval(MP_Vm *vm, size_t var, double x, double *value,
+                          MP_Solution *s)
+{
+    vm->vars[var] = x;
+    s->evaluations++;
+
+    if (!mp_vm_run(vm)) {
+        s->error = vm->error != MP_ERROR_OK ? vm->error : MP_ERROR_INVALID_EXPRESSION;
+        return false;
+    }
+
+    *value = mp_vm_result(vm);
+    return true;
+}
+
+MP_Solution mp_solve_bisection(MP_Vm *vm, char var, double a, double b,
+                               MP_Solve_Options options)
+{
+    MP_Solution s;
+    if (!mp_solve_start(vm, var, &s))
+        return s;
+
+    if (!isfinite(a) || !isfinite(b)) {
+        s.error = MP_ERROR_INVALID_EXPRESSION;
+        return s;
+    }
+
+    options = mp_solve_defaults(options);
+    size_t v = var - 'a';
+    double saved = vm->vars[v];
+
+    double fa, fb;
+    if (!mp_solve_eval(vm, v, a, &fa, &s) || !mp_solve_eval(vm, v, b, &fb, &s)) {
+        return mp_solve_end(vm, v, saved, s);
+    }
+
+    if (fa == 0.0 || fb == 0.0) {
+        s.x = fa == 0.0 ? a : b;
+        s.value = 0.0;
+        s.converged = true;
+    } else if (!isnan(fa) && !isnan(fb) && (fa > 0) != (fb > 0)) {
+        while (s.iterations < options.max_iterations) {
+            double m = a + (b - a) / 2;
+            double fm;
+            s.iterations++;
+            if (!mp_solve_eval(vm, v, m, &fm, &s))
+                break;
+
+            s.x = m;
+            s.value = fm;
+            if ((fm > 0) == (fa > 0)) {
+                a = m;
+                fa = fm;
+            } else {
+                b = m;
+            }
+
+            if (fm == 0.0 || mp_solve_done(b - a, m, options.tolerance)) {
+                s.converged = true;
+                break;
+            }
+        }
+    }
+
+    return mp_solve_end(vm, v, saved, s);
+}
+
+// Brent's method as in "Algorithms for Minimization without Derivatives". b is
+// the best estimate, a the previous one and c the other end of the bracket.
+MP_Solution mp_solve_brent(MP_Vm *vm, char var, double a, double b,
+                           MP_Solve_Options options)
+{
+    MP_Solution s;
+    if (!mp_solve_start(vm, var, &s))
+        return s;
+
+    if (!isfinite(a) || !isfinite(b)) {
+        s.error = MP_ERROR_INVALID_EXPRESSION;
+        return s;
+    }
+
+    options = mp_solve_defaults(options);
+    size_t v = var - 'a';
+    double saved = vm->vars[v];
+
+    double fa, fb;
+    if (!mp_solve_eval(vm, v, a, &fa, &s) || !mp_solve_eval(vm, v, b, &fb, &s)) {
+        return mp_solve_end(vm, v, saved, s);
+    }
+
+    if (isnan(fa) || isnan(fb) || (fa > 0 && fb > 0) || (fa < 0 && fb < 0)) {
+        return mp_solve_end(vm, v, saved, s);
+    }
+
+    double c = b;
+    double fc = fb;
+    double d = b - a;
+    double e = d;
+
+    while (true) {
+        if ((fb > 0 && fc > 0) || (fb < 0 && fc < 0)) {
+            c = a;
+            fc = fa;
+            d = b - a;
+            e = d;
+        }
+
+        if (fabs(fc) < fabs(fb)) {
+            a = b;
+            b = c;
+            c = a;
+            fa = fb;
+            fb = fc;
+            fc = fa;
+        }
+
+        s.x = b;
+        s.value = fb;
+
+        double tolerance = 2 * DBL_EPSILON * fabs(b) + 0.5 * options.tolerance;
+        double half = 0.5 * (c - b);
+        if (fabs(half) <= tolerance || fb == 0.0) {
+            s.converged = true;
+            break;
+        }
+
+        if (s.iterations >= options.max_iterations)
+            break;
+
+        if (fabs(e) >= tolerance && fabs(fa) > fabs(fb)) {
+            // Secant when there are two points, inverse quadratic otherwise
+            double p, q;
+            double ratio = fb / fa;
+            if (a == c) {
+                p = 2 * half * ratio;
+                q = 1 - ratio;
+            } else {
+                double qa = fa / fc;
+                double rb = fb / fc;
+                p = ratio * (2 * half * qa * (qa - rb) - (b - a) * (rb - 1));
+                q = (qa - 1) * (rb - 1) * (ratio - 1);
+            }
+
+            if (p > 0) q = -q;
+            p = fabs(p);
+
+            // Accepted if it falls in the bracket and shrinks faster than
+            // bisection would
+            double interpolation = 3 * half * q - fabs(tolerance * q);
+            double previous = fabs(e * q);
+            if (2 * p < (interpolation < previous ? interpolation : previous)) {
+                e = d;
+                d = p / q;
+            } else {
+                d = half;
+                e = d;
+            }
+        } else {
+            d = half;
+            e = d;
+        }
+
+        a = b;
+        fa = fb;
+        b += fabs(d) > tolerance ? d : (half > 0 ? tolerance : -tolerance);
+
+        s.iterations++;
+        if (!mp_solve_eval(vm, v, b, &fb, &s))
+            break;
+    }
+
+    return mp_solve_end(vm, v, saved, s);
+}
+
+MP_Solution mp_solve_newton(MP_Vm *vm, MP_Vm *derivative, char var, double x,
+                            MP_Solve_Options options)
+{
+    MP_Solution s;
+    if (!mp_solve_start(vm, var, &s))
+        return s;
+
+    if (!isfinite(x)) {
+        s.error = MP_ERROR_INVALID_EXPRESSION;
+        return s;
+    }
+
+    options = mp_solve_defaults(options);
+    size_t v = var - 'a';
+    double saved = vm->vars[v];
+    if (derivative != NULL)
+        memcpy(derivative->vars, vm->vars, sizeof(derivative->vars));
+
+    bool small_step = false;
+    while (true) {
+        double fx;
+        if (!mp_solve_eval(vm, v, x, &fx, &s))
+            break;
+
+        s.x = x;
+        s.value = fx;
+        if (fx == 0.0 || small_step) {
+            s.converged = true;
+            break;
+        }
+
+        if (s.iterations >= options.max_iterations || !isfinite(fx))
+            break;
+
+        double slope;
+        if (derivative != NULL) {
+            if (!mp_solve_eval(derivative, v, x, &slope, &s))
+                break;
+        } else {
+            // The error of the difference is smallest around the cube root of
+            // the epsilon
+            double h = 6.0554544523933395e-6 * (fabs(x) > 1 ? fabs(x) : 1);
+            double above, below;
+            if (!mp_solve_eval(vm, v, x + h, &above, &s)
+                    || !mp_solve_eval(vm, v, x - h, &below, &s))
+                break;
+            slope = (above - below) / (2 * h);
+        }
+
+        if (slope == 0.0 || !isfinite(slope))
+            break;
+
+        double step = fx / slope;
+        x -= step;
+        s.iterations++;
+        small_step = mp_solve_done(step, x, options.tolerance);
+    }
+
+    return mp_solve_end(vm, v, saved, s);
+}
+
+MP_Solution mp_minimize_golden(MP_Vm *vm, char var, double a, double b,
+                               MP_Solve_Options options)
+{
+    MP_Solution s;
+    if (!mp_solve_start(vm, var, &s))
+        return s;
+
+    if (!isfinite(a) || !isfinite(b)) {
+        s.error = MP_ERROR_INVALID_EXPRESSION;
+        return s;
+    }
+
+    options = mp_solve_defaults(options);
+    size_t v = var - 'a';
+    double saved = vm->vars[v];
+
+    // The inner points split [a, b] by the golden ratio, so that one of them
+    // is an inner point of the next bracket too and each iteration costs one
+    // run
+    const double ratio = 0.6180339887498949;
+    double c = b - ratio * (b - a);
+    double d = a + ratio * (b - a);
+    double fc, fd;
+    if (!mp_solve_eval(vm, v, c, &fc, &s) || !mp_solve_eval(vm, v, d, &fd, &s)) {
+        return mp_solve_end(vm, v, saved, s);
+    }
+
+    while (true) {
+        s.x = fc < fd ? c : d;
+        s.value = fc < fd ? fc : fd;
+        if (mp_solve_done(b - a, s.x, options.tolerance)) {
+            s.converged = true;
+            break;
+        }
+
+        if (s.iterations >= options.max_iterations)
+            break;
+
+        s.iterations++;
+        if (fc < fd) {
+            b = d;
+            d = c;
+            fd = fc;
+            c = b - ratio * (b - a);
+            if (!mp_solve_eval(vm, v, c, &fc, &s))
+                break;
+        } else {
+            a = c;
+            c = d;
+            fc = fd;
+            d = a + ratio * (b - a);
+            if (!mp_solve_eval(vm, v, d, &fd, &s))
+                break;
+        }
+    }
+
+    return mp_solve_end(vm, v, saved, s);
+}
+
+static bool mp_solve_eval_point(MP_Vm *vm, const char *vars, size_t count,
+                                const double *point, double *value,
+                                MP_Solution *s)
+{
+    for (size_t k = 0; k < count; ++k) {
+        vm->vars[vars[k] - 'a'] = point[k];
+    }
+
+    s->evaluations++;
+    if (!mp_vm_run(vm)) {
+        s->error = vm->error != MP_ERROR_OK ? vm->error : MP_ERROR_INVALID_EXPRESSION;
+        return false;
+    }
+
+    *value = mp_vm_result(vm);
+    if (isnan(*value)) *value = INFINITY;
+    return true;
+}
+
+// The coefficients and the starting simplex are the usual ones, as in
+// MATLAB's fminsearch
+MP_Solution mp_minimize_nelder_mead(MP_Vm *vm, const char *vars, double *point,
+                                    MP_Solve_Options options)
+{
+    MP_Solution s;
+    if (!mp_solve_start(vm, vars != NULL ? vars[0] : '\0', &s) || point == NULL)
+        return s;
+
+    size_t n = strlen(vars);
+    for (size_t k = 0; k < n; ++k) {
+        if (vars[k] < 'a' || vars[k] > 'z' || n > 26 || !isfinite(point[k])) {
+            s.error = MP_ERROR_INVALID_EXPRESSION;
+            return s;
+        }
+    }
+
+    if (options.max_iterations == 0)
+        options.max_iterations = MP_SOLVE_MAX_ITERATIONS * n;
+    options = mp_solve_defaults(options);
+
+    double saved[26];
+    memcpy(saved, vm->vars, sizeof(saved));
+
+    // simplex[order[0]] is the best vertex and simplex[order[n]] the worst
+    double simplex[27][26];
+    double values[27];
+    size_t order[27];
+    double centroid[26], reflected[26], trial[26];
+    bool ok = true;
+
+    for (size_t i = 0; i <= n && ok; ++i) {
+        memcpy(simplex[i], point, n * sizeof(double));
+        if (i > 0) {
+            double x = point[i - 1];
+            simplex[i][i - 1] = x != 0.0 ? 1.05 * x : 0.00025;
+        }
+        order[i] = i;
+        ok = mp_solve_eval_point(vm, vars, n, simplex[i], &values[i], &s);
+    }
+
+    while (ok) {
+        for (size_t i = 1; i <= n; ++i) {
+            for (size_t j = i; j > 0 && values[order[j]] < values[order[j - 1]]; --j) {
+                size_t t = order[j];
+                order[j] = order[j - 1];
+                order[j - 1] = t;
+            }
+        }
+
+        const double *best = simplex[order[0]];
+        double *worst = simplex[order[n]];
+        s.x = best[0];
+        s.value = values[order[0]];
+
+        bool small = true;
+        for (size_t i = 1; i <= n && small; ++i) {
+            const double *vertex = simplex[order[i]];
+            small = mp_solve_done(values[order[i]] - values[order[0]], 0.0, options.tolerance);
+            for (size_t k = 0; k < n && small; ++k) {
+                small = mp_solve_done(vertex[k] - best[k], best[k], options.tolerance);
+            }
+        }
+
+        if (small) {
+            s.converged = true;
+            break;
+        }
+
+        if (s.iterations >= options.max_iterations)
+            break;
+        s.iterations++;
+
+        for (size_t k = 0; k < n; ++k) {
+            double sum = 0.0;
+            for (size_t i = 0; i < n; ++i) sum += simplex[order[i]][k];
+            centroid[k] = sum / n;
+            reflected[k] = 2 * centroid[k] - worst[k];
+        }
+
+        double f_reflected;
+        if (!(ok = mp_solve_eval_point(vm, vars, n, reflected, &f_reflected, &s)))
+            break;
+
+        if (f_reflected < values[order[0]]) {
+            for (size_t k = 0; k < n; ++k) trial[k] = 3 * centroid[k] - 2 * worst[k];
+
+            double f_expanded;
+            if (!(ok = mp_solve_eval_point(vm, vars, n, trial, &f_expanded, &s)))
+                break;
+
+            bool expand = f_expanded < f_reflected;
+            memcpy(worst, expand ? trial : reflected, n * sizeof(double));
+            values[order[n]] = expand ? f_expanded : f_reflected;
+        } else if (f_reflected < values[order[n - 1]]) {
+            memcpy(worst, reflected, n * sizeof(double));
+            values[order[n]] = f_reflected;
+        } else {
+            // Contracts outside if the reflection is better than the worst
+            // vertex, inside otherwise, and shrinks everything toward the best
+            // vertex if that fails too
+            bool outside = f_reflected < values[order[n]];
+            for (size_t k = 0; k < n; ++k) {
+                double from = outside ? reflected[k] : worst[k];
+                trial[k] = centroid[k] + 0.5 * (from - centroid[k]);
+            }
+
+            double f_contracted;
+            if (!(ok = mp_solve_eval_point(vm, vars, n, trial, &f_contracted, &s)))
+                break;
+
+            double bound = outside ? f_reflected : values[order[n]];
+            if (f_contracted < bound) {
+                memcpy(worst, trial, n * sizeof(double));
+                values[order[n]] = f_contracted;
+            } else {
+                for (size_t i = 1; i <= n && ok; ++i) {
+                    double *vertex = simplex[order[i]];
+                    for (size_t k = 0; k < n; ++k) {
+                        vertex[k] = best[k] + 0.5 * (vertex[k] - best[k]);
+                    }
+                    ok = mp_solve_eval_point(vm, vars, n, vertex, &values[order[i]], &s);
+                }
+            }
+        }
+    }
+
+    memcpy(vm->vars, saved, sizeof(saved));
+    if (!ok) {
+        s.x = NAN;
+        s.value = NAN;
+        s.converged = false;
+        return s;
+    }
+
+    memcpy(point, simplex[order[0]], n * sizeof(double));
+    return s;
+}
+
+// Solves one problem per row, see Solvers. The VM must be verified (see
+// mp_vm_verify) and its program batchable.
+bool mp_solve_bisection_batch(const MP_Vm *vm, char var,
+                              const double *const columns[26], size_t rows,
+                              const double *a, const double *b,
+                              MP_Solve_Options options, double *roots)
+{
+    if (vm == NULL || var < 'a' || var > 'z' || a == NULL || b == NULL || roots == NULL)
+        return false;
+
+    if (!vm->verified || !mp_program_batchable(vm->program))
+        return false;
+
+    options = mp_solve_defaults(options);
+    size_t v = var - 'a';
+
+    double lo[MP_BATCH_SIZE], hi[MP_BATCH_SIZE], f_lo[MP_BATCH_SIZE];
+    double x[MP_BATCH_SIZE], found[MP_BATCH_SIZE];
+    double *stack = mp_vm_batch_stack(vm, sizeof(double));
+
+    for (size_t row = 0; row < rows; row += MP_BATCH_SIZE) {
+        size_t n = rows - row < MP_BATCH_SIZE ? rows - row : MP_BATCH_SIZE;
+
+        // The block is run from its first row, var reads x
+        const double *block_columns[26];
+        for (size_t k = 0; k < 26; ++k) {
+            block_columns[k] = columns != NULL && columns[k] != NULL ? columns[k] + row : NULL;
+        }
+        block_columns[v] = x;
+
+        // The rows past n bisect [0, 0], which is done from the start
+        for (size_t i = 0; i < MP_BATCH_SIZE; ++i) {
+            lo[i] = i < n ? a[row + i] : 0.0;
+            hi[i] = i < n ? b[row + i] : 0.0;
+        }
+
+        memcpy(x, lo, sizeof(x));
+        mp_vm_run_block_f64(vm, block_columns, 0, n, stack, NULL);
+        memcpy(f_lo, stack, sizeof(f_lo));
+        memcpy(x, hi, sizeof(x));
+        mp_vm_run_block_f64(vm, block_columns, 0, n, stack, NULL);
+
+        // A root at an end collapses the bracket on it
+        for (size_t i = 0; i < MP_BATCH_SIZE; ++i) {
+            double low = f_lo[i];
+            double high = stack[i];
+            double left = lo[i];
+            double right = hi[i];
+            bool at_left = low == 0.0;
+            bool at_right = high == 0.0 && !at_left;
+            bool sign = at_left || at_right || (low > 0 && high < 0) || (low < 0 && high > 0);
+            found[i] = isfinite(left) && isfinite(right) && sign;
+            lo[i] = at_right ? right : left;
+            hi[i] = at_left ? left : right;
+            f_lo[i] = at_right ? 0.0 : low;
+        }
+
+        for (size_t iteration = 0; iteration < options.max_iterations; ++iteration) {
+            size_t open = 0;
+            for (size_t i = 0; i < MP_BATCH_SIZE; ++i) {
+                double width = hi[i] - lo[i];
+                open += found[i] != 0.0 && !mp_solve_done(width, lo[i], options.tolerance);
+                x[i] = lo[i] + width / 2;
+            }
+
+            if (open == 0)
+                break;
+
+            mp_vm_run_block_f64(vm, block_columns, 0, n, stack, NULL);
+
+            for (size_t i = 0; i < MP_BATCH_SIZE; ++i) {
+                double value = stack[i];
+                double middle = x[i];
+                bool zero = value == 0.0;
+                bool same = (value > 0) == (f_lo[i] > 0);
+                lo[i] = same || zero ? middle : lo[i];
+                hi[i] = !same || zero ? middle : hi[i];
+                f_lo[i] = same ? value : f_lo[i];
+            }
+        }
+
+        for (size_t i = 0; i < n; ++i) {
+            roots[row + i] = found[i] != 0.0 ? lo[i] + (hi[i] - lo[i]) / 2 : NAN;
+        }
+    }
+    mp_vm_batch_stack_free(vm, stack, sizeof(double));
+
+    return true;
+}
+
+//----------------
+// Simplified API
+//----------------
+
+// TODO: In this API, MP_Result's won't contain detailed data about errors
+
+MP_Env *mp_init(const char *expression)
+{
+    return mp_init_mode(expression, MP_MODE_ADAPTIVE);
+}
+
+MP_Env *mp_init_mode(const char *expression, MP_Mode mode)
+{
+    MP_Options options = {0};
+    options.mode = mode;
+
+    return mp_init_options(expression, options);
+}
+
+// Sets up the backend of env for tree, arena is taken over. The memory is
+// right-sized since the environment may stay around for long.
+static bool mp_env_setup(MP_Env *env, MP_Arena arena, MP_Parse_Tree tree,
+                         MP_Precision precision)
+{
+    switch (env->backend) {
+        case MP_MODE_INTERPRET: {
+            mp_parse_tree_compact(&arena, &tree);
+            env->interpreter = mp_interpreter_init(tree, arena);
+            env->interpreter.precision = precision;
+
+            // The stacks never hold more than a frame and a value per level
+            // of the tree
+            MP_Tree_Stack *frames = &env->interpreter.frames;
+            MP_Stack *values = &env->interpreter.values;
+            size_t count = mp_tree_height(tree.root);
+            frames->allocator = &env->allocator;
+            frames->items = mp_allocator_alloc(frames->allocator,
+                                               count * sizeof(*frames->items));
+            frames->capacity = frames->items != NULL ? count : 0;
+            values->allocator = &env->allocator;
+            values->items = mp_allocator_alloc(values->allocator,
+                                               count * sizeof(*values->items));
+            values->capacity = values->items != NULL ? count : 0;
+        } break;
+
+        case MP_MODE_COMPILE: {
+            MP_Program program = {0};
+            program.allocator = &env->allocator;
+
+            if (!mp_program_compile_with(&program, tree.root, &env->stack)) {
+                mp_arena_free(&arena);
+                mp_da_free(&program);
+                return false;
+            }
+
+            mp_arena_free(&arena);
+            mp_program_shrink(&program);
+
+            env->vm = mp_vm_init(program);
+            env->vm.precision = precision;
+            mp_vm_verify(&env->vm);
+        } break;
+
+        case MP_MODE_INCREMENTAL: {
+            env->incremental.nodes.allocator = &env->allocator;
+            env->incremental.precision = precision;
+            mp_incremental_build_with(&env->incremental, tree, &env->stack);
+            mp_arena_free(&arena);
+        } break;
+
+        default: {
+            assert(false && "Unreachable MP_MODE");
+        } break;
+    }
+
+    return true;
+}
+
+MP_Env *mp_init_options(const char *expression, MP_Options options)
+{
+    if (expression == NULL) {
+        return NULL;
+    }
+
+    MP_Env *env = mp_allocator_alloc(options.allocator, sizeof(*env));
+    if (env == NULL) {
+        return NULL;
+    }
+    memset(env, 0, sizeof(*env));
+
+    env->mode = options.mode;
+    env->backend = options.mode == MP_MODE_COMPILE
+        || options.mode == MP_MODE_INCREMENTAL ? options.mode : MP_MODE_INTERPRET;
+    env->strict = options.strict;
+    env->adaptive_threshold = options.adaptive_threshold > 0
+        ? options.adaptive_threshold : MP_ADAPTIVE_THRESHOLD;
+    if (options.allocator != NULL) {
+        env->allocator = *options.allocator;
+    }
+    env->tokens.allocator = &env->allocator;
+    env->arena.allocator = &env->allocator;
+    env->stack.allocator = &env->allocator;
+
+    MP_Token_List token_list = {0};
+    token_list.allocator = &env->allocator;
+
+    MP_Result tr = mp_tokenize(&token_list, expression);
+    if (tr.error) {
+        mp_da_free(&token_list);
+        mp_allocator_free(options.allocator, env, sizeof(*env));
+        return NULL;
+    }
+
+    MP_Arena arena = {0};
+    arena.allocator = &env->allocator;
+    MP_Parse_Tree parse_tree = {0};
+
+    MP_Result pr = mp_parse(&arena, &parse_tree, token_list);
+    if (pr.error) {
+        mp_da_free(&token_list);
+        mp_arena_free(&arena);
+        mp_allocator_free(options.allocator, env, sizeof(*env));
+        return NULL;
+    }
+
+    mp_da_free(&token_list);
+
+    if (!options.strict) {
+        mp_optimize(&arena, &parse_tree);
+    }
+
+    // The frames are kept by mp_reinit, an environment that is never
+    // reinitialized doesn't hold them
+    bool ok = mp_env_setup(env, arena, parse_tree, options.precision);
+    mp_da_free(&env->stack);
+    if (!ok) {
+        mp_allocator_free(options.allocator, env, sizeof(*env));
+        return NULL;
+    }
+
+    mp_variable(env, 'p', MP_PI);
+    mp_variable(env, 'e', MP_E);
+
+    return env;
+
+}
+
+void mp_variable(MP_Env *env, char var, double value)
+{
+    if (env == NULL)
+        return;
+
+    switch (env->backend) {
+        case MP_MODE_INTERPRET: {
+            mp_interpreter_var(&env->interpreter, var, value);
+        } break;
+
+        case MP_MODE_COMPILE: {
+            mp_vm_var(&env->vm, var, value);
+        } break;
+
+        case MP_MODE_INCREMENTAL: {
+            mp_incremental_var(&env->incremental, var, value);
+        } break;
+
+        default: {
+            assert(false && "Unreachable MP_MODE");
+        } break;
+    }
+}
+
+MP_Result mp_evaluate(MP_Env *env)
+{
+    MP_Result result = {0};
+
+    if (env == NULL) {
+        result.error = true;
+        return result;
+    }
+
+    if (env->mode == MP_MODE_ADAPTIVE && env->backend == MP_MODE_INTERPRET
+            && !env->promotion_failed
+            && ++env->evaluations >= env->adaptive_threshold) {
+        mp_promote(env);
+    }
+
+    switch (env->backend) {
+        case MP_MODE_INTERPRET: {
+            result = mp_interpret(&env->interpreter);
+        } break;
+
+        case MP_MODE_COMPILE: {
+            if (!mp_vm_run(&env->vm)) {
+                result.error = true;
+                result.error_type = env->vm.error;
+                return result;
+            }
+
+            result.value = mp_vm_result(&env->vm);
+        } break;
+
+        case MP_MODE_INCREMENTAL: {
+            result = mp_incremental_evaluate(&env->incremental);
+        } break;
+
+        default: {
+            assert(false && "Unreachable MP_MODE");
+        } break;
+    }
+
+    return result;
+}
+
+// Replaces the interpreter of env with the VM, keeping the variables. Returns
+// false if the expression can't be compiled, env keeps interpreting then.
+bool mp_promote(MP_Env *env)
+{
+    if (env == NULL)
+        return false;
+
+    if (env->backend == MP_MODE_COMPILE)
+        return true;
+
+    MP_Interpreter interpreter = env->interpreter;
+
+    MP_Program program = {0};
+    program.allocator = &env->allocator;
+
+    if (!mp_program_compile_with(&program, interpreter.tree.root, &env->stack)) {
+        mp_da_free(&program);
+        env->promotion_failed = true; // Don't try again
+        return false;
+    }
+    mp_program_shrink(&program);
+
+    env->vm = mp_vm_init(program);
+    env->vm.precision = interpreter.precision;
+    memcpy(env->vm.vars, interpreter.vars, sizeof(env->vm.vars));
+    mp_vm_verify(&env->vm);
+    env->backend = MP_MODE_COMPILE;
+
+    mp_interpreter_free(&interpreter);
+
+    return true;
+}
+
+// Replaces the expression of env, reusing the memory it already holds. The
+// variables, the mode and the options are kept. On error false is returned and
+// env still evaluates the previous expression.
+//
+// An adaptive environment that has been promoted compiles the new expression
+// right away, one that has not starts counting evaluations again, also when
+// the previous expression couldn't be compiled.
+bool mp_reinit(MP_Env *env, const char *expression)
+{
+    if (env == NULL || expression == NULL)
+        return false;
+
+    mp_da_reset(&env->tokens);
+    if (mp_tokenize(&env->tokens, expression).error)
+        return false;
+
+    // The new tree goes to the spare arena, the current expression stays
+    // untouched until everything succeeded
+    mp_arena_reset(&env->arena);
+    MP_Parse_Tree parse_tree = {0};
+    if (mp_parse(&env->arena, &parse_tree, env->tokens).error)
+        return false;
+
+    if (!env->strict) {
+        mp_optimize(&env->arena, &parse_tree);
+    }
+
+    switch (env->backend) {
+        case MP_MODE_INTERPRET: {
+            MP_Arena previous = env->interpreter.arena;
+            env->interpreter.arena = env->arena;
+            env->interpreter.tree = parse_tree;
+            env->arena = previous;
+            env->evaluations = 0;
+            env->promotion_failed = false;
+        } break;
+
+        case MP_MODE_COMPILE: {
+            // Compiled after the current program and moved to the front on
+            // success, so a failure leaves the current program intact
+            MP_Program *program = &env->vm.program;
+            size_t previous = program->count;
+
+            if (!mp_program_compile_with(program, parse_tree.root, &env->stack)) {
+                program->count = previous;
+                return false;
+            }
+
+            program->count -= previous;
+            memmove(program->items, program->items + previous,
+                    program->count * sizeof(*program->items));
+            mp_vm_verify(&env->vm);
+        } break;
+
+        case MP_MODE_INCREMENTAL: {
+            mp_incremental_build_with(&env->incremental, parse_tree, &env->stack);
+        } break;
+
+        default: {
+            assert(false && "Unreachable MP_MODE");
+        } break;
+    }
+
+    return true;
+}
+
+// Returns a new environment for the expression of env where the variables in
+// vars, e.g. "abc", are replaced by their current values. What became constant
+// is folded and the rest optimized again, so the new environment only computes
+// the part that depends on the other variables. env is left untouched.
+MP_Env *mp_specialize(MP_Env *env, const char *vars)
+{
+    if (env == NULL || vars == NULL)
+        return NULL;
+
+    uint32_t frozen = 0;
+    for (const char *v = vars; *v != '\0'; ++v) {
+        if (*v < 'a' || *v > 'z')
+            return NULL;
+        frozen |= 1u << (*v - 'a');
+    }
+
+    MP_Env *special = mp_allocator_alloc(&env->allocator, sizeof(*special));
+    if (special == NULL)
+        return NULL;
+    memset(special, 0, sizeof(*special));
+
+    special->mode = env->mode;
+    special->backend = env->backend;
+    special->allocator = env->allocator;
+    special->strict = env->strict;
+    special->adaptive_threshold = env->adaptive_threshold;
+    special->tokens.allocator = &special->allocator;
+    special->arena.allocator = &special->allocator;
+    special->stack.allocator = &special->allocator;
+
+    MP_Arena arena = {0};
+    arena.allocator = &special->allocator;
+    MP_Parse_Tree tree = {0};
+    const double *values = NULL;
+    MP_Precision precision = MP_PRECISION_EXACT;
+    bool ok = false;
+
+    switch (env->backend) {
+        case MP_MODE_INTERPRET: {
+            tree.root = mp_tree_node_copy(&arena, env->interpreter.tree.root);
+            values = env->interpreter.vars;
+            precision = env->interpreter.precision;
+            ok = tree.root != NULL;
+        } break;
+
+        case MP_MODE_COMPILE: {
+            ok = mp_program_decompile(&arena, &tree, env->vm.program);
+            values = env->vm.vars;
+            precision = env->vm.precision;
+        } break;
+
+        case MP_MODE_INCREMENTAL: {
+            ok = mp_incremental_tree(&arena, &tree, &env->incremental);
+            values = env->incremental.vars;
+            precision = env->incremental.precision;
+        } break;
+
+        default: {
+            assert(false && "Unreachable MP_MODE");
+        } break;
+    }
+
+    if (!ok) {
+        mp_arena_free(&arena);
+        mp_allocator_free(&env->allocator, special, sizeof(*special));
+        return NULL;
+    }
+
+    mp_specialize_tree(&tree, frozen, values, precision);
+    if (!special->strict) {
+        mp_optimize(&arena, &tree);
+    }
+
+    ok = mp_env_setup(special, arena, tree, precision);
+    mp_da_free(&special->stack);
+    if (!ok) {
+        mp_allocator_free(&env->allocator, special, sizeof(*special));
+        return NULL;
+    }
+
+    for (char v = 'a'; v <= 'z'; ++v) {
+        mp_variable(special, v, values[v - 'a']);
+    }
+
+    return special;
+}
+
+// The VM that runs env in batches: the one of env, which MP_MODE_ADAPTIVE
+// compiles right away, or one compiled into temporary for the interpreter and
+// MP_MODE_INCREMENTAL, which the caller frees. NULL if it can't be compiled.
+static const MP_Vm *mp_env_batch_vm(MP_Env *env, MP_Vm *temporary)
+{
+    if (env->mode == MP_MODE_ADAPTIVE && !env->promotion_failed)
+        mp_promote(env);
+
+    if (env->backend == MP_MODE_COMPILE)
+        return &env->vm;
+
+    MP_Arena arena = {0};
+    arena.allocator = &env->allocator;
+    MP_Parse_Tree tree = {0};
+    const double *values = NULL;
+    MP_Precision precision = MP_PRECISION_EXACT;
+
+    if (env->backend == MP_MODE_INTERPRET) {
+        tree = env->interpreter.tree;
+        values = env->interpreter.vars;
+        precision = env->interpreter.precision;
+    } else if (mp_incremental_tree(&arena, &tree, &env->incremental)) {
+        values = env->incremental.vars;
+        precision = env->incremental.precision;
+    }
+
+    MP_Program program = {0};
+    program.allocator = &env->allocator;
+    bool ok = values != NULL && mp_program_compile_with(&program, tree.root, &env->stack);
+    mp_arena_free(&arena);
+
+    if (!ok) {
+        mp_da_free(&program);
+        return NULL;
+    }
+
+    *temporary = mp_vm_init(program);
+    temporary->precision = precision;
+    memcpy(temporary->vars, values, sizeof(temporary->vars));
+    mp_vm_verify(temporary);
+    return temporary;
+}
+
+// Evaluates the expression of env for every row, see Batch VM. The variables
+// without a column keep the value given by mp_variable.
+bool mp_evaluate_batch(MP_Env *env, const double *const columns[26],
+                       size_t rows, double *out)
+{
+    if (env == NULL)
+        return false;
+
+    MP_Vm temporary = {0};
+    const MP_Vm *vm = mp_env_batch_vm(env, &temporary);
+    bool ok = mp_vm_run_batch(vm, columns, rows, out);
+    mp_vm_free(&temporary);
+
+    return ok;
+}
+
+bool mp_evaluate_batch_f32(MP_Env *env, const float *const columns[26],
+                           size_t rows, float *out)
+{
+    if (env == NULL)
+        return false;
+
+    MP_Vm temporary = {0};
+    const MP_Vm *vm = mp_env_batch_vm(env, &temporary);
+    bool ok = mp_vm_run_batch_f32(vm, columns, rows, out);
+    mp_vm_free(&temporary);
+
+    return ok;
+}
+
+// Same as mp_evaluate_batch, errors gets the MP_Error_Type of every row
+bool mp_evaluate_batch_errors(MP_Env *env, const double *const columns[26],
+                              size_t rows, double *out, uint8_t *errors)
+{
+    if (env == NULL)
+        return false;
+
+    MP_Vm temporary = {0};
+    const MP_Vm *vm = mp_env_batch_vm(env, &temporary);
+    bool ok = mp_vm_run_batch_errors(vm, columns, rows, out, errors);
+    mp_vm_free(&temporary);
+
+    return ok;
+}
+
+bool mp_evaluate_batch_errors_f32(MP_Env *env, const float *const columns[26],
+                                  size_t rows, float *out, uint8_t *errors)
+{
+    if (env == NULL)
+        return false;
+
+    MP_Vm temporary = {0};
+    const MP_Vm *vm = mp_env_batch_vm(env, &temporary);
+    bool ok = mp_vm_run_batch_errors_f32(vm, columns, rows, out, errors);
+    mp_vm_free(&temporary);
+
+    return ok;
+}
+
+bool mp_reduce(MP_Env *env, const double *const columns[26], size_t rows,
+               MP_Reduce_Options options, MP_Reduction *reduction)
+{
+    if (env == NULL)
+        return false;
+
+    MP_Vm temporary = {0};
+    const MP_Vm *vm = mp_env_batch_vm(env, &temporary);
+    bool ok = mp_vm_reduce(vm, columns, rows, options, reduction);
+    mp_vm_free(&temporary);
+
+    return ok;
+}
+
+// Selects the rows for which the expression of env is true, see Batch VM
+bool mp_filter(MP_Env *env, const double *const columns[26], size_t rows,
+               uint64_t *bitmap, size_t *selected)
+{
+    if (env == NULL)
+        return false;
+
+    MP_Vm temporary = {0};
+    const MP_Vm *vm = mp_env_batch_vm(env, &temporary);
+    bool ok = mp_vm_filter(vm, columns, rows, bitmap, selected);
+    mp_vm_free(&temporary);
+
+    return ok;
+}
+
+bool mp_filter_rows(MP_Env *env, const double *const columns[26], size_t rows,
+                    size_t *indices, size_t *selected)
+{
+    if (env == NULL)
+        return false;
+
+    MP_Vm temporary = {0};
+    const MP_Vm *vm = mp_env_batch_vm(env, &temporary);
+    bool ok = mp_vm_filter_rows(vm, columns, rows, indices, selected);
+    mp_vm_free(&temporary);
+
+    return ok;
+}
+
+void mp_free(MP_Env *env)
+{
+    if (env == NULL)
+        return;
+
+    switch (env->backend) {
+        case MP_MODE_INTERPRET: {
+            mp_interpreter_free(&env->interpreter);
+        } break;
+
+        case MP_MODE_COMPILE: {
+            mp_vm_free(&env->vm);
+        } break;
+
+        case MP_MODE_INCREMENTAL: {
+            mp_incremental_free(&env->incremental);
+        } break;
+
+        default: {
+            assert(false && "Unreachable MP_MODE");
+        } break;
+    }
+
+    mp_da_free(&env->tokens);
+    mp_arena_free(&env->arena);
+    mp_da_free(&env->stack);
+
+    MP_Allocator allocator = env->allocator;
+    mp_allocator_free(&allocator, env, sizeof(*env));
+}
+
+MP_Env_Pool mp_pool_init(MP_Options options)
+{
+    MP_Env_Pool pool = {0};
+    pool.allocator = options.allocator;
+    pool.options = options;
+    return pool;
+}
+
+// Returns an environment for expression, from the pool if there is one. NULL
+// if the expression is invalid.
+MP_Env *mp_pool_acquire(MP_Env_Pool *pool, const char *expression)
+{
+    if (pool == NULL)
+        return NULL;
+
+    if (pool->count == 0)
+        return mp_init_options(expression, pool->options);
+
+    MP_Env *env = pool->items[pool->count - 1];
+    if (!mp_reinit(env, expression))
+        return NULL;
+
+    --pool->count;
+    return env;
+}
+
+void mp_pool_release(MP_Env_Pool *pool, MP_Env *env)
+{
+    if (pool == NULL || env == NULL)
+        return;
+
+    mp_da_append(pool, env);
+}
+
+void mp_pool_free(MP_Env_Pool *pool)
+{
+    if (pool == NULL)
+        return;
+
+    for (size_t i = 0; i < pool->count; ++i) {
+        mp_free(pool->items[i]);
+    }
+    mp_da_free(pool);
+}
+
+// Bytes of memory held by env, including the MP_Env itself
+size_t mp_memory_usage(const MP_Env *env)
+{
+    if (env == NULL)
+        return 0;
+
+    size_t size = sizeof(*env);
+    size += env->tokens.capacity * sizeof(*env->tokens.items);
+    size += mp_arena_size(&env->arena);
+    size += env->stack.capacity * sizeof(*env->stack.items);
+
+    switch (env->backend) {
+        case MP_MODE_INTERPRET: {
+            size += mp_arena_size(&env->interpreter.arena);
+            size += env->interpreter.frames.capacity
+                * sizeof(*env->interpreter.frames.items);
+            size += env->interpreter.values.capacity
+                * sizeof(*env->interpreter.values.items);
+        } break;
+
+        case MP_MODE_COMPILE: {
+            size += env->vm.program.capacity * sizeof(*env->vm.program.items);
+            size += env->vm.stack.capacity * sizeof(*env->vm.stack.items);
+        } break;
+
+        case MP_MODE_INCREMENTAL: {
+            size += env->incremental.nodes.capacity
+                * sizeof(*env->incremental.nodes.items);
+        } break;
+
+        default: {
+            assert(false && "Unreachable MP_MODE");
+        } break;
+    }
+
+    return size;
+}
+
+const char *mp_mode_to_string(MP_Mode mode)
+{
+    switch (mode) {
+        case MP_MODE_INTERPRET:   return "INTERPRET";
+        case MP_MODE_COMPILE:     return "COMPILE";
+        case MP_MODE_ADAPTIVE:    return "ADAPTIVE";
+        case MP_MODE_INCREMENTAL: return "INCREMENTAL";
+        default:                  return MP_STR_UNKNOWN;
+    }
+}
+
+#ifdef MP_PROFILE
+
+MP_Profile *mp_profile(MP_Env *env)
+{
+    if (env == NULL)
+        return NULL;
+
+    switch (env->backend) {
+        case MP_MODE_INTERPRET: return &env->interpreter.profile;
+        case MP_MODE_COMPILE:   return &env->vm.profile;
+        default:                return NULL;
+    }
+}
+
+void mp_profile_reset(MP_Env *env)
+{
+    MP_Profile *profile = mp_profile(env);
+    if (profile == NULL)
+        return;
+
+    memset(profile, 0, sizeof(*profile));
+}
+
+#endif // MP_PROFILE
+
+//---------------
+// Approximation
+//---------------
+
+// The piece of x and the polynomial evaluated at u in [-1, 1] over it
+static inline double mp_approx_piece(const MP_Approx *approx, double x)
+{
+    if (approx->pieces == 0)
+        return NAN;
+
+    double position = (x - approx->lo) * approx->scale;
+    double last = (double)approx->pieces;
+    position = position > 0 ? position : 0; // NaN too
+    position = position < last ? position : last;
+
+    size_t piece = (size_t)position;
+    piece = piece < approx->pieces ? piece : approx->pieces - 1;
+    double u = 2 * (position - (double)piece) - 1;
+
+    const double *c = approx->coefficients + piece * (MP_APPROX_DEGREE + 1);
+    double value = c[0];
+    for (size_t k = 1; k <= MP_APPROX_DEGREE; ++k) {
+        value = value * u + c[k];
+    }
+
+    return isnan(x) ? x : value;
+}
+
+// Interpolates the samples at the Chebyshev nodes of a piece, cos(pi * (j +
+// 1/2) / n) for j in [0, n), and turns the Chebyshev series into powers of u
+static void mp_approx_fit(const double *samples, double *coefficients)
+{
+    enum { N = MP_APPROX_DEGREE + 1 };
+    double chebyshev[N];
+    for (size_t k = 0; k < N; ++k) {
+        double sum = 0.0;
+        for (size_t j = 0; j < N; ++j) {
+            sum += samples[j] * cos(MP_PI * k * (j + 0.5) / N);
+        }
+        chebyshev[k] = (k == 0 ? 1.0 : 2.0) * sum / N;
+    }
+
+    // T[k+1] = 2u T[k] - T[k-1], the powers of the two last ones are kept
+    double powers[N] = {0};
+    double previous[N] = {0};
+    double current[N] = {0};
+    double next[N];
+    previous[0] = 1.0;
+    current[1] = 1.0;
+    powers[0] = chebyshev[0];
+    powers[1] = chebyshev[1];
+
+    for (size_t k = 2; k < N; ++k) {
+        for (size_t j = 0; j < N; ++j) {
+            next[j] = (j > 0 ? 2 * current[j - 1] : 0.0) - previous[j];
+            powers[j] += chebyshev[k] * next[j];
+        }
+        memcpy(previous, current, sizeof(previous));
+        memcpy(current, next, sizeof(current));
+    }
+
+    for (size_t j = 0; j < N; ++j) {
+        coefficients[j] = powers[N - 1 - j];
+    }
+}
+
+// Builds the approximation, see Approximation
+bool mp_approx_init(MP_Approx *approx, MP_Env *env, char var, double lo,
+                    double hi, double tolerance)
+{
+    if (approx == NULL)
+        return false;
+
+    *approx = (MP_Approx){0};
+    if (env == NULL || var < 'a' || var > 'z' || !isfinite(lo) || !isfinite(hi)
+            || !(lo < hi) || !(tolerance > 0))
+        return false;
+
+    const size_t n = MP_APPROX_DEGREE + 1;
+    const size_t per_piece = n > MP_APPROX_CHECKS ? n : MP_APPROX_CHECKS;
+    approx->allocator = env->allocator;
+    approx->lo = lo;
+    approx->hi = hi;
+
+    const double *columns[26] = {0};
+    bool ok = false;
+
+    for (size_t pieces = 1; pieces <= MP_APPROX_MAX_PIECES && !ok; pieces *= 2) {
+        size_t samples_size = pieces * per_piece * sizeof(double);
+        size_t coefficients_size = pieces * n * sizeof(double);
+        double *xs = mp_allocator_alloc(&approx->allocator, samples_size);
+        double *ys = mp_allocator_alloc(&approx->allocator, samples_size);
+        double *coefficients = mp_allocator_alloc(&approx->allocator, coefficients_size);
+        assert(xs != NULL && ys != NULL && coefficients != NULL && "Buy more RAM LOL");
+
+        double width = (hi - lo) / pieces;
+        columns[var - 'a'] = xs;
+
+        for (size_t i = 0; i < pieces; ++i) {
+            for (size_t j = 0; j < n; ++j) {
+                double u = cos(MP_PI * (j + 0.5) / n);
+                xs[i * n + j] = lo + (i + (u + 1) / 2) * width;
+            }
+        }
+
+        bool finite = mp_evaluate_batch(env, columns, pieces * n, ys);
+        for (size_t i = 0; i < pieces * n && finite; ++i) {
+            finite = isfinite(ys[i]);
+        }
+
+        if (finite) {
+            for (size_t i = 0; i < pieces; ++i) {
+                mp_approx_fit(ys + i * n, coefficients + i * n);
+            }
+
+            approx->pieces = pieces;
+            approx->scale = pieces / (hi - lo);
+            approx->coefficients = coefficients;
+
+            // The checks include both ends of every piece
+            for (size_t i = 0; i < pieces; ++i) {
+                for (size_t k = 0; k < MP_APPROX_CHECKS; ++k) {
+                    double x = lo + (i + (double)k / (MP_APPROX_CHECKS - 1)) * width;
+                    xs[i * MP_APPROX_CHECKS + k] = x < hi ? x : hi;
+                }
+            }
+
+            finite = mp_evaluate_batch(env, columns, pieces * MP_APPROX_CHECKS, ys);
+            approx->max_error = 0.0;
+            for (size_t i = 0; i < pieces * MP_APPROX_CHECKS && finite; ++i) {
+                double error = fabs(mp_approx_piece(approx, xs[i]) - ys[i]);
+                finite = isfinite(ys[i]);
+                approx->max_error = error > approx->max_error ? error : approx->max_error;
+            }
+
+            ok = finite && approx->max_error <= tolerance / 2;
+        }
+
+        if (!ok) {
+            mp_allocator_free(&approx->allocator, coefficients, coefficients_size);
+            approx->coefficients = NULL;
+        }
+        mp_allocator_free(&approx->allocator, xs, samples_size);
+        mp_allocator_free(&approx->allocator, ys, samples_size);
+
+        if (!finite)
+            break;
+    }
+
+    if (!ok) {
+        approx->pieces = 0;
+        return false;
+    }
+
+    return true;
+}
+
+double mp_approx_eval(const MP_Approx *approx, double x)
+{
+    return mp_approx_piece(approx, x);
+}
+
+void mp_approx_eval_batch(const MP_Approx *approx, const double *x,
+                          size_t rows, double *out)
+{
+    for (size_t i = 0; i < rows; ++i) {
+        out[i] = mp_approx_piece(approx, x[i]);
+    }
+}
+
+void mp_approx_free(MP_Approx *approx)
+{
+    if (approx == NULL)
+        return;
+
+    mp_allocator_free(&approx->allocator, approx->coefficients,
+                      approx->pieces * (MP_APPROX_DEGREE + 1) * sizeof(double));
+    approx->coefficients = NULL;
+    approx->pieces = 0;
+}
+
+//-------------
+// Program set
+//-------------
+
+static size_t mp_set_node_hash(const MP_Set_Node *n)
+{
+    uint64_t bits = 0;
+    memcpy(&bits, &n->value, sizeof(bits));
+
+    uint64_t h = 1469598103934665603ULL;
+    h = (h ^ (uint64_t)n->type) * 1099511628211ULL;
+    h = (h ^ (uint64_t)n->function) * 1099511628211ULL;
+    h = (h ^ (uint64_t)n->lhs) * 1099511628211ULL;
+    h = (h ^ (uint64_t)n->rhs) * 1099511628211ULL;
+    h = (h ^ bits) * 1099511628211ULL;
+    h = (h ^ (uint64_t)n->symbol) * 1099511628211ULL;
+    return (size_t)h;
+}
+
+static bool mp_set_node_equal(const MP_Set_Node *a, const MP_Set_Node *b)
+{
+    return a->type == b->type
+        && a->function == b->function
+        && a->lhs == b->lhs
+        && a->rhs == b->rhs
+        && memcmp(&a->value, &b->value, sizeof(a->value)) == 0
+        && a->symbol == b->symbol;
+}
+
+static void mp_set_builder_grow(MP_Set_Builder *b)
+{
+    size_t capacity = b->table_capacity == 0 ? 256 : b->table_capacity * 2;
+    size_t *table = MP_MALLOC(capacity * sizeof(*table));
+    assert(table != NULL && "Buy more RAM LOL");
+    memset(table, 0, capacity * sizeof(*table));
+
+    for (size_t i = 0; i < b->nodes.count; ++i) {
+        size_t j = mp_set_node_hash(&b->nodes.items[i]) & (capacity - 1);
+        while (table[j] != 0) {
+            j = (j + 1) & (capacity - 1);
+        }
+        table[j] = i + 1;
+    }
+
+    MP_FREE(b->table);
+    b->table = table;
+    b->table_capacity = capacity;
+}
+
+static size_t mp_set_builder_add(MP_Set_Builder *b, MP_Set_Node node)
+{
+    if ((b->nodes.count + 1) * 2 > b->table_capacity) {
+        mp_set_builder_grow(b);
+    }
+
+    size_t mask = b->table_capacity - 1;
+    size_t j = mp_set_node_hash(&node) & mask;
+    while (b->table[j] != 0) {
+        size_t id = b->table[j] - 1;
+        if (mp_set_node_equal(&b->nodes.items[id], &node))
+            return id;
+        j = (j + 1) & mask;
+    }
+
+    node.slot = MP_SET_NO_SLOT;
+    mp_da_append(&b->nodes, node);
+    b->table[j] = b->nodes.count;
+
+    return b->nodes.count - 1;
+}
+
+// The operands are interned before the node, last is the id of the subtree
+// interned last and the frame of a binary node keeps the one of its left
+// operand
+size_t mp_set_builder_intern(MP_Set_Builder *b, MP_Tree_Node *node)
+{
+    MP_Tree_Stack stack = {0};
+    size_t last = 0;
+
+    mp_tree_push(&stack, node, NULL, 0);
+
+    while (stack.count > 0) {
+        MP_Tree_Frame *frame = &stack.items[stack.count - 1];
+        MP_Tree_Node *t = frame->node;
+        MP_Tree_Node **operands[2];
+        size_t count = mp_tree_operands(t, operands);
+
+        if (frame->state < count) {
+            if (frame->state == 1) frame->first = last;
+            MP_Tree_Node *operand = *operands[frame->state++];
+            mp_tree_push(&stack, operand, NULL, 0);
+            continue;
+        }
+        --stack.count;
+
+        // A plus is its operand
+        if (t->type == MP_NODE_PLUS)
+            continue;
+
+        MP_Set_Node n = {0};
+        n.type = t->type;
+
+        switch (t->type) {
+            case MP_NODE_NUMBER: {
+                n.value = t->value;
+            } break;
+
+            case MP_NODE_SYMBOL: {
+                n.symbol = t->symbol;
+            } break;
+
+            case MP_NODE_FUNCTION: {
+                n.function = t->function.name;
+                n.lhs = last;
+
+                // Every call of an impure function is its own node, the value
+                // is otherwise unused so a unique one keeps it out of the table
+                if (!mp_function_pure(n.function)) {
+                    n.value = (double)b->nodes.count;
+                }
+            } break;
+
+            case MP_NODE_ADD:
+            case MP_NODE_MULTIPLY:
+            case MP_NODE_EQUAL:
+            case MP_NODE_NOT_EQUAL:
+            case MP_NODE_AND:
+            case MP_NODE_OR: {
+                n.lhs = frame->first;
+                n.rhs = last;
+
+                // These operators are commutative also in floating point (both
+                // operands of && and || are computed), so a canonical operand
+                // order finds more common terms
+                if (n.lhs > n.rhs) {
+                    size_t swap = n.lhs;
+                    n.lhs = n.rhs;
+                    n.rhs = swap;
+                }
+            } break;
+
+            case MP_NODE_SUBTRACT:
+            case MP_NODE_DIVIDE:
+            case MP_NODE_POWER:
+            case MP_NODE_LESS:
+            case MP_NODE_LESS_EQUAL:
+            case MP_NODE_GREATER:
+            case MP_NODE_GREATER_EQUAL:
+            case MP_NODE_SELECT:
+            case MP_NODE_ARGUMENTS:
+            case MP_NODE_BRANCHES: {
+                n.lhs = frame->first;
+                n.rhs = last;
+            } break;
+
+            case MP_NODE_MINUS: {
+                n.lhs = last;
+            } break;
+
+            case MP_NODE_POWI: {
+                n.lhs = last;
+                n.value = t->powi.exponent;
+            } break;
+
+            default: {
+                assert(false && "Unreachable MP_Node_Type");
+            } break;
+        }
+
+        last = mp_set_builder_add(b, n);
+    }
+
+    mp_da_free(&stack);
+    return last;
+}
+
+// A node is emitted after its operands, unless it has been stored already
+void mp_set_builder_emit(MP_Set_Builder *b, MP_Program *p, size_t id,
+                         size_t *slot_count)
+{
+    MP_Set_Stack stack = {0};
+    MP_Set_Frame root = {id, 0};
+    mp_da_append(&stack, root);
+
+    while (stack.count > 0) {
+        MP_Set_Frame *frame = &stack.items[stack.count - 1];
+        MP_Set_Node *n = &b->nodes.items[frame->id];
+        uint32_t state = frame->state++;
+
+        // The operand to emit before going on with n, if descend
+        size_t next = 0;
+        bool descend = false;
+
+        if (state == 0 && n->emitted && n->slot != MP_SET_NO_SLOT) {
+            mp_program_push_opcode(p, MP_OP_LOAD);
+            mp_program_push_slot(p, n->slot);
+            --stack.count;
+            continue;
+        }
+
+        switch (n->type) {
+            case MP_NODE_NUMBER: {
+                mp_program_emit_number(p, n->value);
+            } break;
+
+            case MP_NODE_SYMBOL: {
+                mp_program_emit_var(p, n->symbol - 'a');
+            } break;
+
+            case MP_NODE_FUNCTION:
+            case MP_NODE_MINUS:
+            case MP_NODE_POWI: {
+                if (state == 0) {
+                    next = n->lhs;
+                    descend = true;
+                } else if (n->type == MP_NODE_FUNCTION) {
+                    mp_program_push_opcode(p, MP_OP_FUNC);
+                    mp_program_push_function(p, n->function);
+                } else if (n->type == MP_NODE_MINUS) {
+                    mp_program_push_opcode(p, MP_OP_NEG);
+                } else {
+                    mp_program_push_opcode(p, MP_OP_POWI);
+                    mp_program_push_int(p, (int32_t)n->value);
+                }
+            } break;
+
+            // Two or more values, it is emitted again where it is shared
+            case MP_NODE_SELECT:
+            case MP_NODE_BRANCHES:
+            case MP_NODE_ARGUMENTS: {
+                if (state < 2) {
+                    next = state == 0 ? n->lhs : n->rhs;
+                    descend = true;
+                } else if (n->type == MP_NODE_SELECT) {
+                    mp_program_push_opcode(p, MP_OP_SELECT);
+                }
+            } break;
+
+            default: {
+                MP_Opcode op = mp_node_opcode(n->type);
+                assert(op != MP_OP_INVALID && "Unreachable MP_Node_Type");
+
+                MP_Set_Node *rhs = &b->nodes.items[n->rhs];
+                if (state == 0) {
+                    next = n->lhs;
+                    descend = true;
+                } else if (state == 1) {
+                    if (rhs->type == MP_NODE_SYMBOL
+                            && mp_program_emit_var_op(p, op, rhs->symbol - 'a'))
+                        break;
+                    if (rhs->type == MP_NODE_NUMBER
+                            && mp_program_emit_const_op(p, op, rhs->value))
+                        break;
+                    next = n->rhs;
+                    descend = true;
+                } else {
+                    mp_program_push_opcode(p, op);
+                }
+            } break;
+        }
+
+        if (descend) {
+            MP_Set_Frame operand = {next, 0};
+            mp_da_append(&stack, operand);
+            continue;
+        }
+        --stack.count;
+
+        n->emitted = true;
+
+        if (n->uses > 1 && n->type != MP_NODE_NUMBER && n->type != MP_NODE_SYMBOL
+                && n->type != MP_NODE_BRANCHES && n->type != MP_NODE_ARGUMENTS) {
+            n->slot = (*slot_count)++;
+            mp_program_push_opcode(p, MP_OP_STORE);
+            mp_program_push_slot(p, n->slot);
+        }
+    }
+
+    mp_da_free(&stack);
+}
+
+void mp_set_builder_free(MP_Set_Builder *b)
+{
+    if (b == NULL)
+        return;
+
+    mp_da_free(&b->nodes);
+    MP_FREE(b->table);
+    b->table = NULL;
+    b->table_capacity = 0;
+}
+
+MP_Program_Set *mp_program_set_init(const char **expressions, size_t count)
+{
+    if (expressions == NULL || count == 0)
+        return NULL;
+
+    MP_Program_Set *set = MP_MALLOC(sizeof(*set));
+    if (set == NULL)
+        return NULL;
+    memset(set, 0, sizeof(*set));
+
+    MP_Set_Builder builder = {0};
+    MP_Token_List token_list = {0};
+    size_t *roots = MP_MALLOC(count * sizeof(*roots));
+    assert(roots != NULL && "Buy more RAM LOL");
+
+    for (size_t i = 0; i < count; ++i) {
+        mp_da_reset(&token_list);
+
+        MP_Arena arena = {0};
+        MP_Parse_Tree parse_tree = {0};
+
+        if (expressions[i] == NULL
+            || mp_tokenize(&token_list, expressions[i]).error
+            || mp_parse(&arena, &parse_tree, token_list).error
+            || mp_tree_reference_count(parse_tree.root) > 0) {
+            mp_arena_free(&arena);
+            mp_da_free(&token_list);
+            mp_set_builder_free(&builder);
+            MP_FREE(roots);
+            MP_FREE(set);
+            return NULL;
+        }
+
+        mp_optimize(&arena, &parse_tree);
+        roots[i] = mp_set_builder_intern(&builder, parse_tree.root);
+        mp_arena_free(&arena);
+    }
+
+    mp_da_free(&token_list);
+
+    // Every node is emitted once, so a node is used once per edge coming
+    // from a distinct node plus once per expression it is the root of
+    for (size_t i = 0; i < builder.nodes.count; ++i) {
+        MP_Set_Node *n = &builder.nodes.items[i];
+        switch (n->type) {
+            case MP_NODE_NUMBER:
+            case MP_NODE_SYMBOL:
+                break;
+
+            case MP_NODE_FUNCTION:
+            case MP_NODE_MINUS:
+            case MP_NODE_POWI:
+                builder.nodes.items[n->lhs].uses++;
+                break;
+
+            default:
+                builder.nodes.items[n->lhs].uses++;
+                builder.nodes.items[n->rhs].uses++;
+                break;
+        }
+    }
+    for (size_t i = 0; i < count; ++i) {
+        builder.nodes.items[roots[i]].uses++;
+    }
+
+    MP_Program program = {0};
+    size_t slot_count = count;
+
+    for (size_t i = 0; i < count; ++i) {
+        mp_set_builder_emit(&builder, &program, roots[i], &slot_count);
+        mp_program_push_opcode(&program, MP_OP_STORE);
+        mp_program_push_slot(&program, i);
+        mp_program_push_opcode(&program, MP_OP_POP);
+    }
+
+    mp_set_builder_free(&builder);
+    MP_FREE(roots);
+
+    set->output_count = count;
+    set->shared_count = slot_count - count;
+    set->slots = MP_MALLOC(slot_count * sizeof(*set->slots));
+    assert(set->slots != NULL && "Buy more RAM LOL");
+    memset(set->slots, 0, slot_count * sizeof(*set->slots));
+
+    set->vm = mp_vm_init(program);
+    set->vm.slots = set->slots;
+    set->vm.slot_count = slot_count;
+    mp_vm_verify(&set->vm);
+
+    mp_program_set_variable(set, 'p', MP_PI);
+    mp_program_set_variable(set, 'e', MP_E);
+
+    return set;
+}
+
+void mp_program_set_variable(MP_Program_Set *set, char var, double value)
+{
+    if (set == NULL)
+        return;
+
+    mp_vm_var(&set->vm, var, value);
+}
+
+bool mp_program_set_evaluate(MP_Program_Set *set)
+{
+    if (set == NULL)
+        return false;
+
+    return mp_vm_run(&set->vm);
+}
+
+double mp_program_set_output(MP_Program_Set *set, size_t index)
+{
+    if (set == NULL || index >= set->output_count)
+        return 0.0;
+
+    return set->slots[index];
+}
+
+void mp_program_set_free(MP_Program_Set *set)
+{
+    if (set == NULL)
+        return;
+
+    mp_vm_free(&set->vm);
+    MP_FREE(set->slots);
+    MP_FREE(set);
+}
+
+//---------------
+// Formula graph
+//---------------
+
+static size_t mp_graph_hash(const char *name, size_t length)
+{
+    // FNV-1a
+    uint64_t h = 14695981039346656037ull;
+    for (size_t i = 0; i < length; ++i) {
+        h ^= (unsigned char)name[i];
+        h *= 1099511628211ull;
+    }
+    return (size_t)h;
+}
+
+static size_t mp_graph_lookup(const MP_Graph *g, const char *name, size_t length)
+{
+    if (g->table_capacity == 0)
+        return MP_GRAPH_NO_FORMULA;
+
+    size_t mask = g->table_capacity - 1;
+    for (size_t i = mp_graph_hash(name, length) & mask;; i = (i + 1) & mask) {
+        size_t entry = g->table[i];
+        if (entry == 0)
+            return MP_GRAPH_NO_FORMULA;
+
+        const char *other = g->formulas.items[entry - 1].name;
+        if (strncmp(other, name, length) == 0 && other[length] == '\0')
+            return entry - 1;
+    }
+}
+
+static void mp_graph_insert(MP_Graph *g, size_t index)
+{
+    // The table is kept at most half full
+    if (2 * (index + 1) > g->table_capacity) {
+        size_t capacity = g->table_capacity == 0 ? 64 : g->table_capacity * 2;
+        size_t *table = MP_MALLOC(capacity * sizeof(*table));
+        assert(table != NULL && "Buy more RAM LOL");
+        memset(table, 0, capacity * sizeof(*table));
+
+        MP_FREE(g->table);
+        g->table = table;
+        g->table_capacity = capacity;
+
+        for (size_t i = 0; i < index; ++i) {
+            mp_graph_insert(g, i);
+        }
+    }
+
+    const char *name = g->formulas.items[index].name;
+    size_t mask = g->table_capacity - 1;
+    size_t i = mp_graph_hash(name, strlen(name)) & mask;
+    while (g->table[i] != 0) {
+        i = (i + 1) & mask;
+    }
+    g->table[i] = index + 1;
 }
 
-bool mp_vm_run(MP_Vm *vm)
+static char *mp_graph_copy_string(const char *str)
 {
-#define ASSERT_PRESENT(o) if (!(o).present) return false
+    size_t size = strlen(str) + 1;
+    char *copy = MP_MALLOC(size);
+    assert(copy != NULL && "Buy more RAM LOL");
+    memcpy(copy, str, size);
+    return copy;
+}
 
-    if (vm == NULL)
-        return false;;
+// Resolves the references of the tree to the slots of the formulas they name
+// and collects the inputs and the variables of the formula
+static bool mp_graph_resolve(MP_Graph *g, MP_Formula *f, MP_Tree_Node *root)
+{
+    MP_Tree_Stack stack = {0};
+    bool ok = true;
 
-    MP_Stack *stack = &vm->stack;
-    MP_Program *program = &vm->program;
-    vm->ip = 0;
+    mp_tree_push(&stack, root, NULL, 0);
 
-    while (vm->ip < program->count) {
-        MP_Opcode op = program->items[vm->ip];
+    while (ok && stack.count > 0) {
+        MP_Tree_Node *node = stack.items[--stack.count].node;
+        mp_tree_push_operands(&stack, node);
 
-        switch (op) {
-            case MP_OP_PUSH_NUM: {
-                ++vm->ip;
-                double operand = *(double*)&program->items[vm->ip];
-                mp_stack_push(stack, operand);
-                vm->ip += sizeof(operand);
+        switch (node->type) {
+            case MP_NODE_SYMBOL: {
+                f->vars |= 1u << (node->symbol - 'a');
             } break;
 
-            case MP_OP_PUSH_VAR: {
-                ++vm->ip;
-                char var = *(char*)&program->items[vm->ip];
-                mp_stack_push(stack, vm->vars[(int)var]);
-                vm->ip += sizeof(var);
-            } break;
+            case MP_NODE_REFERENCE: {
+                size_t index = mp_graph_lookup(g, node->reference.name,
+                                               node->reference.length);
+                if (index == MP_GRAPH_NO_FORMULA) {
+                    ok = false;
+                    break;
+                }
+                node->reference.slot = index;
 
-            case MP_OP_ADD: {
-                MP_Optional b = mp_stack_pop(stack); ASSERT_PRESENT(b);
-                MP_Optional a = mp_stack_pop(stack); ASSERT_PRESENT(a);
-                mp_stack_push(stack, a.value + b.value);
-                ++vm->ip;
+                bool known = false;
+                for (size_t i = 0; i < f->input_count; ++i) {
+                    if (f->inputs[i] == index) known = true;
+                }
+                if (!known) f->inputs[f->input_count++] = index;
             } break;
 
-            case MP_OP_SUB: {
-                MP_Optional b = mp_stack_pop(stack); ASSERT_PRESENT(b);
-                MP_Optional a = mp_stack_pop(stack); ASSERT_PRESENT(a);
-                mp_stack_push(stack, a.value - b.value);
-                ++vm->ip;
-            } break;
+            default: break;
+        }
+    }
 
-            case MP_OP_MUL: {
-                MP_Optional b = mp_stack_pop(stack); ASSERT_PRESENT(b);
-                MP_Optional a = mp_stack_pop(stack); ASSERT_PRESENT(a);
-                mp_stack_push(stack, a.value * b.value);
-                ++vm->ip;
-            } break;
+    mp_da_free(&stack);
+    return ok;
+}
 
-            case MP_OP_DIV: {
-                MP_Optional b = mp_stack_pop(stack); ASSERT_PRESENT(b);
-                MP_Optional a = mp_stack_pop(stack); ASSERT_PRESENT(a);
-                mp_stack_push(stack, a.value / b.value);
-                ++vm->ip;
-            } break;
+static MP_Result mp_graph_compile(MP_Graph *g, size_t index)
+{
+    MP_Formula *f = &g->formulas.items[index];
 
-            case MP_OP_POW: {
-                MP_Optional b = mp_stack_pop(stack); ASSERT_PRESENT(b);
-                MP_Optional a = mp_stack_pop(stack); ASSERT_PRESENT(a);
-                mp_stack_push(stack, pow(a.value, b.value));
-                ++vm->ip;
-            } break;
+    mp_da_reset(&g->tokens);
+    mp_arena_reset(&g->arena);
 
-            case MP_OP_NEG: {
-                MP_Optional n = mp_stack_pop(stack); ASSERT_PRESENT(n);
-                mp_stack_push(stack, -n.value);
-                ++vm->ip;
-            } break;
+    MP_Parse_Tree tree = {0};
+    MP_Result result = mp_tokenize(&g->tokens, f->expression);
+    if (result.error) return result;
 
-            default: {
-                return false;
-            } break;
-        }
+    result = mp_parse(&g->arena, &tree, g->tokens);
+    if (result.error) return result;
+
+    mp_optimize(&g->arena, &tree);
+    f->cost = mp_tree_cost(tree.root);
+    f->pure = mp_tree_pure(tree.root);
+
+    MP_FREE(f->inputs);
+    f->inputs = NULL;
+    f->input_count = 0;
+    f->vars = 0;
+
+    size_t reference_count = mp_tree_reference_count(tree.root);
+    if (reference_count > 0) {
+        f->inputs = MP_MALLOC(reference_count * sizeof(*f->inputs));
+        assert(f->inputs != NULL && "Buy more RAM LOL");
     }
 
-    return true;
+    if (!mp_graph_resolve(g, f, tree.root)) {
+        result.error = true;
+        result.error_type = MP_ERROR_UNKNOWN_REFERENCE;
+        return result;
+    }
 
-#undef ASSERT_PRESENT
+    MP_Program program = {0};
+    if (!mp_program_compile(&program, tree)) {
+        mp_da_free(&program);
+        result.error = true;
+        result.error_type = MP_ERROR_INVALID_EXPRESSION;
+        return result;
+    }
+    mp_program_shrink(&program);
+
+    mp_vm_free(&f->vm);
+    f->vm = mp_vm_init(program);
+    f->vm.slots = g->values;
+    f->vm.slot_count = g->formulas.count;
+    mp_vm_verify(&f->vm);
+
+    f->compiled = true;
+    return result;
 }
 
-double mp_vm_result(MP_Vm *vm)
+// Sorts the formulas by level with Kahn's algorithm, one level at a time
+static MP_Result mp_graph_order(MP_Graph *g)
 {
-    if (vm == NULL)
-        return 0.0;
+    MP_Result result = {0};
+    size_t count = g->formulas.count;
+    MP_Formula *formulas = g->formulas.items;
 
-    return mp_stack_peek(&vm->stack).value;
+    size_t edge_count = 0;
+    for (size_t i = 0; i < count; ++i) {
+        edge_count += formulas[i].input_count;
+    }
+
+    // One more item everywhere so that no size is 0
+    g->order = MP_REALLOC(g->order, (count + 1) * sizeof(*g->order));
+    g->level_start = MP_REALLOC(g->level_start, (count + 1) * sizeof(*g->level_start));
+    g->user_start = MP_REALLOC(g->user_start, (count + 1) * sizeof(*g->user_start));
+    g->users = MP_REALLOC(g->users, (edge_count + 1) * sizeof(*g->users));
+    g->work = MP_REALLOC(g->work, (count + 1) * sizeof(*g->work));
+    assert(g->order != NULL && g->level_start != NULL && g->user_start != NULL
+           && g->users != NULL && g->work != NULL && "Buy more RAM LOL");
+
+    // Reverse edges: the users are counted, user_start[i] is used as a cursor
+    // while they are filled in and shifted back in place afterwards
+    memset(g->user_start, 0, (count + 1) * sizeof(*g->user_start));
+    for (size_t i = 0; i < count; ++i) {
+        for (size_t k = 0; k < formulas[i].input_count; ++k) {
+            g->user_start[formulas[i].inputs[k] + 1]++;
+        }
+    }
+    for (size_t i = 0; i < count; ++i) {
+        g->user_start[i + 1] += g->user_start[i];
+    }
+    for (size_t i = 0; i < count; ++i) {
+        for (size_t k = 0; k < formulas[i].input_count; ++k) {
+            g->users[g->user_start[formulas[i].inputs[k]]++] = i;
+        }
+    }
+    for (size_t i = count; i > 0; --i) {
+        g->user_start[i] = g->user_start[i - 1];
+    }
+    g->user_start[0] = 0;
+
+    // The work list holds the inputs not yet ordered of every formula
+    size_t *pending = g->work;
+    size_t ordered = 0;
+    for (size_t i = 0; i < count; ++i) {
+        pending[i] = formulas[i].input_count;
+        if (pending[i] == 0) {
+            formulas[i].level = 0;
+            g->order[ordered++] = i;
+        }
+    }
+
+    g->level_count = 0;
+    size_t begin = 0;
+    while (begin < ordered) {
+        size_t end = ordered;
+        g->level_start[g->level_count++] = begin;
+
+        for (size_t k = begin; k < end; ++k) {
+            size_t i = g->order[k];
+            for (size_t u = g->user_start[i]; u < g->user_start[i + 1]; ++u) {
+                size_t user = g->users[u];
+                if (--pending[user] == 0) {
+                    formulas[user].level = g->level_count;
+                    g->order[ordered++] = user;
+                }
+            }
+        }
+
+        begin = end;
+    }
+    g->level_start[g->level_count] = ordered;
+
+    if (ordered < count) {
+        // Every formula left has an input left, following them from any of
+        // them ends up going around a cycle
+        size_t i = 0;
+        while (pending[i] == 0) {
+            ++i;
+        }
+        for (size_t step = 0; step < count; ++step) {
+            for (size_t k = 0; k < formulas[i].input_count; ++k) {
+                if (pending[formulas[i].inputs[k]] > 0) {
+                    i = formulas[i].inputs[k];
+                    break;
+                }
+            }
+        }
+
+        g->error_formula = i;
+        result.error = true;
+        result.error_type = MP_ERROR_CIRCULAR_REFERENCE;
+        return result;
+    }
+
+    g->ordered = true;
+    return result;
 }
 
-void mp_vm_free(MP_Vm *vm)
+static void mp_graph_compute(MP_Graph *g, size_t index)
 {
-    if (vm == NULL)
-        return;
+    MP_Formula *f = &g->formulas.items[index];
 
-    mp_da_free(&vm->stack);
-    mp_da_free(&vm->program);
-}
+    memcpy(f->vm.vars, g->vars, sizeof(g->vars));
+    f->vm.slots = g->values;
+    f->vm.slot_count = g->formulas.count;
+    f->vm.precision = g->precision;
 
-//----------------
-// Simplified API
-//----------------
+    f->failed = !mp_vm_run(&f->vm);
+    if (f->failed)
+        return;
 
-// TODO: In this API, MP_Result's won't contain detailed data about errors
+    // Compared bitwise so that a NaN that stays NaN is not a change
+    double value = mp_vm_result(&f->vm);
+    f->updated = memcmp(&value, &g->values[index], sizeof(value)) != 0;
+    g->values[index] = value;
+}
 
-MP_Env *mp_init(const char *expression)
+#ifdef MP_THREADS
+static void mp_graph_compute_work(MP_Graph *g)
 {
-    return mp_init_mode(expression, MP_MODE_INTERPRET);
+    for (;;) {
+        size_t k = __atomic_fetch_add(&g->workers.next, 1, __ATOMIC_RELAXED);
+        if (k >= g->work_count)
+            break;
+        mp_graph_compute(g, g->work[k]);
+    }
 }
 
-MP_Env *mp_init_mode(const char *expression, MP_Mode mode)
+static void *mp_graph_worker(void *arg)
 {
-    if (expression == NULL) {
-        return NULL;
-    }
+    MP_Graph *g = arg;
+    MP_Graph_Workers *w = &g->workers;
+    size_t generation = 0;
+
+    for (;;) {
+        pthread_mutex_lock(&w->mutex);
+        while (!w->stop && w->generation == generation) {
+            pthread_cond_wait(&w->start, &w->mutex);
+        }
+        if (w->stop) {
+            pthread_mutex_unlock(&w->mutex);
+            return NULL;
+        }
+        generation = w->generation;
+        pthread_mutex_unlock(&w->mutex);
 
-    MP_Env *env = malloc(sizeof(*env));
-    if (env == NULL) {
-        return NULL;
+        mp_graph_compute_work(g);
+
+        pthread_mutex_lock(&w->mutex);
+        if (--w->running == 0)
+            pthread_cond_signal(&w->done);
+        pthread_mutex_unlock(&w->mutex);
     }
-    memset(env, 0, sizeof(*env));
+}
 
-    env->mode = mode;
+static void mp_graph_stop_workers(MP_Graph *g)
+{
+    MP_Graph_Workers *w = &g->workers;
+    if (w->count == 0)
+        return;
 
-    MP_Token_List token_list = {0};
+    pthread_mutex_lock(&w->mutex);
+    w->stop = true;
+    pthread_cond_broadcast(&w->start);
+    pthread_mutex_unlock(&w->mutex);
 
-    MP_Result tr = mp_tokenize(&token_list, expression);
-    if (tr.error) {
-        free(env);
-        mp_da_free(&token_list);
-        return NULL;
+    for (size_t i = 0; i < w->count; ++i) {
+        pthread_join(w->threads[i], NULL);
     }
 
-    MP_Arena arena = {0};
-    MP_Parse_Tree parse_tree = {0};
+    pthread_cond_destroy(&w->done);
+    pthread_cond_destroy(&w->start);
+    pthread_mutex_destroy(&w->mutex);
+    MP_FREE(w->threads);
+    memset(w, 0, sizeof(*w));
+}
+#endif // MP_THREADS
 
-    MP_Result pr = mp_parse(&arena, &parse_tree, token_list);
-    if (pr.error) {
-        free(env);
-        mp_da_free(&token_list);
-        mp_arena_free(&arena);
-        return NULL;
+// Computes the work list, with the workers if there is enough work
+static void mp_graph_compute_level(MP_Graph *g)
+{
+#ifdef MP_THREADS
+    MP_Graph_Workers *w = &g->workers;
+    bool enough = g->work_count >= MP_GRAPH_PARALLEL_THRESHOLD
+               || g->work_cost >= MP_GRAPH_PARALLEL_COST;
+    if (w->count > 0 && g->work_count > 1 && enough) {
+        pthread_mutex_lock(&w->mutex);
+        w->next = 0;
+        w->running = w->count;
+        w->generation++;
+        pthread_cond_broadcast(&w->start);
+        pthread_mutex_unlock(&w->mutex);
+
+        mp_graph_compute_work(g);
+
+        pthread_mutex_lock(&w->mutex);
+        while (w->running > 0) {
+            pthread_cond_wait(&w->done, &w->mutex);
+        }
+        pthread_mutex_unlock(&w->mutex);
+        return;
     }
+#endif
 
-    mp_da_free(&token_list);
-
-    switch (env->mode) {
-        case MP_MODE_INTERPRET: {
-            env->interpreter = mp_interpreter_init(parse_tree, arena);
-        } break;
+    for (size_t k = 0; k < g->work_count; ++k) {
+        mp_graph_compute(g, g->work[k]);
+    }
+}
 
-        case MP_MODE_COMPILE: {
-            MP_Program program = {0};
+MP_Graph *mp_graph_init(void)
+{
+    MP_Graph *g = MP_MALLOC(sizeof(*g));
+    if (g == NULL)
+        return NULL;
+    memset(g, 0, sizeof(*g));
 
-            if (!mp_program_compile(&program, parse_tree)) {
-                free(env);
-                mp_arena_free(&arena);
-                mp_da_free(&program);
-                return NULL;
-            }
+    g->error_formula = MP_GRAPH_NO_FORMULA;
+    mp_graph_variable(g, 'p', MP_PI);
+    mp_graph_variable(g, 'e', MP_E);
 
-            mp_arena_free(&arena);
+    return g;
+}
 
-            env->vm = mp_vm_init(program);
-        } break;
+// Adds a formula or replaces the one with the same name, the name is made of
+// letters, digits and '_'. Returns the index of the formula, which doesn't
+// change afterwards, or MP_GRAPH_NO_FORMULA. The expression is compiled by the
+// next mp_graph_update, so it can reference formulas that are set later.
+size_t mp_graph_set(MP_Graph *g, const char *name, const char *expression)
+{
+    if (g == NULL || name == NULL || expression == NULL)
+        return MP_GRAPH_NO_FORMULA;
+
+    size_t length = strlen(name);
+    if (length == 0 || mp_reference_length(name) != length)
+        return MP_GRAPH_NO_FORMULA;
+
+    size_t index = mp_graph_lookup(g, name, length);
+    if (index == MP_GRAPH_NO_FORMULA) {
+        MP_Formula f = {0};
+        f.name = mp_graph_copy_string(name);
+
+        size_t capacity = g->formulas.capacity;
+        mp_da_append(&g->formulas, f);
+        if (g->formulas.capacity != capacity) {
+            g->values = MP_REALLOC(g->values,
+                                   g->formulas.capacity * sizeof(*g->values));
+            assert(g->values != NULL && "Buy more RAM LOL");
+        }
 
-        default: {
-            assert(false && "Unreachable MP_MODE");
-        } break;
+        index = g->formulas.count - 1;
+        g->values[index] = 0.0;
+        mp_graph_insert(g, index);
     }
 
-    mp_variable(env, 'p', MP_PI);
-    mp_variable(env, 'e', MP_E);
-
-    return env;
+    MP_Formula *f = &g->formulas.items[index];
+    MP_FREE(f->expression);
+    f->expression = mp_graph_copy_string(expression);
+    f->compiled = false;
+    f->changed = true;
+    g->ordered = false;
 
+    return index;
 }
 
-void mp_variable(MP_Env *env, char var, double value)
+size_t mp_graph_find(const MP_Graph *g, const char *name)
 {
-    if (env == NULL)
-        return;
+    if (g == NULL || name == NULL)
+        return MP_GRAPH_NO_FORMULA;
 
-    switch (env->mode) {
-        case MP_MODE_INTERPRET: {
-            mp_interpreter_var(&env->interpreter, var, value);
-        } break;
+    return mp_graph_lookup(g, name, strlen(name));
+}
 
-        case MP_MODE_COMPILE: {
-            mp_vm_var(&env->vm, var, value);
-        } break;
+void mp_graph_variable(MP_Graph *g, char var, double value)
+{
+    if (g == NULL)
+        return;
 
-        default: {
-            assert(false && "Unreachable MP_MODE");
-        } break;
+    assert('a' <= var && var <= 'z');
+    double *v = &g->vars[var - 'a'];
+    if (memcmp(v, &value, sizeof(value)) != 0) {
+        *v = value;
+        g->dirty_vars |= 1u << (var - 'a');
     }
 }
 
-MP_Result mp_evaluate(MP_Env *env)
+// On failure error_formula is the formula at fault, the values computed so far
+// are kept and the formulas left are computed again by the next update
+MP_Result mp_graph_update(MP_Graph *g)
 {
     MP_Result result = {0};
-
-    if (env == NULL) {
+    if (g == NULL) {
         result.error = true;
         return result;
     }
 
-    switch (env->mode) {
-        case MP_MODE_INTERPRET: {
-            result = mp_interpret(&env->interpreter);
-        } break;
+    g->computed = 0;
+    g->error_formula = MP_GRAPH_NO_FORMULA;
+    MP_Formula *formulas = g->formulas.items;
 
-        case MP_MODE_COMPILE: {
-            if (!mp_vm_run(&env->vm)) {
+    for (size_t i = 0; i < g->formulas.count; ++i) {
+        if (formulas[i].compiled)
+            continue;
+
+        result = mp_graph_compile(g, i);
+        if (result.error) {
+            g->error_formula = i;
+            return result;
+        }
+    }
+
+    if (!g->ordered) {
+        result = mp_graph_order(g);
+        if (result.error) return result;
+    }
+
+    for (size_t i = 0; i < g->formulas.count; ++i) {
+        MP_Formula *f = &formulas[i];
+        f->dirty = f->changed || !f->pure || (f->vars & g->dirty_vars) != 0;
+    }
+
+    for (size_t level = 0; level < g->level_count; ++level) {
+        g->work_count = 0;
+        g->work_cost = 0;
+        for (size_t k = g->level_start[level]; k < g->level_start[level + 1]; ++k) {
+            size_t i = g->order[k];
+            if (!formulas[i].dirty) continue;
+            g->work[g->work_count++] = i;
+            g->work_cost += formulas[i].cost;
+        }
+
+        mp_graph_compute_level(g);
+        g->computed += g->work_count;
+
+        for (size_t k = 0; k < g->work_count; ++k) {
+            size_t i = g->work[k];
+            MP_Formula *f = &formulas[i];
+
+            if (f->failed) {
+                // The formulas computed so far were not propagated
+                for (size_t j = 0; j < g->formulas.count; ++j) {
+                    formulas[j].changed = true;
+                }
+                g->error_formula = i;
                 result.error = true;
+                result.error_type = f->vm.error;
                 return result;
             }
 
-            result.value = mp_vm_result(&env->vm);
-        } break;
+            f->changed = false;
+            f->dirty = false;
+            if (!f->updated)
+                continue;
 
-        default: {
-            assert(false && "Unreachable MP_MODE");
-        } break;
+            for (size_t u = g->user_start[i]; u < g->user_start[i + 1]; ++u) {
+                formulas[g->users[u]].dirty = true;
+            }
+        }
     }
 
+    g->dirty_vars = 0;
     return result;
 }
 
-void mp_free(MP_Env *env)
+double mp_graph_value(const MP_Graph *g, size_t index)
 {
-    if (env == NULL)
-        return;
+    if (g == NULL || index >= g->formulas.count)
+        return 0.0;
 
-    switch (env->mode) {
-        case MP_MODE_INTERPRET: {
-            mp_interpreter_free(&env->interpreter);
-        } break;
+    return g->values[index];
+}
 
-        case MP_MODE_COMPILE: {
-            mp_vm_free(&env->vm);
-        } break;
+// Uses count threads, the calling one included, to compute the levels of the
+// next updates. Returns false if mp.h is compiled without MP_THREADS.
+bool mp_graph_threads(MP_Graph *g, size_t count)
+{
+    if (g == NULL)
+        return false;
 
-        default: {
-            assert(false && "Unreachable MP_MODE");
-        } break;
+#ifdef MP_THREADS
+    mp_graph_stop_workers(g);
+    if (count <= 1)
+        return true;
+
+    MP_Graph_Workers *w = &g->workers;
+    w->threads = MP_MALLOC((count - 1) * sizeof(*w->threads));
+    assert(w->threads != NULL && "Buy more RAM LOL");
+    pthread_mutex_init(&w->mutex, NULL);
+    pthread_cond_init(&w->start, NULL);
+    pthread_cond_init(&w->done, NULL);
+
+    for (size_t i = 0; i < count - 1; ++i) {
+        if (pthread_create(&w->threads[i], NULL, mp_graph_worker, g) != 0)
+            break;
+        w->count++;
+    }
+
+    if (w->count == 0) {
+        pthread_cond_destroy(&w->done);
+        pthread_cond_destroy(&w->start);
+        pthread_mutex_destroy(&w->mutex);
+        MP_FREE(w->threads);
+        memset(w, 0, sizeof(*w));
+        return false;
     }
 
-    free(env);
+    return true;
+#else
+    return count <= 1;
+#endif
+}
+
+void mp_graph_free(MP_Graph *g)
+{
+    if (g == NULL)
+        return;
+
+#ifdef MP_THREADS
+    mp_graph_stop_workers(g);
+#endif
+
+    for (size_t i = 0; i < g->formulas.count; ++i) {
+        MP_Formula *f = &g->formulas.items[i];
+        MP_FREE(f->name);
+        MP_FREE(f->expression);
+        MP_FREE(f->inputs);
+        mp_vm_free(&f->vm);
+    }
+    mp_da_free(&g->formulas);
+
+    MP_FREE(g->values);
+    MP_FREE(g->table);
+    MP_FREE(g->order);
+    MP_FREE(g->level_start);
+    MP_FREE(g->users);
+    MP_FREE(g->user_start);
+    MP_FREE(g->work);
+    mp_da_free(&g->tokens);
+    mp_arena_free(&g->arena);
+    MP_FREE(g);
 }
 
 #endif // MP_IMPLEMENTATION
@@ -1540,6 +9619,58 @@ void mp_free(MP_Env *env)
 /*
     Revision history:
 
+        1.27.0 (2026-10-18) Add MP_Approx, piecewise Chebyshev approximations
+                            of an expression in one variable with a given
+                            error, mp_approx_eval() and mp_approx_eval_batch()
+        1.26.0 (2026-10-18) Add solvers that run the VM directly:
+                            bisection, Brent, Newton, golden-section and
+                            Nelder-Mead, and mp_solve_bisection_batch()
+        1.25.0 (2026-10-18) Add per-row batch errors with
+                            mp_vm_run_batch_errors() and
+                            mp_evaluate_batch_errors(), division by zero
+                            fails in every backend unless MP_IEEE
+        1.24.0 (2026-10-18) Add float batches with mp_vm_run_batch_f32() and
+                            mp_evaluate_batch_f32(), the batch VM is a macro
+                            template over the element type
+        1.23.0 (2026-10-18) Add native functions registered with
+                            mp_register_function(), with purity and cost
+        1.22.0 (2026-10-18) Add functions of several arguments min(), max(),
+                            pow(), atan2(), hypot(), fma() and clamp()
+        1.21.0 (2026-10-18) Add comparison, logical and conditional operators,
+                            branchless select opcodes, mp_filter() and
+                            mp_filter_rows()
+        1.20.0 (2026-10-18) Add the batch VM, mp_evaluate_batch() and
+                            mp_reduce() with plain, Kahan or pairwise sums
+        1.19.0 (2026-10-18) Add MP_Graph, named formulas that reference each
+                            other with $name and are updated incrementally
+        1.18.0 (2026-10-18) Add mp_specialize() to fold variables that don't
+                            change into the expression
+        1.17.0 (2026-10-18) Add MP_MODE_INCREMENTAL, which computes again
+                            only the subexpressions of changed variables
+        1.16.0 (2026-10-18) Denser bytecode: variables folded in the opcode,
+                            small constants inline, ADD_VAR, MUL_CONST, ...
+        1.15.0 (2026-10-18) Add mp_program_verify(), verified programs run
+                            without the checks of the VM
+        1.14.0 (2026-10-18) Add mp_reinit() and MP_Env_Pool to replace the
+                            expression of an environment without allocating
+        1.13.0 (2026-10-18) Right-size the memory of an MP_Env, add
+                            mp_memory_usage()
+        1.12.0 (2026-10-18) Add MP_MODE_ADAPTIVE, the default of mp_init(), and
+                            mp_promote()
+        1.11.0 (2026-10-18) Parse with explicit stacks in mp_parse_operators()
+                            and make the arena a linked list of regions
+        1.10.0 (2026-10-18) Parse numbers without strtod, independently of the
+                            locale, with mp_parse_number()
+        1.9.0 (2026-10-18) Add MP_PRECISION_FAST with table and polynomial
+                           approximations of the functions and x^y
+        1.8.0 (2026-10-18) Add mp_optimize: integer powers, x^0.5 and polynomials in
+                           Horner form no longer call pow()
+        1.7.0 (2026-10-18) Add MP_MALLOC/MP_REALLOC/MP_FREE, MP_Allocator and
+                           mp_init_options()
+        1.6.0 (2026-10-18) Add opt-in profiling with MP_PROFILE. Fix the VM stack
+                           growing by one value at each evaluation
+        1.5.0 (2026-10-18) Add program sets sharing common subexpressions across
+                           expressions. Functions can now be compiled
         1.4.0 (2025-06-01) Add functions log(), cos(), tan(), sqrt()
         1.3.0 (2025-06-01) Add function support (ln, sin) to the interpreter
         1.2.0 (2025-06-01) Now interpreter supports variables. Various fixes. Improved modularity
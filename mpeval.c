@@ -0,0 +1,803 @@
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MP_IMPLEMENTATION
+#include "mp.h"
+
+// Evaluates an expression over many rows. The values of the variables come
+// from binary column files or from CSV, see usage().
+//
+// A column file is a raw array of doubles or floats, or the same preceded by a
+// header: the 4 bytes "MPC1", the size of an element (uint32, 4 or 8) and the
+// number of rows (uint64), all in native byte order. The output file has the
+// same layout, with the header when -H is given.
+
+#define CHUNK_ROWS (64*1024) // Rows handed to a thread at a time, a multiple of MP_BATCH_SIZE
+#define CSV_BATCH_ROWS (64*1024)
+#define CSV_READ_SIZE (1024*1024)
+#define CSV_FIELD_CAPACITY 64
+
+typedef enum {
+    TYPE_F64,
+    TYPE_F32,
+} Type;
+
+typedef struct {
+    char magic[4];
+    uint32_t element_size;
+    uint64_t rows;
+} Header;
+
+typedef struct {
+    const char *path;
+    Type type;
+    const void *data; // First row
+    size_t rows;
+    void *map;
+    size_t map_size;
+} Column;
+
+typedef struct {
+    const char *expression;
+    Column columns[26];
+    bool has_column[26];
+    double values[26];
+    bool has_value[26];
+    const char *output;
+    const char *errors;
+    const char *csv;
+    Type type;
+    bool type_given;
+    bool header;
+    size_t threads;
+    bool quiet;
+} Options;
+
+Options options;
+
+long long now_ns(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (long long)t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+size_t type_size(Type type)
+{
+    return type == TYPE_F32 ? sizeof(float) : sizeof(double);
+}
+
+void usage(const char *program)
+{
+    fprintf(stderr, "Usage: %s [options] [--] expression\n", program);
+    fprintf(stderr, "  -c VAR=FILE[:f32|:f64]  Column file of a variable, raw doubles unless\n");
+    fprintf(stderr, "                          it has a header or the type is given\n");
+    fprintf(stderr, "  -s VAR=VALUE            Same value for every row\n");
+    fprintf(stderr, "  -o FILE                 Output file, required with -c\n");
+    fprintf(stderr, "  -e FILE                 Error code of every row (uint8, MP_Error_Type)\n");
+    fprintf(stderr, "  -t f32|f64              Type of the evaluation and of the output, f32\n");
+    fprintf(stderr, "                          by default when all the columns are f32\n");
+    fprintf(stderr, "  -H                      Write a header in the output file\n");
+    fprintf(stderr, "  -j N                    Threads, the online CPUs by default\n");
+    fprintf(stderr, "  --csv FILE              Read the rows from CSV (- for stdin), its first\n");
+    fprintf(stderr, "                          line names the columns, the ones named by a\n");
+    fprintf(stderr, "                          variable are used. Writes CSV to -o or stdout,\n");
+    fprintf(stderr, "                          -c, -e, -t, -H and -j are not supported\n");
+    fprintf(stderr, "  -q                      Don't print the throughput on stderr\n");
+    fprintf(stderr, "A variable without a column or a value is 0.\n");
+}
+
+void fail(const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    fprintf(stderr, "ERROR: ");
+    vfprintf(stderr, fmt, args);
+    fprintf(stderr, "\n");
+    va_end(args);
+    exit(EXIT_FAILURE);
+}
+
+void report(const char *what, size_t rows, size_t bytes, long long ns)
+{
+    if (options.quiet)
+        return;
+
+    double seconds = ns > 0 ? ns / 1e9 : 1e-9;
+    fprintf(stderr, "%s: %zu rows in %.3f s, %.1f M rows/s, %.1f MB/s\n",
+            what, rows, seconds, rows / seconds / 1e6,
+            bytes / seconds / 1e6);
+}
+
+//-----------
+// Arguments
+//-----------
+
+int parse_variable(const char *arg, const char **rest)
+{
+    if (arg[0] < 'a' || arg[0] > 'z' || arg[1] != '=')
+        fail("Expected VAR=..., with VAR from a to z: %s", arg);
+
+    *rest = arg + 2;
+    return arg[0] - 'a';
+}
+
+void parse_arguments(int argc, char **argv)
+{
+    options.threads = (size_t)sysconf(_SC_NPROCESSORS_ONLN);
+
+    // The first option given that only applies to column files
+    const char *columns_only = NULL;
+
+    for (int i = 1; i < argc; ++i) {
+        const char *arg = argv[i];
+        bool has_next = i + 1 < argc;
+
+        if (strcmp(arg, "--") == 0 && has_next && options.expression == NULL) {
+            options.expression = argv[++i];
+        } else if (strcmp(arg, "-h") == 0 || strcmp(arg, "--help") == 0) {
+            usage(argv[0]);
+            exit(EXIT_SUCCESS);
+        } else if (strcmp(arg, "-H") == 0) {
+            options.header = true;
+            if (columns_only == NULL) columns_only = arg;
+        } else if (strcmp(arg, "-q") == 0) {
+            options.quiet = true;
+        } else if (arg[0] == '-' && arg[1] != '\0' && !has_next) {
+            fail("Missing value of %s", arg);
+        } else if (strcmp(arg, "-c") == 0) {
+            if (columns_only == NULL) columns_only = arg;
+            const char *path;
+            int var = parse_variable(argv[++i], &path);
+            Column *column = &options.columns[var];
+            options.has_column[var] = true;
+            column->path = path;
+            column->type = TYPE_F64;
+
+            // The type suffix is kept out of the path
+            const char *colon = strrchr(path, ':');
+            if (colon != NULL && (strcmp(colon, ":f32") == 0 || strcmp(colon, ":f64") == 0)) {
+                column->type = strcmp(colon, ":f32") == 0 ? TYPE_F32 : TYPE_F64;
+                column->path = strndup(path, colon - path);
+            }
+        } else if (strcmp(arg, "-s") == 0) {
+            const char *value;
+            int var = parse_variable(argv[++i], &value);
+            char *end;
+            options.values[var] = strtod(value, &end);
+            options.has_value[var] = true;
+            if (end == value || *end != '\0')
+                fail("Invalid value: %s", value);
+        } else if (strcmp(arg, "-o") == 0) {
+            options.output = argv[++i];
+        } else if (strcmp(arg, "-e") == 0) {
+            if (columns_only == NULL) columns_only = arg;
+            options.errors = argv[++i];
+        } else if (strcmp(arg, "-t") == 0) {
+            if (columns_only == NULL) columns_only = arg;
+            const char *type = argv[++i];
+            if (strcmp(type, "f32") != 0 && strcmp(type, "f64") != 0)
+                fail("Unknown type %s", type);
+            options.type = strcmp(type, "f32") == 0 ? TYPE_F32 : TYPE_F64;
+            options.type_given = true;
+        } else if (strcmp(arg, "-j") == 0) {
+            if (columns_only == NULL) columns_only = arg;
+            options.threads = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(arg, "--csv") == 0) {
+            options.csv = argv[++i];
+        } else if (arg[0] == '-' && arg[1] != '\0') {
+            fail("Unknown option %s", arg);
+        } else if (options.expression == NULL) {
+            options.expression = arg;
+        } else {
+            fail("More than one expression given");
+        }
+    }
+
+    if (options.expression == NULL) {
+        usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    // The CSV rows are parsed and evaluated on one thread, in doubles
+    if (options.csv != NULL && columns_only != NULL)
+        fail("%s is not supported with --csv", columns_only);
+
+    if (options.threads == 0)
+        options.threads = 1;
+}
+
+MP_Env *init_env(void)
+{
+    MP_Env *env = mp_init_mode(options.expression, MP_MODE_COMPILE);
+    if (env == NULL)
+        fail("Invalid expression: %s", options.expression);
+
+    if (!mp_program_batchable(env->vm.program))
+        fail("The expression can't be evaluated in batches");
+
+    for (int var = 0; var < 26; ++var) {
+        if (options.has_value[var])
+            mp_variable(env, 'a' + var, options.values[var]);
+    }
+
+    return env;
+}
+
+//-------------------
+// Memory mapped I/O
+//-------------------
+
+void map_column(Column *column)
+{
+    int fd = open(column->path, O_RDONLY);
+    if (fd < 0)
+        fail("Could not open %s: %s", column->path, strerror(errno));
+
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+        fail("Could not stat %s: %s", column->path, strerror(errno));
+
+    column->map_size = (size_t)st.st_size;
+    column->map = NULL;
+    if (column->map_size > 0) {
+        column->map = mmap(NULL, column->map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (column->map == MAP_FAILED)
+            fail("Could not map %s: %s", column->path, strerror(errno));
+        madvise(column->map, column->map_size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+
+    size_t offset = 0;
+    Header header = {0};
+    if (column->map_size >= sizeof(header)) {
+        memcpy(&header, column->map, sizeof(header));
+        if (memcmp(header.magic, "MPC1", 4) == 0) {
+            if (header.element_size != sizeof(float) && header.element_size != sizeof(double))
+                fail("%s: unknown element size %u", column->path, header.element_size);
+            column->type = header.element_size == sizeof(float) ? TYPE_F32 : TYPE_F64;
+            offset = sizeof(header);
+        }
+    }
+
+    size_t size = type_size(column->type);
+    if ((column->map_size - offset) % size != 0)
+        fail("%s: the size isn't a multiple of %zu", column->path, size);
+
+    column->rows = (column->map_size - offset) / size;
+    if (offset > 0 && header.rows != column->rows)
+        fail("%s: the header gives %llu rows, the file has %zu", column->path,
+             (unsigned long long)header.rows, column->rows);
+
+    column->data = (const char*)column->map + offset;
+}
+
+// Creates the file with size bytes and maps it for writing
+void *map_output(const char *path, size_t size)
+{
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        fail("Could not open %s: %s", path, strerror(errno));
+
+    if (ftruncate(fd, (off_t)size) < 0)
+        fail("Could not resize %s: %s", path, strerror(errno));
+
+    void *map = NULL;
+    if (size > 0) {
+        map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED)
+            fail("Could not map %s: %s", path, strerror(errno));
+    }
+    close(fd);
+
+    return map;
+}
+
+//---------------
+// Binary columns
+//---------------
+
+typedef struct {
+    const MP_Vm *vm;
+    const Column *columns[26];
+    size_t rows;
+    Type type;
+    void *out;
+    uint8_t *errors;
+
+    pthread_mutex_t mutex;
+    size_t next; // First row of the next chunk
+    bool failed;
+} Job;
+
+typedef struct {
+    Job *job;
+    void *converted[26]; // CHUNK_ROWS rows of the columns of the other type
+    pthread_t thread;
+    bool started;
+} Worker;
+
+// Gives the rows [begin, begin + n) of the column as the type of the job
+const void *chunk_column(Worker *w, int var, size_t begin, size_t n)
+{
+    const Column *column = w->job->columns[var];
+    if (column->type == w->job->type)
+        return (const char*)column->data + begin * type_size(column->type);
+
+    if (w->converted[var] == NULL) {
+        w->converted[var] = malloc(CHUNK_ROWS * sizeof(double));
+        assert(w->converted[var] != NULL && "Buy more RAM LOL");
+    }
+
+    if (column->type == TYPE_F32) {
+        const float *from = (const float*)column->data + begin;
+        double *to = w->converted[var];
+        for (size_t i = 0; i < n; ++i) to[i] = from[i];
+    } else {
+        const double *from = (const double*)column->data + begin;
+        float *to = w->converted[var];
+        for (size_t i = 0; i < n; ++i) to[i] = (float)from[i];
+    }
+
+    return w->converted[var];
+}
+
+bool evaluate_chunk(Worker *w, size_t begin, size_t n)
+{
+    Job *job = w->job;
+    const void *columns[26] = {0};
+    for (int var = 0; var < 26; ++var) {
+        if (job->columns[var] != NULL)
+            columns[var] = chunk_column(w, var, begin, n);
+    }
+
+    uint8_t *errors = job->errors != NULL ? job->errors + begin : NULL;
+
+    if (job->type == TYPE_F32) {
+        const float *const *c = (const float *const *)columns;
+        float *out = (float*)job->out + begin;
+        return errors != NULL
+            ? mp_vm_run_batch_errors_f32(job->vm, c, n, out, errors)
+            : mp_vm_run_batch_f32(job->vm, c, n, out);
+    }
+
+    const double *const *c = (const double *const *)columns;
+    double *out = (double*)job->out + begin;
+    return errors != NULL
+        ? mp_vm_run_batch_errors(job->vm, c, n, out, errors)
+        : mp_vm_run_batch(job->vm, c, n, out);
+}
+
+void *worker_run(void *arg)
+{
+    Worker *w = arg;
+    Job *job = w->job;
+
+    while (true) {
+        pthread_mutex_lock(&job->mutex);
+        size_t begin = job->next;
+        job->next = job->rows - begin > CHUNK_ROWS ? begin + CHUNK_ROWS : job->rows;
+        pthread_mutex_unlock(&job->mutex);
+
+        if (begin >= job->rows)
+            break;
+
+        size_t n = job->rows - begin < CHUNK_ROWS ? job->rows - begin : CHUNK_ROWS;
+        if (!evaluate_chunk(w, begin, n)) {
+            pthread_mutex_lock(&job->mutex);
+            job->failed = true;
+            pthread_mutex_unlock(&job->mutex);
+        }
+    }
+
+    return NULL;
+}
+
+void run_columns(void)
+{
+    if (options.output == NULL)
+        fail("No output file given, see -o");
+
+    size_t rows = 0;
+    bool all_f32 = true;
+    const Column *first = NULL;
+    for (int var = 0; var < 26; ++var) {
+        if (!options.has_column[var])
+            continue;
+
+        Column *column = &options.columns[var];
+        map_column(column);
+        if (first != NULL && column->rows != rows)
+            fail("%s has %zu rows, %s has %zu", column->path, column->rows,
+                 first->path, rows);
+        first = first != NULL ? first : column;
+        rows = column->rows;
+        all_f32 = all_f32 && column->type == TYPE_F32;
+    }
+
+    if (first == NULL)
+        fail("No column given, see -c");
+
+    MP_Env *env = init_env();
+
+    Job job = {0};
+    job.vm = &env->vm;
+    job.rows = rows;
+    job.type = options.type_given ? options.type : (all_f32 ? TYPE_F32 : TYPE_F64);
+    for (int var = 0; var < 26; ++var) {
+        if (options.has_column[var])
+            job.columns[var] = &options.columns[var];
+    }
+    pthread_mutex_init(&job.mutex, NULL);
+
+    size_t offset = options.header ? sizeof(Header) : 0;
+    size_t out_size = offset + rows * type_size(job.type);
+    char *out = map_output(options.output, out_size);
+    if (options.header) {
+        Header header = {{'M', 'P', 'C', '1'}, (uint32_t)type_size(job.type), rows};
+        memcpy(out, &header, sizeof(header));
+    }
+    job.out = out + offset;
+
+    uint8_t *errors = NULL;
+    if (options.errors != NULL) {
+        errors = map_output(options.errors, rows);
+        job.errors = errors;
+    }
+
+    // The calling thread is the first worker, and it runs all the chunks if
+    // no thread could be created
+    size_t chunks = (rows + CHUNK_ROWS - 1) / CHUNK_ROWS;
+    size_t count = options.threads < chunks ? options.threads : (chunks > 0 ? chunks : 1);
+    Worker *workers = calloc(count, sizeof(*workers));
+    assert(workers != NULL && "Buy more RAM LOL");
+
+    long long start = now_ns();
+    for (size_t t = 0; t < count; ++t) {
+        workers[t].job = &job;
+        if (t > 0)
+            workers[t].started = pthread_create(&workers[t].thread, NULL,
+                                                worker_run, &workers[t]) == 0;
+    }
+    worker_run(&workers[0]);
+    for (size_t t = 1; t < count; ++t) {
+        if (workers[t].started)
+            pthread_join(workers[t].thread, NULL);
+    }
+    long long ns = now_ns() - start;
+
+    if (job.failed)
+        fail("Could not evaluate the expression");
+
+    size_t bytes = out_size + (errors != NULL ? rows : 0);
+    for (int var = 0; var < 26; ++var) {
+        if (job.columns[var] != NULL)
+            bytes += job.columns[var]->rows * type_size(job.columns[var]->type);
+    }
+    report("columns", rows, bytes, ns);
+
+    for (size_t t = 0; t < count; ++t) {
+        for (int var = 0; var < 26; ++var) free(workers[t].converted[var]);
+    }
+    free(workers);
+    if (out_size > 0) munmap(out, out_size);
+    if (errors != NULL && rows > 0) munmap(errors, rows);
+    for (int var = 0; var < 26; ++var) {
+        if (options.has_column[var] && options.columns[var].map != NULL)
+            munmap(options.columns[var].map, options.columns[var].map_size);
+    }
+    pthread_mutex_destroy(&job.mutex);
+    mp_free(env);
+}
+
+//-----
+// CSV
+//-----
+
+typedef struct {
+    MP_Env *env;
+    int variable[256];  // Variable of each CSV column, -1 for the others
+    size_t field_count; // Columns named in the first line
+    bool has_names;
+
+    double *columns[26];
+    double *out;
+    size_t count; // Rows in columns
+    size_t rows;  // Rows evaluated
+    size_t line;
+
+    FILE *output;
+    char *buffer;
+    size_t buffer_count;
+} Csv;
+
+static const double powers_of_ten[] = {
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+// Parses a decimal number in [begin, end). When its digits fit in the 53 bits
+// of a double and its power of ten is exact, a single multiplication or
+// division gives the correctly rounded value, the others are left to strtod.
+// An empty field is a missing value, NaN.
+bool parse_number(const char *begin, const char *end, double *value)
+{
+    while (begin < end && (*begin == ' ' || *begin == '\t')) ++begin;
+    while (end > begin && (end[-1] == ' ' || end[-1] == '\t')) --end;
+
+    if (begin == end) {
+        *value = NAN;
+        return true;
+    }
+
+    const char *p = begin;
+    bool negative = *p == '-';
+    if (*p == '-' || *p == '+') ++p;
+
+    uint64_t mantissa = 0;
+    int exponent = 0;
+    int digits = 0;
+    bool exact = true;
+    bool any = false;
+
+    for (; p < end && isdigit((unsigned char)*p); ++p, any = true) {
+        if (digits < 19) {
+            mantissa = mantissa * 10 + (*p - '0');
+            digits += mantissa != 0;
+        } else {
+            exponent += 1;
+            exact = exact && *p == '0';
+        }
+    }
+
+    if (p < end && *p == '.') {
+        for (++p; p < end && isdigit((unsigned char)*p); ++p, any = true) {
+            if (digits < 19) {
+                mantissa = mantissa * 10 + (*p - '0');
+                digits += mantissa != 0;
+                exponent -= 1;
+            } else {
+                exact = exact && *p == '0';
+            }
+        }
+    }
+
+    if (any && p < end && (*p == 'e' || *p == 'E')) {
+        const char *q = p + 1;
+        bool negative_exponent = q < end && *q == '-';
+        if (q < end && (*q == '-' || *q == '+')) ++q;
+
+        int e = 0;
+        bool exponent_digits = false;
+        for (; q < end && isdigit((unsigned char)*q); ++q, exponent_digits = true) {
+            if (e < 10000) e = e * 10 + (*q - '0');
+        }
+        if (exponent_digits) {
+            exponent += negative_exponent ? -e : e;
+            p = q;
+        }
+    }
+
+    if (any && p == end && exact && mantissa <= (1ull << 53)
+            && exponent >= -22 && exponent <= 22) {
+        double v = (double)mantissa;
+        v = exponent < 0 ? v / powers_of_ten[-exponent] : v * powers_of_ten[exponent];
+        *value = negative ? -v : v;
+        return true;
+    }
+
+    // inf, nan, hexadecimal, long mantissas and large exponents
+    char field[CSV_FIELD_CAPACITY];
+    size_t length = end - begin;
+    if (length >= sizeof(field))
+        return false;
+
+    memcpy(field, begin, length);
+    field[length] = '\0';
+    char *parsed;
+    *value = strtod(field, &parsed);
+    return parsed == field + length;
+}
+
+void csv_flush(Csv *csv)
+{
+    if (csv->count == 0)
+        return;
+
+    const double *columns[26] = {0};
+    for (int var = 0; var < 26; ++var) columns[var] = csv->columns[var];
+
+    if (!mp_vm_run_batch(&csv->env->vm, columns, csv->count, csv->out))
+        fail("Could not evaluate the expression");
+
+    for (size_t i = 0; i < csv->count; ++i) {
+        if (csv->buffer_count + 32 > CSV_READ_SIZE) {
+            fwrite(csv->buffer, 1, csv->buffer_count, csv->output);
+            csv->buffer_count = 0;
+        }
+        csv->buffer_count += snprintf(csv->buffer + csv->buffer_count, 32,
+                                      "%.17g\n", csv->out[i]);
+    }
+
+    csv->rows += csv->count;
+    csv->count = 0;
+}
+
+void csv_names(Csv *csv, const char *begin, const char *end)
+{
+    for (const char *field = begin; field <= end; ++csv->field_count) {
+        const char *comma = memchr(field, ',', end - field);
+        const char *field_end = comma != NULL ? comma : end;
+
+        while (field < field_end && isspace((unsigned char)*field)) ++field;
+        const char *name_end = field_end;
+        while (name_end > field && isspace((unsigned char)name_end[-1])) --name_end;
+
+        if (csv->field_count >= sizeof(csv->variable)/sizeof(csv->variable[0]))
+            fail("More than %zu columns", sizeof(csv->variable)/sizeof(csv->variable[0]));
+
+        int var = name_end - field == 1 && *field >= 'a' && *field <= 'z' ? *field - 'a' : -1;
+        csv->variable[csv->field_count] = var;
+        if (var >= 0 && csv->columns[var] == NULL) {
+            csv->columns[var] = malloc(CSV_BATCH_ROWS * sizeof(double));
+            assert(csv->columns[var] != NULL && "Buy more RAM LOL");
+        }
+
+        field = field_end + 1;
+    }
+
+    csv->has_names = true;
+    fprintf(csv->output, "result\n");
+}
+
+void csv_row(Csv *csv, const char *begin, const char *end)
+{
+    size_t field_index = 0;
+    for (const char *field = begin; field <= end; ++field_index) {
+        const char *comma = memchr(field, ',', end - field);
+        const char *field_end = comma != NULL ? comma : end;
+
+        if (field_index >= csv->field_count)
+            fail("line %zu: more fields than columns", csv->line);
+
+        int var = csv->variable[field_index];
+        if (var >= 0 && !parse_number(field, field_end, &csv->columns[var][csv->count]))
+            fail("line %zu: invalid number in column %zu", csv->line, field_index + 1);
+
+        field = field_end + 1;
+    }
+
+    if (field_index != csv->field_count)
+        fail("line %zu: %zu fields, expected %zu", csv->line, field_index,
+             csv->field_count);
+
+    if (++csv->count == CSV_BATCH_ROWS)
+        csv_flush(csv);
+}
+
+// Parses the complete lines of [begin, end), the last one too when final.
+// Gives the number of bytes parsed.
+size_t csv_parse(Csv *csv, const char *begin, const char *end, bool final)
+{
+    const char *line = begin;
+    while (line < end) {
+        const char *newline = memchr(line, '\n', end - line);
+        if (newline == NULL && !final)
+            break;
+
+        const char *line_end = newline != NULL ? newline : end;
+        const char *next = newline != NULL ? newline + 1 : end;
+        if (line_end > line && line_end[-1] == '\r') --line_end;
+
+        csv->line += 1;
+        if (line_end > line) {
+            if (csv->has_names) {
+                csv_row(csv, line, line_end);
+            } else {
+                csv_names(csv, line, line_end);
+            }
+        }
+
+        line = next;
+    }
+
+    return line - begin;
+}
+
+void run_csv(void)
+{
+    Csv csv = {0};
+    csv.env = init_env();
+    csv.out = malloc(CSV_BATCH_ROWS * sizeof(double));
+    csv.buffer = malloc(CSV_READ_SIZE);
+    assert(csv.out != NULL && csv.buffer != NULL && "Buy more RAM LOL");
+
+    csv.output = stdout;
+    if (options.output != NULL) {
+        csv.output = fopen(options.output, "w");
+        if (csv.output == NULL)
+            fail("Could not open %s: %s", options.output, strerror(errno));
+    }
+
+    bool from_stdin = strcmp(options.csv, "-") == 0;
+    int fd = from_stdin ? STDIN_FILENO : open(options.csv, O_RDONLY);
+    if (fd < 0)
+        fail("Could not open %s: %s", options.csv, strerror(errno));
+
+    long long start = now_ns();
+    size_t bytes = 0;
+
+    // A regular file is mapped and parsed at once, anything else is read in
+    // blocks, with the incomplete last line moved to the start of the next one
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        bytes = (size_t)st.st_size;
+        void *map = mmap(NULL, bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED)
+            fail("Could not map %s: %s", options.csv, strerror(errno));
+        madvise(map, bytes, MADV_SEQUENTIAL);
+        csv_parse(&csv, map, (const char*)map + bytes, true);
+        munmap(map, bytes);
+    } else {
+        char *block = malloc(CSV_READ_SIZE);
+        assert(block != NULL && "Buy more RAM LOL");
+        size_t count = 0;
+        while (true) {
+            ssize_t n = read(fd, block + count, CSV_READ_SIZE - count);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0)
+                fail("Could not read %s: %s", options.csv, strerror(errno));
+
+            count += (size_t)n;
+            bytes += (size_t)n;
+            size_t parsed = csv_parse(&csv, block, block + count, n == 0);
+            if (parsed == 0 && count == CSV_READ_SIZE)
+                fail("line %zu is longer than %d bytes", csv.line + 1, CSV_READ_SIZE);
+
+            memmove(block, block + parsed, count - parsed);
+            count -= parsed;
+            if (n == 0)
+                break;
+        }
+        free(block);
+    }
+
+    csv_flush(&csv);
+    fwrite(csv.buffer, 1, csv.buffer_count, csv.output);
+    if (csv.output != stdout) fclose(csv.output);
+    if (!from_stdin) close(fd);
+
+    report("csv", csv.rows, bytes, now_ns() - start);
+
+    for (int var = 0; var < 26; ++var) free(csv.columns[var]);
+    free(csv.out);
+    free(csv.buffer);
+    mp_free(csv.env);
+}
+
+int main(int argc, char **argv)
+{
+    parse_arguments(argc, argv);
+
+    if (options.csv != NULL) {
+        run_csv();
+    } else {
+        run_columns();
+    }
+
+    return EXIT_SUCCESS;
+}
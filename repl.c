@@ -29,21 +29,22 @@ int main(void)
             continue;
 
         /* Eval */
-        mp = mp_init(input);
+        if (mp == NULL) {
+            mp = mp_init(input);
+        } else if (!mp_reinit(mp, input)) {
+            fprintf(stderr, "ERROR: Invalid expression\n");
+            continue;
+        }
         set_vars(mp, vars);
 
         MP_Result result = mp_evaluate(mp);
         if (result.error) {
             fprintf(stderr, "ERROR: Invalid expression\n");
-            mp_free(mp);
-            mp = NULL;
             continue;
         }
 
         /* Print */
         printf("%f\n", result.value);
-        mp_free(mp);
-        mp = NULL;
     }
 
     mp_free(mp);
@@ -62,6 +63,10 @@ int get_user_input(void)
         printf("Usage:\n");
         printf("  Type an expression or a command to use the application.\n");
         printf("  Supported operations: (+) (-) (*) (/) (^)\n");
+        printf("  Comparisons: (<) (<=) (>) (>=) (==) (!=), logic: (&&) (||)\n");
+        printf("  Conditional: c ? a : b, a if c is not 0 else b\n");
+        printf("  Functions: ln log sin cos tan sqrt, min max pow atan2 hypot of two\n");
+        printf("             arguments, fma(a, b, c) and clamp(x, lo, hi)\n");
         printf("  Example: 2 * (4.3 / 3.1) - 8\n");
         printf("\n");
         printf("Commands:\n");
@@ -0,0 +1,1400 @@
+#include <assert.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Every allocation made by mp.h is counted, also the ones of the arrays that
+// fall back to MP_MALLOC and MP_REALLOC
+
+static size_t allocations = 0;
+
+static void *count_malloc(size_t size)
+{
+    ++allocations;
+    return malloc(size);
+}
+
+static void *count_realloc(void *ptr, size_t size)
+{
+    ++allocations;
+    return realloc(ptr, size);
+}
+
+#define MP_MALLOC(size)       count_malloc(size)
+#define MP_REALLOC(ptr, size) count_realloc(ptr, size)
+#define MP_IMPLEMENTATION
+#include "mp.h"
+
+// Checks of the simplified API in every mode, run by `make check`
+
+#define DEPTH 100000
+
+static const MP_Mode modes[] = {
+    MP_MODE_INTERPRET,
+    MP_MODE_COMPILE,
+    MP_MODE_ADAPTIVE,
+    MP_MODE_INCREMENTAL,
+};
+#define MODE_COUNT (sizeof(modes) / sizeof(modes[0]))
+
+static const char *mode_names[] = {
+    [MP_MODE_INTERPRET]   = "interpret",
+    [MP_MODE_COMPILE]     = "compile",
+    [MP_MODE_ADAPTIVE]    = "adaptive",
+    [MP_MODE_INCREMENTAL] = "incremental",
+};
+
+static size_t failures = 0;
+
+static void fail(const char *name, MP_Mode mode, bool strict, const char *what)
+{
+    fprintf(stderr, "FAIL: %s, %s%s: %s\n", name, mode_names[mode],
+            strict ? ", strict" : "", what);
+    ++failures;
+}
+
+// pre repeated n times, then mid, then post repeated n times
+static char *repeat(const char *pre, const char *mid, const char *post, size_t n)
+{
+    size_t a = strlen(pre);
+    size_t b = strlen(mid);
+    size_t c = strlen(post);
+
+    char *s = malloc((a + c) * n + b + 1);
+    assert(s != NULL && "Buy more RAM LOL");
+
+    char *p = s;
+    for (size_t i = 0; i < n; ++i, p += a) memcpy(p, pre, a);
+    memcpy(p, mid, b);
+    p += b;
+    for (size_t i = 0; i < n; ++i, p += c) memcpy(p, post, c);
+    *p = '\0';
+
+    return s;
+}
+
+//---------------
+// Deep nesting
+//---------------
+
+// None of the passes over a tree recurses, so expressions nested DEPTH deep
+// must work in every mode
+
+typedef struct {
+    const char *name;
+    char *expression;
+    double expected;
+} Deep_Case;
+
+static void test_deep(void)
+{
+    const double x = 0.5;
+
+    double sines = x;
+    double powers = x;
+    for (size_t i = 0; i < DEPTH; ++i) {
+        sines = sin(sines);
+        powers = pow(0.5, powers);
+    }
+
+    Deep_Case cases[] = {
+        {"unary minus",    repeat("-", "x", "", DEPTH),          x},
+        {"function calls", repeat("sin(", "x", ")", DEPTH),      sines},
+        {"min",            repeat("min(", "x", ",1)", DEPTH),    x},
+        {"power",          repeat("0.5^(", "x", ")", DEPTH),     powers},
+        {"sum",            repeat("x+", "x", "", DEPTH),         (DEPTH + 1) * x},
+        {"parentheses",    repeat("(", "x", ")", DEPTH),         x},
+    };
+
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i) {
+        for (size_t m = 0; m < MODE_COUNT; ++m) {
+            for (int strict = 0; strict <= 1; ++strict) {
+                MP_Options options = {0};
+                options.mode = modes[m];
+                options.strict = strict;
+
+                MP_Env *env = mp_init_options(cases[i].expression, options);
+                if (env == NULL) {
+                    fail(cases[i].name, modes[m], strict, "mp_init failed");
+                    continue;
+                }
+
+                mp_variable(env, 'x', x);
+                MP_Result result = mp_evaluate(env);
+                if (result.error) {
+                    fail(cases[i].name, modes[m], strict, "mp_evaluate failed");
+                } else if (fabs(result.value - cases[i].expected)
+                           > 1e-9 * fabs(cases[i].expected)) {
+                    fail(cases[i].name, modes[m], strict, "wrong value");
+                }
+
+                mp_free(env);
+            }
+        }
+        free(cases[i].expression);
+    }
+}
+
+//---------------
+// Adaptive mode
+//---------------
+
+// Evaluating past the threshold switches to the VM without changing the
+// results, and a failed switch doesn't stick to the environment
+static void test_adaptive(void)
+{
+    const size_t evaluations = 2 * MP_ADAPTIVE_THRESHOLD;
+
+#ifndef MP_IEEE
+    for (size_t m = 0; m < MODE_COUNT; ++m) {
+        MP_Env *env = mp_init_mode("1 / x", modes[m]);
+        if (env == NULL) {
+            fail("1 / x", modes[m], false, "mp_init failed");
+            continue;
+        }
+
+        mp_variable(env, 'x', 0.0);
+        for (size_t i = 0; i < evaluations; ++i) {
+            MP_Result result = mp_evaluate(env);
+            if (!result.error || result.error_type != MP_ERROR_ZERO_DIVISION) {
+                fail("1 / x", modes[m], false, "no division by zero");
+                break;
+            }
+        }
+
+        mp_free(env);
+    }
+#endif
+
+    MP_Env *env = mp_init_mode("$total + x", MP_MODE_ADAPTIVE);
+    if (env == NULL) {
+        fail("$total + x", MP_MODE_ADAPTIVE, false, "mp_init failed");
+        return;
+    }
+
+    for (size_t i = 0; i < evaluations; ++i) {
+        mp_evaluate(env);
+    }
+    if (env->backend != MP_MODE_INTERPRET) {
+        fail("$total + x", MP_MODE_ADAPTIVE, false, "compiled a reference");
+    }
+
+    if (!mp_reinit(env, "x + 1")) {
+        fail("x + 1", MP_MODE_ADAPTIVE, false, "mp_reinit failed");
+    } else {
+        mp_variable(env, 'x', 2.0);
+        MP_Result result = {0};
+        for (size_t i = 0; i < evaluations; ++i) {
+            result = mp_evaluate(env);
+        }
+        if (env->backend != MP_MODE_COMPILE) {
+            fail("x + 1", MP_MODE_ADAPTIVE, false, "not compiled after mp_reinit");
+        }
+        if (result.error || result.value != 3.0) {
+            fail("x + 1", MP_MODE_ADAPTIVE, false, "wrong value");
+        }
+    }
+
+    mp_free(env);
+}
+
+//--------
+// Errors
+//--------
+
+// Every mode fails with the error of the interpreter. The compiler can't
+// read references, so the compiled mode rejects them in mp_init instead.
+static void test_errors(void)
+{
+    const char *expressions[] = {
+        "$foo + x",
+        "x + $foo",
+        "-$foo",
+        "sin($foo)",
+        "x^$foo",
+        "x < 1 ? $foo : 2",
+        "x > 1 ? $foo : 2",
+#ifndef MP_IEEE
+        "1 / (x - 0.5)",
+        "x < 1 ? 1 / (x - 0.5) : $foo",
+#endif
+    };
+
+    for (size_t i = 0; i < sizeof(expressions) / sizeof(expressions[0]); ++i) {
+        const char *expression = expressions[i];
+        MP_Result expected = {0};
+
+        for (size_t m = 0; m < MODE_COUNT; ++m) {
+            MP_Env *env = mp_init_mode(expression, modes[m]);
+            if (env == NULL) {
+                if (modes[m] != MP_MODE_COMPILE || strchr(expression, '$') == NULL) {
+                    fail(expression, modes[m], false, "mp_init failed");
+                }
+                continue;
+            }
+
+            mp_variable(env, 'x', 0.5);
+            for (int again = 0; again <= 1; ++again) {
+                MP_Result result = mp_evaluate(env);
+                if (modes[m] == MP_MODE_INTERPRET && !again) {
+                    expected = result;
+                } else if (result.error != expected.error
+                           || result.error_type != expected.error_type) {
+                    fail(expression, modes[m], false, "wrong error");
+                    break;
+                }
+            }
+
+            mp_free(env);
+        }
+    }
+}
+
+//-------------
+// Allocations
+//-------------
+
+static void *counting_alloc(void *context, size_t size)
+{
+    (void)context;
+    return count_malloc(size);
+}
+
+static void *counting_realloc(void *context, void *ptr, size_t old_size,
+                              size_t new_size)
+{
+    (void)context;
+    (void)old_size;
+    return count_realloc(ptr, new_size);
+}
+
+static void counting_free(void *context, void *ptr, size_t size)
+{
+    (void)context;
+    (void)size;
+    free(ptr);
+}
+
+static const char *reinit_expressions[] = {
+    "x + 1",
+    "x*x + sin(y) - 3*z",
+    "min(x, y) + x^2 + (x > 1 ? y : z)",
+    "x^-3 + 2*x + atan2(y, x) * (x + (y + (z + (x + (y + z)))))",
+};
+#define REINIT_COUNT (sizeof(reinit_expressions) / sizeof(reinit_expressions[0]))
+
+// Replaces the expression with each of reinit_expressions in turn, evaluated
+// enough to promote an adaptive environment. Gives the allocations made.
+static size_t reinit_round(MP_Env *env, MP_Env_Pool *pool)
+{
+    size_t before = allocations;
+
+    for (size_t i = 0; i < REINIT_COUNT; ++i) {
+        MP_Env *e = env;
+        if (pool != NULL) {
+            e = mp_pool_acquire(pool, reinit_expressions[i]);
+        } else if (!mp_reinit(e, reinit_expressions[i])) {
+            e = NULL;
+        }
+        if (e == NULL)
+            return SIZE_MAX;
+
+        for (size_t k = 0; k < 2 * MP_ADAPTIVE_THRESHOLD; ++k) {
+            mp_evaluate(e);
+        }
+        if (pool != NULL) {
+            mp_pool_release(pool, e);
+        }
+    }
+
+    return allocations - before;
+}
+
+// Once the buffers of an environment or of a pool have grown to the
+// expressions they hold, replacing the expression allocates nothing
+static void test_allocations(void)
+{
+    MP_Allocator counting = {0};
+    counting.alloc = counting_alloc;
+    counting.realloc = counting_realloc;
+    counting.free = counting_free;
+
+    for (size_t m = 0; m < MODE_COUNT; ++m) {
+        MP_Options options = {0};
+        options.mode = modes[m];
+        options.allocator = &counting;
+
+        MP_Env *env = mp_init_options(reinit_expressions[0], options);
+        if (env == NULL) {
+            fail("mp_reinit", modes[m], false, "mp_init failed");
+            continue;
+        }
+
+        reinit_round(env, NULL);
+        reinit_round(env, NULL);
+        if (reinit_round(env, NULL) != 0) {
+            fail("mp_reinit", modes[m], false, "allocated once warm");
+        }
+        mp_free(env);
+
+        MP_Env_Pool pool = mp_pool_init(options);
+        reinit_round(NULL, &pool);
+        reinit_round(NULL, &pool);
+        if (reinit_round(NULL, &pool) != 0) {
+            fail("mp_pool_acquire", modes[m], false, "allocated once warm");
+        }
+        mp_pool_free(&pool);
+    }
+}
+
+//---------------
+// Integer powers
+//---------------
+
+typedef struct {
+    const char *expression;
+    int exponent;
+    double x;
+} Power_Case;
+
+// x^n with a constant n is computed by square-and-multiply unless strict,
+// which must not lose what pow gives when a power overflows or underflows on
+// the way
+static void test_powers(void)
+{
+    const Power_Case cases[] = {
+        {"x^-32", -32, 4294967296.0},
+        {"x^-3",  -3,  1e103},
+        {"x^-2",  -2,  1e160},
+        {"x^-2",  -2,  1e-160},
+        {"x^-5",  -5,  1e-70},
+        {"x^2",   2,   1e-160},
+        {"x^3",   3,   1e-110},
+        {"x^3",   3,   -1e103},
+        {"x^-3",  -3,  -1e-103},
+        {"x^-1",  -1,  1e-310},
+        {"x^7",   7,   1.0000001},
+    };
+
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i) {
+        const Power_Case *c = &cases[i];
+        double expected = pow(c->x, c->exponent);
+
+        for (size_t m = 0; m < MODE_COUNT; ++m) {
+            MP_Env *env = mp_init_mode(c->expression, modes[m]);
+            if (env == NULL) {
+                fail(c->expression, modes[m], false, "mp_init failed");
+                continue;
+            }
+
+            mp_variable(env, 'x', c->x);
+            double batch = NAN;
+            const double *columns[26] = {0};
+            columns['x' - 'a'] = &c->x;
+
+            MP_Result result = mp_evaluate(env);
+            if (!mp_evaluate_batch(env, columns, 1, &batch)) {
+                fail(c->expression, modes[m], false, "mp_evaluate_batch failed");
+            }
+
+            double values[] = {result.error ? NAN : result.value, batch};
+            for (size_t k = 0; k < 2; ++k) {
+                double error = fabs(values[k] - expected);
+                if (!(values[k] == expected || error <= 1e-15 * fabs(expected))) {
+                    fail(c->expression, modes[m], false,
+                         k == 0 ? "wrong value" : "wrong batch value");
+                }
+            }
+
+            mp_free(env);
+        }
+    }
+}
+
+//-----------------
+// Number parsing
+//-----------------
+
+// mp_parse_number must give the same double as strtod in the C locale, bit
+// for bit, and consume the same characters for anything starting with a digit
+
+static uint64_t random_state = 0x9e3779b97f4a7c15ULL;
+
+static uint64_t random_next(void)
+{
+    // xorshift64*
+    random_state ^= random_state >> 12;
+    random_state ^= random_state << 25;
+    random_state ^= random_state >> 27;
+    return random_state * 0x2545f4914f6cdd1dULL;
+}
+
+static void check_number(const char *str, size_t length)
+{
+    char buffer[512];
+    assert(length < sizeof(buffer));
+    memcpy(buffer, str, length);
+    buffer[length] = '\0';
+
+    char *end = NULL;
+    double expected = strtod(buffer, &end);
+    double value = -1.0;
+    size_t consumed = mp_parse_number(buffer, length, &value);
+
+    if (consumed != (size_t)(end - buffer)) {
+        fprintf(stderr, "FAIL: %s: consumed %zu instead of %zu\n", buffer,
+                consumed, (size_t)(end - buffer));
+        ++failures;
+    } else if (memcmp(&value, &expected, sizeof(value)) != 0) {
+        fprintf(stderr, "FAIL: %s: %.17g instead of %.17g\n", buffer, value,
+                expected);
+        ++failures;
+    }
+}
+
+static void test_numbers(void)
+{
+    const char *numbers[] = {
+        "0", "00012", "0.1", "123.456e-7", "1.", "1.e5", "1e", "1e+", "1e+5x",
+        "1.5.3", "1E-2", "7.3177701707893310e+15", "1e23", "8.5e-5",
+        // Halfway between two doubles, ties to even
+        "9007199254740993", "9007199254740995", "9007199254740993.0000000001",
+        "1.00000000000000011102230246251565404236316680908203125",
+        "1.00000000000000011102230246251565404236316680908203126",
+        "0.1000000000000000055511151231257827021181583404541015625",
+        "179769313486231580793728971405301e276",
+        // Subnormals and underflow
+        "2.2250738585072011e-308", "2.2250738585072014e-308",
+        "4.9406564584124654e-324", "2.4703282292062327e-324",
+        "2.4703282292062328e-324", "1e-400", "3e-324",
+        // Around the largest double and overflow
+        "1.7976931348623157e308", "1.7976931348623158e308",
+        "1.7976931348623159e308", "1e309", "1e99999999",
+        // Hexadecimal floats
+        "0x1p-1074", "0x1.fffffffffffffp1023", "0xABCp0", "0x10", "0x1.8p3",
+        "0x", "0x1p", "0xg", "0X1P+4",
+        // Long mantissas
+        "3.14159265358979323846264338327950288419716939937510582097494459",
+        "0.000000000000000000000000000000000000000000000000000000000000123",
+        "123456789012345678901234567890123456789012345678901234567890e-40",
+    };
+
+    for (size_t i = 0; i < sizeof(numbers) / sizeof(numbers[0]); ++i) {
+        check_number(numbers[i], strlen(numbers[i]));
+    }
+
+    // The length bounds the number
+    double value = 0.0;
+    if (mp_parse_number("123456", 3, &value) != 3 || value != 123.0) {
+        fprintf(stderr, "FAIL: 123456: length not respected\n");
+        ++failures;
+    }
+
+    char buffer[64];
+    for (size_t i = 0; i < 200000; ++i) {
+        uint64_t r = random_next();
+        int length = 0;
+
+        if (i % 4 == 0) {
+            // Near the midpoint between two doubles, printed with more digits
+            // than fit in 64 bits so that the dropped ones decide the rounding
+            uint64_t bits = random_next() & 0x7fefffffffffffffULL;
+            double x, y;
+            memcpy(&x, &bits, sizeof(x));
+            y = nextafter(x, INFINITY);
+            long double middle = ((long double)x + (long double)y) / 2.0L;
+            length = snprintf(buffer, sizeof(buffer), "%.*Le",
+                              20 + (int)(r % 20), middle);
+        } else if (i % 2 == 0) {
+            // A random double printed with 1 to 17 significant digits
+            uint64_t bits = random_next() & 0x7fffffffffffffffULL;
+            double x;
+            memcpy(&x, &bits, sizeof(x));
+            if (!isfinite(x)) continue;
+            length = snprintf(buffer, sizeof(buffer), "%.*e", (int)(r % 17), x);
+        } else {
+            // Random digits with a random point and exponent
+            size_t digits = 1 + r % 24;
+            size_t point = (r >> 8) % (digits + 1);
+            for (size_t k = 0; k < digits; ++k) {
+                if (k == point && k > 0) buffer[length++] = '.';
+                buffer[length++] = (char)('0' + random_next() % 10);
+            }
+            length += snprintf(buffer + length, sizeof(buffer) - length, "e%d",
+                               (int)((r >> 16) % 700) - 350);
+        }
+
+        check_number(buffer, (size_t)length);
+    }
+}
+
+//----------
+// Bytecode
+//----------
+
+#define SLOT_COUNT 4
+
+static const double constants[] = {0.0, -0.0, 1.0, -2.5, 0.5, 1e300, INFINITY, NAN};
+#define CONSTANT_COUNT (sizeof(constants) / sizeof(constants[0]))
+
+// Mostly valid instructions with operands in and out of range, mixed with
+// random bytes, so that a good part of the programs verify
+static void random_program(MP_Program *p)
+{
+    size_t instructions = 1 + random_next() % 24;
+    for (size_t i = 0; i < instructions; ++i) {
+        uint64_t r = random_next();
+        if (r % 8 == 0) {
+            mp_da_append(p, (uint8_t)(r >> 8));
+            continue;
+        }
+
+        MP_Opcode op = 1 + (r >> 8) % (MP_OP_COUNT - 1);
+        if (r % 3 == 0) op = MP_OP_PUSH_VAR_A + (r >> 16) % 26;
+        mp_da_append(p, (uint8_t)op);
+
+        uint64_t operand = random_next();
+        switch (op) {
+            case MP_OP_PUSH_NUM:
+            case MP_OP_ADD_CONST:
+            case MP_OP_SUB_CONST:
+            case MP_OP_MUL_CONST:
+            case MP_OP_DIV_CONST: {
+                double value = constants[operand % CONSTANT_COUNT];
+                for (size_t k = 0; k < sizeof(value); ++k) {
+                    mp_da_append(p, ((uint8_t *)&value)[k]);
+                }
+            } break;
+
+            case MP_OP_PUSH_FLOAT: {
+                float value = (float)constants[operand % CONSTANT_COUNT];
+                for (size_t k = 0; k < sizeof(value); ++k) {
+                    mp_da_append(p, ((uint8_t *)&value)[k]);
+                }
+            } break;
+
+            case MP_OP_STORE:
+            case MP_OP_LOAD:
+            case MP_OP_POWI: {
+                int32_t value = op == MP_OP_POWI
+                    ? (int32_t)(operand % 21) - 10
+                    : (int32_t)(operand % (SLOT_COUNT + 2));
+                for (size_t k = 0; k < sizeof(value); ++k) {
+                    mp_da_append(p, ((uint8_t *)&value)[k]);
+                }
+            } break;
+
+            case MP_OP_FUNC: {
+                mp_da_append(p, (uint8_t)(operand % (MP_FUNCTION_COUNT + 2)));
+            } break;
+
+            case MP_OP_PUSH_VAR:
+            case MP_OP_ADD_VAR:
+            case MP_OP_SUB_VAR:
+            case MP_OP_MUL_VAR:
+            case MP_OP_DIV_VAR: {
+                mp_da_append(p, (uint8_t)(operand % 28));
+            } break;
+
+            case MP_OP_PUSH_INT:
+            case MP_OP_ADD_INT:
+            case MP_OP_SUB_INT:
+            case MP_OP_MUL_INT:
+            case MP_OP_DIV_INT: {
+                mp_da_append(p, (uint8_t)operand);
+            } break;
+
+            default: break;
+        }
+    }
+
+    // Cut in the middle of an operand now and then
+    if (random_next() % 8 == 0 && p->count > 0) --p->count;
+}
+
+static bool same_double(double a, double b)
+{
+    return (isnan(a) && isnan(b)) || memcmp(&a, &b, sizeof(a)) == 0;
+}
+
+static bool vm_run_slots(MP_Vm *vm, bool verified, double *slots)
+{
+    for (size_t i = 0; i < SLOT_COUNT; ++i) slots[i] = (double)i + 0.5;
+    vm->verified = verified;
+    return mp_vm_run(vm);
+}
+
+// A random expression of x and y, at most depth deep. Calls are in
+// parentheses since they can't be raised to a power.
+static void random_expression(char *buffer, size_t size, size_t *length,
+                              size_t depth)
+{
+    static const char *leaves[] = {"x", "y", "0", "2", "0.5", "3.25", "1e3"};
+    static const char *binary[] = {
+        "+", "-", "*", "/", "^", "<", "<=", ">", ">=", "==", "!=", "&&", "||",
+    };
+    static const char *unary[] = {"-", "sin", "cos", "tan", "sqrt", "ln", "log"};
+    static const char *functions[] = {"min", "max", "pow", "atan2", "hypot"};
+#define PRINT(...) \
+    if (*length < size) *length += snprintf(buffer + *length, size - *length, __VA_ARGS__)
+#define COUNT(a) (sizeof(a) / sizeof((a)[0]))
+
+    uint64_t r = random_next();
+    if (depth == 0 || r % 5 == 0) {
+        PRINT("%s", leaves[(r >> 8) % COUNT(leaves)]);
+        return;
+    }
+
+    switch ((r >> 8) % 5) {
+        case 0:
+        case 1: {
+            PRINT("(");
+            random_expression(buffer, size, length, depth - 1);
+            PRINT(" %s ", binary[(r >> 16) % COUNT(binary)]);
+            random_expression(buffer, size, length, depth - 1);
+            PRINT(")");
+        } break;
+
+        case 2: {
+            PRINT("(%s(", unary[(r >> 16) % COUNT(unary)]);
+            random_expression(buffer, size, length, depth - 1);
+            PRINT("))");
+        } break;
+
+        case 3: {
+            PRINT("(%s(", functions[(r >> 16) % COUNT(functions)]);
+            random_expression(buffer, size, length, depth - 1);
+            PRINT(", ");
+            random_expression(buffer, size, length, depth - 1);
+            PRINT("))");
+        } break;
+
+        default: {
+            PRINT("(");
+            random_expression(buffer, size, length, depth - 1);
+            PRINT(" ? ");
+            random_expression(buffer, size, length, depth - 1);
+            PRINT(" : ");
+            random_expression(buffer, size, length, depth - 1);
+            PRINT(")");
+        } break;
+    }
+
+#undef COUNT
+#undef PRINT
+}
+
+// Any program accepted by mp_program_verify runs in the unchecked loop and in
+// the batch VM without failing, except for a division by zero, and gives the
+// same as the checked loop
+static void test_bytecode(void)
+{
+    const size_t programs = 100000;
+    size_t verified = 0;
+    double slots[SLOT_COUNT];
+
+    for (size_t i = 0; i < programs; ++i) {
+        MP_Program program = {0};
+        random_program(&program);
+
+        size_t stack_size = 0;
+        if (!mp_program_verify(program, SLOT_COUNT, &stack_size)) {
+            mp_da_free(&program);
+            continue;
+        }
+        ++verified;
+
+        MP_Vm vm = mp_vm_init(program);
+        vm.slots = slots;
+        vm.slot_count = SLOT_COUNT;
+        if (!mp_vm_verify(&vm)) {
+            fprintf(stderr, "FAIL: program %zu: mp_vm_verify failed\n", i);
+            ++failures;
+            mp_vm_free(&vm);
+            continue;
+        }
+        for (size_t var = 0; var < 26; ++var) {
+            vm.vars[var] = constants[random_next() % CONSTANT_COUNT];
+        }
+
+        bool ok = vm_run_slots(&vm, true, slots);
+        MP_Error_Type error = vm.error;
+        size_t depth = vm.stack.count;
+        double value = mp_vm_result(&vm);
+        if (!ok && error != MP_ERROR_ZERO_DIVISION) {
+            fprintf(stderr, "FAIL: program %zu: unchecked run failed\n", i);
+            ++failures;
+        }
+
+        bool checked = vm_run_slots(&vm, false, slots);
+        if (checked != ok || vm.error != error || vm.stack.count != depth
+                || !same_double(mp_vm_result(&vm), value)) {
+            fprintf(stderr, "FAIL: program %zu: checked and unchecked differ\n", i);
+            ++failures;
+        }
+        vm.verified = true;
+
+        if (mp_program_batchable(program)) {
+            const double *columns[26] = {0};
+            double out[3];
+            if (!mp_vm_run_batch(&vm, columns, 3, out)) {
+                fprintf(stderr, "FAIL: program %zu: batch run failed\n", i);
+                ++failures;
+            } else if (!same_double(out[0], value) || !same_double(out[2], value)) {
+                fprintf(stderr, "FAIL: program %zu: batch gives %g instead of %g\n",
+                        i, out[0], value);
+                ++failures;
+            }
+        }
+
+        mp_vm_free(&vm);
+    }
+
+    if (verified < programs / 20) {
+        fprintf(stderr, "FAIL: only %zu random programs verified\n", verified);
+        ++failures;
+    }
+
+    // Compiled expressions give the same in the checked and unchecked loops
+    char expression[4096];
+    for (size_t i = 0; i < 2000; ++i) {
+        size_t length = 0;
+        random_expression(expression, sizeof(expression), &length, 5);
+
+        MP_Env *env = mp_init_mode(expression, MP_MODE_COMPILE);
+        if (env == NULL) {
+            fail(expression, MP_MODE_COMPILE, false, "mp_init failed");
+            continue;
+        }
+        if (!env->vm.verified) {
+            fail(expression, MP_MODE_COMPILE, false, "not verified");
+        }
+
+        for (size_t k = 0; k < 8; ++k) {
+            mp_variable(env, 'x', constants[random_next() % CONSTANT_COUNT]);
+            mp_variable(env, 'y', (double)(random_next() % 7) - 3.0);
+
+            env->vm.verified = true;
+            bool ok = mp_vm_run(&env->vm);
+            MP_Error_Type error = env->vm.error;
+            double value = mp_vm_result(&env->vm);
+
+            env->vm.verified = false;
+            bool checked = mp_vm_run(&env->vm);
+            if (checked != ok || env->vm.error != error
+                    || !same_double(mp_vm_result(&env->vm), value)) {
+                fail(expression, MP_MODE_COMPILE, false,
+                     "checked and unchecked differ");
+                break;
+            }
+        }
+        env->vm.verified = true;
+
+        mp_free(env);
+    }
+}
+
+//------------
+// Row errors
+//------------
+
+#define ROWS 100
+
+// Every row of mp_evaluate_batch_errors has the value and the error that
+// mp_evaluate gives for it, in every mode. A division in a branch that a
+// select, && or || doesn't take can't fail a row.
+static void test_row_errors(void)
+{
+    static const struct {
+        const char *expression;
+        bool can_fail;
+    } cases[] = {
+        {"1 / (x - y)",                          true},
+        {"x < 1 ? 1 / x : x",                    true},
+        {"x / y + 1 / x",                        true},
+        {"x == 0 ? 1 : 1 / x",                   false},
+        {"x != 0 ? 1 / x : y == 0 ? 2 : 3 / y",  false},
+        {"x != 0 && 1 / x > 0",                  false},
+        {"x == 0 || 1 / x > 0",                  false},
+        {"y == 0 || x == 0 || x / y + y / x",    false},
+        {"(x != 0 && y != 0) ? hypot(1 / x, 1 / y) : 0", false},
+        {"min(x, 1) > 0 ? sqrt(1 / x) : ln(x) * 2", false},
+    };
+    static const double xs[] = {0.0, -1.0, 0.5, 2.0, 0.0, -0.0, 3.0};
+    static const double ys[] = {0.0, 1.0, 0.0, 2.0, 2.0, 0.5, 0.0, -4.0};
+
+    double x[ROWS], y[ROWS], out[ROWS];
+    uint8_t errors[ROWS];
+    for (size_t row = 0; row < ROWS; ++row) {
+        x[row] = xs[row % (sizeof(xs) / sizeof(xs[0]))];
+        y[row] = ys[row % (sizeof(ys) / sizeof(ys[0]))];
+    }
+    const double *columns[26] = {0};
+    columns['x' - 'a'] = x;
+    columns['y' - 'a'] = y;
+
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i) {
+        const char *expression = cases[i].expression;
+#ifdef MP_IEEE
+        bool can_fail = false;
+#else
+        bool can_fail = cases[i].can_fail;
+#endif
+
+        for (size_t m = 0; m < MODE_COUNT; ++m) {
+            MP_Env *env = mp_init_mode(expression, modes[m]);
+            if (env == NULL) {
+                fail(expression, modes[m], false, "mp_init failed");
+                continue;
+            }
+
+            if (!mp_evaluate_batch_errors(env, columns, ROWS, out, errors)) {
+                fail(expression, modes[m], false, "batch failed");
+                mp_free(env);
+                continue;
+            }
+
+            bool failed = false;
+            for (size_t row = 0; row < ROWS; ++row) {
+                mp_variable(env, 'x', x[row]);
+                mp_variable(env, 'y', y[row]);
+                MP_Result result = mp_evaluate(env);
+                MP_Error_Type error = result.error ? result.error_type : MP_ERROR_OK;
+
+                if (error != MP_ERROR_OK) failed = true;
+                if (error != MP_ERROR_OK && !can_fail) {
+                    fail(expression, modes[m], false, "a row failed");
+                    break;
+                }
+                if (errors[row] != error) {
+                    fail(expression, modes[m], false, "batch and scalar errors differ");
+                    break;
+                }
+                if (error == MP_ERROR_OK && !same_double(out[row], result.value)) {
+                    fail(expression, modes[m], false, "batch and scalar values differ");
+                    break;
+                }
+            }
+
+            if (can_fail && !failed) {
+                fail(expression, modes[m], false, "no row failed");
+            }
+
+            mp_free(env);
+        }
+    }
+}
+
+//---------------
+// Formula graph
+//---------------
+
+#define GRAPH_WIDTH 200
+
+static void graph_expect(MP_Graph *g, const char *name, double expected)
+{
+    double value = mp_graph_value(g, mp_graph_find(g, name));
+    if (!same_double(value, expected)) {
+        fprintf(stderr, "FAIL: graph, %s: %g instead of %g\n", name, value,
+                expected);
+        ++failures;
+    }
+}
+
+static void graph_update(MP_Graph *g, const char *what, MP_Error_Type error,
+                         const char *formula, size_t computed)
+{
+    MP_Result result = mp_graph_update(g);
+    MP_Error_Type got = result.error ? result.error_type : MP_ERROR_OK;
+    size_t at = formula != NULL ? mp_graph_find(g, formula) : MP_GRAPH_NO_FORMULA;
+
+    if (got != error) {
+        fprintf(stderr, "FAIL: graph, %s: %s instead of %s\n", what,
+                mp_error_to_string(got), mp_error_to_string(error));
+        ++failures;
+    } else if (error != MP_ERROR_OK && g->error_formula != at) {
+        fprintf(stderr, "FAIL: graph, %s: wrong error_formula\n", what);
+        ++failures;
+    } else if (error == MP_ERROR_OK && computed != (size_t)-1
+               && g->computed != computed) {
+        fprintf(stderr, "FAIL: graph, %s: computed %zu instead of %zu\n", what,
+                g->computed, computed);
+        ++failures;
+    }
+}
+
+// A wide graph whose levels are given to the workers, with a formula failing
+// for x = 5
+static void graph_wide(MP_Graph *g)
+{
+    char name[32], expression[64];
+    for (size_t i = 0; i < GRAPH_WIDTH; ++i) {
+        snprintf(name, sizeof(name), "a%zu", i);
+        snprintf(expression, sizeof(expression), "sin(x + %zu) * y", i);
+        mp_graph_set(g, name, expression);
+
+        snprintf(name, sizeof(name), "b%zu", i);
+        snprintf(expression, sizeof(expression), i == GRAPH_WIDTH / 2
+                 ? "$a%zu / (x - 5)" : "$a%zu * 2 + $a0", i);
+        mp_graph_set(g, name, expression);
+    }
+    mp_graph_set(g, "sum", "$b0 + $b1 + $b99 + $b100 + $b199");
+}
+
+// Formulas are computed after the ones they read and only when downstream of a
+// change; a failed update leaves the graph as it was for the next one
+static void test_graph(void)
+{
+    MP_Graph *g = mp_graph_init();
+    assert(g != NULL);
+
+    mp_graph_set(g, "c", "$b + $a");
+    mp_graph_set(g, "b", "$a * 2");
+    mp_graph_set(g, "a", "x + 1");
+    mp_graph_set(g, "d", "y");
+    mp_graph_set(g, "e", "$d + 1");
+    mp_graph_set(g, "sign", "x > 0");
+    mp_graph_set(g, "f", "$sign + 10");
+    mp_graph_variable(g, 'x', 1.0);
+    mp_graph_variable(g, 'y', 2.0);
+    graph_update(g, "first update", MP_ERROR_OK, NULL, 7);
+    graph_expect(g, "c", 6.0);
+    graph_expect(g, "e", 3.0);
+    graph_expect(g, "f", 11.0);
+
+    // Downstream of a change only
+    graph_update(g, "nothing changed", MP_ERROR_OK, NULL, 0);
+    mp_graph_variable(g, 'y', 5.0);
+    graph_update(g, "y changed", MP_ERROR_OK, NULL, 2);
+    graph_expect(g, "e", 6.0);
+    mp_graph_variable(g, 'x', 2.0);
+    graph_update(g, "x changed", MP_ERROR_OK, NULL, 4); // f keeps its value
+    graph_expect(g, "c", 9.0);
+    graph_expect(g, "f", 11.0);
+    mp_graph_set(g, "b", "$a * 3");
+    graph_update(g, "b replaced", MP_ERROR_OK, NULL, 2);
+    graph_expect(g, "c", 12.0);
+
+    // Cycles, through another formula or the formula itself
+    mp_graph_set(g, "p", "$q + 1");
+    mp_graph_set(g, "q", "$p + 1");
+    MP_Result result = mp_graph_update(g);
+    if (!result.error || result.error_type != MP_ERROR_CIRCULAR_REFERENCE
+            || (g->error_formula != mp_graph_find(g, "p")
+                && g->error_formula != mp_graph_find(g, "q"))) {
+        fprintf(stderr, "FAIL: graph, cycle: not reported\n");
+        ++failures;
+    }
+    mp_graph_set(g, "q", "$c");
+    graph_update(g, "cycle broken", MP_ERROR_OK, NULL, (size_t)-1);
+    graph_expect(g, "p", 13.0);
+
+    mp_graph_set(g, "self", "$self + 1");
+    graph_update(g, "$self", MP_ERROR_CIRCULAR_REFERENCE, "self", 0);
+    mp_graph_set(g, "self", "$p");
+    graph_update(g, "$self replaced", MP_ERROR_OK, NULL, (size_t)-1);
+    graph_expect(g, "self", 13.0);
+
+    // A reference to a formula not set yet
+    mp_graph_set(g, "u", "$later * 2");
+    graph_update(g, "unknown reference", MP_ERROR_UNKNOWN_REFERENCE, "u", 0);
+    mp_graph_set(g, "later", "$a");
+    graph_update(g, "reference set", MP_ERROR_OK, NULL, (size_t)-1);
+    graph_expect(g, "u", 6.0);
+
+    // A division by zero, then a value that doesn't divide by zero
+    mp_graph_set(g, "r", "1 / (x - 3)");
+    mp_graph_set(g, "s", "$r + $c");
+    mp_graph_variable(g, 'x', 3.0);
+#ifdef MP_IEEE
+    graph_update(g, "division by zero", MP_ERROR_OK, NULL, (size_t)-1);
+    graph_expect(g, "s", INFINITY);
+#else
+    graph_update(g, "division by zero", MP_ERROR_ZERO_DIVISION, "r", 0);
+#endif
+    mp_graph_variable(g, 'x', 4.0);
+    graph_update(g, "recovered", MP_ERROR_OK, NULL, (size_t)-1);
+    graph_expect(g, "s", 1.0 + 20.0);
+    graph_expect(g, "u", 10.0);
+    graph_update(g, "recovered, nothing changed", MP_ERROR_OK, NULL, 0);
+
+    mp_graph_free(g);
+
+    // The same wide graph with and without workers
+    MP_Graph *serial = mp_graph_init();
+    MP_Graph *parallel = mp_graph_init();
+    assert(serial != NULL && parallel != NULL);
+    graph_wide(serial);
+    graph_wide(parallel);
+#ifdef MP_THREADS
+    if (!mp_graph_threads(parallel, 4)) {
+        fprintf(stderr, "FAIL: graph: mp_graph_threads failed\n");
+        ++failures;
+    }
+#else
+    if (mp_graph_threads(parallel, 4) || !mp_graph_threads(parallel, 1)) {
+        fprintf(stderr, "FAIL: graph: mp_graph_threads without MP_THREADS\n");
+        ++failures;
+    }
+#endif
+
+    static const double xs[] = {1.0, 1.0, 2.5, 5.0, 6.0, -3.0};
+    for (size_t i = 0; i < sizeof(xs) / sizeof(xs[0]); ++i) {
+        mp_graph_variable(serial, 'x', xs[i]);
+        mp_graph_variable(parallel, 'x', xs[i]);
+        mp_graph_variable(serial, 'y', 0.5);
+        mp_graph_variable(parallel, 'y', 0.5);
+
+        MP_Result expected = mp_graph_update(serial);
+        MP_Result result = mp_graph_update(parallel);
+        if (result.error != expected.error || parallel->computed != serial->computed
+                || parallel->error_formula != serial->error_formula) {
+            fprintf(stderr, "FAIL: graph, threads, x = %g: wrong update\n", xs[i]);
+            ++failures;
+        }
+        for (size_t k = 0; k < serial->formulas.count; ++k) {
+            if (!same_double(mp_graph_value(parallel, k), mp_graph_value(serial, k))) {
+                fprintf(stderr, "FAIL: graph, threads, x = %g: %s differs\n",
+                        xs[i], serial->formulas.items[k].name);
+                ++failures;
+                break;
+            }
+        }
+    }
+
+    mp_graph_free(parallel);
+    mp_graph_free(serial);
+}
+
+//---------
+// Solvers
+//---------
+
+#define SOLVE_ROWS 40
+
+static void solution_expect(const char *what, MP_Solution s, double x,
+                            double tolerance, MP_Error_Type error)
+{
+    bool ok = s.error == error;
+    if (isnan(x)) {
+        ok = ok && isnan(s.x) && !s.converged;
+    } else {
+        ok = ok && s.converged && fabs(s.x - x) <= tolerance;
+    }
+
+    if (!ok) {
+        fprintf(stderr, "FAIL: %s: x = %.17g, converged %d, %s\n", what, s.x,
+                s.converged, mp_error_to_string(s.error));
+        ++failures;
+    }
+}
+
+// The solvers find the roots and minima they bracket or start near, reject
+// what isn't finite, report nothing found without a sign change and stop at
+// an evaluation that fails
+static void test_solvers(void)
+{
+    MP_Solve_Options options = {0};
+    MP_Env *f = mp_init_mode("x^2 - c", MP_MODE_COMPILE);
+    MP_Env *df = mp_init_mode("2 * x", MP_MODE_COMPILE);
+    MP_Env *bowl = mp_init_mode("(x - 1)^2 + (y + 2)^2 + 3", MP_MODE_COMPILE);
+    MP_Env *pole = mp_init_mode("1 / (x - 1)", MP_MODE_COMPILE);
+    assert(f != NULL && df != NULL && bowl != NULL && pole != NULL);
+
+    mp_variable(f, 'c', 2.0);
+    mp_variable(f, 'x', 7.0);
+    mp_variable(bowl, 'y', -2.0);
+    const double root = sqrt(2.0);
+
+    solution_expect("bisection", mp_solve_bisection(&f->vm, 'x', 0.0, 2.0, options),
+                    root, 1e-12, MP_ERROR_OK);
+    solution_expect("brent", mp_solve_brent(&f->vm, 'x', 2.0, 0.0, options),
+                    root, 1e-12, MP_ERROR_OK);
+    solution_expect("newton", mp_solve_newton(&f->vm, &df->vm, 'x', 1.0, options),
+                    root, 1e-12, MP_ERROR_OK);
+    solution_expect("newton, differences",
+                    mp_solve_newton(&f->vm, NULL, 'x', 1.0, options),
+                    root, 1e-9, MP_ERROR_OK);
+    solution_expect("golden", mp_minimize_golden(&bowl->vm, 'x', -2.0, 4.0, options),
+                    1.0, 1e-6, MP_ERROR_OK);
+    if (f->vm.vars['x' - 'a'] != 7.0) {
+        fprintf(stderr, "FAIL: solvers: x not given back its value\n");
+        ++failures;
+    }
+
+    double point[2] = {0.0, 0.0};
+    MP_Solution s = mp_minimize_nelder_mead(&bowl->vm, "xy", point, options);
+    if (!s.converged || fabs(point[0] - 1.0) > 1e-5 || fabs(point[1] + 2.0) > 1e-5) {
+        fprintf(stderr, "FAIL: nelder-mead: (%g, %g)\n", point[0], point[1]);
+        ++failures;
+    }
+
+    // No sign change
+    solution_expect("bisection, no sign change",
+                    mp_solve_bisection(&f->vm, 'x', 2.0, 3.0, options),
+                    NAN, 0.0, MP_ERROR_OK);
+    solution_expect("brent, no sign change",
+                    mp_solve_brent(&f->vm, 'x', -1.0, 1.0, options),
+                    NAN, 0.0, MP_ERROR_OK);
+
+    // Not finite
+    solution_expect("bisection, NaN",
+                    mp_solve_bisection(&f->vm, 'x', NAN, 2.0, options),
+                    NAN, 0.0, MP_ERROR_INVALID_EXPRESSION);
+    solution_expect("brent, inf",
+                    mp_solve_brent(&f->vm, 'x', 0.0, INFINITY, options),
+                    NAN, 0.0, MP_ERROR_INVALID_EXPRESSION);
+    solution_expect("newton, NaN",
+                    mp_solve_newton(&f->vm, &df->vm, 'x', NAN, options),
+                    NAN, 0.0, MP_ERROR_INVALID_EXPRESSION);
+    solution_expect("golden, inf",
+                    mp_minimize_golden(&bowl->vm, 'x', -INFINITY, 4.0, options),
+                    NAN, 0.0, MP_ERROR_INVALID_EXPRESSION);
+    point[0] = NAN;
+    point[1] = 0.0;
+    s = mp_minimize_nelder_mead(&bowl->vm, "xy", point, options);
+    if (s.error != MP_ERROR_INVALID_EXPRESSION || !isnan(s.x) || s.converged
+            || !isnan(point[0]) || point[1] != 0.0) {
+        fprintf(stderr, "FAIL: nelder-mead, NaN: not rejected\n");
+        ++failures;
+    }
+
+    // A pole in the bracket, the first point tried by both is 1
+#ifdef MP_IEEE
+    MP_Error_Type zero_division = MP_ERROR_OK;
+#else
+    MP_Error_Type zero_division = MP_ERROR_ZERO_DIVISION;
+#endif
+    s = mp_solve_bisection(&pole->vm, 'x', 0.0, 2.0, options);
+    if (s.error != zero_division || (s.error != MP_ERROR_OK && !isnan(s.x))) {
+        fprintf(stderr, "FAIL: bisection, pole: %s\n", mp_error_to_string(s.error));
+        ++failures;
+    }
+    s = mp_solve_brent(&pole->vm, 'x', 0.0, 2.0, options);
+    if (s.error != zero_division || (s.error != MP_ERROR_OK && !isnan(s.x))) {
+        fprintf(stderr, "FAIL: brent, pole: %s\n", mp_error_to_string(s.error));
+        ++failures;
+    }
+
+    // One problem per row, the rows without a root or a finite bracket are NaN
+    double c[SOLVE_ROWS], a[SOLVE_ROWS], b[SOLVE_ROWS], roots[SOLVE_ROWS];
+    for (size_t row = 0; row < SOLVE_ROWS; ++row) {
+        c[row] = (double)row - 3.0;
+        a[row] = 0.0;
+        b[row] = 8.0;
+    }
+    a[5] = NAN;
+    b[6] = INFINITY;
+    a[37] = -INFINITY;
+    b[38] = NAN;
+    const double *columns[26] = {0};
+    columns['c' - 'a'] = c;
+
+    if (!mp_solve_bisection_batch(&f->vm, 'x', columns, SOLVE_ROWS, a, b, options,
+                                  roots)) {
+        fprintf(stderr, "FAIL: bisection batch failed\n");
+        ++failures;
+    }
+    for (size_t row = 0; row < SOLVE_ROWS; ++row) {
+        bool bracketed = c[row] >= 0.0 && c[row] <= 64.0 && isfinite(a[row])
+            && isfinite(b[row]);
+        if (bracketed ? fabs(roots[row] - sqrt(c[row])) > 1e-12 : !isnan(roots[row])) {
+            fprintf(stderr, "FAIL: bisection batch, row %zu: %g\n", row, roots[row]);
+            ++failures;
+        }
+    }
+
+    mp_free(pole);
+    mp_free(bowl);
+    mp_free(df);
+    mp_free(f);
+}
+
+//---------------
+// Approximation
+//---------------
+
+#define APPROX_ROWS 100000
+
+// Between the checks of mp_approx_init the error stays within the other half
+// of the tolerance when the derivatives are bounded over the domain. A pole, a domain
+// that isn't one or a tolerance that isn't positive fails and leaves an
+// approximation that gives NaN.
+static void test_approx(void)
+{
+    const char *expression = "tan(x) * sqrt(x) * (2 + x) / 2";
+    const double lo = 0.1, hi = 1.4, tolerance = 1e-11;
+
+    static double xs[APPROX_ROWS], expected[APPROX_ROWS], out[APPROX_ROWS];
+    for (size_t i = 0; i < APPROX_ROWS; ++i) {
+        xs[i] = lo + (hi - lo) * (double)i / (APPROX_ROWS - 1);
+    }
+    const double *columns[26] = {0};
+    columns['x' - 'a'] = xs;
+
+    for (size_t m = 0; m < MODE_COUNT; ++m) {
+        MP_Env *env = mp_init_mode(expression, modes[m]);
+        assert(env != NULL);
+        mp_variable(env, 'x', 0.5);
+        double before = mp_evaluate(env).value;
+
+        MP_Approx approx;
+        if (!mp_approx_init(&approx, env, 'x', lo, hi, tolerance)) {
+            fail(expression, modes[m], false, "mp_approx_init failed");
+            mp_free(env);
+            continue;
+        }
+        if (mp_evaluate(env).value != before) {
+            fail(expression, modes[m], false, "env changed by mp_approx_init");
+        }
+
+        mp_evaluate_batch(env, columns, APPROX_ROWS, expected);
+        mp_approx_eval_batch(&approx, xs, APPROX_ROWS, out);
+        double max_error = 0.0;
+        for (size_t i = 0; i < APPROX_ROWS; ++i) {
+            double error = fabs(out[i] - expected[i]);
+            if (!(error <= max_error)) max_error = error;
+            if (!same_double(out[i], mp_approx_eval(&approx, xs[i]))) {
+                fail(expression, modes[m], false, "batch and scalar differ");
+                break;
+            }
+        }
+        if (!(max_error <= approx.max_error + tolerance / 2)) {
+            char what[64];
+            snprintf(what, sizeof(what), "error %g between the checks", max_error);
+            fail(expression, modes[m], false, what);
+        }
+
+        if (mp_approx_eval(&approx, lo - 1.0) != mp_approx_eval(&approx, lo)
+                || mp_approx_eval(&approx, hi + 1.0) != mp_approx_eval(&approx, hi)
+                || !isnan(mp_approx_eval(&approx, NAN))) {
+            fail(expression, modes[m], false, "x outside the domain");
+        }
+
+        mp_approx_free(&approx);
+        if (!isnan(mp_approx_eval(&approx, 0.5))) {
+            fail(expression, modes[m], false, "freed approximation not NaN");
+        }
+        mp_free(env);
+    }
+
+    static const struct {
+        const char *what;
+        const char *expression;
+        double lo, hi, tolerance;
+    } failing[] = {
+        {"pole",               "1 / (x - 1)", 0.0, 2.5, 1e-6},
+        {"pole of tan",        "tan(x)",      1.0, 2.0, 1e-6},
+        {"empty domain",       "x",           1.0, 1.0, 1e-6},
+        {"reversed domain",    "x",           2.0, 1.0, 1e-6},
+        {"NaN domain",         "x",           NAN, 1.0, 1e-6},
+        {"infinite domain",    "x",           0.0, INFINITY, 1e-6},
+        {"zero tolerance",     "x",           0.0, 1.0, 0.0},
+        {"negative tolerance", "x",           0.0, 1.0, -1e-6},
+        {"NaN tolerance",      "x",           0.0, 1.0, NAN},
+    };
+
+    for (size_t i = 0; i < sizeof(failing) / sizeof(failing[0]); ++i) {
+        MP_Env *env = mp_init_mode(failing[i].expression, MP_MODE_COMPILE);
+        assert(env != NULL);
+
+        MP_Approx approx;
+        if (mp_approx_init(&approx, env, 'x', failing[i].lo, failing[i].hi,
+                           failing[i].tolerance)) {
+            fail(failing[i].what, MP_MODE_COMPILE, false, "mp_approx_init succeeded");
+        } else if (approx.pieces != 0 || !isnan(mp_approx_eval(&approx, 0.5))) {
+            fail(failing[i].what, MP_MODE_COMPILE, false, "failed approximation not NaN");
+        }
+
+        mp_approx_free(&approx);
+        mp_free(env);
+    }
+}
+
+//----------------
+// Specialization
+//----------------
+
+static size_t program_ops(MP_Program p)
+{
+    size_t ops = 0;
+    for (size_t i = 0; i < p.count; i += 1 + mp_opcode_operand_size(p.items[i])) {
+        ++ops;
+    }
+    return ops;
+}
+
+// Freezing variables gives the same values with a program that is shorter, in
+// bytes and in opcodes: the folded constants fit in the opcodes using them
+static void test_specialize(void)
+{
+    const char *expression = "a*x^2 + b*x + c + sqrt(a*a + b*b)*y";
+
+    for (size_t m = 0; m < MODE_COUNT; ++m) {
+        MP_Env *env = mp_init_mode(expression, modes[m]);
+        assert(env != NULL);
+        mp_variable(env, 'a', 3.0);
+        mp_variable(env, 'b', 4.0);
+        mp_variable(env, 'c', 5.0);
+
+        MP_Env *special = mp_specialize(env, "abc");
+        if (special == NULL) {
+            fail(expression, modes[m], false, "mp_specialize failed");
+            mp_free(env);
+            continue;
+        }
+
+        if (special->backend == MP_MODE_COMPILE) {
+            MP_Program before = env->vm.program;
+            MP_Program after = special->vm.program;
+            if (after.count >= before.count || program_ops(after) > 10) {
+                char what[64];
+                snprintf(what, sizeof(what), "%zu bytes and %zu ops", after.count,
+                         program_ops(after));
+                fail(expression, modes[m], false, what);
+            }
+        }
+
+        for (double x = -2.0; x <= 2.0; x += 0.75) {
+            mp_variable(env, 'x', x);
+            mp_variable(special, 'x', x);
+            mp_variable(env, 'y', 1.0 - x);
+            mp_variable(special, 'y', 1.0 - x);
+            double expected = mp_evaluate(env).value;
+            double value = mp_evaluate(special).value;
+            if (fabs(value - expected) > 1e-12 * fabs(expected)) {
+                fail(expression, modes[m], false, "specialized value differs");
+                break;
+            }
+        }
+
+        mp_free(special);
+        mp_free(env);
+    }
+}
+
+int main(void)
+{
+    test_deep();
+    test_adaptive();
+    test_errors();
+    test_row_errors();
+    test_powers();
+    test_numbers();
+    test_bytecode();
+    test_graph();
+    test_solvers();
+    test_approx();
+    test_specialize();
+    test_allocations();
+
+    if (failures > 0) {
+        fprintf(stderr, "%zu checks failed\n", failures);
+        return EXIT_FAILURE;
+    }
+
+    printf("All checks passed\n");
+    return EXIT_SUCCESS;
+}